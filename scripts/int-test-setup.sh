@@ -145,6 +145,13 @@ in
         ;;
 esac
 
+# tests that need the daemon configured beyond the defaults
+case "${TEST_NAME}" in
+    connections-scale.int)
+        TABRMD_OPTS="${TABRMD_OPTS} --max-connections=5000"
+        ;;
+esac
+
 # start tpm2-abrmd daemon
 TABRMD_LOG_FILE=${TEST_BIN}_tabrmd.log
 TABRMD_PID_FILE=${TEST_BIN}_tabrmd.pid
@@ -152,9 +159,10 @@ tabrmd_start ${TABRMD_BIN} ${TABRMD_LOG_FILE} ${TABRMD_PID_FILE} "${TABRMD_OPTS}
 if [ $? -ne 0 ]; then
     echo "failed to start tabrmd with name ${TABRMD_NAME}"
 fi
+TABRMD_TEST_PID=$(cat ${TABRMD_PID_FILE})
 
 # execute the test script and capture exit code
-env G_MESSAGES_DEBUG=all TABRMD_TEST_TCTI_CONF="${TABRMD_TEST_TCTI_CONF}" TABRMD_TEST_TCTI_RETRIES=10 $@
+env G_MESSAGES_DEBUG=all TABRMD_TEST_TCTI_CONF="${TABRMD_TEST_TCTI_CONF}" TABRMD_TEST_TCTI_RETRIES=10 TABRMD_TEST_PID="${TABRMD_TEST_PID}" $@
 ret_test=$?
 
 # This sleep is sadly necessary: If we kill the tabrmd w/o sleeping for a
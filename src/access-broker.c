@@ -10,15 +10,21 @@
 #include <string.h>
 
 #include "tabrmd.h"
+#include "tabrmd-probes.h"
 
 #include "access-broker.h"
 #include "tcti.h"
+#include "tpm2-header.h"
 #include "tpm2-command.h"
 #include "tpm2-response.h"
 #include "util.h"
 
 G_DEFINE_TYPE (AccessBroker, access_broker, G_TYPE_OBJECT);
 
+static lock_stats_t access_broker_lock_stats = LOCK_STATS_INIT ("AccessBroker");
+/* how long to block in each receive while waiting for a response */
+#define ACCESS_BROKER_POLL_MS 10
+
 enum {
     PROP_0,
     PROP_SAPI_CTX,
@@ -85,6 +91,9 @@ access_broker_dispose (GObject *obj)
 {
     AccessBroker *self = ACCESS_BROKER (obj);
 
+    g_debug ("%s: TPM busy for %" PRIu64 " us, %" PRIu64 " context loads, %"
+             PRIu64 " context saves", __func__, self->stats.busy_us,
+             self->stats.context_loads, self->stats.context_saves);
     if (self->sapi_context != NULL) {
         Tss2_Sys_Finalize (self->sapi_context);
     }
@@ -93,13 +102,12 @@ access_broker_dispose (GObject *obj)
     G_OBJECT_CLASS (access_broker_parent_class)->dispose (obj);
 }
 /*
- * G_DEFINE_TYPE requires an instance init even though we don't use it.
+ * The SAPI mutex is initialized here, before anything can lock it.
  */
 static void
 access_broker_init (AccessBroker *broker)
 {
-    UNUSED_PARAM(broker);
-    /* noop */
+    stat_mutex_init (&broker->sapi_mutex, &access_broker_lock_stats);
 }
 /**
  * GObject class initialization function. This function boils down to:
@@ -198,7 +206,7 @@ access_broker_lock (AccessBroker *broker)
 
     assert (broker != NULL);
 
-    error = pthread_mutex_lock (&broker->sapi_mutex);
+    error = stat_mutex_lock (&broker->sapi_mutex);
     if (error != 0) {
         switch (error) {
         case EINVAL:
@@ -225,7 +233,7 @@ access_broker_unlock (AccessBroker *broker)
 
     assert (broker != NULL);
 
-    error= pthread_mutex_unlock (&broker->sapi_mutex);
+    error = stat_mutex_unlock (&broker->sapi_mutex);
     if (error != 0) {
         switch (error) {
         case EINVAL:
@@ -238,6 +246,39 @@ access_broker_unlock (AccessBroker *broker)
         }
     }
 }
+/*
+ * Add the time since 'since' to the time the TPM has been busy. Callers
+ * take 'since' just before handing a command to the TCTI and call this
+ * once the response is back.
+ */
+static void
+access_broker_add_busy (AccessBroker *broker,
+                        gint64        since)
+{
+    __atomic_fetch_add (&broker->stats.busy_us,
+                        g_get_monotonic_time () - since,
+                        __ATOMIC_RELAXED);
+}
+/*
+ * Copy the AccessBroker statistics into 'stats'. The counters are updated
+ * with atomic ops so they're read without the mutex: a monitor polling
+ * them never waits behind a slow TPM command. The time the TPM spends on
+ * a command is only added once it completes.
+ */
+void
+access_broker_get_stats (AccessBroker          *broker,
+                         access_broker_stats_t *stats)
+{
+    assert (broker != NULL);
+    assert (stats != NULL);
+
+    stats->busy_us = __atomic_load_n (&broker->stats.busy_us,
+                                      __ATOMIC_RELAXED);
+    stats->context_loads = __atomic_load_n (&broker->stats.context_loads,
+                                            __ATOMIC_RELAXED);
+    stats->context_saves = __atomic_load_n (&broker->stats.context_saves,
+                                            __ATOMIC_RELAXED);
+}
 /**
  * Query the TPM for fixed (TPM2_PT_FIXED) TPM properties.
  * This function is intended for internal use only. The caller MUST
@@ -356,24 +397,56 @@ access_broker_send_cmd (AccessBroker *broker,
                    PRIx32, __func__, rc);
     return rc;
 }
+/*
+ * A cancel requested through access_broker_cancel is passed to the TCTI
+ * here, by the thread waiting for the response. The TCTIs don't expect
+ * Tss2_Tcti_Cancel to be called while another thread is in
+ * Tss2_Tcti_Receive on the same context.
+ */
+static void
+access_broker_check_cancel (AccessBroker *broker)
+{
+    TSS2_RC rc;
+
+    if (!g_atomic_int_compare_and_exchange (&broker->cancel_requested, 1, 0))
+        return;
+    rc = tcti_cancel (broker->tcti);
+    if (rc == TSS2_TCTI_RC_NOT_IMPLEMENTED) {
+        g_atomic_int_set (&broker->cancel_unsupported, TRUE);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_info ("%s: TCTI cancel failed: 0x%" PRIx32, __func__, rc);
+    }
+}
 /*
  * Get a response buffer from the TPM. Return the TSS2_RC through the
  * 'rc' parameter. Returns a buffer (that must be freed by the caller)
  * containing the response from the TPM. Determine the size of the buffer
- * by reading the size field from the TPM command header.
+ * by reading the size field from the TPM command header. The time spent in
+ * the busy_func is returned through 'func_us' so it isn't counted as TPM
+ * time.
+ * The TCTI is polled with a short timeout so that a cancel can be passed
+ * on while the TPM is executing the command. TCTIs that only support a
+ * blocking receive can't be polled, we block and they can't cancel.
  */
 static TSS2_RC
 access_broker_get_response (AccessBroker *broker,
                             uint8_t     **buffer,
-                            size_t       *buffer_size)
+                            size_t       *buffer_size,
+                            gint64       *func_us)
 {
     TSS2_RC rc;
     guint32 max_size;
+    gint64 start;
+    int32_t timeout = TSS2_TCTI_TIMEOUT_NONE;
+    gboolean busy_called = FALSE;
 
     assert (broker != NULL);
     assert (buffer != NULL);
     assert (buffer_size != NULL);
+    assert (func_us != NULL);
 
+    *func_us = 0;
     rc = access_broker_get_max_response (broker, &max_size);
     if (rc != TSS2_RC_SUCCESS)
         return rc;
@@ -384,8 +457,35 @@ access_broker_get_response (AccessBroker *broker,
                    strerror (errno));
         return RM_RC (TPM2_RC_MEMORY);
     }
-    *buffer_size = max_size;
-    rc = tcti_receive (broker->tcti, buffer_size, *buffer, TSS2_TCTI_TIMEOUT_BLOCK);
+    if (broker->nonblock_unsupported)
+        timeout = TSS2_TCTI_TIMEOUT_BLOCK;
+    for (;;) {
+        *buffer_size = max_size;
+        rc = tcti_receive (broker->tcti, buffer_size, *buffer, timeout);
+        if (timeout != TSS2_TCTI_TIMEOUT_BLOCK &&
+            (rc == TSS2_TCTI_RC_BAD_VALUE ||
+             rc == TSS2_TCTI_RC_NOT_IMPLEMENTED))
+        {
+            g_info ("%s: TCTI doesn't support non-blocking receive, RC 0x%"
+                    PRIx32, __func__, rc);
+            broker->nonblock_unsupported = TRUE;
+            g_atomic_int_set (&broker->cancel_unsupported, TRUE);
+            timeout = TSS2_TCTI_TIMEOUT_BLOCK;
+            continue;
+        }
+        if (rc != TSS2_TCTI_RC_TRY_AGAIN)
+            break;
+        /* the TPM is still executing, let the caller do other work */
+        if (broker->busy_func != NULL && !busy_called) {
+            start = g_get_monotonic_time ();
+            broker->busy_func (broker->busy_data);
+            *func_us = g_get_monotonic_time () - start;
+            busy_called = TRUE;
+        }
+        access_broker_check_cancel (broker);
+        if (timeout != TSS2_TCTI_TIMEOUT_BLOCK)
+            timeout = ACCESS_BROKER_POLL_MS;
+    }
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("%s: tcti_receive failed with RC 0x%" PRIx32, __func__, rc);
         free (*buffer);
@@ -416,20 +516,50 @@ access_broker_send_command (AccessBroker  *broker,
     Connection     *connection = NULL;
     guint8         *buffer = NULL;
     size_t          buffer_size = 0;
+    guint64         id;
+    TPM2_CC         command_code;
+    gint64          start, func_us = 0;
 
     g_debug (__func__);
     assert (broker != NULL);
     assert (command != NULL);
     assert (rc != NULL);
 
+    /* commands built by the daemon itself have no connection */
+    id = command->connection != NULL ? command->connection->id : 0;
+    command_code = tpm2_command_get_code (command);
     access_broker_lock (broker);
+    switch (command_code) {
+    case TPM2_CC_ContextLoad:
+        __atomic_fetch_add (&broker->stats.context_loads, 1, __ATOMIC_RELAXED);
+        break;
+    case TPM2_CC_ContextSave:
+        __atomic_fetch_add (&broker->stats.context_saves, 1, __ATOMIC_RELAXED);
+        break;
+    default:
+        break;
+    }
+    TABRMD_PROBE4 (tpm_transmit, id, command_code,
+                   tpm2_command_get_size (command),
+                   tpm2_command_get_handle (command, 0));
+    start = g_get_monotonic_time ();
     *rc = access_broker_send_cmd (broker, command);
-    if (*rc != TSS2_RC_SUCCESS)
+    if (*rc != TSS2_RC_SUCCESS) {
+        TABRMD_PROBE4 (tpm_receive, id, command_code, 0, *rc);
         goto unlock_out;
-    *rc = access_broker_get_response (broker, &buffer, &buffer_size);
+    }
+    *rc = access_broker_get_response (broker,
+                                      &buffer,
+                                      &buffer_size,
+                                      &func_us);
+    access_broker_add_busy (broker, start + func_us);
     if (*rc != TSS2_RC_SUCCESS) {
+        TABRMD_PROBE4 (tpm_receive, id, command_code, 0, *rc);
         goto unlock_out;
     }
+    TABRMD_PROBE4 (tpm_receive, id, command_code, buffer_size,
+                   buffer_size >= TPM_HEADER_SIZE ?
+                   get_response_code (buffer) : 0);
     access_broker_unlock (broker);
     connection = tpm2_command_get_connection (command);
     response = tpm2_response_new (connection,
@@ -437,6 +567,14 @@ access_broker_send_command (AccessBroker  *broker,
                                   buffer_size,
                                   tpm2_command_get_attributes (command));
     g_clear_object (&connection);
+    /* session contexts are swapped with commands, not the SAPI */
+    if (command_code == TPM2_CC_ContextLoad) {
+        TABRMD_PROBE2 (context_load, tpm2_response_get_handle (response),
+                       tpm2_response_get_code (response));
+    } else if (command_code == TPM2_CC_ContextSave) {
+        TABRMD_PROBE2 (context_save, tpm2_command_get_handle (command, 0),
+                       tpm2_response_get_code (response));
+    }
     return response;
 
 unlock_out:
@@ -447,6 +585,57 @@ unlock_out:
     g_object_unref (connection);
     return response;
 }
+/*
+ * Ask the TPM to cancel the command sent by access_broker_send_command
+ * that's executing. This may be called from any thread and doesn't take
+ * the AccessBroker lock: the thread that sent the command holds it while
+ * it waits for the response. The request is only recorded here, the
+ * waiting thread passes it to the TCTI. The caller is responsible for
+ * knowing that the command in progress is the one it wants canceled and
+ * for clearing the request with access_broker_clear_cancel once it's done.
+ * Returns TSS2_TCTI_RC_NOT_IMPLEMENTED if the TCTI is known not to support
+ * cancel, TSS2_RC_SUCCESS otherwise.
+ */
+TSS2_RC
+access_broker_cancel (AccessBroker *broker)
+{
+    assert (broker != NULL);
+
+    if (g_atomic_int_get (&broker->cancel_unsupported)) {
+        return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+    }
+    g_atomic_int_set (&broker->cancel_requested, TRUE);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Drop a cancel requested through access_broker_cancel that wasn't passed
+ * to the TCTI because the command completed first. It must not be applied
+ * to whatever is sent next.
+ */
+void
+access_broker_clear_cancel (AccessBroker *broker)
+{
+    assert (broker != NULL);
+
+    g_atomic_int_set (&broker->cancel_requested, FALSE);
+}
+/*
+ * Register a function to be called while the TPM is executing a command
+ * sent through access_broker_send_command. 'func' is called once if the
+ * response isn't ready when the AccessBroker first polls for it. TCTIs
+ * that reject a non-blocking receive block for the response without
+ * calling 'func'. Pass NULL to clear.
+ */
+void
+access_broker_set_busy_func (AccessBroker         *broker,
+                             AccessBrokerBusyFunc  func,
+                             gpointer              user_data)
+{
+    access_broker_lock (broker);
+    broker->busy_func = func;
+    broker->busy_data = user_data;
+    access_broker_unlock (broker);
+}
 /**
  * Create new TPM access broker (ACCESS_BROKER) object. This includes
  * using the provided TCTI to send the TPM the startup command and
@@ -485,7 +674,6 @@ access_broker_init_tpm (AccessBroker *broker)
 
     if (broker->initialized)
         return TSS2_RC_SUCCESS;
-    pthread_mutex_init (&broker->sapi_mutex, NULL);
     rc = access_broker_send_tpm_startup (broker);
     if (rc != TSS2_RC_SUCCESS)
         goto out;
@@ -508,6 +696,7 @@ access_broker_get_trans_object_count (AccessBroker *broker,
     TSS2_SYS_CONTEXT *sapi_context;
     TPMI_YES_NO more_data;
     TPMS_CAPABILITY_DATA capability_data = { 0, };
+    gint64 start;
 
     assert (broker != NULL);
     assert (count != NULL);
@@ -518,6 +707,7 @@ access_broker_get_trans_object_count (AccessBroker *broker,
      * the 4th parameter. It assumes that it's a signed type which causes
      * -Wsign-conversion to complain. Casting to UINT32 is all we can do.
      */
+    start = g_get_monotonic_time ();
     rc = Tss2_Sys_GetCapability (sapi_context,
                                  NULL,
                                  TPM2_CAP_HANDLES,
@@ -526,6 +716,7 @@ access_broker_get_trans_object_count (AccessBroker *broker,
                                  &more_data,
                                  &capability_data,
                                  NULL);
+    access_broker_add_busy (broker, start);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("%s: Tss2_Sys_GetCapability failed with RC 0x%" PRIx32,
                    __func__, rc);
@@ -543,13 +734,18 @@ access_broker_context_load (AccessBroker *broker,
 {
     TSS2_RC           rc;
     TSS2_SYS_CONTEXT *sapi_context;
+    gint64            start;
 
     assert (broker == NULL);
     assert (context == NULL);
     assert (handle == NULL);
 
     sapi_context = access_broker_lock_sapi (broker);
+    start = g_get_monotonic_time ();
     rc = Tss2_Sys_ContextLoad (sapi_context, context, handle);
+    access_broker_add_busy (broker, start);
+    __atomic_fetch_add (&broker->stats.context_loads, 1, __ATOMIC_RELAXED);
+    TABRMD_PROBE2 (context_load, *handle, rc);
     access_broker_unlock (broker);
     if (rc == TSS2_RC_SUCCESS) {
         g_debug ("%s: successfully load context, got handle 0x%" PRIx32,
@@ -574,13 +770,100 @@ access_broker_context_save (AccessBroker *broker,
 {
     TSS2_RC rc;
     TSS2_SYS_CONTEXT *sapi_context;
+    gint64 start;
 
     assert (broker == NULL);
     assert (context == NULL);
 
     g_debug ("access_broker_context_save: handle 0x%08" PRIx32, handle);
     sapi_context = access_broker_lock_sapi (broker);
+    start = g_get_monotonic_time ();
     rc = Tss2_Sys_ContextSave (sapi_context, handle, context);
+    access_broker_add_busy (broker, start);
+    __atomic_fetch_add (&broker->stats.context_saves, 1, __ATOMIC_RELAXED);
+    TABRMD_PROBE2 (context_save, handle, rc);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s returned an error: 0x%" PRIx32, __func__, rc);
+    }
+    access_broker_unlock (broker);
+
+    return rc;
+}
+/*
+ * This function is a simple wrapper around the TPM2_GetRandom command. The
+ * TPM may return fewer bytes than requested: no more than the size of its
+ * largest digest.
+ */
+TSS2_RC
+access_broker_get_random (AccessBroker *broker,
+                          UINT16        size,
+                          TPM2B_DIGEST *random_bytes)
+{
+    TSS2_RC rc;
+    TSS2_SYS_CONTEXT *sapi_context;
+    gint64 start;
+
+    g_debug ("%s: requesting %" PRIu16 " bytes", __func__, size);
+    sapi_context = access_broker_lock_sapi (broker);
+    start = g_get_monotonic_time ();
+    rc = Tss2_Sys_GetRandom (sapi_context, NULL, size, random_bytes, NULL);
+    access_broker_add_busy (broker, start);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s returned an error: 0x%" PRIx32, __func__, rc);
+    }
+    access_broker_unlock (broker);
+
+    return rc;
+}
+/*
+ * This function is a simple wrapper around the TPM2_IncrementalSelfTest
+ * command. An empty 'to_test' list just returns the algorithms that still
+ * need testing through 'to_do_list'.
+ */
+TSS2_RC
+access_broker_incremental_self_test (AccessBroker *broker,
+                                     TPML_ALG     *to_test,
+                                     TPML_ALG     *to_do_list)
+{
+    TSS2_RC rc;
+    TSS2_SYS_CONTEXT *sapi_context;
+    gint64 start;
+
+    g_debug ("%s: testing %" PRIu32 " algorithms", __func__, to_test->count);
+    sapi_context = access_broker_lock_sapi (broker);
+    start = g_get_monotonic_time ();
+    rc = Tss2_Sys_IncrementalSelfTest (sapi_context,
+                                       NULL,
+                                       to_test,
+                                       to_do_list,
+                                       NULL);
+    access_broker_add_busy (broker, start);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s returned an error: 0x%" PRIx32, __func__, rc);
+    }
+    access_broker_unlock (broker);
+
+    return rc;
+}
+/*
+ * This function is a simple wrapper around the TPM2_GetTestResult command.
+ * The manufacturer specific test data is discarded, only the result is
+ * returned through 'test_result'.
+ */
+TSS2_RC
+access_broker_get_test_result (AccessBroker *broker,
+                               TPM2_RC      *test_result)
+{
+    TPM2B_MAX_BUFFER out_data = { .size = 0 };
+    TSS2_RC rc;
+    TSS2_SYS_CONTEXT *sapi_context;
+    gint64 start;
+
+    sapi_context = access_broker_lock_sapi (broker);
+    start = g_get_monotonic_time ();
+    rc = Tss2_Sys_GetTestResult (sapi_context, NULL, &out_data, test_result,
+                                 NULL);
+    access_broker_add_busy (broker, start);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("%s returned an error: 0x%" PRIx32, __func__, rc);
     }
@@ -597,12 +880,16 @@ access_broker_context_flush (AccessBroker *broker,
 {
     TSS2_RC rc;
     TSS2_SYS_CONTEXT *sapi_context;
+    gint64 start;
 
     assert (broker == NULL);
 
     g_debug ("access_broker_context_flush: handle 0x%08" PRIx32, handle);
     sapi_context = access_broker_lock_sapi (broker);
+    start = g_get_monotonic_time ();
     rc = Tss2_Sys_FlushContext (sapi_context, handle);
+    access_broker_add_busy (broker, start);
+    TABRMD_PROBE2 (context_flush, handle, rc);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("Failed to flush context for handle 0x%08" PRIx32
                    " RC: 0x%" PRIx32, handle, rc);
@@ -618,13 +905,18 @@ access_broker_context_saveflush (AccessBroker *broker,
 {
     TSS2_RC           rc;
     TSS2_SYS_CONTEXT *sapi_context;
+    gint64            start;
 
     assert (broker == NULL);
     assert (context == NULL);
 
     g_debug ("access_broker_context_saveflush: handle 0x%" PRIx32, handle);
     sapi_context = access_broker_lock_sapi (broker);
+    start = g_get_monotonic_time ();
     rc = Tss2_Sys_ContextSave (sapi_context, handle, context);
+    access_broker_add_busy (broker, start);
+    __atomic_fetch_add (&broker->stats.context_saves, 1, __ATOMIC_RELAXED);
+    TABRMD_PROBE2 (context_save, handle, rc);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("%s: Tss2_Sys_ContextSave failed to save context for "
                    "handle: 0x%" PRIx32 " TSS2_RC: 0x%" PRIx32, __func__,
@@ -632,7 +924,10 @@ access_broker_context_saveflush (AccessBroker *broker,
         goto out;
     }
     g_debug ("access_broker_context_saveflush: handle 0x%" PRIx32, handle);
+    start = g_get_monotonic_time ();
     rc = Tss2_Sys_FlushContext (sapi_context, handle);
+    access_broker_add_busy (broker, start);
+    TABRMD_PROBE2 (context_flush, handle, rc);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning("%s: Tss2_Sys_FlushContext failed for handle: 0x%" PRIx32
                   ", TSS2_RC: 0x%" PRIx32, __func__, handle, rc);
@@ -658,12 +953,14 @@ access_broker_flush_all_unlocked (AccessBroker     *broker,
     TPMS_CAPABILITY_DATA capability_data = { 0, };
     TPM2_HANDLE handle;
     size_t i;
+    gint64 start;
 
     g_debug ("%s: first: 0x%08" PRIx32 ", last: 0x%08" PRIx32,
              __func__, first, last);
     assert (broker != NULL);
     assert (sapi_context != NULL);
 
+    start = g_get_monotonic_time ();
     rc = Tss2_Sys_GetCapability (sapi_context,
                                  NULL,
                                  TPM2_CAP_HANDLES,
@@ -672,6 +969,7 @@ access_broker_flush_all_unlocked (AccessBroker     *broker,
                                  &more_data,
                                  &capability_data,
                                  NULL);
+    access_broker_add_busy (broker, start);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("Failed to get capability TPM2_CAP_HANDLES");
         return rc;
@@ -681,7 +979,9 @@ access_broker_flush_all_unlocked (AccessBroker     *broker,
         handle = capability_data.data.handles.handle [i];
         g_debug ("%s: flushing context with handle: 0x%08" PRIx32, __func__,
                  handle);
+        start = g_get_monotonic_time ();
         rc = Tss2_Sys_FlushContext (sapi_context, handle);
+        access_broker_add_busy (broker, start);
         if (rc != TSS2_RC_SUCCESS) {
             g_warning ("Failed to flush context for handle 0x%08" PRIx32
                        " RC: 0x%" PRIx32, handle, rc);
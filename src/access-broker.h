@@ -11,22 +11,49 @@
 #include <pthread.h>
 #include <tss2/tss2_sys.h>
 
+#include "lock-stats.h"
 #include "tcti.h"
 #include "tpm2-response.h"
 
 G_BEGIN_DECLS
 
+/*
+ * Called by the AccessBroker at most once per command, while the TPM is
+ * executing it. The AccessBroker lock is held so this function must not
+ * use the AccessBroker.
+ */
+typedef void (*AccessBrokerBusyFunc) (gpointer user_data);
+
+/*
+ * 'busy_us' is the time the TPM was busy on our behalf: from handing a
+ * command to the TCTI until the response is back, less any time spent in
+ * the busy_func. Context loads and saves are counted whether they come
+ * from the ResourceManager or from a client. All three are updated with
+ * atomic ops.
+ */
+typedef struct {
+    guint64                 busy_us;
+    guint64                 context_loads;
+    guint64                 context_saves;
+} access_broker_stats_t;
+
 typedef struct _AccessBrokerClass {
     GObjectClass      parent;
 } AccessBrokerClass;
 
 typedef struct _AccessBroker {
     GObject                 parent_instance;
-    pthread_mutex_t         sapi_mutex;
+    stat_mutex_t            sapi_mutex;
     TSS2_SYS_CONTEXT       *sapi_context;
     Tcti                   *tcti;
     TPMS_CAPABILITY_DATA    properties_fixed;
     gboolean                initialized;
+    AccessBrokerBusyFunc    busy_func;
+    gpointer                busy_data;
+    gboolean                nonblock_unsupported;
+    gint                    cancel_requested;
+    gint                    cancel_unsupported;
+    access_broker_stats_t   stats;
 } AccessBroker;
 
 #include "tpm2-command.h"
@@ -46,6 +73,13 @@ void               access_broker_unlock         (AccessBroker    *broker);
 Tpm2Response*      access_broker_send_command   (AccessBroker    *broker,
                                                  Tpm2Command     *command,
                                                  TSS2_RC         *rc);
+TSS2_RC            access_broker_cancel         (AccessBroker    *broker);
+void               access_broker_clear_cancel   (AccessBroker    *broker);
+void               access_broker_set_busy_func  (AccessBroker    *broker,
+                                                 AccessBrokerBusyFunc func,
+                                                 gpointer         user_data);
+void               access_broker_get_stats      (AccessBroker    *broker,
+                                                 access_broker_stats_t *stats);
 TSS2_RC            access_broker_get_max_command    (AccessBroker   *broker,
                                                      guint32        *value);
 TSS2_RC            access_broker_get_max_response   (AccessBroker   *broker,
@@ -65,6 +99,14 @@ TSS2_RC            access_broker_context_save           (AccessBroker *broker,
                                                          TPM2_HANDLE    handle,
                                                          TPMS_CONTEXT *context);
 void               access_broker_flush_all_context      (AccessBroker *broker);
+TSS2_RC            access_broker_incremental_self_test  (AccessBroker *broker,
+                                                         TPML_ALG     *to_test,
+                                                         TPML_ALG     *to_do_list);
+TSS2_RC            access_broker_get_test_result        (AccessBroker *broker,
+                                                         TPM2_RC      *test_result);
+TSS2_RC            access_broker_get_random             (AccessBroker *broker,
+                                                         UINT16        size,
+                                                         TPM2B_DIGEST *random_bytes);
 TSS2_RC            access_broker_send_tpm_startup       (AccessBroker *broker);
 TSS2_SYS_CONTEXT*  sapi_context_init                    (Tcti *tcti);
 TSS2_RC            access_broker_flush_all_unlocked     (AccessBroker     *broker,
@@ -0,0 +1,263 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+
+#include "admission-control.h"
+
+G_DEFINE_TYPE (AdmissionControl, admission_control, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_MAX_IN_FLIGHT,
+    PROP_MAX_CONNECTION_IN_FLIGHT,
+    PROP_BUSY_WHEN_FULL,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+
+static void
+admission_control_get_property (GObject     *object,
+                                guint        property_id,
+                                GValue      *value,
+                                GParamSpec  *pspec)
+{
+    AdmissionControl *self = ADMISSION_CONTROL (object);
+
+    switch (property_id) {
+    case PROP_MAX_IN_FLIGHT:
+        g_value_set_uint (value, self->max_in_flight);
+        break;
+    case PROP_MAX_CONNECTION_IN_FLIGHT:
+        g_value_set_uint (value, self->max_connection_in_flight);
+        break;
+    case PROP_BUSY_WHEN_FULL:
+        g_value_set_boolean (value, self->busy_when_full);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+admission_control_set_property (GObject        *object,
+                                guint           property_id,
+                                GValue const   *value,
+                                GParamSpec     *pspec)
+{
+    AdmissionControl *self = ADMISSION_CONTROL (object);
+
+    switch (property_id) {
+    case PROP_MAX_IN_FLIGHT:
+        self->max_in_flight = g_value_get_uint (value);
+        g_debug ("%s: max-in-flight: %u", __func__, self->max_in_flight);
+        break;
+    case PROP_MAX_CONNECTION_IN_FLIGHT:
+        self->max_connection_in_flight = g_value_get_uint (value);
+        g_debug ("%s: max-connection-in-flight: %u", __func__,
+                 self->max_connection_in_flight);
+        break;
+    case PROP_BUSY_WHEN_FULL:
+        self->busy_when_full = g_value_get_boolean (value);
+        g_debug ("%s: busy-when-full: %s", __func__,
+                 self->busy_when_full ? "true" : "false");
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+admission_control_init (AdmissionControl *admission)
+{
+    pthread_mutex_init (&admission->mutex, NULL);
+}
+static void
+admission_control_finalize (GObject *object)
+{
+    AdmissionControl *admission = ADMISSION_CONTROL (object);
+
+    g_debug ("%s: admitted %" PRIu64 " commands, deferred %" PRIu64
+             ", rejected %" PRIu64, __func__, admission->stats.admitted,
+             admission->stats.deferred, admission->stats.rejected);
+    pthread_mutex_destroy (&admission->mutex);
+    G_OBJECT_CLASS (admission_control_parent_class)->finalize (object);
+}
+static void
+admission_control_class_init (AdmissionControlClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (admission_control_parent_class == NULL)
+        admission_control_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = admission_control_finalize;
+    object_class->get_property = admission_control_get_property;
+    object_class->set_property = admission_control_set_property;
+
+    obj_properties [PROP_MAX_IN_FLIGHT] =
+        g_param_spec_uint ("max-in-flight",
+                           "max in flight",
+                           "Commands admitted but not yet answered across "
+                           "all connections, 0 for no limit",
+                           0,
+                           G_MAXUINT,
+                           0,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_MAX_CONNECTION_IN_FLIGHT] =
+        g_param_spec_uint ("max-connection-in-flight",
+                           "max connection in flight",
+                           "Commands admitted but not yet answered for a "
+                           "single connection, 0 for no limit",
+                           0,
+                           G_MAXUINT,
+                           0,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_BUSY_WHEN_FULL] =
+        g_param_spec_boolean ("busy-when-full",
+                              "busy when full",
+                              "Answer with a busy response code instead of "
+                              "deferring when the global limit is hit",
+                              FALSE,
+                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+/*
+ * A limit of 0 means no limit. When 'busy_when_full' is set a connection
+ * that hits the global limit while it has nothing in flight is told to try
+ * again instead of being deferred.
+ */
+AdmissionControl*
+admission_control_new (guint    max_in_flight,
+                       guint    max_connection_in_flight,
+                       gboolean busy_when_full)
+{
+    return ADMISSION_CONTROL (g_object_new (TYPE_ADMISSION_CONTROL,
+                                            "max-in-flight", max_in_flight,
+                                            "max-connection-in-flight",
+                                            max_connection_in_flight,
+                                            "busy-when-full", busy_when_full,
+                                            NULL));
+}
+/*
+ * Register the function called when a command is released while someone
+ * is waiting to be admitted. Pass NULL to clear it.
+ */
+void
+admission_control_set_resume_func (AdmissionControl   *admission,
+                                   AdmissionResumeFunc func,
+                                   gpointer            user_data)
+{
+    g_assert_nonnull (admission);
+    pthread_mutex_lock (&admission->mutex);
+    admission->resume_func = func;
+    admission->resume_data = user_data;
+    pthread_mutex_unlock (&admission->mutex);
+}
+/*
+ * Put 'connection' under the control of 'admission'. The Connection holds
+ * a reference so responses can be released after the CommandSource is gone.
+ */
+void
+admission_control_attach (AdmissionControl *admission,
+                          Connection       *connection)
+{
+    g_assert_nonnull (admission);
+    g_assert_nonnull (connection);
+    g_assert_null (connection->admission);
+    connection->admission = g_object_ref (admission);
+}
+/*
+ * Decide whether the next command from 'connection' may be read. A command
+ * that's admitted counts against both limits until it's released. When a
+ * limit is hit the connection is deferred: the caller stops reading from
+ * it until the resume function is called. The per-connection limit always
+ * defers so responses to a connection stay in order.
+ */
+admission_t
+admission_control_admit (AdmissionControl *admission,
+                         Connection       *connection)
+{
+    admission_t ret = ADMISSION_ADMIT;
+
+    g_assert_nonnull (admission);
+    pthread_mutex_lock (&admission->mutex);
+    if (admission->max_connection_in_flight != 0 &&
+        connection->in_flight >= admission->max_connection_in_flight)
+    {
+        ret = ADMISSION_DEFER;
+    } else if (admission->max_in_flight != 0 &&
+               admission->in_flight >= admission->max_in_flight)
+    {
+        ret = (admission->busy_when_full && connection->in_flight == 0) ?
+            ADMISSION_REJECT : ADMISSION_DEFER;
+    }
+    switch (ret) {
+    case ADMISSION_ADMIT:
+        ++admission->in_flight;
+        ++connection->in_flight;
+        ++admission->stats.admitted;
+        admission->stats.high_water = MAX (admission->stats.high_water,
+                                           admission->in_flight);
+        admission->stats.connection_high_water =
+            MAX (admission->stats.connection_high_water,
+                 connection->in_flight);
+        break;
+    case ADMISSION_DEFER:
+        admission->waiting = TRUE;
+        ++admission->stats.deferred;
+        break;
+    case ADMISSION_REJECT:
+        ++admission->stats.rejected;
+        break;
+    }
+    pthread_mutex_unlock (&admission->mutex);
+    return ret;
+}
+/*
+ * Release 'count' commands admitted for 'connection', either because
+ * they've been answered or because they were dropped. Does nothing for a
+ * connection that isn't under admission control. If a connection was
+ * deferred the resume function is called, with the lock held so it can't
+ * be cleared out from under us.
+ */
+void
+admission_control_release (Connection *connection,
+                           guint       count)
+{
+    AdmissionControl *admission;
+
+    g_assert_nonnull (connection);
+    admission = connection->admission;
+    if (admission == NULL || count == 0) {
+        return;
+    }
+    pthread_mutex_lock (&admission->mutex);
+    count = MIN (count, connection->in_flight);
+    connection->in_flight -= count;
+    admission->in_flight -= MIN (count, admission->in_flight);
+    if (admission->waiting && admission->resume_func != NULL) {
+        admission->waiting = FALSE;
+        admission->resume_func (admission->resume_data);
+    }
+    pthread_mutex_unlock (&admission->mutex);
+}
+guint
+admission_control_in_flight (AdmissionControl *admission)
+{
+    guint in_flight;
+
+    pthread_mutex_lock (&admission->mutex);
+    in_flight = admission->in_flight;
+    pthread_mutex_unlock (&admission->mutex);
+    return in_flight;
+}
+void
+admission_control_get_stats (AdmissionControl          *admission,
+                             admission_control_stats_t *stats)
+{
+    g_assert_nonnull (admission);
+    g_assert_nonnull (stats);
+    pthread_mutex_lock (&admission->mutex);
+    *stats = admission->stats;
+    pthread_mutex_unlock (&admission->mutex);
+}
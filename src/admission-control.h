@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+
+#include "connection.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+    ADMISSION_ADMIT,
+    ADMISSION_DEFER,
+    ADMISSION_REJECT,
+} admission_t;
+
+/*
+ * Called when a command is released while a connection is waiting to be
+ * admitted. It may be called from any thread.
+ */
+typedef void (*AdmissionResumeFunc) (gpointer user_data);
+
+typedef struct {
+    guint64           admitted;
+    guint64           deferred;
+    guint64           rejected;
+    guint             high_water;
+    guint             connection_high_water;
+} admission_control_stats_t;
+
+typedef struct _AdmissionControlClass {
+    GObjectClass      parent;
+} AdmissionControlClass;
+
+typedef struct _AdmissionControl {
+    GObject           parent_instance;
+    pthread_mutex_t   mutex;
+    guint             max_in_flight;
+    guint             max_connection_in_flight;
+    gboolean          busy_when_full;
+    guint             in_flight;
+    gboolean          waiting;
+    AdmissionResumeFunc resume_func;
+    gpointer          resume_data;
+    admission_control_stats_t stats;
+} AdmissionControl;
+
+#define TYPE_ADMISSION_CONTROL              (admission_control_get_type   ())
+#define ADMISSION_CONTROL(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_ADMISSION_CONTROL, AdmissionControl))
+#define ADMISSION_CONTROL_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_ADMISSION_CONTROL, AdmissionControlClass))
+#define IS_ADMISSION_CONTROL(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_ADMISSION_CONTROL))
+#define IS_ADMISSION_CONTROL_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_ADMISSION_CONTROL))
+#define ADMISSION_CONTROL_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_ADMISSION_CONTROL, AdmissionControlClass))
+
+GType             admission_control_get_type        (void);
+AdmissionControl* admission_control_new             (guint            max_in_flight,
+                                                     guint            max_connection_in_flight,
+                                                     gboolean         busy_when_full);
+void              admission_control_set_resume_func (AdmissionControl *admission,
+                                                     AdmissionResumeFunc func,
+                                                     gpointer         user_data);
+void              admission_control_attach          (AdmissionControl *admission,
+                                                     Connection      *connection);
+admission_t       admission_control_admit           (AdmissionControl *admission,
+                                                     Connection      *connection);
+void              admission_control_release         (Connection      *connection,
+                                                     guint            count);
+guint             admission_control_in_flight       (AdmissionControl *admission);
+void              admission_control_get_stats       (AdmissionControl *admission,
+                                                     admission_control_stats_t *stats);
+
+G_END_DECLS
+#endif /* ADMISSION_CONTROL_H */
@@ -15,8 +15,11 @@
 #include "connection-manager.h"
 #include "command-source.h"
 #include "source-interface.h"
+#include "tabrmd.h"
+#include "tabrmd-probes.h"
 #include "tpm2-command.h"
 #include "tpm2-header.h"
+#include "tpm2-response.h"
 #include "util.h"
 
 #ifndef G_SOURCE_FUNC
@@ -25,6 +28,7 @@
 
 enum {
     PROP_0,
+    PROP_ADMISSION_CONTROL,
     PROP_COMMAND_ATTRS,
     PROP_CONNECTION_MANAGER,
     PROP_SINK,
@@ -104,6 +108,100 @@ G_DEFINE_TYPE_WITH_CODE (
                            command_source_source_interface_init)
     );
 
+/*
+ * Create a GSource to call us back when 'istream' has data and attach it
+ * to our GMainContext. Any previous GSource must already be destroyed.
+ */
+static void
+command_source_watch (CommandSource        *self,
+                      GPollableInputStream *istream,
+                      source_data_t        *data)
+{
+    g_clear_pointer (&data->source, g_source_unref);
+    data->source = g_pollable_input_stream_create_source (istream,
+                                                          data->cancellable);
+    g_source_set_callback (data->source,
+                           G_SOURCE_FUNC (command_source_on_input_ready),
+                           data,
+                           NULL);
+    /* we ignore the ID returned since we keep a reference to the source around */
+    g_source_attach (data->source, self->main_context);
+}
+/*
+ * Idle callback run by the GMainLoop thread after the AdmissionControl has
+ * released a command while a connection was deferred. Every paused
+ * connection is polled again: those still over a limit are deferred again
+ * on their next callback.
+ */
+gboolean
+command_source_resume (gpointer user_data)
+{
+    CommandSource *self = COMMAND_SOURCE (user_data);
+    GHashTableIter iter;
+    gpointer key, value;
+    source_data_t *data;
+
+    g_debug ("%s", __func__);
+    g_atomic_int_set (&self->resume_pending, 0);
+    g_hash_table_iter_init (&iter, self->istream_to_source_data_map);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        data = (source_data_t*)value;
+        if (data->paused) {
+            data->paused = FALSE;
+            command_source_watch (self, G_POLLABLE_INPUT_STREAM (key), data);
+        }
+    }
+    return G_SOURCE_REMOVE;
+}
+/*
+ * AdmissionResumeFunc: called from whatever thread released the command.
+ * The paused GSources belong to the GMainLoop thread so we get it to do
+ * the work. Only one idle source is pending at a time.
+ */
+static void
+command_source_on_resume (gpointer user_data)
+{
+    CommandSource *self = COMMAND_SOURCE (user_data);
+    GSource *idle;
+
+    if (!g_atomic_int_compare_and_exchange (&self->resume_pending, 0, 1)) {
+        return;
+    }
+    idle = g_idle_source_new ();
+    g_source_set_callback (idle, command_source_resume, self, NULL);
+    g_source_attach (idle, self->main_context);
+    g_source_unref (idle);
+}
+/*
+ * Read a command from a connection the AdmissionControl has turned away
+ * and answer it with TSS2_RESMGR_RC_BUSY. The connection has nothing in
+ * flight so this response can't overtake another. Returns FALSE if the
+ * command couldn't be read or the response written.
+ */
+static gboolean
+command_source_reply_busy (Connection   *connection,
+                           GInputStream *istream)
+{
+    Tpm2Response *response;
+    GOutputStream *ostream;
+    uint8_t *buf;
+    size_t buf_size;
+    ssize_t written;
+
+    buf = read_tpm_buffer_alloc (istream, &buf_size);
+    if (buf == NULL) {
+        return FALSE;
+    }
+    g_free (buf);
+    g_debug ("%s: connection %p is busy", __func__, (void*)connection);
+    response = tpm2_response_new_rc (connection, TSS2_RESMGR_RC_BUSY);
+    ostream = g_io_stream_get_output_stream (connection_get_iostream (connection));
+    written = write_all (ostream,
+                         tpm2_response_get_buffer (response),
+                         tpm2_response_get_size (response));
+    g_object_unref (response);
+    return written > 0;
+}
 static void
 command_source_set_property (GObject       *object,
                               guint          property_id,
@@ -114,6 +212,14 @@ command_source_set_property (GObject       *object,
 
     g_debug (__func__);
     switch (property_id) {
+    case PROP_ADMISSION_CONTROL:
+        self->admission = g_value_dup_object (value);
+        if (self->admission != NULL) {
+            admission_control_set_resume_func (self->admission,
+                                               command_source_on_resume,
+                                               self);
+        }
+        break;
     case PROP_COMMAND_ATTRS:
         self->command_attrs = COMMAND_ATTRS (g_value_dup_object (value));
         break;
@@ -145,6 +251,9 @@ command_source_get_property (GObject      *object,
 
     g_debug (__func__);
     switch (property_id) {
+    case PROP_ADMISSION_CONTROL:
+        g_value_set_object (value, self->admission);
+        break;
     case PROP_COMMAND_ATTRS:
         g_value_set_object (value, self->command_attrs);
         break;
@@ -159,6 +268,22 @@ command_source_get_property (GObject      *object,
         break;
     }
 }
+/*
+ * Classify a command as stateless: it must be a command the TPM knows about
+ * (so the attributes can be trusted), have no handles in either the command
+ * or response handle area, and have no authorization area.
+ */
+static gboolean
+command_is_stateless (Tpm2Command *command,
+                      TPM2_CC      command_code)
+{
+    TPMA_CC attributes = tpm2_command_get_attributes (command);
+
+    return (attributes & TPMA_CC_COMMANDINDEX_MASK) ==
+        (command_code & TPMA_CC_COMMANDINDEX_MASK) &&
+        (attributes & (TPMA_CC_CHANDLES_MASK | TPMA_CC_RHANDLE)) == 0 &&
+        tpm2_command_get_tag (command) == TPM2_ST_NO_SESSIONS;
+}
 /*
  * This function is invoked by the GMainLoop thread when a client GSocket has
  * data ready. This is what makes the CommandSource a source (of Tpm2Commands).
@@ -170,6 +295,10 @@ command_source_get_property (GObject      *object,
  * with the client will be closed and removed from the ConnectionManager.
  * Additionally the function will return FALSE and the GSource will no longer
  * monitor the GSocket for the G_IO_IN condition.
+ *
+ * With an AdmissionControl the command is only read once it's admitted.
+ * A deferred connection stops being polled: the command stays in the socket
+ * and the client is pushed back on through the socket buffer.
  */
 gboolean
 command_source_on_input_ready (GInputStream *istream,
@@ -179,8 +308,9 @@ command_source_on_input_ready (GInputStream *istream,
     Connection    *connection;
     Tpm2Command   *command;
     TPMA_CC        attributes = { 0 };
-    uint8_t       *buf;
+    uint8_t       *buf = NULL;
     size_t         buf_size;
+    gboolean       admitted = FALSE;
 
     g_debug (__func__);
     connection =
@@ -190,6 +320,25 @@ command_source_on_input_ready (GInputStream *istream,
         g_error ("%s: failed to get connection associated with istream",
                  __func__);
     }
+    if (data->self->admission != NULL) {
+        switch (admission_control_admit (data->self->admission, connection)) {
+        case ADMISSION_ADMIT:
+            admitted = TRUE;
+            break;
+        case ADMISSION_DEFER:
+            g_debug ("%s: deferring connection %p", __func__,
+                     (void*)connection);
+            data->paused = TRUE;
+            g_object_unref (connection);
+            return G_SOURCE_REMOVE;
+        case ADMISSION_REJECT:
+            if (!command_source_reply_busy (connection, istream)) {
+                goto fail_out;
+            }
+            g_object_unref (connection);
+            return G_SOURCE_CONTINUE;
+        }
+    }
     buf = read_tpm_buffer_alloc (istream, &buf_size);
     if (buf == NULL) {
         goto fail_out;
@@ -198,6 +347,12 @@ command_source_on_input_ready (GInputStream *istream,
                                         get_command_code (buf));
     command = tpm2_command_new (connection, buf, buf_size, attributes);
     if (command != NULL) {
+        TABRMD_PROBE5 (command_read, connection->id, get_command_code (buf),
+                       buf_size, tpm2_command_get_handle_count (command),
+                       tpm2_command_get_handle (command, 0));
+        tpm2_command_set_stateless (command,
+                                    command_is_stateless (command,
+                                                          get_command_code (buf)));
         sink_enqueue (data->self->sink, G_OBJECT (command));
         /* the sink now owns this message */
         g_object_unref (command);
@@ -210,6 +365,9 @@ fail_out:
     if (buf != NULL) {
         g_free (buf);
     }
+    if (admitted) {
+        admission_control_release (connection, 1);
+    }
     g_debug ("%s: removing connection from connection_manager", __func__);
     connection_manager_remove (data->self->connection_manager,
                                connection);
@@ -252,17 +410,13 @@ command_source_on_new_connection (ConnectionManager   *connection_manager,
     iostream = connection_get_iostream (connection);
     istream = G_POLLABLE_INPUT_STREAM (g_io_stream_get_input_stream (iostream));
     g_object_ref (istream);
+    if (self->admission != NULL) {
+        admission_control_attach (self->admission, connection);
+    }
     data = g_malloc0 (sizeof (source_data_t));
     data->cancellable = g_cancellable_new ();
-    data->source = g_pollable_input_stream_create_source (istream,
-                                                          data->cancellable);
-    /* we ignore the ID returned since we keep a reference to the source around */
-    g_source_attach (data->source, self->main_context);
     data->self = self;
-    g_source_set_callback (data->source,
-                           G_SOURCE_FUNC (command_source_on_input_ready),
-                           data,
-                           NULL);
+    command_source_watch (self, istream, data);
     /*
      * To stop watching this socket for G_IO_IN condition use this GHashTable
      * to look up the GCancellable object. The hash table takes ownership of
@@ -298,7 +452,18 @@ command_source_source_cancel (gpointer key,
 static void
 command_source_dispose (GObject *object) {
     CommandSource *self = COMMAND_SOURCE (object);
+    admission_control_stats_t stats;
 
+    if (self->admission != NULL) {
+        admission_control_set_resume_func (self->admission, NULL, NULL);
+        admission_control_get_stats (self->admission, &stats);
+        g_info ("%s: admitted %" PRIu64 " commands, deferred %" PRIu64
+                ", rejected %" PRIu64 ", in flight high water mark %u (%u "
+                "for one connection)", __func__, stats.admitted,
+                stats.deferred, stats.rejected, stats.high_water,
+                stats.connection_high_water);
+    }
+    g_clear_object (&self->admission);
     g_clear_object (&self->sink);
     g_clear_object (&self->connection_manager);
     g_clear_object (&self->command_attrs);
@@ -339,6 +504,8 @@ command_source_unblock (Thread *self)
 /*
  * This function creates it's very own GMainLoop thread. This is used to
  * monitor client connections for incoming data (TPM2 command buffers).
+ * The GMainContext is the thread default so that stages running inline
+ * on this thread can attach their own timers to it.
  */
 void*
 command_source_thread (void *data)
@@ -349,9 +516,11 @@ command_source_thread (void *data)
     source = COMMAND_SOURCE (data);
     g_assert (source->main_loop != NULL);
 
+    g_main_context_push_thread_default (source->main_context);
     if (!g_main_loop_is_running (source->main_loop)) {
         g_main_loop_run (source->main_loop);
     }
+    g_main_context_pop_thread_default (source->main_context);
 
     return NULL;
 }
@@ -373,6 +542,12 @@ command_source_class_init (CommandSourceClass *klass)
     thread_class->thread_run   = command_source_thread;
     thread_class->thread_unblock = command_source_unblock;
 
+    obj_properties [PROP_ADMISSION_CONTROL] =
+        g_param_spec_object ("admission-control",
+                             "AdmissionControl object",
+                             "Limits the commands in flight, NULL for none.",
+                             TYPE_ADMISSION_CONTROL,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     obj_properties [PROP_COMMAND_ATTRS] =
         g_param_spec_object ("command-attrs",
                              "CommandAttrs object",
@@ -395,9 +570,15 @@ command_source_class_init (CommandSourceClass *klass)
                                        N_PROPERTIES,
                                        obj_properties);
 }
+/*
+ * Create a CommandSource reading commands from the Connections in
+ * 'connection_manager'. 'admission' may be NULL in which case commands are
+ * read as soon as they arrive.
+ */
 CommandSource*
 command_source_new (ConnectionManager    *connection_manager,
-                    CommandAttrs         *command_attrs)
+                    CommandAttrs         *command_attrs,
+                    AdmissionControl     *admission)
 {
     CommandSource *source;
 
@@ -405,6 +586,7 @@ command_source_new (ConnectionManager    *connection_manager,
         g_error ("command_source_new passed NULL ConnectionManager");
     g_object_ref (connection_manager);
     source = COMMAND_SOURCE (g_object_new (TYPE_COMMAND_SOURCE,
+                                             "admission-control", admission,
                                              "command-attrs", command_attrs,
                                              "connection-manager", connection_manager,
                                              NULL));
@@ -10,6 +10,7 @@
 #include <glib-object.h>
 #include <pthread.h>
 
+#include "admission-control.h"
 #include "command-attrs.h"
 #include "connection-manager.h"
 #include "sink-interface.h"
@@ -34,6 +35,8 @@ typedef struct _CommandSource {
     GMainLoop         *main_loop;
     GHashTable        *istream_to_source_data_map;
     Sink              *sink;
+    AdmissionControl  *admission;
+    gint               resume_pending;
 } CommandSource;
 
 #define TYPE_COMMAND_SOURCE              (command_source_get_type   ())
@@ -45,7 +48,8 @@ typedef struct _CommandSource {
 
 GType           command_source_get_type          (void);
 CommandSource*  command_source_new               (ConnectionManager  *connection_manager,
-                                                  CommandAttrs       *command_attrs);
+                                                  CommandAttrs       *command_attrs,
+                                                  AdmissionControl   *admission);
 gint            command_source_on_new_connection (ConnectionManager  *connection_manager,
                                                   Connection         *connection,
                                                   CommandSource      *command_source);
@@ -55,6 +59,7 @@ gint            command_source_on_new_connection (ConnectionManager  *connection
  */
 gboolean        command_source_on_input_ready    (GInputStream       *socket,
                                                   gpointer            user_data);
+gboolean        command_source_resume            (gpointer            user_data);
 /*
  * Instances of this structure are used to track GSources and their
  * GCancellable objects that have been registered with the
@@ -69,6 +74,9 @@ gboolean        command_source_on_input_ready    (GInputStream       *socket,
  *   and remove the same structure from the hash table (and free it). This way
  *   when the CommandSource is destroyed we won't have stale GSources hanging
  *   around.
+ * - When the AdmissionControl defers a connection we stop polling its
+ *   GSocket: the GSource is destroyed and the structure marked 'paused'.
+ *   Once there's room again a new GSource is created for it.
  * - When the CommandSource is destroyed all of the GSources registered with
  *   the GMainContext/Loop must be canceled and freed (see dispose function).
  */
@@ -76,6 +84,7 @@ typedef struct {
     CommandSource *self;
     GCancellable  *cancellable;
     GSource       *source;
+    gboolean       paused;
 } source_data_t;
 
 
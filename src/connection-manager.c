@@ -14,11 +14,14 @@
 #include "connection-manager.h"
 #include "util.h"
 
-#define MAX_CONNECTIONS 100
+#define MAX_CONNECTIONS CONNECTION_MANAGER_MAX
 #define MAX_CONNECTIONS_DEFAULT 27
 
 G_DEFINE_TYPE (ConnectionManager, connection_manager, G_TYPE_OBJECT);
 
+static lock_stats_t connection_manager_lock_stats =
+    LOCK_STATS_INIT ("ConnectionManager");
+
 enum {
     SIGNAL_0,
     SIGNAL_NEW_CONNECTION,
@@ -91,7 +94,7 @@ connection_manager_new (guint max_connections)
 static void
 connection_manager_init (ConnectionManager *mgr)
 {
-    if (pthread_mutex_init (&mgr->mutex, NULL) != 0)
+    if (stat_mutex_init (&mgr->mutex, &connection_manager_lock_stats) != 0)
         g_error ("Failed to initialize connection _manager mutex: %s",
                  strerror (errno));
     /* These two data structures must be kept in sync. When the
@@ -118,13 +121,13 @@ connection_manager_dispose (GObject *obj)
     ConnectionManager *self = CONNECTION_MANAGER (obj);
     gint ret;
 
-    ret = pthread_mutex_lock (&self->mutex);
+    ret = stat_mutex_lock (&self->mutex);
     if (ret != 0)
         g_warning ("Error locking connection_manager mutex: %s",
                    strerror (errno));
     g_hash_table_unref (self->connection_from_istream_table);
     g_hash_table_unref (self->connection_from_id_table);
-    ret = pthread_mutex_unlock (&self->mutex);
+    ret = stat_mutex_unlock (&self->mutex);
     if (ret != 0)
         g_error ("Error unlocking connection_manager mutex: %s",
                  strerror (errno));
@@ -136,7 +139,7 @@ connection_manager_finalize (GObject *obj)
 {
     ConnectionManager *manager = CONNECTION_MANAGER (obj);
 
-    if (pthread_mutex_destroy (&manager->mutex) != 0)
+    if (stat_mutex_destroy (&manager->mutex) != 0)
         g_error ("Error destroying connection_manager mutex: %s",
                  strerror (errno));
     G_OBJECT_CLASS (connection_manager_parent_class)->finalize (obj);
@@ -190,14 +193,14 @@ connection_manager_insert (ConnectionManager    *manager,
 {
     gint ret;
 
-    ret = pthread_mutex_lock (&manager->mutex);
+    ret = stat_mutex_lock (&manager->mutex);
     if (ret != 0)
         g_error ("Error locking connection_manager mutex: %s",
                  strerror (errno));
     if (connection_manager_is_full (manager)) {
         g_warning ("%s: max_connections of %u exceeded", __func__,
                    manager->max_connections);
-        pthread_mutex_unlock (&manager->mutex);
+        stat_mutex_unlock (&manager->mutex);
         return -1;
     }
     /*
@@ -212,7 +215,8 @@ connection_manager_insert (ConnectionManager    *manager,
     g_hash_table_insert (manager->connection_from_id_table,
                          connection_key_id (connection),
                          connection);
-    ret = pthread_mutex_unlock (&manager->mutex);
+    g_atomic_int_inc (&manager->count);
+    ret = stat_mutex_unlock (&manager->mutex);
     if (ret != 0)
         g_error ("Error unlocking connection_manager mutex: %s",
                  strerror (errno));
@@ -236,7 +240,7 @@ connection_manager_lookup_istream (ConnectionManager *manager,
 {
     Connection *connection;
 
-    pthread_mutex_lock (&manager->mutex);
+    stat_mutex_lock (&manager->mutex);
     connection = g_hash_table_lookup (manager->connection_from_istream_table,
                                       istream);
     if (connection != NULL) {
@@ -244,7 +248,7 @@ connection_manager_lookup_istream (ConnectionManager *manager,
     } else {
         g_warning ("%s returned NULL connection", __func__);
     }
-    pthread_mutex_unlock (&manager->mutex);
+    stat_mutex_unlock (&manager->mutex);
 
     return connection;
 }
@@ -261,7 +265,7 @@ connection_manager_lookup_id (ConnectionManager   *manager,
     Connection *connection;
 
     g_debug ("locking manager mutex");
-    pthread_mutex_lock (&manager->mutex);
+    stat_mutex_lock (&manager->mutex);
     g_debug ("g_hash_table_lookup: connection_from_id_table");
     connection = g_hash_table_lookup (manager->connection_from_id_table,
                                       &id);
@@ -271,7 +275,7 @@ connection_manager_lookup_id (ConnectionManager   *manager,
         g_warning ("connection_manager_lookup_id returned NULL connection");
     }
     g_debug ("unlocking manager mutex");
-    pthread_mutex_unlock (&manager->mutex);
+    stat_mutex_unlock (&manager->mutex);
 
     return connection;
 }
@@ -290,7 +294,7 @@ connection_manager_remove (ConnectionManager   *manager,
     gboolean ret;
 
     g_debug ("%s: removing Connection", __func__);
-    pthread_mutex_lock (&manager->mutex);
+    stat_mutex_lock (&manager->mutex);
     ret = g_hash_table_remove (manager->connection_from_istream_table,
                                connection_key_istream (connection));
     if (ret != TRUE)
@@ -299,15 +303,38 @@ connection_manager_remove (ConnectionManager   *manager,
                                connection_key_id (connection));
     if (ret != TRUE)
         g_error ("%s: failed to remove Connection", __func__);
-    pthread_mutex_unlock (&manager->mutex);
+    g_atomic_int_add (&manager->count, -1);
+    stat_mutex_unlock (&manager->mutex);
 
     return ret;
 }
 
+/*
+ * Return a list of all of the Connections currently managed. The reference
+ * count of each Connection is incremented: the caller must free the list
+ * with g_list_free_full (list, g_object_unref).
+ */
+GList*
+connection_manager_get_connections (ConnectionManager *manager)
+{
+    GList *connections;
+
+    stat_mutex_lock (&manager->mutex);
+    connections = g_hash_table_get_values (manager->connection_from_id_table);
+    g_list_foreach (connections, (GFunc)g_object_ref, NULL);
+    stat_mutex_unlock (&manager->mutex);
+
+    return connections;
+}
+/*
+ * Return the number of Connections managed. This doesn't take the mutex
+ * so it's safe to call from threads that must not wait on the
+ * ConnectionManager, the count may be stale by the time it's used.
+ */
 guint
 connection_manager_size (ConnectionManager   *manager)
 {
-    return g_hash_table_size (manager->connection_from_istream_table);
+    return (guint)g_atomic_int_get (&manager->count);
 }
 
 gboolean
@@ -10,10 +10,11 @@
 #include <glib-object.h>
 
 #include "connection.h"
+#include "lock-stats.h"
 
 G_BEGIN_DECLS
 
-#define CONNECTION_MANAGER_MAX 100
+#define CONNECTION_MANAGER_MAX 8192
 
 typedef struct _ConnectionManagerClass {
     GObjectClass      parent;
@@ -21,10 +22,12 @@ typedef struct _ConnectionManagerClass {
 
 typedef struct _ConnectionManager {
     GObject           parent_instance;
-    pthread_mutex_t   mutex;
+    stat_mutex_t      mutex;
     GHashTable       *connection_from_istream_table;
     GHashTable       *connection_from_id_table;
     guint             max_connections;
+    /* number of Connections in the tables, read without the mutex */
+    gint              count;
 } ConnectionManager;
 
 #define TYPE_CONNECTION_MANAGER              (connection_manager_get_type   ())
@@ -46,6 +49,7 @@ Connection*    connection_manager_lookup_id   (ConnectionManager  *manager,
                                                gint64              id_in);
 gboolean       connection_manager_contains_id (ConnectionManager  *manager,
                                                gint64              id_in);
+GList*         connection_manager_get_connections (ConnectionManager *manager);
 guint          connection_manager_size        (ConnectionManager  *manager);
 gboolean       connection_manager_is_full     (ConnectionManager  *manager);
 
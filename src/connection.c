@@ -78,14 +78,14 @@ connection_get_property (GObject     *object,
     }
 }
 
-/*
- * G_DEFINE_TYPE requires an instance init even though we don't use it.
- */
 static void
 connection_init (Connection *connection)
 {
-    UNUSED_PARAM(connection);
-    /* noop */
+    pthread_mutex_init (&connection->stats_mutex, NULL);
+    connection->command_counts = g_hash_table_new_full (g_direct_hash,
+                                                        g_direct_equal,
+                                                        NULL,
+                                                        g_free);
 }
 
 static void
@@ -95,10 +95,22 @@ connection_dispose (GObject *obj)
 
     g_clear_object (&connection->iostream);
     g_object_unref (connection->transient_handle_map);
+    g_clear_object (&connection->admission);
 
     G_OBJECT_CLASS (connection_parent_class)->dispose (obj);
 }
 
+static void
+connection_finalize (GObject *obj)
+{
+    Connection *connection = CONNECTION (obj);
+
+    g_clear_pointer (&connection->command_counts, g_hash_table_unref);
+    pthread_mutex_destroy (&connection->stats_mutex);
+
+    G_OBJECT_CLASS (connection_parent_class)->finalize (obj);
+}
+
 static void
 connection_class_init (ConnectionClass *klass)
 {
@@ -109,6 +121,7 @@ connection_class_init (ConnectionClass *klass)
         connection_parent_class = g_type_class_peek_parent (klass);
 
     object_class->dispose      = connection_dispose;
+    object_class->finalize     = connection_finalize;
     object_class->get_property = connection_get_property;
     object_class->set_property = connection_set_property;
 
@@ -182,3 +195,80 @@ connection_get_trans_map (Connection *connection)
     g_object_ref (connection->transient_handle_map);
     return connection->transient_handle_map;
 }
+/*
+ * Record the credentials of the client on the other end of the connection.
+ * This is done once, before the connection is made available to other
+ * threads, so they're read without taking a lock.
+ */
+void
+connection_set_client (Connection *connection,
+                       guint32     pid,
+                       guint32     uid)
+{
+    connection->pid = pid;
+    connection->uid = uid;
+}
+/*
+ * Add the counts in 'delta' to the statistics kept for the connection.
+ */
+void
+connection_stats_add (Connection               *connection,
+                      const connection_stats_t *delta)
+{
+    pthread_mutex_lock (&connection->stats_mutex);
+    connection->stats.commands      += delta->commands;
+    connection->stats.tpm_time_us   += delta->tpm_time_us;
+    connection->stats.context_loads += delta->context_loads;
+    connection->stats.context_saves += delta->context_saves;
+    connection->stats.bytes_in      += delta->bytes_in;
+    connection->stats.bytes_out     += delta->bytes_out;
+    pthread_mutex_unlock (&connection->stats_mutex);
+}
+/*
+ * Count a command with the given command code against the connection.
+ */
+void
+connection_stats_add_command (Connection *connection,
+                              guint32     command_code)
+{
+    guint64 *count;
+
+    pthread_mutex_lock (&connection->stats_mutex);
+    count = g_hash_table_lookup (connection->command_counts,
+                                 GUINT_TO_POINTER (command_code));
+    if (count == NULL) {
+        count = g_new0 (guint64, 1);
+        g_hash_table_insert (connection->command_counts,
+                             GUINT_TO_POINTER (command_code),
+                             count);
+    }
+    ++*count;
+    ++connection->stats.commands;
+    pthread_mutex_unlock (&connection->stats_mutex);
+}
+/*
+ * Copy the statistics for the connection into 'stats'. The return value is
+ * a new GHashTable mapping command codes (GUINT_TO_POINTER) to a guint64
+ * count of the commands sent with that code. The caller must unref it.
+ */
+GHashTable*
+connection_get_stats (Connection         *connection,
+                      connection_stats_t *stats)
+{
+    GHashTable *counts;
+    GHashTableIter iter;
+    gpointer key, value;
+    guint64 *count;
+
+    counts = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+    pthread_mutex_lock (&connection->stats_mutex);
+    *stats = connection->stats;
+    g_hash_table_iter_init (&iter, connection->command_counts);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        count = g_new (guint64, 1);
+        *count = *(guint64*)value;
+        g_hash_table_insert (counts, key, count);
+    }
+    pthread_mutex_unlock (&connection->stats_mutex);
+    return counts;
+}
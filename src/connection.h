@@ -9,11 +9,26 @@
 #include <glib.h>
 #include <glib-object.h>
 #include <gio/gio.h>
+#include <pthread.h>
 
 #include "handle-map.h"
 
 G_BEGIN_DECLS
 
+/*
+ * Resources used on behalf of a connection. 'tpm_time_us' and the context
+ * counts are what the TPM spent on the connection's commands, including the
+ * contexts the ResourceManager swapped in and out to run them.
+ */
+typedef struct {
+    guint64             commands;
+    guint64             tpm_time_us;
+    guint64             context_loads;
+    guint64             context_saves;
+    guint64             bytes_in;
+    guint64             bytes_out;
+} connection_stats_t;
+
 typedef struct _ConnectionClass {
     GObjectClass        parent;
 } ConnectionClass;
@@ -23,6 +38,15 @@ typedef struct _Connection {
     GIOStream          *iostream;
     guint64             id;
     HandleMap          *transient_handle_map;
+    /* commands admitted but not yet answered, see AdmissionControl */
+    struct _AdmissionControl *admission;
+    guint               in_flight;
+    /* client credentials, recorded by the IPC frontend */
+    guint32             pid;
+    guint32             uid;
+    pthread_mutex_t     stats_mutex;
+    connection_stats_t  stats;
+    GHashTable         *command_counts;
 } Connection;
 
 #define TYPE_CONNECTION              (connection_get_type ())
@@ -40,4 +64,13 @@ gpointer         connection_key_istream  (Connection      *session);
 gpointer         connection_key_id       (Connection      *session);
 GIOStream*       connection_get_iostream (Connection      *connection);
 HandleMap*       connection_get_trans_map(Connection      *session);
+void             connection_set_client   (Connection      *connection,
+                                          guint32          pid,
+                                          guint32          uid);
+void             connection_stats_add    (Connection      *connection,
+                                          const connection_stats_t *delta);
+void             connection_stats_add_command (Connection *connection,
+                                               guint32     command_code);
+GHashTable*      connection_get_stats    (Connection      *connection,
+                                          connection_stats_t *stats);
 #endif /* CONNECTION_H */
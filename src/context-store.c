@@ -0,0 +1,574 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "context-store.h"
+#include "util.h"
+
+G_DEFINE_TYPE (ContextStore, context_store, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_PATH,
+    PROP_BUDGET,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * A segment is a fixed size file that we mmap and then unlink immediately
+ * so that nothing is left behind in the file system if the daemon dies.
+ * Records are only ever appended at 'tail'. The 'live' member counts the
+ * bytes still referenced by records. Once a segment that isn't being
+ * appended to holds mostly dead records it's compacted: the live records
+ * are copied to the active segment and the segment is released.
+ */
+typedef struct {
+    guint     index;
+    int       fd;
+    uint8_t  *map;
+    size_t    tail;
+    size_t    live;
+} context_segment_t;
+/*
+ * A record is a single context blob. When 'buf' is non-NULL the blob is
+ * resident in memory and 'lru_link' is its position in the LRU queue. When
+ * 'buf' is NULL the blob has been spilled to the segment at index 'segment'
+ * and 'offset'.
+ */
+typedef struct {
+    guint64   id;
+    size_t    size;
+    uint8_t  *buf;
+    GList    *lru_link;
+    guint     segment;
+    size_t    offset;
+} context_record_t;
+
+static void
+context_store_get_property (GObject     *object,
+                            guint        property_id,
+                            GValue      *value,
+                            GParamSpec  *pspec)
+{
+    ContextStore *self = CONTEXT_STORE (object);
+
+    switch (property_id) {
+    case PROP_PATH:
+        g_value_set_string (value, self->path);
+        break;
+    case PROP_BUDGET:
+        g_value_set_uint64 (value, self->budget);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+context_store_set_property (GObject        *object,
+                            guint           property_id,
+                            GValue const   *value,
+                            GParamSpec     *pspec)
+{
+    ContextStore *self = CONTEXT_STORE (object);
+
+    switch (property_id) {
+    case PROP_PATH:
+        g_free (self->path);
+        self->path = g_value_dup_string (value);
+        g_debug ("%s: path: %s", __func__, self->path);
+        break;
+    case PROP_BUDGET:
+        self->budget = g_value_get_uint64 (value);
+        g_debug ("%s: budget: %" PRIu64, __func__, self->budget);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+context_record_free (gpointer data)
+{
+    context_record_t *record = (context_record_t*)data;
+
+    g_free (record->buf);
+    g_free (record);
+}
+static void
+context_segment_free (gpointer data)
+{
+    context_segment_t *segment = (context_segment_t*)data;
+
+    if (segment == NULL) {
+        return;
+    }
+    if (segment->map != NULL && segment->map != MAP_FAILED) {
+        munmap (segment->map, CONTEXT_STORE_SEGMENT_SIZE);
+    }
+    if (segment->fd >= 0) {
+        close (segment->fd);
+    }
+    g_free (segment);
+}
+static void
+context_store_init (ContextStore *store)
+{
+    pthread_mutex_init (&store->mutex, NULL);
+    store->records = g_hash_table_new_full (g_int64_hash,
+                                            g_int64_equal,
+                                            NULL,
+                                            context_record_free);
+    g_queue_init (&store->lru);
+    store->segments = g_ptr_array_new_with_free_func (context_segment_free);
+    store->next_id = 1;
+}
+static void
+context_store_finalize (GObject *object)
+{
+    ContextStore *store = CONTEXT_STORE (object);
+
+    g_debug ("%s: spilled %" PRIu64 ", faulted %" PRIu64 ", compacted %"
+             PRIu64, __func__, store->spill_count, store->fault_count,
+             store->compact_count);
+    g_queue_clear (&store->lru);
+    g_clear_pointer (&store->records, g_hash_table_unref);
+    g_clear_pointer (&store->segments, g_ptr_array_unref);
+    g_clear_pointer (&store->path, g_free);
+    pthread_mutex_destroy (&store->mutex);
+    G_OBJECT_CLASS (context_store_parent_class)->finalize (object);
+}
+static void
+context_store_class_init (ContextStoreClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (context_store_parent_class == NULL)
+        context_store_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = context_store_finalize;
+    object_class->get_property = context_store_get_property;
+    object_class->set_property = context_store_set_property;
+
+    obj_properties [PROP_PATH] =
+        g_param_spec_string ("path",
+                             "Backing store directory",
+                             "Directory where segment files are created.",
+                             NULL,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_BUDGET] =
+        g_param_spec_uint64 ("budget",
+                             "Memory budget",
+                             "Bytes of context data kept in memory, 0 for unlimited.",
+                             0,
+                             G_MAXUINT64,
+                             0,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+ContextStore*
+context_store_new (const gchar *path,
+                   guint64      budget)
+{
+    return CONTEXT_STORE (g_object_new (TYPE_CONTEXT_STORE,
+                                        "path", path,
+                                        "budget", budget,
+                                        NULL));
+}
+/*
+ * Create a new segment file, map it and unlink it. The new segment becomes
+ * the active segment. Returns NULL on failure, in which case the caller must
+ * keep the blob it was trying to spill in memory.
+ */
+static context_segment_t*
+context_segment_new (ContextStore *store)
+{
+    context_segment_t *segment;
+    gchar *file_name;
+    guint i;
+
+    if (store->path == NULL) {
+        return NULL;
+    }
+    segment = g_new0 (context_segment_t, 1);
+    segment->fd = -1;
+    file_name = g_build_filename (store->path, "contexts-XXXXXX", NULL);
+    segment->fd = mkstemp (file_name);
+    if (segment->fd < 0) {
+        g_warning ("%s: failed to create segment in %s: %s",
+                   __func__, store->path, strerror (errno));
+        goto err_out;
+    }
+    unlink (file_name);
+    if (ftruncate (segment->fd, CONTEXT_STORE_SEGMENT_SIZE) != 0) {
+        g_warning ("%s: failed to size segment: %s",
+                   __func__, strerror (errno));
+        goto err_out;
+    }
+    segment->map = mmap (NULL,
+                         CONTEXT_STORE_SEGMENT_SIZE,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED,
+                         segment->fd,
+                         0);
+    if (segment->map == MAP_FAILED) {
+        g_warning ("%s: failed to map segment: %s",
+                   __func__, strerror (errno));
+        goto err_out;
+    }
+    /* reuse slots released by compaction so indexes stay small */
+    for (i = 0; i < store->segments->len; ++i) {
+        if (g_ptr_array_index (store->segments, i) == NULL) {
+            break;
+        }
+    }
+    if (i == store->segments->len) {
+        g_ptr_array_add (store->segments, NULL);
+    }
+    segment->index = i;
+    g_ptr_array_index (store->segments, i) = segment;
+    store->active = segment;
+    g_debug ("%s: created segment %u", __func__, i);
+    g_free (file_name);
+    return segment;
+err_out:
+    g_free (file_name);
+    context_segment_free (segment);
+    return NULL;
+}
+static void
+context_segment_release (ContextStore      *store,
+                         context_segment_t *segment)
+{
+    g_debug ("%s: releasing segment %u", __func__, segment->index);
+    if (store->active == segment) {
+        store->active = NULL;
+    }
+    /* clear the slot first so the array free func doesn't see it */
+    g_ptr_array_index (store->segments, segment->index) = NULL;
+    context_segment_free (segment);
+}
+/*
+ * Append the blob to the active segment, allocating a new active segment
+ * if the current one is full.
+ */
+static gboolean
+context_store_append (ContextStore   *store,
+                      const uint8_t  *buf,
+                      size_t          size,
+                      guint          *index,
+                      size_t         *offset)
+{
+    context_segment_t *segment = store->active;
+
+    if (size > CONTEXT_STORE_SEGMENT_SIZE) {
+        g_warning ("%s: blob of size %zu will never fit in a segment",
+                   __func__, size);
+        return FALSE;
+    }
+    if (segment == NULL || CONTEXT_STORE_SEGMENT_SIZE - segment->tail < size) {
+        segment = context_segment_new (store);
+        if (segment == NULL) {
+            return FALSE;
+        }
+    }
+    memcpy (&segment->map [segment->tail], buf, size);
+    *index = segment->index;
+    *offset = segment->tail;
+    segment->tail += size;
+    segment->live += size;
+    return TRUE;
+}
+/*
+ * Move a resident record to the active segment and free its memory.
+ */
+static gboolean
+context_store_spill_record (ContextStore     *store,
+                            context_record_t *record)
+{
+    if (!context_store_append (store,
+                               record->buf,
+                               record->size,
+                               &record->segment,
+                               &record->offset))
+    {
+        return FALSE;
+    }
+    g_queue_delete_link (&store->lru, record->lru_link);
+    record->lru_link = NULL;
+    g_clear_pointer (&record->buf, g_free);
+    store->resident_bytes -= record->size;
+    ++store->spill_count;
+    g_debug ("%s: spilled record %" PRIu64 " to segment %u offset %zu",
+             __func__, record->id, record->segment, record->offset);
+    return TRUE;
+}
+typedef struct {
+    ContextStore      *store;
+    context_segment_t *segment;
+} compact_data_t;
+static void
+context_store_compact_callback (gpointer key,
+                                gpointer value,
+                                gpointer user_data)
+{
+    context_record_t *record = (context_record_t*)value;
+    compact_data_t *data = (compact_data_t*)user_data;
+    guint index;
+    size_t offset;
+    UNUSED_PARAM (key);
+
+    if (record->buf != NULL ||
+        record->size == 0 ||
+        record->segment != data->segment->index)
+    {
+        return;
+    }
+    if (!context_store_append (data->store,
+                               &data->segment->map [record->offset],
+                               record->size,
+                               &index,
+                               &offset))
+    {
+        /* keep the record alive in memory rather than lose it */
+        record->buf = g_malloc (record->size);
+        memcpy (record->buf,
+                &data->segment->map [record->offset],
+                record->size);
+        g_queue_push_tail (&data->store->lru, record);
+        record->lru_link = data->store->lru.tail;
+        data->store->resident_bytes += record->size;
+        return;
+    }
+    record->segment = index;
+    record->offset = offset;
+}
+/*
+ * Once more than half of a full segment is dead we copy out the live
+ * records and drop it. The active segment is never compacted since it's
+ * still being appended to.
+ */
+static void
+context_store_maybe_compact (ContextStore      *store,
+                             context_segment_t *segment)
+{
+    compact_data_t data = {
+        .store = store,
+        .segment = segment,
+    };
+
+    if (segment == store->active) {
+        return;
+    }
+    if (segment->live > 0 && segment->live * 2 > segment->tail) {
+        return;
+    }
+    if (segment->live > 0) {
+        g_debug ("%s: compacting segment %u with %zu of %zu bytes live",
+                 __func__, segment->index, segment->live, segment->tail);
+        g_hash_table_foreach (store->records,
+                              context_store_compact_callback,
+                              &data);
+        ++store->compact_count;
+    }
+    context_segment_release (store, segment);
+}
+/*
+ * Drop whatever storage currently holds the record's blob.
+ */
+static void
+context_store_release_record (ContextStore     *store,
+                              context_record_t *record)
+{
+    context_segment_t *segment;
+
+    if (record->buf != NULL) {
+        g_queue_delete_link (&store->lru, record->lru_link);
+        record->lru_link = NULL;
+        g_clear_pointer (&record->buf, g_free);
+        store->resident_bytes -= record->size;
+    } else if (record->size > 0) {
+        segment = g_ptr_array_index (store->segments, record->segment);
+        segment->live -= record->size;
+        record->size = 0;
+        context_store_maybe_compact (store, segment);
+    }
+    record->size = 0;
+}
+/*
+ * Evict least recently used records until we're back within budget.
+ */
+static void
+context_store_enforce_budget (ContextStore *store)
+{
+    context_record_t *record;
+
+    if (store->budget == 0) {
+        return;
+    }
+    while (store->resident_bytes > store->budget) {
+        record = g_queue_peek_tail (&store->lru);
+        if (record == NULL || !context_store_spill_record (store, record)) {
+            break;
+        }
+    }
+}
+static void
+context_store_set_resident (ContextStore     *store,
+                            context_record_t *record,
+                            const uint8_t    *buf,
+                            size_t            size)
+{
+    record->buf = g_malloc (size);
+    memcpy (record->buf, buf, size);
+    record->size = size;
+    g_queue_push_head (&store->lru, record);
+    record->lru_link = store->lru.head;
+    store->resident_bytes += size;
+}
+/*
+ * Add a new blob to the store. The returned id is never 0 so callers may
+ * use 0 to mean 'not in the store'.
+ */
+guint64
+context_store_insert (ContextStore  *store,
+                      const uint8_t *buf,
+                      size_t         size)
+{
+    context_record_t *record;
+    guint64 id;
+
+    g_assert_nonnull (store);
+    g_assert_nonnull (buf);
+    record = g_new0 (context_record_t, 1);
+    pthread_mutex_lock (&store->mutex);
+    id = record->id = store->next_id++;
+    context_store_set_resident (store, record, buf, size);
+    g_hash_table_insert (store->records, &record->id, record);
+    context_store_enforce_budget (store);
+    pthread_mutex_unlock (&store->mutex);
+    g_debug ("%s: record %" PRIu64 " with size %zu", __func__, id, size);
+    return id;
+}
+/*
+ * Replace the blob associated with 'id'. The new blob is the most recently
+ * used.
+ */
+gboolean
+context_store_update (ContextStore  *store,
+                      guint64        id,
+                      const uint8_t *buf,
+                      size_t         size)
+{
+    context_record_t *record;
+    gboolean ret = FALSE;
+
+    g_assert_nonnull (store);
+    g_assert_nonnull (buf);
+    pthread_mutex_lock (&store->mutex);
+    record = g_hash_table_lookup (store->records, &id);
+    if (record == NULL) {
+        g_warning ("%s: no record with id %" PRIu64, __func__, id);
+        goto out;
+    }
+    context_store_release_record (store, record);
+    context_store_set_resident (store, record, buf, size);
+    context_store_enforce_budget (store);
+    ret = TRUE;
+out:
+    pthread_mutex_unlock (&store->mutex);
+    return ret;
+}
+/*
+ * Copy the blob associated with 'id' into the caller supplied buffer. The
+ * 'size' parameter is the size of 'buf' on input and the size of the blob
+ * on output. A resident blob becomes the most recently used. A spilled
+ * blob is read from its segment and stays there: the caller has its own
+ * copy now, keeping a second one in memory would only push other blobs
+ * out.
+ */
+gboolean
+context_store_lookup (ContextStore *store,
+                      guint64       id,
+                      uint8_t      *buf,
+                      size_t       *size)
+{
+    context_record_t *record;
+    context_segment_t *segment;
+    gboolean ret = FALSE;
+
+    g_assert_nonnull (store);
+    g_assert_nonnull (buf);
+    g_assert_nonnull (size);
+    pthread_mutex_lock (&store->mutex);
+    record = g_hash_table_lookup (store->records, &id);
+    if (record == NULL) {
+        g_warning ("%s: no record with id %" PRIu64, __func__, id);
+        goto out;
+    }
+    if (record->size > *size) {
+        g_warning ("%s: buffer of size %zu too small for record of size %zu",
+                   __func__, *size, record->size);
+        goto out;
+    }
+    *size = record->size;
+    if (record->buf != NULL) {
+        memcpy (buf, record->buf, record->size);
+        g_queue_unlink (&store->lru, record->lru_link);
+        g_queue_push_head_link (&store->lru, record->lru_link);
+    } else {
+        segment = g_ptr_array_index (store->segments, record->segment);
+        memcpy (buf, &segment->map [record->offset], record->size);
+        g_debug ("%s: read record %" PRIu64 " from segment %u",
+                 __func__, id, record->segment);
+        ++store->fault_count;
+    }
+    ret = TRUE;
+out:
+    pthread_mutex_unlock (&store->mutex);
+    return ret;
+}
+void
+context_store_remove (ContextStore *store,
+                      guint64       id)
+{
+    context_record_t *record;
+
+    g_assert_nonnull (store);
+    pthread_mutex_lock (&store->mutex);
+    record = g_hash_table_lookup (store->records, &id);
+    if (record != NULL) {
+        context_store_release_record (store, record);
+        g_hash_table_remove (store->records, &id);
+    }
+    pthread_mutex_unlock (&store->mutex);
+}
+guint64
+context_store_resident_bytes (ContextStore *store)
+{
+    guint64 bytes;
+
+    pthread_mutex_lock (&store->mutex);
+    bytes = store->resident_bytes;
+    pthread_mutex_unlock (&store->mutex);
+    return bytes;
+}
+guint
+context_store_segment_count (ContextStore *store)
+{
+    guint i, count = 0;
+
+    pthread_mutex_lock (&store->mutex);
+    for (i = 0; i < store->segments->len; ++i) {
+        if (g_ptr_array_index (store->segments, i) != NULL) {
+            ++count;
+        }
+    }
+    pthread_mutex_unlock (&store->mutex);
+    return count;
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef CONTEXT_STORE_H
+#define CONTEXT_STORE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Size of each memory mapped segment. A saved context is never split across
+ * segments so this must be larger than the largest marshalled TPMS_CONTEXT.
+ */
+#define CONTEXT_STORE_SEGMENT_SIZE (256 * 1024)
+
+typedef struct _ContextStoreClass {
+    GObjectClass      parent;
+} ContextStoreClass;
+
+typedef struct _ContextStore {
+    GObject           parent_instance;
+    pthread_mutex_t   mutex;
+    gchar            *path;
+    guint64           budget;
+    guint64           resident_bytes;
+    guint64           next_id;
+    GHashTable       *records;
+    GQueue            lru;
+    GPtrArray        *segments;
+    gpointer          active;
+    guint64           spill_count;
+    guint64           fault_count;
+    guint64           compact_count;
+} ContextStore;
+
+#define TYPE_CONTEXT_STORE              (context_store_get_type   ())
+#define CONTEXT_STORE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_CONTEXT_STORE, ContextStore))
+#define CONTEXT_STORE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_CONTEXT_STORE, ContextStoreClass))
+#define IS_CONTEXT_STORE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_CONTEXT_STORE))
+#define IS_CONTEXT_STORE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_CONTEXT_STORE))
+#define CONTEXT_STORE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_CONTEXT_STORE, ContextStoreClass))
+
+GType          context_store_get_type        (void);
+ContextStore*  context_store_new             (const gchar    *path,
+                                              guint64         budget);
+guint64        context_store_insert          (ContextStore   *store,
+                                              const uint8_t  *buf,
+                                              size_t          size);
+gboolean       context_store_update          (ContextStore   *store,
+                                              guint64         id,
+                                              const uint8_t  *buf,
+                                              size_t          size);
+gboolean       context_store_lookup          (ContextStore   *store,
+                                              guint64         id,
+                                              uint8_t        *buf,
+                                              size_t         *size);
+void           context_store_remove          (ContextStore   *store,
+                                              guint64         id);
+guint64        context_store_resident_bytes  (ContextStore   *store);
+guint          context_store_segment_count   (ContextStore   *store);
+
+G_END_DECLS
+#endif /* CONTEXT_STORE_H */
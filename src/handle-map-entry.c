@@ -5,6 +5,8 @@
  */
 #include <inttypes.h>
 
+#include <tss2/tss2_mu.h>
+
 #include "util.h"
 #include "handle-map-entry.h"
 
@@ -37,7 +39,7 @@ handle_map_entry_get_property (GObject        *object,
         g_value_set_uint (value, (guint)self->vhandle);
         break;
     case PROP_CONTEXT:
-        g_value_set_pointer (value, &self->context);
+        g_value_set_pointer (value, handle_map_entry_get_context (self));
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -78,13 +80,32 @@ handle_map_entry_init (HandleMapEntry *entry)
     /* noop */
 }
 /*
- * Deallocate all associated resources. All are static so we just chain
- * up to the parent like a good GObject.
+ * Drop the saved context from the ContextStore (if any) along with our
+ * reference to the store.
+ */
+static void
+handle_map_entry_dispose (GObject *object)
+{
+    HandleMapEntry *entry = HANDLE_MAP_ENTRY (object);
+
+    if (entry->context_store != NULL && entry->context_id != 0) {
+        context_store_remove (entry->context_store, entry->context_id);
+        entry->context_id = 0;
+    }
+    g_clear_object (&entry->context_store);
+    G_OBJECT_CLASS (handle_map_entry_parent_class)->dispose (object);
+}
+/*
+ * Deallocate all associated resources.
  */
 static void
 handle_map_entry_finalize (GObject *object)
 {
+    HandleMapEntry *entry = HANDLE_MAP_ENTRY (object);
+
     g_debug ("%s", __func__);
+    g_clear_pointer (&entry->context, g_free);
+    g_clear_pointer (&entry->public_response, g_bytes_unref);
     G_OBJECT_CLASS (handle_map_entry_parent_class)->finalize (object);
 }
 /*
@@ -97,6 +118,7 @@ handle_map_entry_class_init (HandleMapEntryClass *klass)
 
     if (handle_map_entry_parent_class == NULL)
         handle_map_entry_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose      = handle_map_entry_dispose;
     object_class->finalize     = handle_map_entry_finalize;
     object_class->get_property = handle_map_entry_get_property;
     object_class->set_property = handle_map_entry_set_property;
@@ -145,6 +167,11 @@ handle_map_entry_new (TPM2_HANDLE phandle,
 }
 /*
  * Access the TPMS_CONTEXT member.
+ * If the context was previously stashed in the ContextStore it's read back
+ * (possibly from the backing file) and unmarshalled before it's returned.
+ * The entry owns the context from then on and the record is dropped from
+ * the store, the next stash adds it again. Returns NULL if the stashed
+ * context can't be read back.
  * NOTE: This directly exposes memory from an object instance. The caller
  * must be sure to hold a reference to this object to keep it from being
  * garbage collected while the caller is accessing the context structure.
@@ -153,7 +180,51 @@ handle_map_entry_new (TPM2_HANDLE phandle,
 TPMS_CONTEXT*
 handle_map_entry_get_context (HandleMapEntry *entry)
 {
-    return &entry->context;
+    uint8_t buf [sizeof (TPMS_CONTEXT)];
+    size_t size = sizeof (buf), offset = 0;
+    TSS2_RC rc;
+
+    if (entry->context != NULL) {
+        return entry->context;
+    }
+    entry->context = g_new0 (TPMS_CONTEXT, 1);
+    if (entry->context_store == NULL || entry->context_id == 0) {
+        return entry->context;
+    }
+    if (!context_store_lookup (entry->context_store,
+                               entry->context_id,
+                               buf,
+                               &size))
+    {
+        g_warning ("%s: failed to read context for vhandle 0x%" PRIx32
+                   " from ContextStore", __func__, entry->vhandle);
+        g_clear_pointer (&entry->context, g_free);
+        return NULL;
+    }
+    rc = Tss2_MU_TPMS_CONTEXT_Unmarshal (buf, size, &offset, entry->context);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to unmarshal TPMS_CONTEXT, RC: 0x%" PRIx32,
+                   __func__, rc);
+        g_clear_pointer (&entry->context, g_free);
+        return NULL;
+    }
+    context_store_remove (entry->context_store, entry->context_id);
+    entry->context_id = 0;
+    return entry->context;
+}
+/*
+ * Replace the TPMS_CONTEXT member, e.g. with the context from a
+ * ContextSave. A context stashed in the ContextStore isn't read back since
+ * it's being replaced, the next stash overwrites the record.
+ */
+void
+handle_map_entry_set_context (HandleMapEntry *entry,
+                              TPMS_CONTEXT   *context)
+{
+    if (entry->context == NULL) {
+        entry->context = g_new (TPMS_CONTEXT, 1);
+    }
+    *entry->context = *context;
 }
 /*
  * Accessor for the physical handle member.
@@ -177,3 +248,74 @@ handle_map_entry_set_phandle (HandleMapEntry *entry,
 {
     entry->phandle = phandle;
 }
+/*
+ * Associate the entry with a ContextStore. Once set, saved contexts are
+ * handed off to the store by 'handle_map_entry_stash_context'.
+ */
+void
+handle_map_entry_set_context_store (HandleMapEntry *entry,
+                                    ContextStore   *store)
+{
+    g_object_ref (store);
+    g_clear_object (&entry->context_store);
+    entry->context_store = store;
+}
+/*
+ * Move the saved context out of the entry and in to the ContextStore. This
+ * is a no-op for entries without a ContextStore: the context stays where it
+ * is. The next call to 'handle_map_entry_get_context' brings it back.
+ */
+void
+handle_map_entry_stash_context (HandleMapEntry *entry)
+{
+    uint8_t buf [sizeof (TPMS_CONTEXT)];
+    size_t offset = 0;
+    TSS2_RC rc;
+
+    if (entry->context_store == NULL || entry->context == NULL) {
+        return;
+    }
+    rc = Tss2_MU_TPMS_CONTEXT_Marshal (entry->context,
+                                       buf,
+                                       sizeof (buf),
+                                       &offset);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to marshal TPMS_CONTEXT, RC: 0x%" PRIx32,
+                   __func__, rc);
+        return;
+    }
+    if (entry->context_id == 0) {
+        entry->context_id = context_store_insert (entry->context_store,
+                                                  buf,
+                                                  offset);
+    } else if (!context_store_update (entry->context_store,
+                                      entry->context_id,
+                                      buf,
+                                      offset))
+    {
+        return;
+    }
+    g_clear_pointer (&entry->context, g_free);
+}
+/*
+ * Access the cached response to a TPM2_ReadPublic command for this object.
+ * The public area and names of a transient object never change so once
+ * cached the response is good for the lifetime of the entry. Returns a new
+ * reference or NULL if nothing has been cached.
+ */
+GBytes*
+handle_map_entry_get_public (HandleMapEntry *entry)
+{
+    if (entry->public_response == NULL) {
+        return NULL;
+    }
+    return g_bytes_ref (entry->public_response);
+}
+void
+handle_map_entry_set_public (HandleMapEntry *entry,
+                             const uint8_t  *buf,
+                             size_t          size)
+{
+    g_clear_pointer (&entry->public_response, g_bytes_unref);
+    entry->public_response = g_bytes_new (buf, size);
+}
@@ -10,6 +10,8 @@
 #include <glib-object.h>
 #include <tss2/tss2_tpm2_types.h>
 
+#include "context-store.h"
+
 G_BEGIN_DECLS
 
 typedef struct _HandleMapEntryClass {
@@ -20,7 +22,10 @@ typedef struct _HandleMapEntry {
     GObject           parent_instance;
     TPM2_HANDLE        phandle;
     TPM2_HANDLE        vhandle;
-    TPMS_CONTEXT      context;
+    TPMS_CONTEXT     *context;
+    ContextStore     *context_store;
+    guint64           context_id;
+    GBytes           *public_response;
 } HandleMapEntry;
 
 #define TYPE_HANDLE_MAP_ENTRY              (handle_map_entry_get_type   ())
@@ -36,8 +41,17 @@ HandleMapEntry*  handle_map_entry_new           (TPM2_HANDLE         phandle,
 TPM2_HANDLE       handle_map_entry_get_phandle   (HandleMapEntry    *entry);
 TPM2_HANDLE       handle_map_entry_get_vhandle   (HandleMapEntry    *entry);
 TPMS_CONTEXT*    handle_map_entry_get_context   (HandleMapEntry    *entry);
+void             handle_map_entry_set_context   (HandleMapEntry    *entry,
+                                                 TPMS_CONTEXT      *context);
 void             handle_map_entry_set_phandle   (HandleMapEntry    *entry,
                                                  TPM2_HANDLE         phandle);
+void             handle_map_entry_set_context_store (HandleMapEntry *entry,
+                                                     ContextStore   *store);
+void             handle_map_entry_stash_context (HandleMapEntry    *entry);
+GBytes*          handle_map_entry_get_public    (HandleMapEntry    *entry);
+void             handle_map_entry_set_public    (HandleMapEntry    *entry,
+                                                 const uint8_t     *buf,
+                                                 size_t             size);
 
 G_END_DECLS
 #endif /* HANDLE_MAP_ENTRY_H */
@@ -12,6 +12,8 @@
 
 G_DEFINE_TYPE (HandleMap, handle_map, G_TYPE_OBJECT);
 
+static lock_stats_t handle_map_lock_stats = LOCK_STATS_INIT ("HandleMap");
+
 enum {
     PROP_0,
     PROP_HANDLE_TYPE,
@@ -74,17 +76,16 @@ handle_map_set_property (GObject        *object,
  * The handle_count is currently initialized to start allocating handles
  * @ 0xff. This is an arbitrary way we differentiate them from the handles
  * allocated by the TPM.
+ * The GHashTable is created on the first insert: most connections never
+ * load a transient object, and with thousands of them connected the empty
+ * tables add up.
  */
 static void
 handle_map_init (HandleMap     *map)
 {
     g_debug ("handle_map_init");
-    pthread_mutex_init (&map->mutex, NULL);
-    map->vhandle_to_entry_table =
-        g_hash_table_new_full (g_direct_hash,
-                               g_direct_equal,
-                               NULL,
-                               (GDestroyNotify)g_object_unref);
+    stat_mutex_init (&map->mutex, &handle_map_lock_stats);
+    map->vhandle_to_entry_table = NULL;
     map->handle_count = 0xff;
 }
 /*
@@ -109,7 +110,7 @@ handle_map_finalize (GObject *object)
     HandleMap *self = HANDLE_MAP (object);
 
     g_debug ("handle_map_finalize");
-    pthread_mutex_destroy (&self->mutex);
+    stat_mutex_destroy (&self->mutex);
     G_OBJECT_CLASS (handle_map_parent_class)->finalize (object);
 }
 /*
@@ -169,7 +170,7 @@ handle_map_new (TPM2_HT handle_type,
 static inline void
 handle_map_lock (HandleMap *map)
 {
-    if (pthread_mutex_lock (&map->mutex) != 0)
+    if (stat_mutex_lock (&map->mutex) != 0)
         g_error ("Error locking HandleMap: %s", strerror (errno));
 }
 /*
@@ -178,7 +179,7 @@ handle_map_lock (HandleMap *map)
 static inline void
 handle_map_unlock (HandleMap *map)
 {
-    if (pthread_mutex_unlock (&map->mutex) != 0)
+    if (stat_mutex_unlock (&map->mutex) != 0)
         g_error ("Error unlocking HandleMap: %s", strerror (errno));
 }
 /*
@@ -188,9 +189,11 @@ handle_map_unlock (HandleMap *map)
 gboolean
 handle_map_is_full (HandleMap *map)
 {
-    guint table_size;
+    guint table_size = 0;
 
-    table_size = g_hash_table_size (map->vhandle_to_entry_table);
+    if (map->vhandle_to_entry_table != NULL) {
+        table_size = g_hash_table_size (map->vhandle_to_entry_table);
+    }
     if (table_size < map->max_entries + 1) {
         return FALSE;
     } else {
@@ -217,6 +220,13 @@ handle_map_insert (HandleMap      *map,
         return FALSE;
     }
     if (entry && vhandle != 0) {
+        if (map->vhandle_to_entry_table == NULL) {
+            map->vhandle_to_entry_table =
+                g_hash_table_new_full (g_direct_hash,
+                                       g_direct_equal,
+                                       NULL,
+                                       (GDestroyNotify)g_object_unref);
+        }
         g_object_ref (entry);
         g_hash_table_insert (map->vhandle_to_entry_table,
                              GINT_TO_POINTER (vhandle),
@@ -233,28 +243,33 @@ gboolean
 handle_map_remove (HandleMap *map,
                    TPM2_HANDLE vhandle)
 {
-    gboolean ret;
+    gboolean ret = FALSE;
 
     handle_map_lock (map);
-    ret = g_hash_table_remove (map->vhandle_to_entry_table,
-                               GINT_TO_POINTER (vhandle));
+    if (map->vhandle_to_entry_table != NULL) {
+        ret = g_hash_table_remove (map->vhandle_to_entry_table,
+                                   GINT_TO_POINTER (vhandle));
+    }
     handle_map_unlock (map);
 
     return ret;
 }
 /*
- * Generic lookup function to find an entry in a GHashTable for the given
- * handle.
+ * Lookup function to find an entry in the vhandle table for the given
+ * handle. The table is created by the first insert so the pointer is
+ * only read with the lock held.
  */
 static HandleMapEntry*
 handle_map_lookup (HandleMap     *map,
-                   TPM2_HANDLE     handle,
-                   GHashTable    *table)
+                   TPM2_HANDLE     handle)
 {
-    HandleMapEntry *entry;
+    HandleMapEntry *entry = NULL;
 
     handle_map_lock (map);
-    entry = g_hash_table_lookup (table, GINT_TO_POINTER (handle));
+    if (map->vhandle_to_entry_table != NULL) {
+        entry = g_hash_table_lookup (map->vhandle_to_entry_table,
+                                     GINT_TO_POINTER (handle));
+    }
     if (entry)
         g_object_ref (entry);
     handle_map_unlock (map);
@@ -272,7 +287,7 @@ HandleMapEntry*
 handle_map_vlookup (HandleMap    *map,
                     TPM2_HANDLE    vhandle)
 {
-    return handle_map_lookup (map, vhandle, map->vhandle_to_entry_table);
+    return handle_map_lookup (map, vhandle);
 }
 /*
  * Simple wrapper around the function that reports the number of entries in
@@ -281,10 +296,12 @@ handle_map_vlookup (HandleMap    *map,
 guint
 handle_map_size (HandleMap *map)
 {
-    guint ret;
+    guint ret = 0;
 
     handle_map_lock (map);
-    ret = g_hash_table_size (map->vhandle_to_entry_table);
+    if (map->vhandle_to_entry_table != NULL) {
+        ret = g_hash_table_size (map->vhandle_to_entry_table);
+    }
     handle_map_unlock (map);
 
     return ret;
@@ -314,6 +331,9 @@ handle_map_foreach (HandleMap *map,
                     GHFunc     callback,
                     gpointer   user_data)
 {
+    if (map->vhandle_to_entry_table == NULL) {
+        return;
+    }
     g_hash_table_foreach (map->vhandle_to_entry_table,
                           callback,
                           user_data);
@@ -325,5 +345,8 @@ handle_map_foreach (HandleMap *map,
 GList*
 handle_map_get_keys (HandleMap *map)
 {
+    if (map->vhandle_to_entry_table == NULL) {
+        return NULL;
+    }
     return g_hash_table_get_keys (map->vhandle_to_entry_table);
 }
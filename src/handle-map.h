@@ -12,11 +12,12 @@
 #include <tss2/tss2_tpm2_types.h>
 
 #include "handle-map-entry.h"
+#include "lock-stats.h"
 
 G_BEGIN_DECLS
 
 #define MAX_ENTRIES_DEFAULT 27
-#define MAX_ENTRIES_MAX     100
+#define MAX_ENTRIES_MAX     1024
 
 typedef struct _HandleMapClass {
     GObjectClass      parent;
@@ -24,7 +25,7 @@ typedef struct _HandleMapClass {
 
 typedef struct _HandleMap {
     GObject             parent_instance;
-    pthread_mutex_t     mutex;
+    stat_mutex_t        mutex;
     TPM2_HT              handle_type;
     TPM2_HANDLE          handle_count;
     GHashTable         *vhandle_to_entry_table;
@@ -8,6 +8,7 @@
 #include <inttypes.h>
 
 #include "ipc-frontend-dbus.h"
+#include "lock-stats.h"
 #include "tabrmd-defaults.h"
 #include "tabrmd.h"
 #include "util.h"
@@ -29,6 +30,7 @@ enum {
     PROP_CONNECTION_MANAGER,
     PROP_MAX_TRANS,
     PROP_RANDOM,
+    PROP_RESOURCE_MANAGER,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties[N_PROPERTIES] = { NULL };
@@ -60,6 +62,10 @@ ipc_frontend_dbus_set_property (GObject      *object,
         self->random = g_value_get_object (value);
         g_object_ref (self->random);
         break;
+    case PROP_RESOURCE_MANAGER:
+        g_clear_object (&self->resource_manager);
+        self->resource_manager = g_value_dup_object (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -89,6 +95,9 @@ ipc_frontend_dbus_get_property (GObject    *object,
     case PROP_RANDOM:
         g_value_set_object (value, self->random);
         break;
+    case PROP_RESOURCE_MANAGER:
+        g_value_set_object (value, self->resource_manager);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -109,7 +118,9 @@ ipc_frontend_dbus_dispose (GObject *obj)
 
     g_clear_object (&self->connection_manager);
     g_clear_object (&self->random);
+    g_clear_object (&self->resource_manager);
     g_clear_object (&self->skeleton);
+    g_clear_object (&self->stats_skeleton);
     G_OBJECT_CLASS (ipc_frontend_dbus_parent_class)->dispose (obj);
 }
 /*
@@ -174,6 +185,12 @@ ipc_frontend_dbus_class_init (IpcFrontendDbusClass *klass)
                              "Source of random numbers.",
                              TYPE_RANDOM,
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_RESOURCE_MANAGER] =
+        g_param_spec_object ("resource-manager",
+                             "ResourceManager object",
+                             "ResourceManager that Cancel requests go to.",
+                             TYPE_RESOURCE_MANAGER,
+                             G_PARAM_READWRITE);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -255,11 +272,47 @@ get_pid_from_dbus_invocation (GDBusProxy            *proxy,
         return TRUE;
     }
 }
+/*
+ * Get the UID of the process associated with a method invocation, like
+ * get_pid_from_dbus_invocation. If an error occurs this function returns
+ * false.
+ */
+static gboolean
+get_uid_from_dbus_invocation (GDBusProxy            *proxy,
+                              GDBusMethodInvocation *invocation,
+                              guint32               *uid)
+{
+    const gchar *name   = NULL;
+    GError      *error  = NULL;
+    GVariant    *result = NULL;
+
+    if (proxy == NULL || invocation == NULL || uid == NULL)
+        return FALSE;
+
+    name = g_dbus_method_invocation_get_sender (invocation);
+    result = g_dbus_proxy_call_sync (G_DBUS_PROXY (proxy),
+                                     "GetConnectionUnixUser",
+                                     g_variant_new("(s)", name),
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     -1,
+                                     NULL,
+                                     &error);
+    if (error) {
+        g_warning ("Unable to get UID for %s: %s", name, error->message);
+        g_error_free (error);
+        return FALSE;
+    } else {
+        g_variant_get (result, "(u)", uid);
+        g_variant_unref (result);
+        return TRUE;
+    }
+}
 /*
  * Generate a random uint64 returned in the id out parameter.
  * Mix this random ID with the PID from the caller. This is obtained
  * through the invocation parameter. Mix the two together using xor and
- * return the result through the id_pid_mix out parameter.
+ * return the result through the id_pid_mix out parameter. The PID is
+ * returned through the pid out parameter.
  * NOTE: if an error occurs then a response is sent through the invocation
  * to the client and FALSE is returned to the caller.
  *
@@ -269,17 +322,17 @@ static gboolean
 generate_id_pid_mix_from_invocation (IpcFrontendDbus        *self,
                                      GDBusMethodInvocation  *invocation,
                                      guint64                *id,
-                                     guint64                *id_pid_mix)
+                                     guint64                *id_pid_mix,
+                                     guint32                *pid)
 {
     gboolean pid_ret = FALSE;
-    guint32  pid = 0;
 
     pid_ret = get_pid_from_dbus_invocation (self->dbus_daemon_proxy,
                                             invocation,
-                                            &pid);
+                                            pid);
     if (pid_ret == TRUE) {
         *id = random_get_uint64 (self->random);
-        *id_pid_mix = *id ^ pid;
+        *id_pid_mix = *id ^ *pid;
     } else {
         g_dbus_method_invocation_return_error (invocation,
                                                TABRMD_ERROR,
@@ -348,6 +401,7 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
     GVariant *response_variants[2], *response_tuple;
     GUnixFDList *fd_list = NULL;
     guint64 id = 0, id_pid_mix = 0;
+    guint32 pid = 0, uid = 0;
     gboolean id_ret = FALSE;
     UNUSED_PARAM(skeleton);
 
@@ -363,11 +417,21 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
     id_ret = generate_id_pid_mix_from_invocation (self,
                                                   invocation,
                                                   &id,
-                                                  &id_pid_mix);
+                                                  &id_pid_mix,
+                                                  &pid);
     /* error already returned to caller over dbus */
     if (id_ret == FALSE) {
         return TRUE;
     }
+    if (!get_uid_from_dbus_invocation (self->dbus_daemon_proxy,
+                                       invocation,
+                                       &uid)) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_INTERNAL,
+                                               "Failed to get client UID");
+        return TRUE;
+    }
     g_debug ("Creating connection with id: 0x%" PRIx64, id_pid_mix);
     if (connection_manager_contains_id (self->connection_manager,
                                         id_pid_mix)) {
@@ -388,6 +452,7 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
     g_object_unref (iostream);
     if (connection == NULL)
         g_error ("Failed to allocate new connection.");
+    connection_set_client (connection, pid, uid);
     g_debug ("Created connection with client FD: %d and id: 0x%" PRIx64,
              client_fd, id_pid_mix);
     /* prepare tuple variant for response message */
@@ -423,11 +488,12 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
  * - Locate the Connection object associated with the 'id' parameter in
  *   the ConnectionManager.
  * - If the connection has a command being processed by the tabrmd then it's
- *   removed from the processing queue.
+ *   removed from the processing queue and answered with TPM2_RC_CANCELED.
  * - If the connection has a command being processed by the TPM then the
  *   request to cancel the command will be sent down to the TPM.
- * - If the connection has no commands outstanding then an error is
- *   returned.
+ * - If the connection has no commands outstanding there's nothing to do:
+ *   the response may already be on its way to the client.
+ * See resource_manager_cancel for the details.
  */
 static gboolean
 on_handle_cancel (TctiTabrmd            *skeleton,
@@ -439,7 +505,7 @@ on_handle_cancel (TctiTabrmd            *skeleton,
     Connection *connection = NULL;
     guint64   id_pid_mix = 0;
     gboolean mix_ret = FALSE;
-    UNUSED_PARAM(skeleton);
+    TSS2_RC rc;
 
     g_info ("on_handle_cancel for id 0x%" PRIx64, id);
     ipc_frontend_init_guard (IPC_FRONTEND (self));
@@ -462,13 +528,19 @@ on_handle_cancel (TctiTabrmd            *skeleton,
                                                "No connection.");
         return TRUE;
     }
+    if (self->resource_manager == NULL) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "Cancel function not implemented.");
+        g_object_unref (connection);
+        return TRUE;
+    }
     g_info ("%s: canceling command for connection with id_pid_mix: 0x%" PRIx64,
             __func__, id_pid_mix);
     /* cancel any existing commands for the connection */
-    g_dbus_method_invocation_return_error (invocation,
-                                           TABRMD_ERROR,
-                                           TABRMD_ERROR_NOT_IMPLEMENTED,
-                                           "Cancel function not implemented.");
+    rc = resource_manager_cancel (self->resource_manager, connection);
+    tcti_tabrmd_complete_cancel (skeleton, invocation, rc);
     g_object_unref (connection);
 
     return TRUE;
@@ -524,6 +596,211 @@ on_handle_set_locality (TctiTabrmd            *skeleton,
 
     return TRUE;
 }
+/*
+ * Build the a{sv} dictionary describing one Connection for
+ * GetConnectionStats. The connection ID is deliberately left out: together
+ * with the PID it's all another client needs to Cancel our commands.
+ */
+static GVariant*
+connection_stats_variant (Connection *connection)
+{
+    GVariantBuilder builder, codes;
+    connection_stats_t stats;
+    GHashTable *counts;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    counts = connection_get_stats (connection, &stats);
+    g_variant_builder_init (&codes, G_VARIANT_TYPE ("a{ut}"));
+    g_hash_table_iter_init (&iter, counts);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        g_variant_builder_add (&codes, "{ut}",
+                               GPOINTER_TO_UINT (key),
+                               *(guint64*)value);
+    }
+    g_hash_table_unref (counts);
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&builder, "{sv}", "pid",
+                           g_variant_new_uint32 (connection->pid));
+    g_variant_builder_add (&builder, "{sv}", "uid",
+                           g_variant_new_uint32 (connection->uid));
+    g_variant_builder_add (&builder, "{sv}", "commands",
+                           g_variant_new_uint64 (stats.commands));
+    g_variant_builder_add (&builder, "{sv}", "tpm-time-us",
+                           g_variant_new_uint64 (stats.tpm_time_us));
+    g_variant_builder_add (&builder, "{sv}", "context-loads",
+                           g_variant_new_uint64 (stats.context_loads));
+    g_variant_builder_add (&builder, "{sv}", "context-saves",
+                           g_variant_new_uint64 (stats.context_saves));
+    g_variant_builder_add (&builder, "{sv}", "bytes-in",
+                           g_variant_new_uint64 (stats.bytes_in));
+    g_variant_builder_add (&builder, "{sv}", "bytes-out",
+                           g_variant_new_uint64 (stats.bytes_out));
+    g_variant_builder_add (&builder, "{sv}", "command-codes",
+                           g_variant_builder_end (&codes));
+    return g_variant_builder_end (&builder);
+}
+/*
+ * This is a signal handler for the handle-get-connection-stats signal from
+ * the Tabrmd DBus interface. It returns the resources used by each of the
+ * active connections and the PID / UID of the client that created it.
+ * Root gets every connection, everyone else only gets the connections
+ * created by their own UID.
+ */
+static gboolean
+on_handle_get_connection_stats (TctiTabrmd            *skeleton,
+                                GDBusMethodInvocation *invocation,
+                                gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    GVariantBuilder builder;
+    GList *connections, *item;
+    Connection *connection;
+    guint32 uid = 0;
+
+    g_debug ("%s", __func__);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    if (!get_uid_from_dbus_invocation (self->dbus_daemon_proxy,
+                                       invocation,
+                                       &uid)) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_INTERNAL,
+                                               "Failed to get client UID");
+        return TRUE;
+    }
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+    connections = connection_manager_get_connections (self->connection_manager);
+    for (item = connections; item != NULL; item = item->next) {
+        connection = CONNECTION (item->data);
+        if (uid == 0 || connection->uid == uid) {
+            g_variant_builder_add_value (&builder,
+                                         connection_stats_variant (connection));
+        }
+    }
+    g_list_free_full (connections, g_object_unref);
+    tcti_tabrmd_complete_get_connection_stats (skeleton,
+                                               invocation,
+                                               g_variant_builder_end (&builder));
+
+    return TRUE;
+}
+/*
+ * Build an 'at' array from one of the lock_stats_t histograms.
+ */
+static GVariant*
+lock_histogram_variant (const guint64 hist [LOCK_STATS_BUCKETS])
+{
+    return g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64,
+                                      hist,
+                                      LOCK_STATS_BUCKETS,
+                                      sizeof (guint64));
+}
+/*
+ * This is a signal handler for the handle-get-lock-stats signal from the
+ * Tabrmd DBus interface. It returns the contention statistics for each of
+ * the instrumented locks. Nothing in there identifies a client so anyone
+ * may ask. The array is empty unless the daemon was built with
+ * --enable-lock-stats.
+ */
+static gboolean
+on_handle_get_lock_stats (TctiTabrmd            *skeleton,
+                          GDBusMethodInvocation *invocation,
+                          gpointer               user_data)
+{
+    GVariantBuilder builder, lock;
+    GList *locks, *item;
+    lock_stats_t *stats;
+
+    g_debug ("%s", __func__);
+    ipc_frontend_init_guard (IPC_FRONTEND (user_data));
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+    locks = lock_stats_get_all ();
+    for (item = locks; item != NULL; item = item->next) {
+        stats = (lock_stats_t*)item->data;
+        g_variant_builder_init (&lock, G_VARIANT_TYPE ("a{sv}"));
+        g_variant_builder_add (&lock, "{sv}", "name",
+                               g_variant_new_string (stats->name));
+        g_variant_builder_add (&lock, "{sv}", "acquired",
+                               g_variant_new_uint64 (stats->acquired));
+        g_variant_builder_add (&lock, "{sv}", "contended",
+                               g_variant_new_uint64 (stats->contended));
+        g_variant_builder_add (&lock, "{sv}", "wait-ns",
+                               g_variant_new_uint64 (stats->wait_ns));
+        g_variant_builder_add (&lock, "{sv}", "hold-ns",
+                               g_variant_new_uint64 (stats->hold_ns));
+        g_variant_builder_add (&lock, "{sv}", "wait-histogram",
+                               lock_histogram_variant (stats->wait_hist));
+        g_variant_builder_add (&lock, "{sv}", "hold-histogram",
+                               lock_histogram_variant (stats->hold_hist));
+        g_variant_builder_add_value (&builder, g_variant_builder_end (&lock));
+    }
+    g_list_free_full (locks, g_free);
+    tcti_tabrmd_complete_get_lock_stats (skeleton,
+                                         invocation,
+                                         g_variant_builder_end (&builder));
+
+    return TRUE;
+}
+/*
+ * This is a signal handler for the handle-get-snapshot signal from the
+ * TctiTabrmd.Stats DBus interface. It returns the daemon wide counters
+ * along with the time they were read so that a monitor like tabrmd-top
+ * can turn two snapshots into rates. These are totals across all clients
+ * so anyone may ask. None of the counters take a pipeline lock to read:
+ * the ResourceManager stats are atomics and the ConnectionManager keeps
+ * an atomic count of its connections.
+ */
+static gboolean
+on_handle_get_snapshot (TctiTabrmdStats       *skeleton,
+                        GDBusMethodInvocation *invocation,
+                        gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    GVariantBuilder builder;
+    resource_manager_stats_t stats;
+
+    g_debug ("%s", __func__);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    if (self->resource_manager == NULL) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "GetSnapshot function not implemented.");
+        return TRUE;
+    }
+    resource_manager_get_stats (self->resource_manager, &stats);
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&builder, "{sv}", "time-us",
+                           g_variant_new_int64 (g_get_monotonic_time ()));
+    g_variant_builder_add (&builder, "{sv}", "connections",
+                           g_variant_new_uint32 (
+                               connection_manager_size (self->connection_manager)));
+    g_variant_builder_add (&builder, "{sv}", "commands",
+                           g_variant_new_uint64 (stats.commands));
+    g_variant_builder_add (&builder, "{sv}", "queue-depth",
+                           g_variant_new_uint32 (stats.queue_depth));
+    g_variant_builder_add (&builder, "{sv}", "queue-high-water",
+                           g_variant_new_uint32 (stats.queue_high_water));
+    g_variant_builder_add (&builder, "{sv}", "tpm-busy-us",
+                           g_variant_new_uint64 (stats.tpm_busy_us));
+    g_variant_builder_add (&builder, "{sv}", "context-loads",
+                           g_variant_new_uint64 (stats.context_loads));
+    g_variant_builder_add (&builder, "{sv}", "context-saves",
+                           g_variant_new_uint64 (stats.context_saves));
+    g_variant_builder_add (&builder, "{sv}", "commands-retried",
+                           g_variant_new_uint64 (stats.retried));
+    g_variant_builder_add (&builder, "{sv}", "retries",
+                           g_variant_new_uint64 (stats.retries));
+    g_variant_builder_add (&builder, "{sv}", "retries-exhausted",
+                           g_variant_new_uint64 (stats.retries_exhausted));
+    tcti_tabrmd_stats_complete_get_snapshot (skeleton,
+                                             invocation,
+                                             g_variant_builder_end (&builder));
+
+    return TRUE;
+}
 /* D-Bus signal handlers */
 /*
  * This is a signal handler of type GBusAcquiredCallback. It is registered
@@ -545,10 +822,10 @@ on_bus_acquired (GDBusConnection *connection,
  * 'name' is acquired on the requested bus. It does 3 things:
  * - Obtains a new TctiTabrmd instance and stores a reference in
  *   the 'user_data' parameter (which is a reference to the gmain_data_t.
- * - Register signal handlers for the CreateConnection, Cancel and
- *   SetLocality signals.
- * - Export the TctiTabrmd interface (skeleton) on the DBus
- *   connection.
+ * - Register signal handlers for the CreateConnection, Cancel,
+ *   GetConnectionStats, GetLockStats, SetLocality and GetSnapshot signals.
+ * - Export the TctiTabrmd and TctiTabrmd.Stats interfaces (skeletons) on
+ *   the DBus connection.
  */
 static void
 on_name_acquired (GDBusConnection *connection,
@@ -573,6 +850,14 @@ on_name_acquired (GDBusConnection *connection,
                       "handle-cancel",
                       G_CALLBACK (on_handle_cancel),
                       user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-get-connection-stats",
+                      G_CALLBACK (on_handle_get_connection_stats),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-get-lock-stats",
+                      G_CALLBACK (on_handle_get_lock_stats),
+                      user_data);
     g_signal_connect (self->skeleton,
                       "handle-set-locality",
                       G_CALLBACK (on_handle_set_locality),
@@ -582,8 +867,25 @@ on_name_acquired (GDBusConnection *connection,
         connection,
         TABRMD_DBUS_PATH,
         &error);
-    if (ret == FALSE)
+    if (ret == FALSE) {
         g_warning ("failed to export interface: %s", error->message);
+        g_clear_error (&error);
+    }
+    if (self->stats_skeleton == NULL)
+        self->stats_skeleton = tcti_tabrmd_stats_skeleton_new ();
+    g_signal_connect (self->stats_skeleton,
+                      "handle-get-snapshot",
+                      G_CALLBACK (on_handle_get_snapshot),
+                      user_data);
+    ret = g_dbus_interface_skeleton_export (
+        G_DBUS_INTERFACE_SKELETON (self->stats_skeleton),
+        connection,
+        TABRMD_DBUS_PATH,
+        &error);
+    if (ret == FALSE) {
+        g_warning ("failed to export stats interface: %s", error->message);
+        g_clear_error (&error);
+    }
     self->dbus_name_acquired = TRUE;
 }
 /*
@@ -12,6 +12,7 @@
 #include "connection-manager.h"
 #include "ipc-frontend.h"
 #include "random.h"
+#include "resource-manager.h"
 #include "tabrmd-generated.h"
 
 G_BEGIN_DECLS
@@ -36,7 +37,9 @@ typedef struct _IpcFrontendDbus
     ConnectionManager *connection_manager;
     GDBusProxy        *dbus_daemon_proxy;
     Random            *random;
+    ResourceManager   *resource_manager;
     TctiTabrmd        *skeleton;
+    TctiTabrmdStats   *stats_skeleton;
 } IpcFrontendDbus;
 
 #define TYPE_IPC_FRONTEND_DBUS             (ipc_frontend_dbus_get_type       ())
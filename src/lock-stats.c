@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <glib.h>
+#include <time.h>
+
+#include "lock-stats.h"
+
+#ifdef ENABLE_LOCK_STATS
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static lock_stats_t *registry = NULL;
+
+static void
+lock_stats_register (lock_stats_t *stats)
+{
+    if (__atomic_load_n (&stats->registered, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock (&registry_mutex);
+    if (!stats->registered) {
+        stats->next = registry;
+        registry = stats;
+        __atomic_store_n (&stats->registered, TRUE, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock (&registry_mutex);
+}
+static guint64
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * G_GUINT64_CONSTANT (1000000000) +
+        (guint64)ts.tv_nsec;
+}
+/*
+ * Add a duration to a total and its histogram. Many locks share the same
+ * lock_stats_t so the counters are updated atomically.
+ */
+static void
+record (guint64 *total,
+        guint64  hist [LOCK_STATS_BUCKETS],
+        guint64  ns)
+{
+    guint bucket = 0;
+
+    if (ns > 1) {
+        bucket = MIN (63 - __builtin_clzll (ns), LOCK_STATS_BUCKETS - 1);
+    }
+    __atomic_fetch_add (total, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&hist [bucket], 1, __ATOMIC_RELAXED);
+}
+gint
+stat_mutex_init (stat_mutex_t *mutex,
+                 lock_stats_t *stats)
+{
+    g_assert_nonnull (stats);
+    lock_stats_register (stats);
+    mutex->stats = stats;
+    mutex->acquired_at = 0;
+    return pthread_mutex_init (&mutex->mutex, NULL);
+}
+/*
+ * Try the lock first: if it's taken the acquisition is contended and the
+ * time spent waiting for it is recorded.
+ */
+gint
+stat_mutex_lock (stat_mutex_t *mutex)
+{
+    guint64 start, acquired_at;
+    gint ret;
+
+    ret = pthread_mutex_trylock (&mutex->mutex);
+    if (ret == EBUSY) {
+        start = now_ns ();
+        ret = pthread_mutex_lock (&mutex->mutex);
+        if (ret != 0) {
+            return ret;
+        }
+        acquired_at = now_ns ();
+        __atomic_fetch_add (&mutex->stats->contended, 1, __ATOMIC_RELAXED);
+        record (&mutex->stats->wait_ns,
+                mutex->stats->wait_hist,
+                acquired_at - start);
+    } else if (ret != 0) {
+        return ret;
+    } else {
+        acquired_at = now_ns ();
+    }
+    __atomic_fetch_add (&mutex->stats->acquired, 1, __ATOMIC_RELAXED);
+    mutex->acquired_at = acquired_at;
+    return 0;
+}
+gint
+stat_mutex_unlock (stat_mutex_t *mutex)
+{
+    record (&mutex->stats->hold_ns,
+            mutex->stats->hold_hist,
+            now_ns () - mutex->acquired_at);
+    return pthread_mutex_unlock (&mutex->mutex);
+}
+/*
+ * Return a list with a copy of each registered lock_stats_t. The caller
+ * must free it with g_list_free_full (list, g_free). The 'next' member of
+ * the copies is meaningless.
+ */
+GList*
+lock_stats_get_all (void)
+{
+    GList *list = NULL;
+    lock_stats_t *stats, *copy;
+    size_t i;
+
+    pthread_mutex_lock (&registry_mutex);
+    for (stats = registry; stats != NULL; stats = stats->next) {
+        copy = g_new0 (lock_stats_t, 1);
+        copy->name = stats->name;
+        copy->registered = TRUE;
+        copy->acquired = __atomic_load_n (&stats->acquired, __ATOMIC_RELAXED);
+        copy->contended = __atomic_load_n (&stats->contended, __ATOMIC_RELAXED);
+        copy->wait_ns = __atomic_load_n (&stats->wait_ns, __ATOMIC_RELAXED);
+        copy->hold_ns = __atomic_load_n (&stats->hold_ns, __ATOMIC_RELAXED);
+        for (i = 0; i < LOCK_STATS_BUCKETS; ++i) {
+            copy->wait_hist [i] = __atomic_load_n (&stats->wait_hist [i],
+                                                   __ATOMIC_RELAXED);
+            copy->hold_hist [i] = __atomic_load_n (&stats->hold_hist [i],
+                                                   __ATOMIC_RELAXED);
+        }
+        list = g_list_prepend (list, copy);
+    }
+    pthread_mutex_unlock (&registry_mutex);
+    return list;
+}
+
+#else /* ENABLE_LOCK_STATS */
+
+/*
+ * Nothing is recorded without lock statistics.
+ */
+GList*
+lock_stats_get_all (void)
+{
+    return NULL;
+}
+
+#endif /* ENABLE_LOCK_STATS */
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef LOCK_STATS_H
+#define LOCK_STATS_H
+
+#include <glib.h>
+#include <pthread.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Histogram bucket 'i' counts durations of [2^i, 2^(i+1)) nanoseconds, the
+ * last bucket counts everything longer.
+ */
+#define LOCK_STATS_BUCKETS 32
+
+/*
+ * Statistics shared by all of the stat_mutex_t locks protecting the same
+ * kind of data, e.g. every HandleMap. Each module keeps one of these in
+ * static storage, it's added to the list returned by lock_stats_get_all
+ * the first time a lock using it is initialized. Wait times are only
+ * recorded for contended acquisitions.
+ */
+typedef struct lock_stats {
+    const gchar        *name;
+    guint64             acquired;
+    guint64             contended;
+    guint64             wait_ns;
+    guint64             hold_ns;
+    guint64             wait_hist [LOCK_STATS_BUCKETS];
+    guint64             hold_hist [LOCK_STATS_BUCKETS];
+    gint                registered;
+    struct lock_stats  *next;
+} lock_stats_t;
+
+#define LOCK_STATS_INIT(lock_name) { .name = lock_name, }
+
+#ifdef ENABLE_LOCK_STATS
+
+typedef struct {
+    pthread_mutex_t     mutex;
+    lock_stats_t       *stats;
+    guint64             acquired_at;
+} stat_mutex_t;
+
+gint         stat_mutex_init     (stat_mutex_t  *mutex,
+                                  lock_stats_t  *stats);
+gint         stat_mutex_lock     (stat_mutex_t  *mutex);
+gint         stat_mutex_unlock   (stat_mutex_t  *mutex);
+
+#else /* ENABLE_LOCK_STATS */
+
+/*
+ * Without lock statistics a stat_mutex_t is a pthread_mutex_t and the
+ * functions below are the pthread functions.
+ */
+typedef struct {
+    pthread_mutex_t     mutex;
+} stat_mutex_t;
+
+static inline gint
+stat_mutex_init (stat_mutex_t *mutex,
+                 lock_stats_t *stats)
+{
+    (void)stats;
+    return pthread_mutex_init (&mutex->mutex, NULL);
+}
+static inline gint
+stat_mutex_lock (stat_mutex_t *mutex)
+{
+    return pthread_mutex_lock (&mutex->mutex);
+}
+static inline gint
+stat_mutex_unlock (stat_mutex_t *mutex)
+{
+    return pthread_mutex_unlock (&mutex->mutex);
+}
+
+#endif /* ENABLE_LOCK_STATS */
+
+static inline gint
+stat_mutex_destroy (stat_mutex_t *mutex)
+{
+    return pthread_mutex_destroy (&mutex->mutex);
+}
+
+GList*       lock_stats_get_all  (void);
+
+G_END_DECLS
+#endif /* LOCK_STATS_H */
@@ -10,6 +10,7 @@
 #include <string.h>
 
 #include "message-queue.h"
+#include "tabrmd-probes.h"
 #include "util.h"
 
 G_DEFINE_TYPE (MessageQueue, message_queue, G_TYPE_OBJECT);
@@ -65,10 +66,24 @@ void
 message_queue_enqueue (MessageQueue  *message_queue,
                        GObject       *object)
 {
+    gint length, high_water;
+
     g_assert (message_queue != NULL);
     g_debug ("%s", __func__);
     g_object_ref (object);
     g_async_queue_push (message_queue->queue, object);
+    g_atomic_int_inc (&message_queue->length);
+    /* racy with respect to the consumer but never lower than the truth */
+    length = g_async_queue_length (message_queue->queue);
+    TABRMD_PROBE3 (queue_enqueue, message_queue, object, length);
+    do {
+        high_water = g_atomic_int_get (&message_queue->high_water);
+        if (length <= high_water) {
+            break;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&message_queue->high_water,
+                                                 high_water,
+                                                 length));
 }
 /**
  * Dequeue a blob from the blob_queue_t.
@@ -83,5 +98,133 @@ message_queue_dequeue (MessageQueue *message_queue)
     g_assert (message_queue != NULL);
     g_debug ("%s", __func__);
     obj = g_async_queue_pop (message_queue->queue);
+    g_atomic_int_add (&message_queue->length, -1);
+    TABRMD_PROBE2 (queue_dequeue, message_queue, obj);
+    return obj;
+}
+/*
+ * Like 'message_queue_dequeue' but returns NULL immediately when the queue
+ * is empty instead of blocking.
+ */
+GObject*
+message_queue_try_dequeue (MessageQueue *message_queue)
+{
+    GObject *obj;
+
+    g_assert (message_queue != NULL);
+    obj = g_async_queue_try_pop (message_queue->queue);
+    if (obj != NULL) {
+        g_atomic_int_add (&message_queue->length, -1);
+        TABRMD_PROBE2 (queue_dequeue, message_queue, obj);
+    }
+    return obj;
+}
+/*
+ * Like 'message_queue_dequeue' but gives up and returns NULL if the queue
+ * is still empty after 'timeout_us' microseconds.
+ */
+GObject*
+message_queue_timeout_dequeue (MessageQueue *message_queue,
+                               guint64       timeout_us)
+{
+    GObject *obj;
+
+    g_assert (message_queue != NULL);
+    obj = g_async_queue_timeout_pop (message_queue->queue, timeout_us);
+    if (obj != NULL) {
+        g_atomic_int_add (&message_queue->length, -1);
+        TABRMD_PROBE2 (queue_dequeue, message_queue, obj);
+    }
     return obj;
 }
+/*
+ * Remove every queued object for which 'func' returns TRUE. 'func' is
+ * called on the objects from the oldest to the newest. The removed
+ * objects are returned in queue order, the caller owns the list and the
+ * reference to each object. The order of the objects left in the queue is
+ * preserved.
+ */
+GList*
+message_queue_remove_matching (MessageQueue          *message_queue,
+                               MessageQueueMatchFunc  func,
+                               gpointer               user_data)
+{
+    GQueue keep = G_QUEUE_INIT;
+    GList *matched = NULL;
+    GObject *obj;
+    gint removed = 0;
+
+    g_assert (message_queue != NULL);
+    g_assert (func != NULL);
+    g_async_queue_lock (message_queue->queue);
+    while ((obj = g_async_queue_try_pop_unlocked (message_queue->queue)) != NULL) {
+        if (func (obj, user_data)) {
+            matched = g_list_prepend (matched, obj);
+            ++removed;
+        } else {
+            g_queue_push_tail (&keep, obj);
+        }
+    }
+    while ((obj = g_queue_pop_head (&keep)) != NULL) {
+        g_async_queue_push_unlocked (message_queue->queue, obj);
+    }
+    g_async_queue_unlock (message_queue->queue);
+    g_atomic_int_add (&message_queue->length, -removed);
+    return g_list_reverse (matched);
+}
+/*
+ * Return a list holding a new reference to each of the first 'max' objects
+ * in the queue, in queue order. The queue itself is left unchanged. The
+ * caller owns the list and the references. Only the first 'max' objects
+ * are popped and pushed back, so the queue lock is held for O(max) work
+ * however long the queue is.
+ */
+GList*
+message_queue_peek (MessageQueue *message_queue,
+                    guint         max)
+{
+    GList *peeked = NULL, *item;
+    GObject *obj;
+    guint i;
+
+    g_assert (message_queue != NULL);
+    g_async_queue_lock (message_queue->queue);
+    for (i = 0; i < max; ++i) {
+        obj = g_async_queue_try_pop_unlocked (message_queue->queue);
+        if (obj == NULL) {
+            break;
+        }
+        peeked = g_list_prepend (peeked, obj);
+    }
+    /* 'peeked' is newest first: push back to the front in that order */
+    for (item = peeked; item != NULL; item = item->next) {
+        g_async_queue_push_front_unlocked (message_queue->queue,
+                                           g_object_ref (item->data));
+    }
+    g_async_queue_unlock (message_queue->queue);
+    return g_list_reverse (peeked);
+}
+/*
+ * Return the largest number of objects the queue has held at once.
+ */
+guint
+message_queue_get_high_water (MessageQueue *message_queue)
+{
+    g_assert (message_queue != NULL);
+    return (guint)g_atomic_int_get (&message_queue->high_water);
+}
+/*
+ * Return the number of objects in the queue. This is read without taking
+ * the queue lock so it's cheap enough to poll while the pipeline is busy.
+ * A consumer may pop an object before the producer has counted it, so the
+ * count is clamped at 0.
+ */
+guint
+message_queue_get_length (MessageQueue *message_queue)
+{
+    gint length;
+
+    g_assert (message_queue != NULL);
+    length = g_atomic_int_get (&message_queue->length);
+    return length > 0 ? (guint)length : 0;
+}
@@ -15,9 +15,20 @@ typedef struct _MessageQueueClass {
     GObjectClass parent;
 } MessageQueueClass;
 
+/*
+ * Predicate used by 'message_queue_remove_matching'. Return TRUE to remove
+ * 'obj' from the queue.
+ */
+typedef gboolean (*MessageQueueMatchFunc) (GObject  *obj,
+                                           gpointer  user_data);
+
 typedef struct _MessageQueue {
     GObject       parent_instance;
     GAsyncQueue  *queue;
+    /* deepest the queue has been, updated with atomic ops */
+    gint          high_water;
+    /* current depth, readable without taking the GAsyncQueue lock */
+    gint          length;
 } MessageQueue;
 
 #define TYPE_MESSAGE_QUEUE           (message_queue_get_type             ())
@@ -32,6 +43,16 @@ MessageQueue*   message_queue_new          (void);
 void        message_queue_enqueue          (MessageQueue   *message_queue,
                                             GObject        *obj);
 GObject*    message_queue_dequeue          (MessageQueue   *message_queue);
+GObject*    message_queue_try_dequeue      (MessageQueue   *message_queue);
+GObject*    message_queue_timeout_dequeue  (MessageQueue   *message_queue,
+                                            guint64         timeout_us);
+GList*      message_queue_remove_matching  (MessageQueue   *message_queue,
+                                            MessageQueueMatchFunc func,
+                                            gpointer        user_data);
+GList*      message_queue_peek             (MessageQueue   *message_queue,
+                                            guint           max);
+guint       message_queue_get_high_water   (MessageQueue   *message_queue);
+guint       message_queue_get_length       (MessageQueue   *message_queue);
 
 G_END_DECLS
 #endif /* MESSAGE_QUEUE_H */
@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include "object-cache.h"
+#include "util.h"
+
+G_DEFINE_TYPE (ObjectCache, object_cache, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_MAX_ENTRIES,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * Each entry holds the response buffer from the command that created the
+ * object and the context saved by the RM after that command completed. The
+ * 'tag' is the handle the object was created under (a hierarchy or parent)
+ * and is used to invalidate groups of entries.
+ */
+typedef struct {
+    GBytes       *key;
+    GBytes       *response;
+    TPMS_CONTEXT  context;
+    TPM2_HANDLE   tag;
+    GList        *lru_link;
+} object_cache_entry_t;
+
+static void
+object_cache_entry_free (gpointer data)
+{
+    object_cache_entry_t *entry = (object_cache_entry_t*)data;
+
+    g_bytes_unref (entry->key);
+    g_bytes_unref (entry->response);
+    g_free (entry);
+}
+static void
+object_cache_get_property (GObject     *object,
+                           guint        property_id,
+                           GValue      *value,
+                           GParamSpec  *pspec)
+{
+    ObjectCache *self = OBJECT_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        g_value_set_uint (value, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+object_cache_set_property (GObject        *object,
+                           guint           property_id,
+                           GValue const   *value,
+                           GParamSpec     *pspec)
+{
+    ObjectCache *self = OBJECT_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        self->max_entries = g_value_get_uint (value);
+        g_debug ("%s: max-entries: %u", __func__, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+object_cache_init (ObjectCache *cache)
+{
+    pthread_mutex_init (&cache->mutex, NULL);
+    cache->table = g_hash_table_new_full (g_bytes_hash,
+                                          g_bytes_equal,
+                                          NULL,
+                                          object_cache_entry_free);
+    g_queue_init (&cache->lru);
+}
+static void
+object_cache_finalize (GObject *object)
+{
+    ObjectCache *cache = OBJECT_CACHE (object);
+
+    g_debug ("%s: hits %" PRIu64 ", misses %" PRIu64, __func__,
+             cache->hits, cache->misses);
+    g_queue_clear (&cache->lru);
+    g_clear_pointer (&cache->table, g_hash_table_unref);
+    pthread_mutex_destroy (&cache->mutex);
+    G_OBJECT_CLASS (object_cache_parent_class)->finalize (object);
+}
+static void
+object_cache_class_init (ObjectCacheClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (object_cache_parent_class == NULL)
+        object_cache_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = object_cache_finalize;
+    object_class->get_property = object_cache_get_property;
+    object_class->set_property = object_cache_set_property;
+
+    obj_properties [PROP_MAX_ENTRIES] =
+        g_param_spec_uint ("max-entries",
+                           "max entries",
+                           "Maximum number of cached objects",
+                           1,
+                           OBJECT_CACHE_MAX_ENTRIES_MAX,
+                           1,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+ObjectCache*
+object_cache_new (guint max_entries)
+{
+    return OBJECT_CACHE (g_object_new (TYPE_OBJECT_CACHE,
+                                       "max-entries", max_entries,
+                                       NULL));
+}
+/*
+ * Look up the entry for 'key'. On a hit the caller gets a new reference to
+ * the cached response buffer and a copy of the saved context. The entry
+ * becomes the most recently used.
+ */
+gboolean
+object_cache_lookup (ObjectCache   *cache,
+                     GBytes        *key,
+                     GBytes       **response,
+                     TPMS_CONTEXT  *context)
+{
+    object_cache_entry_t *entry;
+
+    g_assert_nonnull (cache);
+    g_assert_nonnull (key);
+    pthread_mutex_lock (&cache->mutex);
+    entry = g_hash_table_lookup (cache->table, key);
+    if (entry == NULL) {
+        ++cache->misses;
+        pthread_mutex_unlock (&cache->mutex);
+        return FALSE;
+    }
+    ++cache->hits;
+    g_queue_unlink (&cache->lru, entry->lru_link);
+    g_queue_push_head_link (&cache->lru, entry->lru_link);
+    *response = g_bytes_ref (entry->response);
+    memcpy (context, &entry->context, sizeof (TPMS_CONTEXT));
+    pthread_mutex_unlock (&cache->mutex);
+    return TRUE;
+}
+static void
+object_cache_remove_entry (ObjectCache          *cache,
+                           object_cache_entry_t *entry)
+{
+    g_queue_delete_link (&cache->lru, entry->lru_link);
+    g_hash_table_remove (cache->table, entry->key);
+}
+/*
+ * Add a new entry, replacing any existing entry for the same key. When the
+ * cache is full the least recently used entry is evicted.
+ */
+void
+object_cache_insert (ObjectCache   *cache,
+                     GBytes        *key,
+                     TPM2_HANDLE    tag,
+                     const uint8_t *response,
+                     size_t         response_size,
+                     TPMS_CONTEXT  *context)
+{
+    object_cache_entry_t *entry;
+
+    g_assert_nonnull (cache);
+    g_assert_nonnull (key);
+    g_assert_nonnull (response);
+    g_assert_nonnull (context);
+    pthread_mutex_lock (&cache->mutex);
+    entry = g_hash_table_lookup (cache->table, key);
+    if (entry != NULL) {
+        object_cache_remove_entry (cache, entry);
+    }
+    while (g_hash_table_size (cache->table) >= cache->max_entries) {
+        entry = g_queue_peek_tail (&cache->lru);
+        g_debug ("%s: evicting entry with tag 0x%08" PRIx32, __func__,
+                 entry->tag);
+        object_cache_remove_entry (cache, entry);
+        ++cache->evictions;
+    }
+    entry = g_new0 (object_cache_entry_t, 1);
+    entry->key = g_bytes_ref (key);
+    entry->response = g_bytes_new (response, response_size);
+    memcpy (&entry->context, context, sizeof (TPMS_CONTEXT));
+    entry->tag = tag;
+    g_queue_push_head (&cache->lru, entry);
+    entry->lru_link = cache->lru.head;
+    g_hash_table_insert (cache->table, entry->key, entry);
+    g_debug ("%s: cached object with tag 0x%08" PRIx32 ", %u entries",
+             __func__, tag, g_hash_table_size (cache->table));
+    pthread_mutex_unlock (&cache->mutex);
+}
+typedef struct {
+    ObjectCache *cache;
+    TPM2_HANDLE  tag;
+} invalidate_data_t;
+static gboolean
+object_cache_invalidate_callback (gpointer key,
+                                  gpointer value,
+                                  gpointer user_data)
+{
+    object_cache_entry_t *entry = (object_cache_entry_t*)value;
+    invalidate_data_t *data = (invalidate_data_t*)user_data;
+    UNUSED_PARAM (key);
+
+    if (entry->tag != data->tag) {
+        return FALSE;
+    }
+    g_queue_delete_link (&data->cache->lru, entry->lru_link);
+    return TRUE;
+}
+/*
+ * Drop all entries created under the handle 'tag'. Returns the number of
+ * entries removed.
+ */
+guint
+object_cache_invalidate (ObjectCache *cache,
+                         TPM2_HANDLE  tag)
+{
+    invalidate_data_t data = {
+        .cache = cache,
+        .tag = tag,
+    };
+    guint count;
+
+    g_assert_nonnull (cache);
+    pthread_mutex_lock (&cache->mutex);
+    count = g_hash_table_foreach_remove (cache->table,
+                                         object_cache_invalidate_callback,
+                                         &data);
+    cache->invalidations += count;
+    pthread_mutex_unlock (&cache->mutex);
+    g_debug ("%s: removed %u entries with tag 0x%08" PRIx32, __func__,
+             count, tag);
+    return count;
+}
+void
+object_cache_clear (ObjectCache *cache)
+{
+    g_assert_nonnull (cache);
+    pthread_mutex_lock (&cache->mutex);
+    cache->invalidations += g_hash_table_size (cache->table);
+    g_queue_clear (&cache->lru);
+    g_hash_table_remove_all (cache->table);
+    pthread_mutex_unlock (&cache->mutex);
+}
+guint
+object_cache_size (ObjectCache *cache)
+{
+    guint size;
+
+    pthread_mutex_lock (&cache->mutex);
+    size = g_hash_table_size (cache->table);
+    pthread_mutex_unlock (&cache->mutex);
+    return size;
+}
+/*
+ * Take a consistent snapshot of the cache counters.
+ */
+void
+object_cache_get_stats (ObjectCache          *cache,
+                        object_cache_stats_t *stats)
+{
+    g_assert_nonnull (cache);
+    g_assert_nonnull (stats);
+    pthread_mutex_lock (&cache->mutex);
+    stats->size = g_hash_table_size (cache->table);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->invalidations = cache->invalidations;
+    pthread_mutex_unlock (&cache->mutex);
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+#include <tss2/tss2_tpm2_types.h>
+
+G_BEGIN_DECLS
+
+#define OBJECT_CACHE_MAX_ENTRIES_MAX 64
+
+typedef struct {
+    guint             size;
+    guint64           hits;
+    guint64           misses;
+    guint64           evictions;
+    guint64           invalidations;
+} object_cache_stats_t;
+
+typedef struct _ObjectCacheClass {
+    GObjectClass      parent;
+} ObjectCacheClass;
+
+typedef struct _ObjectCache {
+    GObject           parent_instance;
+    pthread_mutex_t   mutex;
+    guint             max_entries;
+    GHashTable       *table;
+    GQueue            lru;
+    guint64           hits;
+    guint64           misses;
+    guint64           evictions;
+    guint64           invalidations;
+} ObjectCache;
+
+#define TYPE_OBJECT_CACHE              (object_cache_get_type   ())
+#define OBJECT_CACHE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_OBJECT_CACHE, ObjectCache))
+#define OBJECT_CACHE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_OBJECT_CACHE, ObjectCacheClass))
+#define IS_OBJECT_CACHE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_OBJECT_CACHE))
+#define IS_OBJECT_CACHE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_OBJECT_CACHE))
+#define OBJECT_CACHE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_OBJECT_CACHE, ObjectCacheClass))
+
+GType          object_cache_get_type        (void);
+ObjectCache*   object_cache_new             (guint           max_entries);
+gboolean       object_cache_lookup          (ObjectCache    *cache,
+                                             GBytes         *key,
+                                             GBytes        **response,
+                                             TPMS_CONTEXT   *context);
+void           object_cache_insert          (ObjectCache    *cache,
+                                             GBytes         *key,
+                                             TPM2_HANDLE     tag,
+                                             const uint8_t  *response,
+                                             size_t          response_size,
+                                             TPMS_CONTEXT   *context);
+guint          object_cache_invalidate      (ObjectCache    *cache,
+                                             TPM2_HANDLE     tag);
+void           object_cache_clear           (ObjectCache    *cache);
+guint          object_cache_size            (ObjectCache    *cache);
+void           object_cache_get_stats       (ObjectCache    *cache,
+                                             object_cache_stats_t *stats);
+
+G_END_DECLS
+#endif /* OBJECT_CACHE_H */
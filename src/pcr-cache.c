@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+
+#include "pcr-cache.h"
+#include "util.h"
+
+G_DEFINE_TYPE (PcrCache, pcr_cache, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_MAX_AGE,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * A cached PCR_Read response and the time (from g_get_monotonic_time) it
+ * was received from the TPM.
+ */
+typedef struct {
+    GBytes       *response;
+    gint64        timestamp;
+} pcr_cache_entry_t;
+
+static void
+pcr_cache_entry_free (gpointer data)
+{
+    pcr_cache_entry_t *entry = (pcr_cache_entry_t*)data;
+
+    g_bytes_unref (entry->response);
+    g_free (entry);
+}
+static void
+pcr_cache_get_property (GObject     *object,
+                        guint        property_id,
+                        GValue      *value,
+                        GParamSpec  *pspec)
+{
+    PcrCache *self = PCR_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_AGE:
+        g_value_set_uint (value, self->max_age);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+pcr_cache_set_property (GObject        *object,
+                        guint           property_id,
+                        GValue const   *value,
+                        GParamSpec     *pspec)
+{
+    PcrCache *self = PCR_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_AGE:
+        self->max_age = g_value_get_uint (value);
+        g_debug ("%s: max-age: %u ms", __func__, self->max_age);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+pcr_cache_init (PcrCache *cache)
+{
+    pthread_mutex_init (&cache->mutex, NULL);
+    cache->table = g_hash_table_new_full (g_bytes_hash,
+                                          g_bytes_equal,
+                                          (GDestroyNotify)g_bytes_unref,
+                                          pcr_cache_entry_free);
+}
+static void
+pcr_cache_finalize (GObject *object)
+{
+    PcrCache *cache = PCR_CACHE (object);
+
+    g_debug ("%s: hits %" PRIu64 ", misses %" PRIu64 ", invalidations %"
+             PRIu64, __func__, cache->hits, cache->misses,
+             cache->invalidations);
+    g_clear_pointer (&cache->table, g_hash_table_unref);
+    pthread_mutex_destroy (&cache->mutex);
+    G_OBJECT_CLASS (pcr_cache_parent_class)->finalize (object);
+}
+static void
+pcr_cache_class_init (PcrCacheClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (pcr_cache_parent_class == NULL)
+        pcr_cache_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = pcr_cache_finalize;
+    object_class->get_property = pcr_cache_get_property;
+    object_class->set_property = pcr_cache_set_property;
+
+    obj_properties [PROP_MAX_AGE] =
+        g_param_spec_uint ("max-age",
+                           "max age",
+                           "Milliseconds a cached PCR_Read response is served",
+                           1,
+                           G_MAXUINT,
+                           1000,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+PcrCache*
+pcr_cache_new (guint max_age)
+{
+    return PCR_CACHE (g_object_new (TYPE_PCR_CACHE,
+                                    "max-age", max_age,
+                                    NULL));
+}
+/*
+ * Look up the response to a PCR_Read with the given selection (the command
+ * parameters). Entries older than 'max-age' are dropped: they cover for
+ * PCR changes the daemon can't see. Returns a new reference to the
+ * response or NULL.
+ */
+GBytes*
+pcr_cache_lookup (PcrCache *cache,
+                  GBytes   *selection)
+{
+    pcr_cache_entry_t *entry;
+    GBytes *response = NULL;
+    gint64 now = g_get_monotonic_time ();
+
+    g_assert_nonnull (cache);
+    g_assert_nonnull (selection);
+    pthread_mutex_lock (&cache->mutex);
+    entry = g_hash_table_lookup (cache->table, selection);
+    if (entry != NULL &&
+        now - entry->timestamp > (gint64)cache->max_age * G_TIME_SPAN_MILLISECOND)
+    {
+        g_debug ("%s: entry expired", __func__);
+        g_hash_table_remove (cache->table, selection);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        ++cache->misses;
+    } else {
+        ++cache->hits;
+        response = g_bytes_ref (entry->response);
+    }
+    pthread_mutex_unlock (&cache->mutex);
+    return response;
+}
+void
+pcr_cache_insert (PcrCache      *cache,
+                  GBytes        *selection,
+                  const uint8_t *response,
+                  size_t         response_size)
+{
+    pcr_cache_entry_t *entry;
+
+    g_assert_nonnull (cache);
+    g_assert_nonnull (selection);
+    g_assert_nonnull (response);
+    entry = g_new0 (pcr_cache_entry_t, 1);
+    entry->response = g_bytes_new (response, response_size);
+    entry->timestamp = g_get_monotonic_time ();
+    pthread_mutex_lock (&cache->mutex);
+    if (g_hash_table_size (cache->table) >= PCR_CACHE_MAX_ENTRIES &&
+        !g_hash_table_contains (cache->table, selection))
+    {
+        g_debug ("%s: cache full, dropping all entries", __func__);
+        g_hash_table_remove_all (cache->table);
+    }
+    g_hash_table_replace (cache->table, g_bytes_ref (selection), entry);
+    pthread_mutex_unlock (&cache->mutex);
+}
+/*
+ * Drop every cached response. Called when a command that changes PCR
+ * values (or the pcrUpdateCounter) succeeds.
+ */
+void
+pcr_cache_invalidate (PcrCache *cache)
+{
+    g_assert_nonnull (cache);
+    pthread_mutex_lock (&cache->mutex);
+    if (g_hash_table_size (cache->table) > 0) {
+        ++cache->invalidations;
+        g_hash_table_remove_all (cache->table);
+    }
+    pthread_mutex_unlock (&cache->mutex);
+}
+guint
+pcr_cache_size (PcrCache *cache)
+{
+    guint size;
+
+    pthread_mutex_lock (&cache->mutex);
+    size = g_hash_table_size (cache->table);
+    pthread_mutex_unlock (&cache->mutex);
+    return size;
+}
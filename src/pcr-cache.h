@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PCR_CACHE_H
+#define PCR_CACHE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Upper bound on the number of distinct PCR selections cached. Clients
+ * tend to read the same few selections so this is rarely reached. When it
+ * is, the whole cache is dropped.
+ */
+#define PCR_CACHE_MAX_ENTRIES 16
+
+typedef struct _PcrCacheClass {
+    GObjectClass      parent;
+} PcrCacheClass;
+
+typedef struct _PcrCache {
+    GObject           parent_instance;
+    pthread_mutex_t   mutex;
+    guint             max_age;
+    GHashTable       *table;
+    guint64           hits;
+    guint64           misses;
+    guint64           invalidations;
+} PcrCache;
+
+#define TYPE_PCR_CACHE              (pcr_cache_get_type   ())
+#define PCR_CACHE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_PCR_CACHE, PcrCache))
+#define PCR_CACHE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_PCR_CACHE, PcrCacheClass))
+#define IS_PCR_CACHE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_PCR_CACHE))
+#define IS_PCR_CACHE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_PCR_CACHE))
+#define PCR_CACHE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_PCR_CACHE, PcrCacheClass))
+
+GType          pcr_cache_get_type        (void);
+PcrCache*      pcr_cache_new             (guint           max_age);
+GBytes*        pcr_cache_lookup          (PcrCache       *cache,
+                                          GBytes         *selection);
+void           pcr_cache_insert          (PcrCache       *cache,
+                                          GBytes         *selection,
+                                          const uint8_t  *response,
+                                          size_t          response_size);
+void           pcr_cache_invalidate      (PcrCache       *cache);
+guint          pcr_cache_size            (PcrCache       *cache);
+
+G_END_DECLS
+#endif /* PCR_CACHE_H */
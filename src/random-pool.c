@@ -0,0 +1,214 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include "random-pool.h"
+#include "util.h"
+
+G_DEFINE_TYPE (RandomPool, random_pool, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_SIZE,
+    PROP_LOW_WATERMARK,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+
+static void
+random_pool_get_property (GObject     *object,
+                          guint        property_id,
+                          GValue      *value,
+                          GParamSpec  *pspec)
+{
+    RandomPool *self = RANDOM_POOL (object);
+
+    switch (property_id) {
+    case PROP_SIZE:
+        g_value_set_uint (value, self->size);
+        break;
+    case PROP_LOW_WATERMARK:
+        g_value_set_uint (value, self->low_watermark);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+random_pool_set_property (GObject        *object,
+                          guint           property_id,
+                          GValue const   *value,
+                          GParamSpec     *pspec)
+{
+    RandomPool *self = RANDOM_POOL (object);
+
+    switch (property_id) {
+    case PROP_SIZE:
+        self->size = g_value_get_uint (value);
+        self->data = g_malloc0 (self->size);
+        g_debug ("%s: size: %u", __func__, self->size);
+        break;
+    case PROP_LOW_WATERMARK:
+        self->low_watermark = g_value_get_uint (value);
+        g_debug ("%s: low-watermark: %u", __func__, self->low_watermark);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+random_pool_init (RandomPool *pool)
+{
+    pthread_mutex_init (&pool->mutex, NULL);
+    /* start out empty: the first idle period fills the pool */
+    pool->refilling = TRUE;
+}
+static void
+random_pool_finalize (GObject *object)
+{
+    RandomPool *pool = RANDOM_POOL (object);
+
+    g_debug ("%s: served %" PRIu64 " requests with %" PRIu64 " TPM calls",
+             __func__, pool->stats.served, pool->stats.refills);
+    if (pool->data != NULL) {
+        memset (pool->data, 0, pool->size);
+        g_clear_pointer (&pool->data, g_free);
+    }
+    pthread_mutex_destroy (&pool->mutex);
+    G_OBJECT_CLASS (random_pool_parent_class)->finalize (object);
+}
+static void
+random_pool_class_init (RandomPoolClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (random_pool_parent_class == NULL)
+        random_pool_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = random_pool_finalize;
+    object_class->get_property = random_pool_get_property;
+    object_class->set_property = random_pool_set_property;
+
+    obj_properties [PROP_SIZE] =
+        g_param_spec_uint ("size",
+                           "size",
+                           "Capacity of the pool in bytes",
+                           1,
+                           RANDOM_POOL_SIZE_MAX,
+                           1024,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_LOW_WATERMARK] =
+        g_param_spec_uint ("low-watermark",
+                           "low watermark",
+                           "Refill the pool once it holds fewer bytes",
+                           0,
+                           RANDOM_POOL_SIZE_MAX,
+                           256,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+/*
+ * The pool starts empty. Once filled it's drawn down until it holds fewer
+ * than 'low_watermark' bytes and is then refilled all the way to 'size'.
+ */
+RandomPool*
+random_pool_new (guint size,
+                 guint low_watermark)
+{
+    return RANDOM_POOL (g_object_new (TYPE_RANDOM_POOL,
+                                      "size", size,
+                                      "low-watermark", MIN (low_watermark,
+                                                            size),
+                                      NULL));
+}
+/*
+ * Copy 'size' bytes out of the pool into 'buf'. The bytes are removed from
+ * the pool and wiped so they're never handed out twice. Returns FALSE,
+ * leaving the pool untouched, when it holds fewer than 'size' bytes.
+ */
+gboolean
+random_pool_take (RandomPool *pool,
+                  uint8_t    *buf,
+                  size_t      size)
+{
+    g_assert_nonnull (pool);
+    g_assert_nonnull (buf);
+    pthread_mutex_lock (&pool->mutex);
+    if (size > pool->level) {
+        pthread_mutex_unlock (&pool->mutex);
+        return FALSE;
+    }
+    pool->level -= size;
+    memcpy (buf, &pool->data [pool->level], size);
+    memset (&pool->data [pool->level], 0, size);
+    if (pool->level < pool->low_watermark) {
+        pool->refilling = TRUE;
+    }
+    ++pool->stats.served;
+    pool->stats.served_bytes += size;
+    pthread_mutex_unlock (&pool->mutex);
+    return TRUE;
+}
+/*
+ * Add bytes from the TPM to the pool. Each call is counted as one TPM call
+ * in the statistics. Returns the number of bytes consumed.
+ */
+size_t
+random_pool_add (RandomPool    *pool,
+                 const uint8_t *buf,
+                 size_t         size)
+{
+    g_assert_nonnull (pool);
+    g_assert_nonnull (buf);
+    pthread_mutex_lock (&pool->mutex);
+    size = MIN (size, pool->size - pool->level);
+    memcpy (&pool->data [pool->level], buf, size);
+    pool->level += size;
+    if (pool->level == pool->size) {
+        pool->refilling = FALSE;
+    }
+    ++pool->stats.refills;
+    pool->stats.refill_bytes += size;
+    pthread_mutex_unlock (&pool->mutex);
+    return size;
+}
+/*
+ * Returns the number of bytes the pool wants from the TPM: 0 unless the
+ * pool has dropped below the low watermark and hasn't yet been refilled.
+ */
+size_t
+random_pool_refill_size (RandomPool *pool)
+{
+    size_t size = 0;
+
+    g_assert_nonnull (pool);
+    pthread_mutex_lock (&pool->mutex);
+    if (pool->refilling) {
+        size = pool->size - pool->level;
+    }
+    pthread_mutex_unlock (&pool->mutex);
+    return size;
+}
+guint
+random_pool_level (RandomPool *pool)
+{
+    guint level;
+
+    pthread_mutex_lock (&pool->mutex);
+    level = pool->level;
+    pthread_mutex_unlock (&pool->mutex);
+    return level;
+}
+void
+random_pool_get_stats (RandomPool          *pool,
+                       random_pool_stats_t *stats)
+{
+    g_assert_nonnull (pool);
+    g_assert_nonnull (stats);
+    pthread_mutex_lock (&pool->mutex);
+    *stats = pool->stats;
+    pthread_mutex_unlock (&pool->mutex);
+}
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef RANDOM_POOL_H
+#define RANDOM_POOL_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+#define RANDOM_POOL_SIZE_MAX (64 * 1024)
+
+typedef struct {
+    guint64           served;
+    guint64           served_bytes;
+    guint64           refills;
+    guint64           refill_bytes;
+} random_pool_stats_t;
+
+typedef struct _RandomPoolClass {
+    GObjectClass      parent;
+} RandomPoolClass;
+
+typedef struct _RandomPool {
+    GObject           parent_instance;
+    pthread_mutex_t   mutex;
+    guint             size;
+    guint             low_watermark;
+    uint8_t          *data;
+    guint             level;
+    gboolean          refilling;
+    random_pool_stats_t stats;
+} RandomPool;
+
+#define TYPE_RANDOM_POOL              (random_pool_get_type   ())
+#define RANDOM_POOL(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_RANDOM_POOL, RandomPool))
+#define RANDOM_POOL_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_RANDOM_POOL, RandomPoolClass))
+#define IS_RANDOM_POOL(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_RANDOM_POOL))
+#define IS_RANDOM_POOL_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_RANDOM_POOL))
+#define RANDOM_POOL_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_RANDOM_POOL, RandomPoolClass))
+
+GType          random_pool_get_type        (void);
+RandomPool*    random_pool_new             (guint           size,
+                                            guint           low_watermark);
+gboolean       random_pool_take            (RandomPool     *pool,
+                                            uint8_t        *buf,
+                                            size_t          size);
+size_t         random_pool_add             (RandomPool     *pool,
+                                            const uint8_t  *buf,
+                                            size_t          size);
+size_t         random_pool_refill_size     (RandomPool     *pool);
+guint          random_pool_level           (RandomPool     *pool);
+void           random_pool_get_stats       (RandomPool     *pool,
+                                            random_pool_stats_t *stats);
+
+G_END_DECLS
+#endif /* RANDOM_POOL_H */
@@ -125,6 +125,10 @@ save_session (ResourceManager *resmgr,
                                &tpm2_response_get_buffer (resp)[TPM_HEADER_SIZE],
                                tpm2_response_get_size (resp) - TPM_HEADER_SIZE);
     session_entry_set_state (entry, SESSION_ENTRY_SAVED_RM);
+    /* every session save advances the TPM contextCounter */
+    resmgr->context_counter = MAX (resmgr->context_counter,
+                                   session_entry_get_sequence (entry));
+    session_entry_stash_context (entry);
 out:
     g_clear_object (&cmd);
     return resp;
@@ -11,6 +11,7 @@
 
 #include <tss2/tss2_mu.h>
 
+#include "admission-control.h"
 #include "connection.h"
 #include "connection-manager.h"
 #include "control-message.h"
@@ -27,9 +28,12 @@
 #include "util.h"
 
 #define MAX_ABANDONED 4
+/* number of queued commands prepared while the TPM is busy */
+#define RESOURCE_MANAGER_PREPARE_MAX 8
 
 static void resource_manager_sink_interface_init   (gpointer g_iface);
 static void resource_manager_source_interface_init (gpointer g_iface);
+static void resource_manager_schedule_retry        (ResourceManager *resmgr);
 
 G_DEFINE_TYPE_WITH_CODE (
     ResourceManager,
@@ -48,13 +52,23 @@ enum {
     PROP_SINK,
     PROP_ACCESS_BROKER,
     PROP_SESSION_LIST,
+    PROP_CONTEXT_STORE,
+    PROP_PRIMARY_CACHE,
+    PROP_LOAD_CACHE,
+    PROP_NV_PUBLIC_CACHE,
+    PROP_PCR_CACHE,
+    PROP_RANDOM_POOL,
+    PROP_COALESCE_CODES,
+    PROP_RETRY_POLICY,
+    PROP_SELF_TEST,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
 /*
  * This is a helper function that does everything required to convert
  * a virtual handle to a physical one in a Tpm2Command object.
- * - load the context from the provided HandleMapEntry
+ * - load the context from the provided HandleMapEntry (the entry reads it
+ *   back from the ContextStore if it was spilled)
  * - store the newly assigned TPM handle (physical handle) in the entry
  * - set this handle in the comamnd at the position indicated by
  *   'handle_number' (0-based index)
@@ -70,6 +84,11 @@ resource_manager_virt_to_phys (ResourceManager *resmgr,
     TSS2_RC       rc = TSS2_RC_SUCCESS;
 
     context = handle_map_entry_get_context (entry);
+    if (context == NULL) {
+        g_warning ("%s: no context for vhandle 0x%" PRIx32, __func__,
+                   handle_map_entry_get_vhandle (entry));
+        return RM_RC (TSS2_BASE_RC_GENERAL_FAILURE);
+    }
     rc = access_broker_context_load (resmgr->access_broker, context, &phandle);
     g_debug ("phandle: 0x%" PRIx32, phandle);
     if (rc == TSS2_RC_SUCCESS) {
@@ -142,14 +161,81 @@ regap_session_callback (gpointer data_entry,
                     " SessionEntry", __func__);
     }
 }
+/*
+ * This structure is used by the find_lru_session_callback to return the
+ * loaded SessionEntry used least recently by a connection other than
+ * 'exclude'.
+ */
+typedef struct {
+    Connection *exclude;
+    SessionEntry *entry;
+} lru_session_data_t;
+static void
+find_lru_session_callback (gpointer data_entry,
+                           gpointer data_user)
+{
+    lru_session_data_t *data = (lru_session_data_t*)data_user;
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+    Connection *connection;
+
+    if (session_entry_get_state (entry) != SESSION_ENTRY_LOADED) {
+        return;
+    }
+    connection = session_entry_get_connection (entry);
+    if (connection != data->exclude &&
+        (data->entry == NULL ||
+         session_entry_get_last_used (entry) <
+         session_entry_get_last_used (data->entry)))
+    {
+        data->entry = entry;
+    }
+    g_clear_object (&connection);
+}
+/*
+ * Free a loaded session slot in the TPM by saving the least recently used
+ * session loaded for a connection other than 'exclude'. The sessions of
+ * the connection whose command needs the slot may already be loaded for
+ * that command so they're left alone. The saved session is loaded again
+ * the next time its owner uses it. Returns TRUE if a session was saved.
+ */
+gboolean
+resource_manager_evict_session (ResourceManager *resmgr,
+                                Connection      *exclude)
+{
+    lru_session_data_t data = { .exclude = exclude, .entry = NULL };
+    Tpm2Response *response;
+    TSS2_RC rc;
+
+    session_list_foreach (resmgr->session_list,
+                          find_lru_session_callback,
+                          &data);
+    if (data.entry == NULL) {
+        g_debug ("%s: no loaded session to evict", __func__);
+        return FALSE;
+    }
+    g_debug ("%s: saving session 0x%08" PRIx32 " to free a session slot",
+             __func__, session_entry_get_handle (data.entry));
+    response = save_session (resmgr, data.entry);
+    rc = tpm2_response_get_code (response);
+    g_object_unref (response);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to save session 0x%08" PRIx32 ": 0x%" PRIx32,
+                   __func__, session_entry_get_handle (data.entry), rc);
+        return FALSE;
+    }
+    ++resmgr->sessions_evicted;
+    return TRUE;
+}
 /*
  * This function is a handler for response codes that we may get from the
  * TPM in response to commands. It may result in addtional commands being
- * sent to the TPM so use it with caution.
+ * sent to the TPM so use it with caution. The 'connection' is the owner of
+ * the command that got the RC, it may be NULL.
  */
 gboolean
 handle_rc (ResourceManager *resmgr,
-           TSS2_RC rc)
+           TSS2_RC          rc,
+           Connection      *connection)
 {
     regap_session_data_t data = {
         .resmgr = resmgr,
@@ -161,11 +247,16 @@ handle_rc (ResourceManager *resmgr,
     switch (rc) {
     case TPM2_RC_CONTEXT_GAP:
         g_debug ("%s: handling TPM2_RC_CONTEXT_GAP", __func__);
+        ++resmgr->context_gaps;
         session_list_foreach (resmgr->session_list,
                               regap_session_callback,
                               &data);
         ret = data.ret;
         break;
+    case TPM2_RC_SESSION_MEMORY:
+        g_debug ("%s: handling TPM2_RC_SESSION_MEMORY", __func__);
+        ret = resource_manager_evict_session (resmgr, connection);
+        break;
     default:
         g_debug ("%s: Unable to recover gracefully from RC 0x%" PRIx32,
                  __func__, rc);
@@ -222,7 +313,7 @@ resource_manager_load_session_from_handle (ResourceManager *resmgr,
     response = load_session (resmgr, session_entry);
     rc = tpm2_response_get_code (response);
     if (rc != TSS2_RC_SUCCESS) {
-        if (handle_rc (resmgr, rc) != TRUE) {
+        if (handle_rc (resmgr, rc, command_conn) != TRUE) {
             g_warning ("Failed to load context for session with handle "
                        "0x%08" PRIx32 " RC: 0x%" PRIx32, handle, rc);
             flush_session (resmgr, session_entry);
@@ -332,6 +423,9 @@ resource_manager_load_handles (ResourceManager *resmgr,
         default:
             break;
         }
+        if (rc != TSS2_RC_SUCCESS) {
+            break;
+        }
     }
     g_debug ("%s: end", __func__);
     g_clear_object (&connection);
@@ -350,7 +444,7 @@ resource_manager_flushsave_context (gpointer data_entry,
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (data_resmgr);
     HandleMapEntry  *entry  = HANDLE_MAP_ENTRY (data_entry);
-    TPMS_CONTEXT   *context;
+    TPMS_CONTEXT    context;
     TPM2_HANDLE      phandle;
     TSS2_RC         rc = TSS2_RC_SUCCESS;
 
@@ -362,12 +456,13 @@ resource_manager_flushsave_context (gpointer data_entry,
     switch (phandle >> TPM2_HR_SHIFT) {
     case TPM2_HT_TRANSIENT:
         g_debug ("%s: handle is transient, saving context", __func__);
-        context = handle_map_entry_get_context (entry);
         rc = access_broker_context_saveflush (resmgr->access_broker,
                                               phandle,
-                                              context);
+                                              &context);
         if (rc == TSS2_RC_SUCCESS) {
+            handle_map_entry_set_context (entry, &context);
             handle_map_entry_set_phandle (entry, 0);
+            handle_map_entry_stash_context (entry);
         } else {
             g_warning ("%s: access_broker_context_saveflush failed for "
                        "handle: 0x%" PRIx32 " rc: 0x%" PRIx32,
@@ -399,7 +494,7 @@ save_session_callback (gpointer data_entry,
     resp = save_session (resmgr, entry);
     rc = tpm2_response_get_code (resp);
     if (rc != TSS2_RC_SUCCESS) {
-        if (handle_rc (resmgr, rc) != TRUE) {
+        if (handle_rc (resmgr, rc, NULL) != TRUE) {
             g_warning ("%s: Failed to save SessionEntry",
                        __func__);
             flush_session (resmgr, entry);
@@ -1079,219 +1174,1658 @@ get_cap_gen_response (ResourceManager *resmgr,
     return response;
 }
 /*
- * If the provided command is something that the ResourceManager "virtualizes"
- * then this function will do so and return a Tpm2Response object that will be
- * returned to the same connection. If the command isn't something that we
- * virtualize then we just return NULL.
- *
- * NOTE: Both the ContextSave and ContextLoad commands, when sent by clients,
- * do not result in the command being executed by the TPM. This makes
- * handling the context gap unnecessary for these commands.
+ * This callback is used to check that every authorization in a command is
+ * a password authorization. The 'count' is the number of authorizations
+ * seen and is set to -1 if any of them aren't.
  */
-Tpm2Response*
-command_special_processing (ResourceManager *resmgr,
-                            Tpm2Command     *command)
+typedef struct {
+    Tpm2Command *command;
+    gint         count;
+} password_auth_data_t;
+static void
+password_auth_callback (gpointer auth_offset_ptr,
+                        gpointer user_data)
 {
-    Tpm2Response *response   = NULL;
+    password_auth_data_t *data = (password_auth_data_t*)user_data;
+    size_t auth_offset = *(size_t*)auth_offset_ptr;
 
-    switch (tpm2_command_get_code (command)) {
-    case TPM2_CC_FlushContext:
-        g_debug ("processing TPM2_CC_FlushContext");
-        response = resource_manager_flush_context (resmgr, command);
-        break;
-    case TPM2_CC_ContextSave:
-        g_debug ("processing TPM2_CC_ContextSave");
-        response = resource_manager_save_context (resmgr, command);
-        break;
-    case TPM2_CC_ContextLoad:
-        g_debug ("%s: processing TPM2_CC_ContextLoad", __func__);
-        response = resource_manager_load_context (resmgr, command);
-        break;
-    case TPM2_CC_GetCapability:
-        g_debug ("processing TPM2_CC_GetCapability");
-        response = get_cap_gen_response (resmgr, command);
-        break;
-    default:
-        break;
+    if (data->count < 0) {
+        return;
+    }
+    if (tpm2_command_get_auth_handle (data->command, auth_offset) == TPM2_RS_PW) {
+        ++data->count;
+    } else {
+        data->count = -1;
     }
+}
+/*
+ * Object caches only accept commands with a single password authorization.
+ * The password is part of the cache key so a hit is only possible when the
+ * caller presents the same password the TPM accepted when the entry was
+ * created. We can't check an HMAC or policy session without the TPM.
+ */
+static gboolean
+command_has_single_password_auth (Tpm2Command *command)
+{
+    password_auth_data_t auth_data = {
+        .command = command,
+        .count = 0,
+    };
 
-    return response;
+    if (!tpm2_command_has_auths (command) ||
+        !tpm2_command_foreach_auth (command,
+                                    password_auth_callback,
+                                    &auth_data))
+    {
+        return FALSE;
+    }
+    return auth_data.count == 1;
 }
 /*
- * This function creates a mapping from the transient physical to a virtual
- * handle in the provided response object. This mapping is then added to
- * the transient HandleMap for the associated connection, as well as the
- * list of currently loaded transient objects.
+ * Build the key used to look up a CreatePrimary command in the primary
+ * cache. The key is everything after the command header: the hierarchy
+ * handle, the authorization area and the parameters (inSensitive, inPublic,
+ * outsideInfo and creationPCR). NULL is returned for commands we won't
+ * cache:
+ * - the cache is disabled
+ * - anything but a single password authorization
+ * - the NULL hierarchy: its seed changes on every TPM Reset
+ * - a non-empty creationPCR selection: the creationData reflects the
+ *   current PCR values
  */
-void
-create_context_mapping_transient (ResourceManager  *resmgr,
-                                  Tpm2Response     *response,
-                                  GSList          **loaded_transient_slist)
+GBytes*
+create_primary_cache_key (ResourceManager *resmgr,
+                          Tpm2Command     *command)
 {
-    HandleMap      *handle_map;
-    HandleMapEntry *handle_entry;
-    TPM2_HANDLE      phandle, vhandle;
-    Connection     *connection;
-    UNUSED_PARAM(resmgr);
+    TPM2B_SENSITIVE_CREATE in_sensitive = { .size = 0 };
+    TPM2B_PUBLIC in_public = { .size = 0 };
+    TPM2B_DATA outside_info = { .size = 0 };
+    TPML_PCR_SELECTION creation_pcr = { .count = 0 };
+    uint8_t *buf = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t offset;
+    TSS2_RC rc;
 
-    g_debug ("create_context_mapping_transient");
-    phandle = tpm2_response_get_handle (response);
-    g_debug ("  physical handle: 0x%08" PRIx32, phandle);
-    connection = tpm2_response_get_connection (response);
-    handle_map = connection_get_trans_map (connection);
-    g_object_unref (connection);
-    vhandle = handle_map_next_vhandle (handle_map);
-    if (vhandle == 0) {
-        g_error ("vhandle rolled over!");
+    if (resmgr->primary_cache == NULL ||
+        tpm2_command_get_code (command) != TPM2_CC_CreatePrimary)
+    {
+        return NULL;
     }
-    g_debug ("  vhandle:0x%08" PRIx32, vhandle);
-    handle_entry = handle_map_entry_new (phandle, vhandle);
-    if (handle_entry == NULL) {
-        g_warning ("failed to create new HandleMapEntry for handle 0x%"
-                   PRIx32, phandle);
+    switch (tpm2_command_get_handle (command, 0)) {
+    case TPM2_RH_OWNER:
+    case TPM2_RH_ENDORSEMENT:
+    case TPM2_RH_PLATFORM:
+        break;
+    default:
+        return NULL;
     }
-    *loaded_transient_slist = g_slist_prepend (*loaded_transient_slist,
-                                               handle_entry);
-    handle_map_insert (handle_map, vhandle, handle_entry);
-    g_object_unref (handle_map);
-    tpm2_response_set_handle (response, vhandle);
-    g_object_ref (handle_entry);
-    *loaded_transient_slist = g_slist_prepend (*loaded_transient_slist,
-                                                   handle_entry);
+    if (!command_has_single_password_auth (command)) {
+        g_debug ("%s: not caching CreatePrimary without a single password "
+                 "authorization", __func__);
+        return NULL;
+    }
+    offset = tpm2_command_get_params_offset (command);
+    rc = Tss2_MU_TPM2B_SENSITIVE_CREATE_Unmarshal (buf, size, &offset,
+                                                   &in_sensitive);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal (buf, size, &offset, &in_public);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = Tss2_MU_TPM2B_DATA_Unmarshal (buf, size, &offset, &outside_info);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = Tss2_MU_TPML_PCR_SELECTION_Unmarshal (buf, size, &offset,
+                                                   &creation_pcr);
+    if (rc != TSS2_RC_SUCCESS || offset != size) {
+        g_debug ("%s: failed to parse CreatePrimary parameters", __func__);
+        return NULL;
+    }
+    if (creation_pcr.count != 0) {
+        g_debug ("%s: not caching CreatePrimary with creationPCR", __func__);
+        return NULL;
+    }
+    return g_bytes_new (&buf [TPM_HEADER_SIZE], size - TPM_HEADER_SIZE);
 }
 /*
- * This function after a Tpm2Command is sent to the TPM and:
- * - we receive a Tpm2Response object with a handle in the response buffers
- *   handle area
- * - the handle is a session handle
- * Since there's a handle in the response handle area the caller is being
- * returned a new handle after a context was successfully created or loaded.
- * So we know that the response is to one of two possible commands:
- * - a session being loaded by a call to LoadContext
- * - a session was newly created by a call to StartAuthSession
- * We differentiate between these two situations as follows:
- * - A call to 'LoadContext' implies that the session already exists and so
- *   it must already be in the session_list.
- *   - If it's in the session_list *AND NOT* in the abandoned_session_queue
- *     then the caller is just loading a context they already own and so we
- *     set the session state to SAVED_RM and add the session to the list of
- *     loaded sessions.
- *   - If it's *NOT* in the session_list *AND* in the abandoned_session_queue
- *     then the caller is loading a context saved by a different connection
- *     and so we make the current connection the owner of the session, set
- *     the session state to SAVED_RM and add the session to the list of loaded
- *     sessions.
- * - A call to 'StartAuthSession' will return a handle for a session object
- *   that is not in either the session_list or the abandoned_session_queue.
- *   In this case we just create a new SessionEntry and add it to the
- *   session_list and the list of loaded sessions.
- * NOTE: If the response doesn't indicate 'success' then we just ignore it
- * since there's nothing useful that we can do.
+ * Build the key used to look up a Load command in the load cache. The key
+ * is the parent handle, the authorization area and the parameters (inPrivate
+ * and inPublic). Only persistent parents are accepted: a virtual handle
+ * for a transient parent means something different on every connection,
+ * while a persistent handle names the same object until it's evicted.
  */
-void
-create_context_mapping_session (ResourceManager *resmgr,
-                                Tpm2Response    *response,
-                                TPM2_HANDLE      handle)
+GBytes*
+create_load_cache_key (ResourceManager *resmgr,
+                       Tpm2Command     *command)
 {
-    SessionEntry *entry = NULL;
-    Connection   *conn_resp = NULL, *conn_entry = NULL;
+    TPM2B_PRIVATE in_private = { .size = 0 };
+    TPM2B_PUBLIC in_public = { .size = 0 };
+    uint8_t *buf = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t offset;
+    TSS2_RC rc;
 
-    entry = session_list_lookup_handle (resmgr->session_list, handle);
-    conn_resp = tpm2_response_get_connection (response);
-    if (entry != NULL) {
-        g_debug ("%s: got SessionEntry that's in the SessionList", __func__);
-        conn_entry = session_entry_get_connection (entry);
-        if (conn_resp != conn_entry) {
-            g_warning ("%s: connections do not match!", __func__);
-        }
-    } else {
-        g_debug ("%s: handle is a session, creating entry for SessionList "
-                 "and SessionList", __func__);
-        entry = session_entry_new (conn_resp, handle);
-        session_entry_set_state (entry, SESSION_ENTRY_LOADED);
-        session_list_insert (resmgr->session_list, entry);
+    if (resmgr->load_cache == NULL ||
+        tpm2_command_get_code (command) != TPM2_CC_Load)
+    {
+        return NULL;
     }
-    g_clear_object (&conn_resp);
-    g_clear_object (&conn_entry);
-    g_clear_object (&entry);
+    if (tpm2_command_get_handle (command, 0) >> TPM2_HR_SHIFT !=
+        TPM2_HT_PERSISTENT)
+    {
+        g_debug ("%s: not caching Load under non-persistent parent",
+                 __func__);
+        return NULL;
+    }
+    if (!command_has_single_password_auth (command)) {
+        g_debug ("%s: not caching Load without a single password "
+                 "authorization", __func__);
+        return NULL;
+    }
+    offset = tpm2_command_get_params_offset (command);
+    rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal (buf, size, &offset, &in_private);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal (buf, size, &offset, &in_public);
+    if (rc != TSS2_RC_SUCCESS || offset != size) {
+        g_debug ("%s: failed to parse Load parameters", __func__);
+        return NULL;
+    }
+    return g_bytes_new (&buf [TPM_HEADER_SIZE], size - TPM_HEADER_SIZE);
 }
 /*
- * Each Tpm2Response object can have at most one handle in it.
- * This function assumes that the handle in the parameter Tpm2Response
- * object is the handle assigned by the TPM. Depending on the type of the
- * handle we do to possible things:
- * For TPM2_HT_TRANSIENT handles we create a new virtual handle and
- * allocates a new HandleMapEntry to map the virtual handle to a
- * TPMS_CONTEXT structure when processing future commands associated
- * with the same connection. This HandleMapEntry is inserted into the
- * handle map for the connection. It is also added to the list of loaded
- * transient objects so that it can be saved / flushed by the typical code
- * path.
- * For TPM2_HT_HMAC_SESSION or TPM2_HT_POLICY_SESSION handles we create a
- * new session_entry_t object, populate the connection field with the
- * connection associated with the response object, and set the savedHandle
- * field. We then add this entry to the list of sessions we're tracking
- * (session_slist) and the list of loaded sessions (loaded_session_slist).
+ * Do the work for a command that depends only on the command buffer as
+ * the client sent it: parsing and building the ObjectCache key. This is
+ * done at most once per command, either while the command is still queued
+ * and the TPM is busy, or when the command is processed.
  */
-void
-resource_manager_create_context_mapping (ResourceManager  *resmgr,
-                                         Tpm2Response     *response,
-                                         GSList          **loaded_transient_slist)
+static void
+resource_manager_prepare_command (ResourceManager *resmgr,
+                                  Tpm2Command     *command)
 {
-    TPM2_HANDLE       handle;
+    GBytes *key = NULL;
 
-    g_debug ("%s", __func__);
-    if (!tpm2_response_has_handle (response)) {
-        g_debug ("response has no handles");
+    if (tpm2_command_is_prepared (command)) {
         return;
     }
-    handle = tpm2_response_get_handle (response);
-    switch (handle >> TPM2_HR_SHIFT) {
-    case TPM2_HT_TRANSIENT:
-        create_context_mapping_transient (resmgr, response, loaded_transient_slist);
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_CreatePrimary:
+        key = create_primary_cache_key (resmgr, command);
         break;
-    case TPM2_HT_HMAC_SESSION:
-    case TPM2_HT_POLICY_SESSION:
-        create_context_mapping_session (resmgr, response, handle);
+    case TPM2_CC_Load:
+        key = create_load_cache_key (resmgr, command);
         break;
     default:
-        g_debug ("  not creating context for handle: 0x%08" PRIx32, handle);
         break;
     }
+    tpm2_command_set_prepared (command, key);
+    if (key != NULL) {
+        g_bytes_unref (key);
+    }
 }
-Tpm2Response*
-send_command_handle_rc (ResourceManager *resmgr,
-                        Tpm2Command *cmd)
+/*
+ * AccessBrokerBusyFunc: called once while the TPM executes a command,
+ * with the AccessBroker lock held. The only work done is building the
+ * ObjectCache key for CreatePrimary and Load commands at the head of the
+ * input queue. Handle resolution and quota checks depend on state the
+ * command in flight can change, so they aren't done here. Responses
+ * aren't held back by the RM, so there are none to flush.
+ */
+static void
+resource_manager_tpm_busy (gpointer user_data)
 {
-    regap_session_data_t data = {
-        .resmgr = resmgr,
-        .ret = TRUE,
-    };
-    Tpm2Response *resp = NULL;
-    TSS2_RC rc;
-
-    /* Send command and create response object. */
-    resp = access_broker_send_command (resmgr->access_broker, cmd, &rc);
-    rc = tpm2_response_get_code (resp);
-    if (rc == TPM2_RC_CONTEXT_GAP) {
-        g_debug ("%s: handling TPM2_RC_CONTEXT_GAP", __func__);
-        session_list_foreach (resmgr->session_list,
-                              regap_session_callback,
-                              &data);
-        g_clear_object (&resp);
-        resp = access_broker_send_command (resmgr->access_broker, cmd, &rc);
+    ResourceManager *resmgr = RESOURCE_MANAGER (user_data);
+    GList *queued, *item;
+
+    queued = message_queue_peek (resmgr->in_queue,
+                                 RESOURCE_MANAGER_PREPARE_MAX);
+    for (item = queued; item != NULL; item = item->next) {
+        if (IS_TPM2_COMMAND (item->data) &&
+            !tpm2_command_is_prepared (TPM2_COMMAND (item->data)))
+        {
+            resource_manager_prepare_command (resmgr,
+                                              TPM2_COMMAND (item->data));
+            ++resmgr->prepared_while_busy;
+        }
     }
-    return resp;
+    g_list_free_full (queued, g_object_unref);
 }
-/**
- * This function is invoked in response to the receipt of a Tpm2Command.
- * This is the place where we send the command buffer out to the TPM
- * through the AccessBroker which will eventually get it to the TPM for us.
- * The AccessBroker will send us back a Tpm2Response that we send back to
- * the client by way of our Sink object. The flow is roughly:
- * - Receive the Tpm2Command as a parameter
- * - Load all virtualized objects required by the command.
- * - Send the Tpm2Command out through the AccessBroker.
+/*
+ * Without an ObjectCache resource_manager_tpm_busy has nothing to do but
+ * would still walk the in_queue for every command, so it's only installed
+ * while one of the caches is set.
+ */
+static void
+resource_manager_update_busy_func (ResourceManager *resmgr)
+{
+    if (resmgr->access_broker == NULL) {
+        return;
+    }
+    if (resmgr->primary_cache != NULL || resmgr->load_cache != NULL) {
+        access_broker_set_busy_func (resmgr->access_broker,
+                                     resource_manager_tpm_busy,
+                                     resmgr);
+    } else {
+        access_broker_set_busy_func (resmgr->access_broker, NULL, NULL);
+    }
+}
+/*
+ * Find the ObjectCache responsible for the command and get its key.
+ * Returns NULL if the command isn't cacheable.
+ */
+static ObjectCache*
+object_cache_for_command (ResourceManager *resmgr,
+                          Tpm2Command     *command,
+                          GBytes         **key)
+{
+    resource_manager_prepare_command (resmgr, command);
+    *key = tpm2_command_get_object_key (command);
+    if (*key == NULL) {
+        return NULL;
+    }
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_CreatePrimary:
+        return resmgr->primary_cache;
+    case TPM2_CC_Load:
+        return resmgr->load_cache;
+    default:
+        g_clear_pointer (key, g_bytes_unref);
+        return NULL;
+    }
+}
+/*
+ * Answer an object creating command (CreatePrimary or Load) from its cache.
+ * On a hit we map a new virtual handle to a copy of the cached context and
+ * return a copy of the cached response with the new virtual handle. The
+ * TPM isn't involved until the object is used. Returns NULL on a miss.
+ */
+static Tpm2Response*
+resource_manager_object_cache_respond (ResourceManager *resmgr,
+                                       Tpm2Command     *command)
+{
+    Connection *connection = NULL;
+    HandleMap *map = NULL;
+    HandleMapEntry *entry = NULL;
+    Tpm2Response *response = NULL;
+    ObjectCache *cache;
+    GBytes *key = NULL, *cached = NULL;
+    TPMS_CONTEXT context;
+    TPM2_HANDLE vhandle;
+    uint8_t *buf;
+    gsize size;
+
+    cache = object_cache_for_command (resmgr, command, &key);
+    if (cache == NULL) {
+        return NULL;
+    }
+    if (!object_cache_lookup (cache, key, &cached, &context)) {
+        g_debug ("%s: miss", __func__);
+        goto out;
+    }
+    connection = tpm2_command_get_connection (command);
+    map = connection_get_trans_map (connection);
+    vhandle = handle_map_next_vhandle (map);
+    if (vhandle == 0) {
+        g_error ("vhandle rolled over!");
+    }
+    g_debug ("%s: hit, mapping cached context to vhandle 0x%08" PRIx32,
+             __func__, vhandle);
+    entry = handle_map_entry_new (0, vhandle);
+    if (resmgr->context_store != NULL) {
+        handle_map_entry_set_context_store (entry, resmgr->context_store);
+    }
+    handle_map_entry_set_context (entry, &context);
+    handle_map_entry_stash_context (entry);
+    handle_map_insert (map, vhandle, entry);
+    buf = g_bytes_unref_to_data (cached, &size);
+    cached = NULL;
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    tpm2_response_set_handle (response, vhandle);
+out:
+    g_clear_object (&entry);
+    g_clear_object (&map);
+    g_clear_object (&connection);
+    g_clear_pointer (&cached, g_bytes_unref);
+    g_bytes_unref (key);
+    return response;
+}
+/*
+ * Store the result of a successful CreatePrimary or Load in its cache,
+ * tagged with the hierarchy or parent handle. This must be called after the
+ * new object has been saved and flushed so that the HandleMapEntry holds a
+ * valid context.
+ */
+static void
+resource_manager_object_cache_store (ObjectCache  *cache,
+                                     GBytes       *key,
+                                     Tpm2Command  *command,
+                                     Tpm2Response *response)
+{
+    Connection *connection;
+    HandleMap *map;
+    HandleMapEntry *entry;
+    TPMS_CONTEXT *context;
+
+    if (tpm2_response_get_code (response) != TSS2_RC_SUCCESS) {
+        return;
+    }
+    connection = tpm2_response_get_connection (response);
+    map = connection_get_trans_map (connection);
+    entry = handle_map_vlookup (map, tpm2_response_get_handle (response));
+    if (entry != NULL && handle_map_entry_get_phandle (entry) == 0) {
+        context = handle_map_entry_get_context (entry);
+        if (context != NULL) {
+            object_cache_insert (cache,
+                                 key,
+                                 tpm2_command_get_handle (command, 0),
+                                 tpm2_response_get_buffer (response),
+                                 tpm2_response_get_size (response),
+                                 context);
+        }
+        handle_map_entry_stash_context (entry);
+    }
+    g_clear_object (&entry);
+    g_object_unref (map);
+    g_object_unref (connection);
+}
+static void
+object_cache_log_stats (const gchar *name,
+                        ObjectCache *cache)
+{
+    object_cache_stats_t stats;
+
+    if (cache == NULL) {
+        return;
+    }
+    object_cache_get_stats (cache, &stats);
+    g_info ("%s: %u entries, %" PRIu64 " hits, %" PRIu64 " misses, %"
+            PRIu64 " evictions, %" PRIu64 " invalidations", name,
+            stats.size, stats.hits, stats.misses, stats.evictions,
+            stats.invalidations);
+}
+/*
+ * Each request served from the pool would otherwise have been a TPM call.
+ */
+static void
+random_pool_log_stats (RandomPool *pool)
+{
+    random_pool_stats_t stats;
+
+    if (pool == NULL) {
+        return;
+    }
+    random_pool_get_stats (pool, &stats);
+    g_info ("random pool: served %" PRIu64 " GetRandom requests (%" PRIu64
+            " bytes) with %" PRIu64 " TPM calls (%" PRIu64 " bytes), %"
+            PRId64 " TPM calls avoided", stats.served, stats.served_bytes,
+            stats.refills, stats.refill_bytes,
+            (gint64)stats.served - (gint64)stats.refills);
+}
+static void
+retry_policy_log_stats (RetryPolicy *policy)
+{
+    retry_policy_stats_t stats;
+
+    if (policy == NULL) {
+        return;
+    }
+    retry_policy_get_stats (policy, &stats);
+    g_info ("retry policy: %" PRIu64 " commands retried with %" PRIu64
+            " resubmissions, %" PRIu64 " ran out of budget", stats.retried,
+            stats.retries, stats.exhausted);
+}
+static void
+self_test_log_result (SelfTest *self_test)
+{
+    if (self_test == NULL) {
+        return;
+    }
+    g_info ("self test: %" PRIu64 " rounds, %" PRIu64 " algorithms tested, "
+            "last result: 0x%" PRIx32, self_test->rounds, self_test->tests,
+            self_test_get_result (self_test));
+}
+/*
+ * Commands that change a hierarchy seed or its authorization invalidate
+ * the primary objects we've cached for it. Objects loaded under a
+ * persistent parent are invalidated when the parent is evicted or the
+ * hierarchy it lives in goes away.
+ */
+static void
+resource_manager_invalidate_object_caches (ResourceManager *resmgr,
+                                           Tpm2Command     *command)
+{
+    TPM2_HANDLE handle;
+
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_ChangePPS:
+        g_debug ("%s: TPM2_CC_ChangePPS, flushing platform hierarchy",
+                 __func__);
+        if (resmgr->primary_cache != NULL)
+            object_cache_invalidate (resmgr->primary_cache, TPM2_RH_PLATFORM);
+        if (resmgr->load_cache != NULL)
+            object_cache_clear (resmgr->load_cache);
+        break;
+    case TPM2_CC_ChangeEPS:
+        g_debug ("%s: TPM2_CC_ChangeEPS, flushing endorsement hierarchy",
+                 __func__);
+        if (resmgr->primary_cache != NULL)
+            object_cache_invalidate (resmgr->primary_cache,
+                                     TPM2_RH_ENDORSEMENT);
+        if (resmgr->load_cache != NULL)
+            object_cache_clear (resmgr->load_cache);
+        break;
+    case TPM2_CC_HierarchyChangeAuth:
+        handle = tpm2_command_get_handle (command, 0);
+        g_debug ("%s: TPM2_CC_HierarchyChangeAuth, flushing hierarchy 0x%08"
+                 PRIx32, __func__, handle);
+        if (resmgr->primary_cache != NULL)
+            object_cache_invalidate (resmgr->primary_cache, handle);
+        break;
+    case TPM2_CC_EvictControl:
+        handle = tpm2_command_get_handle (command, 1);
+        g_debug ("%s: TPM2_CC_EvictControl, flushing objects loaded under "
+                 "0x%08" PRIx32, __func__, handle);
+        if (resmgr->load_cache != NULL)
+            object_cache_invalidate (resmgr->load_cache, handle);
+        break;
+    case TPM2_CC_Clear:
+    case TPM2_CC_HierarchyControl:
+        g_debug ("%s: flushing all cached objects", __func__);
+        if (resmgr->primary_cache != NULL)
+            object_cache_clear (resmgr->primary_cache);
+        if (resmgr->load_cache != NULL)
+            object_cache_clear (resmgr->load_cache);
+        break;
+    default:
+        return;
+    }
+    object_cache_log_stats ("primary cache", resmgr->primary_cache);
+    object_cache_log_stats ("load cache", resmgr->load_cache);
+}
+/*
+ * Find the HandleMapEntry for the object named in a TPM2_ReadPublic command
+ * if the response can be cached. Only commands without sessions are
+ * considered: an audit or encrypt session makes every response unique.
+ * Persistent objects aren't virtualized and are left alone. The caller
+ * must drop the reference to the returned entry.
+ */
+static HandleMapEntry*
+read_public_get_entry (Tpm2Command *command)
+{
+    Connection *connection;
+    HandleMap *map;
+    HandleMapEntry *entry;
+    TPM2_HANDLE handle;
+
+    if (tpm2_command_get_code (command) != TPM2_CC_ReadPublic ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS)
+    {
+        return NULL;
+    }
+    handle = tpm2_command_get_handle (command, 0);
+    if (handle >> TPM2_HR_SHIFT != TPM2_HT_TRANSIENT) {
+        return NULL;
+    }
+    connection = tpm2_command_get_connection (command);
+    map = connection_get_trans_map (connection);
+    entry = handle_map_vlookup (map, handle);
+    g_object_unref (map);
+    g_object_unref (connection);
+    return entry;
+}
+/*
+ * Build a response from cached bytes. The buffer is copied so that the
+ * response can be sent (and freed) independently of the cache.
+ */
+static Tpm2Response*
+response_from_bytes (Tpm2Command *command,
+                     GBytes      *bytes)
+{
+    Connection *connection;
+    Tpm2Response *response;
+    uint8_t *buf;
+    gsize size;
+
+    buf = g_bytes_unref_to_data (bytes, &size);
+    connection = tpm2_command_get_connection (command);
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * Answer a TPM2_ReadPublic from the response cached in the HandleMapEntry
+ * by a previous ReadPublic for the same object.
+ */
+static Tpm2Response*
+resource_manager_read_public_cached (Tpm2Command *command)
+{
+    HandleMapEntry *entry;
+    GBytes *bytes;
+
+    entry = read_public_get_entry (command);
+    if (entry == NULL) {
+        return NULL;
+    }
+    bytes = handle_map_entry_get_public (entry);
+    g_object_unref (entry);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    g_debug ("%s: ReadPublic for vhandle 0x%08" PRIx32 " answered from cache",
+             __func__, tpm2_command_get_handle (command, 0));
+    return response_from_bytes (command, bytes);
+}
+/*
+ * Answer a TPM2_NV_ReadPublic from the per-index cache. NV indices aren't
+ * virtualized so the index is the key.
+ */
+static Tpm2Response*
+resource_manager_nv_read_public_cached (ResourceManager *resmgr,
+                                        Tpm2Command     *command)
+{
+    GBytes *bytes;
+    TPM2_HANDLE index;
+
+    if (!resmgr->nv_public_cache_enabled ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS)
+    {
+        return NULL;
+    }
+    index = tpm2_command_get_handle (command, 0);
+    bytes = g_hash_table_lookup (resmgr->nv_public_cache,
+                                 GUINT_TO_POINTER (index));
+    if (bytes == NULL) {
+        return NULL;
+    }
+    g_debug ("%s: NV_ReadPublic for index 0x%08" PRIx32 " answered from "
+             "cache", __func__, index);
+    return response_from_bytes (command, g_bytes_ref (bytes));
+}
+/*
+ * Cache the response from a successful NV_ReadPublic.
+ */
+static void
+resource_manager_nv_public_store (ResourceManager *resmgr,
+                                  Tpm2Command     *command,
+                                  Tpm2Response    *response)
+{
+    TPM2_HANDLE index = tpm2_command_get_handle (command, 0);
+
+    if (!resmgr->nv_public_cache_enabled ||
+        tpm2_command_get_code (command) != TPM2_CC_NV_ReadPublic ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS ||
+        tpm2_response_get_code (response) != TSS2_RC_SUCCESS)
+    {
+        return;
+    }
+    g_debug ("%s: caching NV_ReadPublic for index 0x%08" PRIx32, __func__,
+             index);
+    g_hash_table_insert (resmgr->nv_public_cache,
+                         GUINT_TO_POINTER (index),
+                         g_bytes_new (tpm2_response_get_buffer (response),
+                                      tpm2_response_get_size (response)));
+}
+/*
+ * Commands that change the public area of an NV index (including the
+ * TPMA_NV_WRITTEN and lock attributes) invalidate the cached NV_ReadPublic
+ * response for it. This is done before the command is executed and
+ * regardless of the outcome.
+ */
+static void
+resource_manager_invalidate_nv_public (ResourceManager *resmgr,
+                                       Tpm2Command     *command)
+{
+    TPM2_HANDLE index;
+
+    if (!resmgr->nv_public_cache_enabled) {
+        return;
+    }
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_NV_UndefineSpaceSpecial:
+    case TPM2_CC_NV_ChangeAuth:
+        index = tpm2_command_get_handle (command, 0);
+        break;
+    case TPM2_CC_NV_UndefineSpace:
+    case TPM2_CC_NV_Write:
+    case TPM2_CC_NV_Increment:
+    case TPM2_CC_NV_Extend:
+    case TPM2_CC_NV_SetBits:
+    case TPM2_CC_NV_WriteLock:
+    case TPM2_CC_NV_ReadLock:
+        index = tpm2_command_get_handle (command, 1);
+        break;
+    default:
+        g_debug ("%s: flushing all cached NV public areas", __func__);
+        g_hash_table_remove_all (resmgr->nv_public_cache);
+        return;
+    }
+    g_debug ("%s: flushing cached NV public area for index 0x%08" PRIx32,
+             __func__, index);
+    g_hash_table_remove (resmgr->nv_public_cache, GUINT_TO_POINTER (index));
+}
+/*
+ * The PCR cache is keyed on the PCR_Read parameters: the TPML_PCR_SELECTION.
+ * Commands with sessions aren't cached. Returns NULL if the command isn't
+ * cacheable.
+ */
+static GBytes*
+pcr_read_cache_key (ResourceManager *resmgr,
+                    Tpm2Command     *command)
+{
+    uint8_t *buf = tpm2_command_get_buffer (command);
+    size_t offset = tpm2_command_get_params_offset (command);
+
+    if (resmgr->pcr_cache == NULL ||
+        tpm2_command_get_code (command) != TPM2_CC_PCR_Read ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS)
+    {
+        return NULL;
+    }
+    return g_bytes_new (&buf [offset],
+                        tpm2_command_get_size (command) - offset);
+}
+static Tpm2Response*
+resource_manager_pcr_read_cached (ResourceManager *resmgr,
+                                  Tpm2Command     *command)
+{
+    GBytes *key, *bytes;
+
+    key = pcr_read_cache_key (resmgr, command);
+    if (key == NULL) {
+        return NULL;
+    }
+    bytes = pcr_cache_lookup (resmgr->pcr_cache, key);
+    g_bytes_unref (key);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    g_debug ("%s: PCR_Read answered from cache", __func__);
+    return response_from_bytes (command, bytes);
+}
+/*
+ * Keep the PCR cache in step with the TPM. This must only be called with
+ * responses from the TPM: a successful PCR_Read is cached and a successful
+ * command that changes PCR values or the pcrUpdateCounter drops the cache.
+ */
+static void
+resource_manager_pcr_cache_update (ResourceManager *resmgr,
+                                   Tpm2Command     *command,
+                                   Tpm2Response    *response)
+{
+    GBytes *key;
+
+    if (resmgr->pcr_cache == NULL ||
+        tpm2_response_get_code (response) != TSS2_RC_SUCCESS)
+    {
+        return;
+    }
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_PCR_Read:
+        key = pcr_read_cache_key (resmgr, command);
+        if (key != NULL) {
+            pcr_cache_insert (resmgr->pcr_cache,
+                              key,
+                              tpm2_response_get_buffer (response),
+                              tpm2_response_get_size (response));
+            g_bytes_unref (key);
+        }
+        break;
+    case TPM2_CC_PCR_Extend:
+    case TPM2_CC_PCR_Event:
+    case TPM2_CC_PCR_Reset:
+    case TPM2_CC_PCR_Allocate:
+    case TPM2_CC_SequenceComplete:
+    case TPM2_CC_EventSequenceComplete:
+    case TPM2_CC_Startup:
+        g_debug ("%s: command 0x%08" PRIx32 " may have changed PCRs, "
+                 "flushing PCR cache", __func__,
+                 tpm2_command_get_code (command));
+        pcr_cache_invalidate (resmgr->pcr_cache);
+        break;
+    default:
+        break;
+    }
+}
+/*
+ * Answer a TPM2_GetRandom from the RandomPool. Like the TPM we return no
+ * more than the size of the largest digest. Commands with sessions and
+ * requests the pool can't currently satisfy go to the TPM.
+ */
+static Tpm2Response*
+resource_manager_get_random_pooled (ResourceManager *resmgr,
+                                    Tpm2Command     *command)
+{
+    Connection *connection;
+    Tpm2Response *response;
+    TPM2B_DIGEST random_bytes = { .size = 0 };
+    uint8_t *buf = tpm2_command_get_buffer (command);
+    size_t offset = TPM_HEADER_SIZE;
+    UINT16 bytes_requested = 0;
+    TSS2_RC rc;
+
+    if (resmgr->random_pool == NULL ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS)
+    {
+        return NULL;
+    }
+    rc = Tss2_MU_UINT16_Unmarshal (buf,
+                                   tpm2_command_get_size (command),
+                                   &offset,
+                                   &bytes_requested);
+    if (rc != TSS2_RC_SUCCESS || bytes_requested == 0) {
+        return NULL;
+    }
+    random_bytes.size = MIN (bytes_requested, sizeof (random_bytes.buffer));
+    if (!random_pool_take (resmgr->random_pool,
+                           random_bytes.buffer,
+                           random_bytes.size))
+    {
+        g_debug ("%s: pool can't satisfy request for %" PRIu16 " bytes",
+                 __func__, random_bytes.size);
+        return NULL;
+    }
+    connection = tpm2_command_get_connection (command);
+    response = tpm2_response_new_get_random (connection, &random_bytes);
+    g_object_unref (connection);
+    memset (&random_bytes, 0, sizeof (random_bytes));
+    return response;
+}
+/*
+ * A command may be coalesced with identical queued commands when:
+ * - its command code is in the allowlist
+ * - it has no authorizations or only password authorizations: the response
+ *   to an HMAC or policy session is unique to the session
+ * - none of its handles are virtualized: a transient or session handle
+ *   names a different object on each connection
+ */
+static gboolean
+command_is_coalescable (ResourceManager *resmgr,
+                        Tpm2Command     *command)
+{
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES] = { 0, };
+    size_t i, handle_count = TPM2_COMMAND_MAX_HANDLES;
+    password_auth_data_t auth_data = {
+        .command = command,
+        .count = 0,
+    };
+
+    if (resmgr->coalesce_codes == NULL ||
+        !g_hash_table_contains (resmgr->coalesce_codes,
+                                GUINT_TO_POINTER (tpm2_command_get_code (command))))
+    {
+        return FALSE;
+    }
+    if (tpm2_command_has_auths (command) &&
+        (!tpm2_command_foreach_auth (command,
+                                     password_auth_callback,
+                                     &auth_data) ||
+         auth_data.count < 1))
+    {
+        return FALSE;
+    }
+    if (!tpm2_command_get_handles (command, handles, &handle_count)) {
+        return FALSE;
+    }
+    for (i = 0; i < handle_count; ++i) {
+        switch (handles [i] >> TPM2_HR_SHIFT) {
+        case TPM2_HT_TRANSIENT:
+        case TPM2_HT_HMAC_SESSION:
+        case TPM2_HT_POLICY_SESSION:
+            return FALSE;
+        default:
+            break;
+        }
+    }
+    return TRUE;
+}
+/*
+ * State for 'command_is_identical' as it walks the in_queue from the
+ * oldest message to the newest.
+ */
+typedef struct {
+    ResourceManager *resmgr;
+    Tpm2Command     *command;
+    /* connections with an older command still in the queue */
+    GHashTable      *blocked;
+    /* set once a command that may change TPM state has been seen */
+    gboolean         stop;
+} coalesce_match_t;
+/*
+ * MessageQueueMatchFunc used to find queued commands identical to the one
+ * in 'user_data'. A duplicate is only taken when answering it now gives
+ * the same result as executing it in turn:
+ * - nothing queued ahead of it may change what it reads, so we stop at the
+ *   first command that is neither identical nor in the allowlist
+ * - its response can't overtake an older response to the same connection,
+ *   so it must be the oldest queued command of its connection
+ */
+static gboolean
+command_is_identical (GObject  *obj,
+                      gpointer  user_data)
+{
+    coalesce_match_t *match = (coalesce_match_t*)user_data;
+    Tpm2Command *command = match->command;
+    Tpm2Command *queued;
+    Connection *connection;
+    gboolean identical;
+
+    if (match->stop || !IS_TPM2_COMMAND (obj)) {
+        return FALSE;
+    }
+    queued = TPM2_COMMAND (obj);
+    identical = tpm2_command_get_size (queued) == tpm2_command_get_size (command) &&
+        memcmp (tpm2_command_get_buffer (queued),
+                tpm2_command_get_buffer (command),
+                tpm2_command_get_size (command)) == 0;
+    if (!identical &&
+        !g_hash_table_contains (match->resmgr->coalesce_codes,
+                                GUINT_TO_POINTER (tpm2_command_get_code (queued))))
+    {
+        match->stop = TRUE;
+        return FALSE;
+    }
+    connection = tpm2_command_get_connection (queued);
+    if (identical && !g_hash_table_contains (match->blocked, connection)) {
+        g_object_unref (connection);
+        return TRUE;
+    }
+    g_hash_table_add (match->blocked, connection);
+    g_object_unref (connection);
+    return FALSE;
+}
+/*
+ * Answer the queued commands identical to 'command' with a copy of the
+ * response the TPM just returned for it, see 'command_is_identical' for
+ * which ones. The coalesced commands are removed from the queue and never
+ * sent to the TPM.
+ */
+static void
+resource_manager_coalesce (ResourceManager *resmgr,
+                           Tpm2Command     *command,
+                           Tpm2Response    *response)
+{
+    Connection *connection;
+    Tpm2Command *queued;
+    Tpm2Response *copy;
+    GList *matched, *item, *link;
+    uint8_t *buf;
+    coalesce_match_t match = {
+        .resmgr = resmgr,
+        .command = command,
+        .stop = FALSE,
+    };
+
+    if (!command_is_coalescable (resmgr, command)) {
+        return;
+    }
+    match.blocked = g_hash_table_new (g_direct_hash, g_direct_equal);
+    /* a command waiting to be retried is older than anything queued */
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    for (link = resmgr->retry_queue.head; link != NULL; link = link->next) {
+        g_hash_table_add (match.blocked,
+                          ((retry_entry_t*)link->data)->command->connection);
+    }
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+    matched = message_queue_remove_matching (resmgr->in_queue,
+                                             command_is_identical,
+                                             &match);
+    g_hash_table_unref (match.blocked);
+    for (item = matched; item != NULL; item = item->next) {
+        queued = TPM2_COMMAND (item->data);
+        connection = tpm2_command_get_connection (queued);
+        buf = g_malloc (tpm2_response_get_size (response));
+        memcpy (buf,
+                tpm2_response_get_buffer (response),
+                tpm2_response_get_size (response));
+        copy = tpm2_response_new (connection,
+                                  buf,
+                                  tpm2_response_get_size (response),
+                                  tpm2_command_get_attributes (queued));
+        g_debug ("%s: coalesced command 0x%08" PRIx32 " for connection %p",
+                 __func__, tpm2_command_get_code (queued), (void*)connection);
+        sink_enqueue (resmgr->sink, G_OBJECT (copy));
+        g_object_unref (copy);
+        g_object_unref (connection);
+        ++resmgr->coalesced;
+    }
+    g_list_free_full (matched, g_object_unref);
+}
+/*
+ * Top up the RandomPool with a single TPM2_GetRandom. The TPM returns at
+ * most a digest worth of bytes per call so a refill takes many calls. This
+ * is spread across idle periods one call at a time so clients never wait
+ * behind more than one. Returns TRUE if the TPM was used.
+ */
+static gboolean
+resource_manager_refill_random_pool (ResourceManager *resmgr)
+{
+    TPM2B_DIGEST random_bytes = { .size = 0 };
+    size_t size;
+    TSS2_RC rc;
+
+    if (resmgr->random_pool == NULL) {
+        return FALSE;
+    }
+    size = random_pool_refill_size (resmgr->random_pool);
+    if (size == 0) {
+        return FALSE;
+    }
+    rc = access_broker_get_random (resmgr->access_broker,
+                                   (UINT16)MIN (size,
+                                                sizeof (random_bytes.buffer)),
+                                   &random_bytes);
+    if (rc != TSS2_RC_SUCCESS || random_bytes.size == 0) {
+        return FALSE;
+    }
+    random_pool_add (resmgr->random_pool,
+                     random_bytes.buffer,
+                     random_bytes.size);
+    memset (&random_bytes, 0, sizeof (random_bytes));
+    return TRUE;
+}
+/*
+ * This structure is used by the find_oldest_session_callback to return the
+ * saved SessionEntry with the lowest context sequence number.
+ */
+typedef struct {
+    SessionEntry *entry;
+    guint64 sequence;
+} oldest_session_data_t;
+static void
+find_oldest_session_callback (gpointer data_entry,
+                              gpointer data_user)
+{
+    oldest_session_data_t *data = (oldest_session_data_t*)data_user;
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+    SessionEntryStateEnum state = session_entry_get_state (entry);
+
+    if (state != SESSION_ENTRY_SAVED_CLIENT &&
+        state != SESSION_ENTRY_SAVED_CLIENT_CLOSED &&
+        state != SESSION_ENTRY_SAVED_RM)
+    {
+        return;
+    }
+    if (data->entry == NULL ||
+        session_entry_get_sequence (entry) < data->sequence)
+    {
+        data->entry = entry;
+        data->sequence = session_entry_get_sequence (entry);
+    }
+}
+/*
+ * Regap the oldest saved session once the distance between its context
+ * sequence and the TPM contextCounter passes half of TPM2_PT_CONTEXT_GAP_MAX.
+ * This is done one session per idle step so the TPM never has to return
+ * TPM2_RC_CONTEXT_GAP, which would stall the client whose command hit it
+ * while every session is regapped. The contextCounter is tracked from the
+ * sequence of the session contexts we save. Returns TRUE if the TPM was
+ * used.
+ */
+static gboolean
+resource_manager_regap_step (ResourceManager *resmgr)
+{
+    oldest_session_data_t data = { .entry = NULL, .sequence = 0 };
+    guint32 gap_max;
+
+    if (resmgr->context_gap_max == 0) {
+        if (access_broker_get_fixed_property (resmgr->access_broker,
+                                              TPM2_PT_CONTEXT_GAP_MAX,
+                                              &gap_max) != TSS2_RC_SUCCESS)
+        {
+            return FALSE;
+        }
+        g_debug ("%s: TPM2_PT_CONTEXT_GAP_MAX: 0x%" PRIx32, __func__,
+                 gap_max);
+        if (gap_max == 0) {
+            return FALSE;
+        }
+        resmgr->context_gap_max = gap_max;
+    }
+    session_list_foreach (resmgr->session_list,
+                          find_oldest_session_callback,
+                          &data);
+    if (data.entry == NULL ||
+        resmgr->context_counter - data.sequence <=
+        resmgr->context_gap_max / 2)
+    {
+        return FALSE;
+    }
+    g_debug ("%s: regapping session 0x%08" PRIx32 " with sequence 0x%"
+             PRIx64 ", contextCounter 0x%" PRIx64, __func__,
+             session_entry_get_handle (data.entry), data.sequence,
+             resmgr->context_counter);
+    if (regap_session (resmgr, data.entry)) {
+        ++resmgr->regaps;
+    }
+    return TRUE;
+}
+/*
+ * Drive the SelfTest one TPM command at a time so the TPM has tested the
+ * configured algorithms before a client needs them, instead of the client
+ * getting TPM2_RC_TESTING (or waiting on a TPM that tests on first use).
+ * IncrementalSelfTest with an empty list only returns the toDoList. We
+ * then test one algorithm per step and finish with GetTestResult since
+ * that's the only place a failed test is reported. Returns TRUE if the TPM
+ * was used.
+ */
+static gboolean
+resource_manager_self_test_step (ResourceManager *resmgr)
+{
+    TPML_ALG to_test = { .count = 0 }, to_do_list = { .count = 0 };
+    TPM2_ALG_ID alg;
+    TPM2_RC test_result;
+    TSS2_RC rc;
+
+    if (resmgr->self_test == NULL ||
+        g_get_monotonic_time () < self_test_get_retry_at (resmgr->self_test))
+    {
+        return FALSE;
+    }
+    switch (self_test_get_state (resmgr->self_test)) {
+    case SELF_TEST_QUERY:
+        rc = access_broker_incremental_self_test (resmgr->access_broker,
+                                                  &to_test,
+                                                  &to_do_list);
+        if (rc == TPM2_RC_TESTING) {
+            self_test_retry (resmgr->self_test, NULL);
+            return TRUE;
+        }
+        break;
+    case SELF_TEST_RUN:
+        if (!self_test_next (resmgr->self_test, &alg)) {
+            /* moved on to reading the result */
+            return TRUE;
+        }
+        g_debug ("%s: testing algorithm 0x%04" PRIx16, __func__, alg);
+        to_test.count = 1;
+        to_test.algorithms [0] = alg;
+        rc = access_broker_incremental_self_test (resmgr->access_broker,
+                                                  &to_test,
+                                                  &to_do_list);
+        if (rc == TPM2_RC_TESTING) {
+            /* busy with earlier tests, 'alg' wasn't started */
+            self_test_retry (resmgr->self_test, &alg);
+            return TRUE;
+        }
+        break;
+    case SELF_TEST_RESULT:
+        rc = access_broker_get_test_result (resmgr->access_broker,
+                                            &test_result);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: GetTestResult failed: 0x%" PRIx32, __func__, rc);
+            self_test_set_result (resmgr->self_test, rc);
+            return TRUE;
+        }
+        if (self_test_check_result (resmgr->self_test, test_result) &&
+            self_test_get_result (resmgr->self_test) != TSS2_RC_SUCCESS)
+        {
+            g_warning ("%s: TPM self test failed: 0x%" PRIx32, __func__,
+                       self_test_get_result (resmgr->self_test));
+        }
+        return TRUE;
+    case SELF_TEST_DONE:
+    default:
+        return FALSE;
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        self_test_set_result (resmgr->self_test, rc);
+        return TRUE;
+    }
+    self_test_set_to_do (resmgr->self_test, &to_do_list);
+    return TRUE;
+}
+/*
+ * The retry_queue entry to process next: the one due first among those not
+ * waiting behind an older entry from the same connection. Called with the
+ * cancel_mutex held.
+ */
+static GList*
+retry_queue_next (ResourceManager *resmgr)
+{
+    GList *link, *older, *next = NULL;
+    retry_entry_t *entry;
+    gboolean blocked;
+
+    for (link = resmgr->retry_queue.head; link != NULL; link = link->next) {
+        entry = (retry_entry_t*)link->data;
+        blocked = FALSE;
+        for (older = link->prev; older != NULL && !blocked; older = older->prev) {
+            blocked = ((retry_entry_t*)older->data)->command->connection ==
+                entry->command->connection;
+        }
+        if (!blocked &&
+            (next == NULL || entry->due < ((retry_entry_t*)next->data)->due))
+        {
+            next = link;
+        }
+    }
+    return next;
+}
+/*
+ * How long until the next entry in the retry_queue is due, in
+ * microseconds. 0 if the queue is empty.
+ */
+static gint64
+resource_manager_retry_wait (ResourceManager *resmgr)
+{
+    GList *link;
+    gint64 wait = 0;
+
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    link = retry_queue_next (resmgr);
+    if (link != NULL) {
+        wait = ((retry_entry_t*)link->data)->due - g_get_monotonic_time ();
+        wait = MAX (wait, 1);
+    }
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+    return wait;
+}
+/*
+ * How long the RM thread may block waiting for a message before there's
+ * work to do again, in microseconds. 0 means until the next message. The
+ * self test and the commands in the retry_queue wait on a timer: while the
+ * TPM answers TPM2_RC_TESTING or TPM2_RC_RETRY it's asked again after a
+ * back off rather than in a tight loop.
+ */
+static gint64
+resource_manager_idle_wait (ResourceManager *resmgr)
+{
+    gint64 wait, retry_wait;
+
+    retry_wait = resource_manager_retry_wait (resmgr);
+    if (resmgr->self_test == NULL ||
+        self_test_get_state (resmgr->self_test) == SELF_TEST_DONE)
+    {
+        return retry_wait;
+    }
+    wait = self_test_get_retry_at (resmgr->self_test) - g_get_monotonic_time ();
+    wait = MAX (wait, 1);
+    return retry_wait > 0 ? MIN (wait, retry_wait) : wait;
+}
+/*
+ * Do one unit of background work while the input queue is empty. Returns
+ * TRUE if any work was done, in which case the caller should check the
+ * queue again before calling this function another time. When this
+ * function returns FALSE there's nothing left to do and the caller may
+ * block waiting for the next message.
+ */
+gboolean
+resource_manager_idle (ResourceManager *resmgr)
+{
+    return resource_manager_regap_step (resmgr) ||
+        resource_manager_self_test_step (resmgr) ||
+        resource_manager_refill_random_pool (resmgr);
+}
+/*
+ * If the provided command is something that the ResourceManager "virtualizes"
+ * then this function will do so and return a Tpm2Response object that will be
+ * returned to the same connection. If the command isn't something that we
+ * virtualize then we just return NULL.
+ *
+ * NOTE: Both the ContextSave and ContextLoad commands, when sent by clients,
+ * do not result in the command being executed by the TPM. This makes
+ * handling the context gap unnecessary for these commands.
+ */
+Tpm2Response*
+command_special_processing (ResourceManager *resmgr,
+                            Tpm2Command     *command)
+{
+    Tpm2Response *response   = NULL;
+
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_FlushContext:
+        g_debug ("processing TPM2_CC_FlushContext");
+        response = resource_manager_flush_context (resmgr, command);
+        break;
+    case TPM2_CC_ContextSave:
+        g_debug ("processing TPM2_CC_ContextSave");
+        response = resource_manager_save_context (resmgr, command);
+        break;
+    case TPM2_CC_ContextLoad:
+        g_debug ("%s: processing TPM2_CC_ContextLoad", __func__);
+        response = resource_manager_load_context (resmgr, command);
+        break;
+    case TPM2_CC_GetCapability:
+        g_debug ("processing TPM2_CC_GetCapability");
+        response = get_cap_gen_response (resmgr, command);
+        break;
+    case TPM2_CC_CreatePrimary:
+    case TPM2_CC_Load:
+        g_debug ("%s: processing TPM2_CC_CreatePrimary / TPM2_CC_Load",
+                 __func__);
+        response = resource_manager_object_cache_respond (resmgr, command);
+        break;
+    case TPM2_CC_ReadPublic:
+        response = resource_manager_read_public_cached (command);
+        break;
+    case TPM2_CC_NV_ReadPublic:
+        response = resource_manager_nv_read_public_cached (resmgr, command);
+        break;
+    case TPM2_CC_PCR_Read:
+        response = resource_manager_pcr_read_cached (resmgr, command);
+        break;
+    case TPM2_CC_GetRandom:
+        response = resource_manager_get_random_pooled (resmgr, command);
+        break;
+    case TPM2_CC_Clear:
+    case TPM2_CC_HierarchyControl:
+        resource_manager_invalidate_object_caches (resmgr, command);
+        resource_manager_invalidate_nv_public (resmgr, command);
+        break;
+    case TPM2_CC_ChangePPS:
+    case TPM2_CC_ChangeEPS:
+    case TPM2_CC_EvictControl:
+    case TPM2_CC_HierarchyChangeAuth:
+        resource_manager_invalidate_object_caches (resmgr, command);
+        break;
+    case TPM2_CC_NV_DefineSpace:
+    case TPM2_CC_NV_UndefineSpace:
+    case TPM2_CC_NV_UndefineSpaceSpecial:
+    case TPM2_CC_NV_Write:
+    case TPM2_CC_NV_Increment:
+    case TPM2_CC_NV_Extend:
+    case TPM2_CC_NV_SetBits:
+    case TPM2_CC_NV_WriteLock:
+    case TPM2_CC_NV_GlobalWriteLock:
+    case TPM2_CC_NV_ReadLock:
+    case TPM2_CC_NV_ChangeAuth:
+        resource_manager_invalidate_nv_public (resmgr, command);
+        break;
+    case TPM2_CC_Startup:
+        resource_manager_invalidate_nv_public (resmgr, command);
+        /* the TPM may need to run its self tests again after a resume */
+        if (resmgr->self_test != NULL) {
+            self_test_reset (resmgr->self_test);
+        }
+        break;
+    default:
+        break;
+    }
+
+    return response;
+}
+/*
+ * This function creates a mapping from the transient physical to a virtual
+ * handle in the provided response object. This mapping is then added to
+ * the transient HandleMap for the associated connection, as well as the
+ * list of currently loaded transient objects.
+ */
+void
+create_context_mapping_transient (ResourceManager  *resmgr,
+                                  Tpm2Response     *response,
+                                  GSList          **loaded_transient_slist)
+{
+    HandleMap      *handle_map;
+    HandleMapEntry *handle_entry;
+    TPM2_HANDLE      phandle, vhandle;
+    Connection     *connection;
+
+    g_debug ("create_context_mapping_transient");
+    phandle = tpm2_response_get_handle (response);
+    g_debug ("  physical handle: 0x%08" PRIx32, phandle);
+    connection = tpm2_response_get_connection (response);
+    handle_map = connection_get_trans_map (connection);
+    g_object_unref (connection);
+    vhandle = handle_map_next_vhandle (handle_map);
+    if (vhandle == 0) {
+        g_error ("vhandle rolled over!");
+    }
+    g_debug ("  vhandle:0x%08" PRIx32, vhandle);
+    handle_entry = handle_map_entry_new (phandle, vhandle);
+    if (handle_entry == NULL) {
+        g_warning ("failed to create new HandleMapEntry for handle 0x%"
+                   PRIx32, phandle);
+    }
+    if (resmgr->context_store != NULL) {
+        handle_map_entry_set_context_store (handle_entry,
+                                            resmgr->context_store);
+    }
+    *loaded_transient_slist = g_slist_prepend (*loaded_transient_slist,
+                                               handle_entry);
+    handle_map_insert (handle_map, vhandle, handle_entry);
+    g_object_unref (handle_map);
+    tpm2_response_set_handle (response, vhandle);
+    g_object_ref (handle_entry);
+    *loaded_transient_slist = g_slist_prepend (*loaded_transient_slist,
+                                                   handle_entry);
+}
+/*
+ * This function after a Tpm2Command is sent to the TPM and:
+ * - we receive a Tpm2Response object with a handle in the response buffers
+ *   handle area
+ * - the handle is a session handle
+ * Since there's a handle in the response handle area the caller is being
+ * returned a new handle after a context was successfully created or loaded.
+ * So we know that the response is to one of two possible commands:
+ * - a session being loaded by a call to LoadContext
+ * - a session was newly created by a call to StartAuthSession
+ * We differentiate between these two situations as follows:
+ * - A call to 'LoadContext' implies that the session already exists and so
+ *   it must already be in the session_list.
+ *   - If it's in the session_list *AND NOT* in the abandoned_session_queue
+ *     then the caller is just loading a context they already own and so we
+ *     set the session state to SAVED_RM and add the session to the list of
+ *     loaded sessions.
+ *   - If it's *NOT* in the session_list *AND* in the abandoned_session_queue
+ *     then the caller is loading a context saved by a different connection
+ *     and so we make the current connection the owner of the session, set
+ *     the session state to SAVED_RM and add the session to the list of loaded
+ *     sessions.
+ * - A call to 'StartAuthSession' will return a handle for a session object
+ *   that is not in either the session_list or the abandoned_session_queue.
+ *   In this case we just create a new SessionEntry and add it to the
+ *   session_list and the list of loaded sessions.
+ * NOTE: If the response doesn't indicate 'success' then we just ignore it
+ * since there's nothing useful that we can do.
+ */
+void
+create_context_mapping_session (ResourceManager *resmgr,
+                                Tpm2Response    *response,
+                                TPM2_HANDLE      handle)
+{
+    SessionEntry *entry = NULL;
+    Connection   *conn_resp = NULL, *conn_entry = NULL;
+
+    entry = session_list_lookup_handle (resmgr->session_list, handle);
+    conn_resp = tpm2_response_get_connection (response);
+    if (entry != NULL) {
+        g_debug ("%s: got SessionEntry that's in the SessionList", __func__);
+        conn_entry = session_entry_get_connection (entry);
+        if (conn_resp != conn_entry) {
+            g_warning ("%s: connections do not match!", __func__);
+        }
+    } else {
+        g_debug ("%s: handle is a session, creating entry for SessionList "
+                 "and SessionList", __func__);
+        entry = session_entry_new (conn_resp, handle);
+        if (resmgr->context_store != NULL) {
+            session_entry_set_context_store (entry, resmgr->context_store);
+        }
+        session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+        session_list_insert (resmgr->session_list, entry);
+    }
+    g_clear_object (&conn_resp);
+    g_clear_object (&conn_entry);
+    g_clear_object (&entry);
+}
+/*
+ * Each Tpm2Response object can have at most one handle in it.
+ * This function assumes that the handle in the parameter Tpm2Response
+ * object is the handle assigned by the TPM. Depending on the type of the
+ * handle we do to possible things:
+ * For TPM2_HT_TRANSIENT handles we create a new virtual handle and
+ * allocates a new HandleMapEntry to map the virtual handle to a
+ * TPMS_CONTEXT structure when processing future commands associated
+ * with the same connection. This HandleMapEntry is inserted into the
+ * handle map for the connection. It is also added to the list of loaded
+ * transient objects so that it can be saved / flushed by the typical code
+ * path.
+ * For TPM2_HT_HMAC_SESSION or TPM2_HT_POLICY_SESSION handles we create a
+ * new session_entry_t object, populate the connection field with the
+ * connection associated with the response object, and set the savedHandle
+ * field. We then add this entry to the list of sessions we're tracking
+ * (session_slist) and the list of loaded sessions (loaded_session_slist).
+ */
+void
+resource_manager_create_context_mapping (ResourceManager  *resmgr,
+                                         Tpm2Response     *response,
+                                         GSList          **loaded_transient_slist)
+{
+    TPM2_HANDLE       handle;
+
+    g_debug ("%s", __func__);
+    if (!tpm2_response_has_handle (response)) {
+        g_debug ("response has no handles");
+        return;
+    }
+    handle = tpm2_response_get_handle (response);
+    switch (handle >> TPM2_HR_SHIFT) {
+    case TPM2_HT_TRANSIENT:
+        create_context_mapping_transient (resmgr, response, loaded_transient_slist);
+        break;
+    case TPM2_HT_HMAC_SESSION:
+    case TPM2_HT_POLICY_SESSION:
+        create_context_mapping_session (resmgr, response, handle);
+        break;
+    default:
+        g_debug ("  not creating context for handle: 0x%08" PRIx32, handle);
+        break;
+    }
+}
+/*
+ * Record that the RM thread has started on a command from 'connection' so
+ * a Cancel for the connection knows where to look. NULL when done.
+ */
+static void
+resource_manager_set_current (ResourceManager *resmgr,
+                              Connection      *connection)
+{
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    resmgr->current = connection;
+    resmgr->current_in_tpm = FALSE;
+    resmgr->cancel_pending = FALSE;
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+}
+/*
+ * Called before the current command is sent to the TPM. Returns FALSE if
+ * the command was canceled before it got there, in which case it must not
+ * be sent. Only the command itself is bracketed by enter / leave, never
+ * the context loads, saves and evictions done around it.
+ */
+static gboolean
+resource_manager_enter_tpm (ResourceManager *resmgr)
+{
+    gboolean ret = TRUE;
+
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    if (resmgr->cancel_pending) {
+        resmgr->cancel_pending = FALSE;
+        ++resmgr->canceled;
+        ret = FALSE;
+    } else {
+        resmgr->current_in_tpm = TRUE;
+    }
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+    return ret;
+}
+/*
+ * Called once the response is back. A cancel requested after the TPM
+ * finished is dropped so the AccessBroker doesn't apply it to the next
+ * command.
+ */
+static void
+resource_manager_leave_tpm (ResourceManager *resmgr)
+{
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    resmgr->current_in_tpm = FALSE;
+    access_broker_clear_cancel (resmgr->access_broker);
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+}
+/*
+ * Send the current command to the TPM, or answer it with TPM2_RC_CANCELED
+ * if the connection canceled it first.
+ */
+static Tpm2Response*
+resource_manager_send_current (ResourceManager *resmgr,
+                               Tpm2Command     *cmd)
+{
+    Tpm2Response *resp;
+    Connection *connection;
+    TSS2_RC rc;
+
+    if (!resource_manager_enter_tpm (resmgr)) {
+        connection = tpm2_command_get_connection (cmd);
+        resp = tpm2_response_new_rc (connection, TPM2_RC_CANCELED);
+        g_object_unref (connection);
+        return resp;
+    }
+    resp = access_broker_send_command (resmgr->access_broker, cmd, &rc);
+    resource_manager_leave_tpm (resmgr);
+    return resp;
+}
+Tpm2Response*
+send_command_handle_rc (ResourceManager *resmgr,
+                        Tpm2Command *cmd)
+{
+    regap_session_data_t data = {
+        .resmgr = resmgr,
+        .ret = TRUE,
+    };
+    Tpm2Response *resp = NULL;
+    Connection *connection;
+    TSS2_RC rc;
+
+    /* Send command and create response object. */
+    resp = resource_manager_send_current (resmgr, cmd);
+    rc = tpm2_response_get_code (resp);
+    if (rc == TPM2_RC_SESSION_MEMORY) {
+        /* e.g. StartAuthSession: make room and send it again */
+        connection = tpm2_command_get_connection (cmd);
+        while (rc == TPM2_RC_SESSION_MEMORY &&
+               resource_manager_evict_session (resmgr, connection))
+        {
+            g_clear_object (&resp);
+            resp = resource_manager_send_current (resmgr, cmd);
+            rc = tpm2_response_get_code (resp);
+        }
+        g_clear_object (&connection);
+    }
+    if (rc == TPM2_RC_CONTEXT_GAP) {
+        g_debug ("%s: handling TPM2_RC_CONTEXT_GAP", __func__);
+        ++resmgr->context_gaps;
+        session_list_foreach (resmgr->session_list,
+                              regap_session_callback,
+                              &data);
+        g_clear_object (&resp);
+        resp = resource_manager_send_current (resmgr, cmd);
+    }
+    return resp;
+}
+/*
+ * Copy of 'command' as the client sent it. Loading the command's handles
+ * rewrites the command being processed, a retry has to start over from
+ * the original.
+ */
+static Tpm2Command*
+resource_manager_copy_command (Tpm2Command *command)
+{
+    Tpm2Command *copy;
+    Connection *connection;
+    guint8 *buf;
+
+    connection = tpm2_command_get_connection (command);
+    buf = g_malloc (tpm2_command_get_size (command));
+    memcpy (buf,
+            tpm2_command_get_buffer (command),
+            tpm2_command_get_size (command));
+    copy = tpm2_command_new (connection,
+                             buf,
+                             tpm2_command_get_size (command),
+                             tpm2_command_get_attributes (command));
+    tpm2_command_set_stateless (copy, tpm2_command_is_stateless (command));
+    g_object_unref (connection);
+    return copy;
+}
+/*
+ * Decide whether the TPM should get 'command' again after answering it with
+ * 'response': RETRY, YIELDED or TESTING while the command's retry budget
+ * lasts. If so the command is put in the retry_queue to be sent again after
+ * a delay and TRUE is returned, the caller must not send the response.
+ * The RM carries on with other connections' commands in the meantime. The
+ * delay doubles with each attempt up to a bound. Once the TPM executes the
+ * command, or the budget runs out, the client gets the last response.
+ */
+static gboolean
+resource_manager_defer_retry (ResourceManager *resmgr,
+                              Tpm2Command     *command,
+                              Tpm2Response    *response)
+{
+    retry_entry_t *prev = resmgr->retrying, *entry;
+    TSS2_RC rc = tpm2_response_get_code (response);
+    gint64 now, deadline;
+    gulong delay;
+    guint retries;
+
+    if (resmgr->retry_policy == NULL) {
+        return FALSE;
+    }
+    resmgr->retrying = NULL;
+    if (!retry_policy_rc_is_retryable (rc)) {
+        if (prev != NULL) {
+            retry_policy_record (resmgr->retry_policy, prev->retries, FALSE);
+        }
+        return FALSE;
+    }
+    now = g_get_monotonic_time ();
+    if (prev == NULL) {
+        deadline = now + (gint64)retry_policy_get_budget (resmgr->retry_policy,
+                                                          tpm2_command_get_code (command)) *
+            G_TIME_SPAN_MILLISECOND;
+        delay = retry_policy_next_delay (0);
+        retries = 0;
+    } else {
+        deadline = prev->deadline;
+        delay = retry_policy_next_delay (prev->delay);
+        retries = prev->retries;
+    }
+    if (now + (gint64)delay > deadline) {
+        retry_policy_record (resmgr->retry_policy, retries, TRUE);
+        return FALSE;
+    }
+    g_debug ("%s: command 0x%08" PRIx32 " got RC 0x%" PRIx32
+             ", retrying in %lu us", __func__,
+             tpm2_command_get_code (command), rc, delay);
+    entry = g_new0 (retry_entry_t, 1);
+    entry->command = g_object_ref (command);
+    entry->due = now + (gint64)delay;
+    entry->deadline = deadline;
+    entry->delay = delay;
+    entry->retries = retries + 1;
+    /* it's older than anything queued behind it from the same connection */
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    g_queue_push_head (&resmgr->retry_queue, entry);
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+    return TRUE;
+}
+/*
+ * Fast path for commands with no handles and no sessions. There is nothing
+ * to virtualize so we skip the quota check, handle and auth area walks,
+ * the session save pass and the transient object cleanup. The special
+ * processing still runs since it's where the RM caches live and Startup
+ * invalidates some of them.
+ */
+static void
+resource_manager_process_stateless (ResourceManager *resmgr,
+                                    Tpm2Command     *command)
+{
+    Tpm2Response *response;
+
+    g_debug ("%s: command 0x%08" PRIx32, __func__,
+             tpm2_command_get_code (command));
+    response = command_special_processing (resmgr, command);
+    if (response == NULL) {
+        response = send_command_handle_rc (resmgr, command);
+        if (resource_manager_defer_retry (resmgr, command, response)) {
+            g_object_unref (response);
+            return;
+        }
+        resource_manager_pcr_cache_update (resmgr, command, response);
+        resource_manager_coalesce (resmgr, command, response);
+    }
+    sink_enqueue (resmgr->sink, G_OBJECT (response));
+    g_object_unref (response);
+}
+/**
+ * This function is invoked in response to the receipt of a Tpm2Command.
+ * This is the place where we send the command buffer out to the TPM
+ * through the AccessBroker which will eventually get it to the TPM for us.
+ * The AccessBroker will send us back a Tpm2Response that we send back to
+ * the client by way of our Sink object. The flow is roughly:
+ * - Receive the Tpm2Command as a parameter
+ * - Load all virtualized objects required by the command.
+ * - Send the Tpm2Command out through the AccessBroker.
  * - Receive the response from the AccessBroker.
  * - Virtualize the new objects created by the command & referenced in the
  *   response.
@@ -1299,6 +2833,8 @@ send_command_handle_rc (ResourceManager *resmgr,
  *   Sink object.
  * - Flush all objects loaded for the command or as part of executing the
  *   command..
+ * Commands classified as stateless by the CommandSource take a shorter
+ * path through resource_manager_process_stateless.
  */
 void
 resource_manager_process_tpm2_command (ResourceManager   *resmgr,
@@ -1309,7 +2845,16 @@ resource_manager_process_tpm2_command (ResourceManager   *resmgr,
     TSS2_RC         rc = TSS2_RC_SUCCESS;
     GSList         *transient_slist = NULL;
     TPMA_CC         command_attrs;
-
+    ObjectCache    *object_cache = NULL;
+    GBytes         *object_cache_key = NULL;
+    HandleMapEntry *public_entry = NULL;
+    Tpm2Command    *original = NULL;
+    gboolean        deferred = FALSE;
+
+    if (tpm2_command_is_stateless (command)) {
+        resource_manager_process_stateless (resmgr, command);
+        return;
+    }
     command_attrs = tpm2_command_get_attributes (command);
     g_debug ("%s", __func__);
     dump_command (command);
@@ -1325,11 +2870,22 @@ resource_manager_process_tpm2_command (ResourceManager   *resmgr,
     if (response != NULL) {
         goto send_response;
     }
+    object_cache = object_cache_for_command (resmgr, command, &object_cache_key);
+    /* grab the entry now, the vhandle is replaced when the object is loaded */
+    public_entry = read_public_get_entry (command);
+    if (resmgr->retry_policy != NULL) {
+        original = resource_manager_copy_command (command);
+    }
     /* Load objects associated with the handles in the command handle area. */
     if (tpm2_command_get_handle_count (command) > 0) {
-        resource_manager_load_handles (resmgr,
-                                       command,
-                                       &transient_slist);
+        rc = resource_manager_load_handles (resmgr,
+                                            command,
+                                            &transient_slist);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_clear_object (&original);
+            response = tpm2_response_new_rc (connection, rc);
+            goto send_response;
+        }
     }
     /* Load objets associated with the authorizations in the command. */
     if (tpm2_command_has_auths (command)) {
@@ -1344,22 +2900,100 @@ resource_manager_process_tpm2_command (ResourceManager   *resmgr,
     }
     /* Send command and create response object. */
     response = send_command_handle_rc (resmgr, command);
-    dump_response (response);
-    /* transform virtualized handles in Tpm2Response if necessary */
-    resource_manager_create_context_mapping (resmgr,
-                                             response,
-                                             &transient_slist);
+    if (original != NULL) {
+        deferred = resource_manager_defer_retry (resmgr, original, response);
+        g_object_unref (original);
+    }
+    if (!deferred) {
+        dump_response (response);
+        resource_manager_pcr_cache_update (resmgr, command, response);
+        resource_manager_coalesce (resmgr, command, response);
+        /* transform virtualized handles in Tpm2Response if necessary */
+        resource_manager_create_context_mapping (resmgr,
+                                                 response,
+                                                 &transient_slist);
+    }
 send_response:
-    sink_enqueue (resmgr->sink, G_OBJECT (response));
-    g_object_unref (response);
+    if (!deferred) {
+        sink_enqueue (resmgr->sink, G_OBJECT (response));
+    }
     /* save contexts that were previously loaded */
     session_list_foreach (resmgr->session_list,
                           save_session_callback,
                           resmgr);
     post_process_loaded_transients (resmgr, &transient_slist, connection, command_attrs);
+    if (object_cache != NULL) {
+        resource_manager_object_cache_store (object_cache,
+                                             object_cache_key,
+                                             command,
+                                             response);
+        g_bytes_unref (object_cache_key);
+    }
+    if (public_entry != NULL) {
+        if (tpm2_response_get_code (response) == TSS2_RC_SUCCESS) {
+            handle_map_entry_set_public (public_entry,
+                                         tpm2_response_get_buffer (response),
+                                         tpm2_response_get_size (response));
+        }
+        g_object_unref (public_entry);
+    }
+    resource_manager_nv_public_store (resmgr, command, response);
+    g_object_unref (response);
     g_object_unref (connection);
     return;
 }
+/*
+ * Remove the entries for 'connection' from the retry_queue and return
+ * them. Called with the cancel_mutex held.
+ */
+static GList*
+retry_queue_remove_connection (ResourceManager *resmgr,
+                               Connection      *connection)
+{
+    GList *link, *next, *removed = NULL;
+    retry_entry_t *entry;
+
+    for (link = resmgr->retry_queue.head; link != NULL; link = next) {
+        next = link->next;
+        entry = (retry_entry_t*)link->data;
+        if (entry->command->connection == connection) {
+            g_queue_unlink (&resmgr->retry_queue, link);
+            removed = g_list_concat (removed, link);
+        }
+    }
+    return removed;
+}
+static void
+retry_entry_free (gpointer data)
+{
+    retry_entry_t *entry = (retry_entry_t*)data;
+
+    g_clear_object (&entry->command);
+    g_free (entry);
+}
+/*
+ * The connection is gone, nobody is waiting for the responses to its
+ * commands in the retry_queue.
+ */
+static void
+resource_manager_drop_retries (ResourceManager *resmgr,
+                               Connection      *connection)
+{
+    GList *removed;
+    guint count;
+
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    removed = retry_queue_remove_connection (resmgr, connection);
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+    count = g_list_length (removed);
+    g_list_free_full (removed, retry_entry_free);
+    if (count > 0) {
+        g_debug ("%s: dropped %u commands from connection %p", __func__,
+                 count, (void*)connection);
+        resmgr->purged += count;
+        admission_control_release (connection, count);
+    }
+}
 /*
  * Return FALSE to terminate main thread.
  */
@@ -1379,6 +3013,7 @@ resource_manager_process_control (ResourceManager *resmgr,
         conn = CONNECTION (control_message_get_object (msg));
         g_debug ("%s: received CONNECTION_REMOVED message for connection",
                  __func__);
+        resource_manager_drop_retries (resmgr, conn);
         resource_manager_remove_connection (resmgr, conn);
         sink_enqueue (resmgr->sink, G_OBJECT (msg));
         return TRUE;
@@ -1388,6 +3023,238 @@ resource_manager_process_control (ResourceManager *resmgr,
         return TRUE;
     }
 }
+/*
+ * Process a Tpm2Command and charge what it cost to its connection. A
+ * command being resubmitted from the retry_queue was already counted.
+ */
+static void
+resource_manager_process_command (ResourceManager *resmgr,
+                                  Tpm2Command     *command)
+{
+    Connection *connection;
+    access_broker_stats_t before, after;
+    connection_stats_t delta = { 0, };
+    gboolean first = resmgr->retrying == NULL;
+
+    connection = tpm2_command_get_connection (command);
+    access_broker_get_stats (resmgr->access_broker, &before);
+    resource_manager_set_current (resmgr, connection);
+    resource_manager_process_tpm2_command (resmgr, command);
+    resource_manager_set_current (resmgr, NULL);
+    access_broker_get_stats (resmgr->access_broker, &after);
+    /*
+     * Everything the TPM did while we were processing the command is
+     * charged to the connection, including the context loads and saves
+     * needed to run it. 'busy_us' only counts the time the TPM had a
+     * command, not the RM's own work in between or in the busy_func.
+     */
+    delta.tpm_time_us = after.busy_us - before.busy_us;
+    delta.context_loads = after.context_loads - before.context_loads;
+    delta.context_saves = after.context_saves - before.context_saves;
+    if (first) {
+        delta.bytes_in = tpm2_command_get_size (command);
+    }
+    connection_stats_add (connection, &delta);
+    if (first) {
+        connection_stats_add_command (connection,
+                                      tpm2_command_get_code (command));
+        __atomic_fetch_add (&resmgr->commands, 1, __ATOMIC_RELAXED);
+    }
+    g_object_unref (connection);
+}
+/*
+ * A command from a connection with a command waiting to be retried has to
+ * wait its turn behind it. Returns TRUE if the command was put in the
+ * retry_queue.
+ */
+static gboolean
+resource_manager_defer_behind_retry (ResourceManager *resmgr,
+                                     Tpm2Command     *command)
+{
+    GList *link;
+    retry_entry_t *entry = NULL;
+
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    for (link = resmgr->retry_queue.head; link != NULL; link = link->next) {
+        if (((retry_entry_t*)link->data)->command->connection ==
+            command->connection)
+        {
+            entry = g_new0 (retry_entry_t, 1);
+            entry->command = g_object_ref (command);
+            g_queue_push_tail (&resmgr->retry_queue, entry);
+            break;
+        }
+    }
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+    return entry != NULL;
+}
+/*
+ * Process a single message from the in_queue (or from the caller when
+ * running inline). Returns FALSE when the message tells us to stop.
+ */
+static gboolean
+resource_manager_process_message (ResourceManager *resmgr,
+                                  GObject         *obj)
+{
+    if (IS_TPM2_COMMAND (obj)) {
+        if (!resource_manager_defer_behind_retry (resmgr, TPM2_COMMAND (obj))) {
+            resource_manager_process_command (resmgr, TPM2_COMMAND (obj));
+        }
+    } else if (IS_CONTROL_MESSAGE (obj)) {
+        return resource_manager_process_control (resmgr, CONTROL_MESSAGE (obj));
+    }
+    return TRUE;
+}
+/*
+ * Process the next entry in the retry_queue if it's due. Returns TRUE if
+ * a command was processed.
+ */
+static gboolean
+resource_manager_retry_step (ResourceManager *resmgr)
+{
+    GList *link;
+    retry_entry_t *entry = NULL;
+
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    link = retry_queue_next (resmgr);
+    if (link != NULL &&
+        ((retry_entry_t*)link->data)->due <= g_get_monotonic_time ())
+    {
+        entry = (retry_entry_t*)link->data;
+        g_queue_delete_link (&resmgr->retry_queue, link);
+    }
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+    if (entry == NULL) {
+        return FALSE;
+    }
+    resmgr->retrying = entry->retries > 0 ? entry : NULL;
+    resource_manager_process_command (resmgr, entry->command);
+    /* answered without getting to the TPM, e.g. canceled */
+    if (resmgr->retrying != NULL) {
+        retry_policy_record (resmgr->retry_policy, entry->retries, FALSE);
+        resmgr->retrying = NULL;
+    }
+    retry_entry_free (entry);
+    return TRUE;
+}
+/*
+ * GSourceFunc for the retry_source: process the retries that are due and
+ * wait for the next one.
+ */
+static gboolean
+resource_manager_retry_timeout (gpointer user_data)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (user_data);
+
+    g_clear_pointer (&resmgr->retry_source, g_source_unref);
+    while (resource_manager_retry_step (resmgr));
+    resource_manager_schedule_retry (resmgr);
+    return G_SOURCE_REMOVE;
+}
+/*
+ * In run-to-completion mode there's no RM thread to wait for the next
+ * retry. A timeout on the caller's thread default GMainContext, the
+ * CommandSource's, processes it instead.
+ */
+static void
+resource_manager_schedule_retry (ResourceManager *resmgr)
+{
+    GMainContext *context;
+    gint64 wait;
+
+    if (resmgr->retry_source != NULL) {
+        g_source_destroy (resmgr->retry_source);
+        g_clear_pointer (&resmgr->retry_source, g_source_unref);
+    }
+    wait = resource_manager_retry_wait (resmgr);
+    if (wait == 0) {
+        return;
+    }
+    resmgr->retry_source =
+        g_timeout_source_new ((guint)((wait + G_TIME_SPAN_MILLISECOND - 1) /
+                                      G_TIME_SPAN_MILLISECOND));
+    g_source_set_callback (resmgr->retry_source,
+                           resource_manager_retry_timeout,
+                           resmgr,
+                           NULL);
+    context = g_main_context_ref_thread_default ();
+    g_source_attach (resmgr->retry_source, context);
+    g_main_context_unref (context);
+}
+/*
+ * MessageQueueMatchFunc matching the commands from the connection passed
+ * as 'user_data'.
+ */
+static gboolean
+command_from_connection (GObject  *obj,
+                         gpointer  user_data)
+{
+    Connection *connection;
+    gboolean ret;
+
+    if (!IS_TPM2_COMMAND (obj)) {
+        return FALSE;
+    }
+    connection = tpm2_command_get_connection (TPM2_COMMAND (obj));
+    ret = connection == CONNECTION (user_data);
+    g_object_unref (connection);
+    return ret;
+}
+/*
+ * Cancel the commands from 'connection'. This is called from the IPC
+ * frontend's thread, not the RM thread:
+ * - Commands still in the in_queue or waiting in the retry_queue are
+ *   removed and answered with TPM2_RC_CANCELED without going near the
+ *   TPM.
+ * - If the RM thread has picked up a command from the connection but not
+ *   sent it yet, it's answered with TPM2_RC_CANCELED when it would have
+ *   been sent.
+ * - If the command is executing in the TPM, the AccessBroker is asked to
+ *   cancel it. The TPM decides whether it can: the client gets either the
+ *   result of the command or TPM2_RC_CANCELED.
+ * The return value is TSS2_TCTI_RC_NOT_IMPLEMENTED when the command is in
+ * the TPM and the TCTI can't cancel, TSS2_RC_SUCCESS otherwise. A
+ * connection with nothing outstanding isn't an error: the response may
+ * well be on its way.
+ */
+TSS2_RC
+resource_manager_cancel (ResourceManager *resmgr,
+                         Connection      *connection)
+{
+    Tpm2Response *response;
+    GList *matched, *retries;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    guint count, i;
+
+    matched = message_queue_remove_matching (resmgr->in_queue,
+                                             command_from_connection,
+                                             connection);
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    retries = retry_queue_remove_connection (resmgr, connection);
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+    count = g_list_length (retries) + g_list_length (matched);
+    for (i = 0; i < count; ++i) {
+        response = tpm2_response_new_rc (connection, TPM2_RC_CANCELED);
+        sink_enqueue (resmgr->sink, G_OBJECT (response));
+        g_object_unref (response);
+    }
+    g_list_free_full (retries, retry_entry_free);
+    g_list_free_full (matched, g_object_unref);
+
+    pthread_mutex_lock (&resmgr->cancel_mutex);
+    resmgr->canceled += count;
+    if (resmgr->current == connection) {
+        if (resmgr->current_in_tpm) {
+            rc = access_broker_cancel (resmgr->access_broker);
+        } else {
+            resmgr->cancel_pending = TRUE;
+        }
+    }
+    pthread_mutex_unlock (&resmgr->cancel_mutex);
+    g_debug ("%s: %u queued commands canceled for connection %p, rc 0x%"
+             PRIx32, __func__, count, (void*)connection, rc);
+    return rc;
+}
 /**
  * This function acts as a thread. It simply:
  * - Blocks on the in_queue. Then wakes up and
@@ -1401,24 +3268,34 @@ resource_manager_thread (gpointer data)
     ResourceManager *resmgr = RESOURCE_MANAGER (data);
     GObject         *obj = NULL;
     gboolean done = FALSE;
+    gint64 wait;
 
     g_debug ("resource_manager_thread start");
     while (!done) {
-        obj = message_queue_dequeue (resmgr->in_queue);
+        if (resource_manager_retry_step (resmgr)) {
+            continue;
+        }
+        obj = message_queue_try_dequeue (resmgr->in_queue);
+        if (obj == NULL && resource_manager_idle (resmgr)) {
+            continue;
+        }
+        if (obj == NULL) {
+            wait = resource_manager_idle_wait (resmgr);
+            if (wait > 0) {
+                obj = message_queue_timeout_dequeue (resmgr->in_queue, wait);
+                if (obj == NULL) {
+                    continue;
+                }
+            } else {
+                obj = message_queue_dequeue (resmgr->in_queue);
+            }
+        }
         g_debug ("%s: message_queue_dequeue got obj", __func__);
         if (obj == NULL) {
             g_debug ("%s: dequeued a null object", __func__);
             break;
         }
-        if (IS_TPM2_COMMAND (obj)) {
-            resource_manager_process_tpm2_command (resmgr, TPM2_COMMAND (obj));
-        } else if (IS_CONTROL_MESSAGE (obj)) {
-            gboolean ret =
-                resource_manager_process_control (resmgr, CONTROL_MESSAGE (obj));
-            if (ret == FALSE) {
-                done = TRUE;
-            }
-        }
+        done = !resource_manager_process_message (resmgr, obj);
         g_object_unref (obj);
     }
 
@@ -1437,9 +3314,39 @@ resource_manager_unblock (Thread *self)
     message_queue_enqueue (resmgr->in_queue, G_OBJECT (msg));
     g_object_unref (msg);
 }
+/*
+ * The client is gone so there's nobody to answer: drop its queued commands
+ * before they get to the TPM. The CONNECTION_REMOVED message that follows
+ * them cleans up whatever the connection left behind.
+ */
+static void
+resource_manager_purge_connection (ResourceManager *resmgr,
+                                   Connection      *connection)
+{
+    GList *matched;
+    guint count;
+
+    matched = message_queue_remove_matching (resmgr->in_queue,
+                                             command_from_connection,
+                                             connection);
+    count = g_list_length (matched);
+    g_list_free_full (matched, g_object_unref);
+    if (count > 0) {
+        g_debug ("%s: dropped %u commands from connection %p", __func__,
+                 count, (void*)connection);
+        resmgr->purged += count;
+        admission_control_release (connection, count);
+    }
+}
 /**
  * Implement the 'enqueue' function from the Sink interface. This is how
  * new messages / commands get into the AccessBroker.
+ *
+ * When the ResourceManager is inline (run-to-completion mode) there is no
+ * thread to hand the message to: it's processed on the caller's thread.
+ * The idle work the thread would do between messages gets a single step
+ * after each one so it still makes progress, and a timer is set for the
+ * commands waiting to be retried.
  */
 void
 resource_manager_enqueue (Sink        *sink,
@@ -1448,8 +3355,55 @@ resource_manager_enqueue (Sink        *sink,
     ResourceManager *resmgr = RESOURCE_MANAGER (sink);
 
     g_debug ("%s", __func__);
+    if (IS_CONTROL_MESSAGE (obj) &&
+        control_message_get_code (CONTROL_MESSAGE (obj)) == CONNECTION_REMOVED)
+    {
+        resource_manager_purge_connection (resmgr,
+            CONNECTION (control_message_get_object (CONTROL_MESSAGE (obj))));
+    }
+    if (thread_is_inline (THREAD (resmgr))) {
+        resource_manager_process_message (resmgr, obj);
+        resource_manager_idle (resmgr);
+        resource_manager_schedule_retry (resmgr);
+        return;
+    }
     message_queue_enqueue (resmgr->in_queue, obj);
 }
+/*
+ * Take a snapshot of the daemon wide statistics. Nothing here takes a lock
+ * that the RM thread or the AccessBroker hold while processing a command so
+ * this is safe to call from the D-Bus thread as often as a monitor likes.
+ * The fields are read one at a time so they aren't a consistent snapshot
+ * of a single instant, which doesn't matter for rates.
+ */
+void
+resource_manager_get_stats (ResourceManager          *resmgr,
+                            resource_manager_stats_t *stats)
+{
+    access_broker_stats_t broker_stats;
+    retry_policy_stats_t retry_stats;
+
+    g_assert (resmgr != NULL);
+    g_assert (stats != NULL);
+
+    stats->commands = __atomic_load_n (&resmgr->commands, __ATOMIC_RELAXED);
+    stats->queue_depth = message_queue_get_length (resmgr->in_queue);
+    stats->queue_high_water = message_queue_get_high_water (resmgr->in_queue);
+    access_broker_get_stats (resmgr->access_broker, &broker_stats);
+    stats->tpm_busy_us = broker_stats.busy_us;
+    stats->context_loads = broker_stats.context_loads;
+    stats->context_saves = broker_stats.context_saves;
+    if (resmgr->retry_policy != NULL) {
+        retry_policy_get_stats (resmgr->retry_policy, &retry_stats);
+        stats->retried = retry_stats.retried;
+        stats->retries = retry_stats.retries;
+        stats->retries_exhausted = retry_stats.exhausted;
+    } else {
+        stats->retried = 0;
+        stats->retries = 0;
+        stats->retries_exhausted = 0;
+    }
+}
 /**
  * Implement the 'add_sink' function from the SourceInterface. This adds a
  * reference to an object that implements the SinkInterface to this objects
@@ -1499,10 +3453,49 @@ resource_manager_set_property (GObject        *object,
         }
         resmgr->access_broker = g_value_get_object (value);
         g_object_ref (resmgr->access_broker);
+        resource_manager_update_busy_func (resmgr);
         break;
     case PROP_SESSION_LIST:
         resmgr->session_list = SESSION_LIST (g_value_dup_object (value));
         break;
+    case PROP_CONTEXT_STORE:
+        g_clear_object (&resmgr->context_store);
+        resmgr->context_store = g_value_dup_object (value);
+        break;
+    case PROP_PRIMARY_CACHE:
+        g_clear_object (&resmgr->primary_cache);
+        resmgr->primary_cache = g_value_dup_object (value);
+        resource_manager_update_busy_func (resmgr);
+        break;
+    case PROP_LOAD_CACHE:
+        g_clear_object (&resmgr->load_cache);
+        resmgr->load_cache = g_value_dup_object (value);
+        resource_manager_update_busy_func (resmgr);
+        break;
+    case PROP_NV_PUBLIC_CACHE:
+        resmgr->nv_public_cache_enabled = g_value_get_boolean (value);
+        g_hash_table_remove_all (resmgr->nv_public_cache);
+        break;
+    case PROP_PCR_CACHE:
+        g_clear_object (&resmgr->pcr_cache);
+        resmgr->pcr_cache = g_value_dup_object (value);
+        break;
+    case PROP_RANDOM_POOL:
+        g_clear_object (&resmgr->random_pool);
+        resmgr->random_pool = g_value_dup_object (value);
+        break;
+    case PROP_COALESCE_CODES:
+        g_clear_pointer (&resmgr->coalesce_codes, g_hash_table_unref);
+        resmgr->coalesce_codes = g_value_dup_boxed (value);
+        break;
+    case PROP_RETRY_POLICY:
+        g_clear_object (&resmgr->retry_policy);
+        resmgr->retry_policy = g_value_dup_object (value);
+        break;
+    case PROP_SELF_TEST:
+        g_clear_object (&resmgr->self_test);
+        resmgr->self_test = g_value_dup_object (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1533,6 +3526,33 @@ resource_manager_get_property (GObject     *object,
     case PROP_SESSION_LIST:
         g_value_set_object (value, resmgr->session_list);
         break;
+    case PROP_CONTEXT_STORE:
+        g_value_set_object (value, resmgr->context_store);
+        break;
+    case PROP_PRIMARY_CACHE:
+        g_value_set_object (value, resmgr->primary_cache);
+        break;
+    case PROP_LOAD_CACHE:
+        g_value_set_object (value, resmgr->load_cache);
+        break;
+    case PROP_NV_PUBLIC_CACHE:
+        g_value_set_boolean (value, resmgr->nv_public_cache_enabled);
+        break;
+    case PROP_PCR_CACHE:
+        g_value_set_object (value, resmgr->pcr_cache);
+        break;
+    case PROP_RANDOM_POOL:
+        g_value_set_object (value, resmgr->random_pool);
+        break;
+    case PROP_COALESCE_CODES:
+        g_value_set_boxed (value, resmgr->coalesce_codes);
+        break;
+    case PROP_RETRY_POLICY:
+        g_value_set_object (value, resmgr->retry_policy);
+        break;
+    case PROP_SELF_TEST:
+        g_value_set_object (value, resmgr->self_test);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1546,22 +3566,78 @@ resource_manager_dispose (GObject *obj)
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (obj);
     Thread *thread = THREAD (obj);
+    retry_entry_t *entry;
 
     g_debug ("%s", __func__);
     if (resmgr == NULL)
         g_error ("%s: passed NULL parameter", __func__);
     if (thread->thread_id != 0)
         g_error ("%s: thread running, cancel thread first", __func__);
+    if (resmgr->in_queue != NULL) {
+        g_info ("%s: input queue high water mark: %u messages", __func__,
+                message_queue_get_high_water (resmgr->in_queue));
+    }
     g_clear_object (&resmgr->in_queue);
     g_clear_object (&resmgr->sink);
+    if (resmgr->access_broker != NULL) {
+        access_broker_set_busy_func (resmgr->access_broker, NULL, NULL);
+        g_debug ("%s: %" PRIu64 " commands prepared while the TPM was busy",
+                 __func__, resmgr->prepared_while_busy);
+    }
     g_clear_object (&resmgr->access_broker);
     g_clear_object (&resmgr->session_list);
+    g_clear_object (&resmgr->context_store);
+    object_cache_log_stats ("primary cache", resmgr->primary_cache);
+    object_cache_log_stats ("load cache", resmgr->load_cache);
+    g_clear_object (&resmgr->primary_cache);
+    g_clear_object (&resmgr->load_cache);
+    g_clear_pointer (&resmgr->nv_public_cache, g_hash_table_unref);
+    g_clear_object (&resmgr->pcr_cache);
+    random_pool_log_stats (resmgr->random_pool);
+    g_clear_object (&resmgr->random_pool);
+    if (resmgr->coalesce_codes != NULL) {
+        g_info ("%s: %" PRIu64 " commands coalesced", __func__,
+                resmgr->coalesced);
+    }
+    g_clear_pointer (&resmgr->coalesce_codes, g_hash_table_unref);
+    if (resmgr->retry_source != NULL) {
+        g_source_destroy (resmgr->retry_source);
+        g_clear_pointer (&resmgr->retry_source, g_source_unref);
+    }
+    while ((entry = g_queue_pop_head (&resmgr->retry_queue)) != NULL) {
+        retry_entry_free (entry);
+    }
+    retry_policy_log_stats (resmgr->retry_policy);
+    g_clear_object (&resmgr->retry_policy);
+    g_info ("%s: %" PRIu64 " sessions regapped while idle, %" PRIu64
+            " TPM2_RC_CONTEXT_GAP responses handled", __func__,
+            resmgr->regaps, resmgr->context_gaps);
+    g_info ("%s: %" PRIu64 " sessions saved to free a TPM session slot",
+            __func__, resmgr->sessions_evicted);
+    self_test_log_result (resmgr->self_test);
+    g_clear_object (&resmgr->self_test);
+    g_info ("%s: %" PRIu64 " commands canceled, %" PRIu64 " dropped for "
+            "closed connections", __func__, resmgr->canceled, resmgr->purged);
     G_OBJECT_CLASS (resource_manager_parent_class)->dispose (obj);
 }
 static void
+resource_manager_finalize (GObject *obj)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (obj);
+
+    pthread_mutex_destroy (&resmgr->cancel_mutex);
+    G_OBJECT_CLASS (resource_manager_parent_class)->finalize (obj);
+}
+static void
 resource_manager_init (ResourceManager *manager)
 {
-    UNUSED_PARAM (manager);
+    pthread_mutex_init (&manager->cancel_mutex, NULL);
+    g_queue_init (&manager->retry_queue);
+    manager->nv_public_cache =
+        g_hash_table_new_full (g_direct_hash,
+                               g_direct_equal,
+                               NULL,
+                               (GDestroyNotify)g_bytes_unref);
 }
 /**
  * GObject class initialization function. This function boils down to:
@@ -1578,6 +3654,7 @@ resource_manager_class_init (ResourceManagerClass *klass)
     if (resource_manager_parent_class == NULL)
         resource_manager_parent_class = g_type_class_peek_parent (klass);
     object_class->dispose = resource_manager_dispose;
+    object_class->finalize = resource_manager_finalize;
     object_class->get_property = resource_manager_get_property;
     object_class->set_property = resource_manager_set_property;
     thread_class->thread_run     = resource_manager_thread;
@@ -1607,6 +3684,60 @@ resource_manager_class_init (ResourceManagerClass *klass)
                              "Data structure to hold session tracking data",
                              TYPE_SESSION_LIST,
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_CONTEXT_STORE] =
+        g_param_spec_object ("context-store",
+                             "ContextStore object",
+                             "Memory budgeted storage for saved contexts",
+                             TYPE_CONTEXT_STORE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_PRIMARY_CACHE] =
+        g_param_spec_object ("primary-cache",
+                             "ObjectCache for primary objects",
+                             "Cache of CreatePrimary results",
+                             TYPE_OBJECT_CACHE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_LOAD_CACHE] =
+        g_param_spec_object ("load-cache",
+                             "ObjectCache for loaded objects",
+                             "Cache of Load results",
+                             TYPE_OBJECT_CACHE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_NV_PUBLIC_CACHE] =
+        g_param_spec_boolean ("nv-public-cache",
+                              "NV_ReadPublic cache",
+                              "Answer NV_ReadPublic from a per-index cache",
+                              FALSE,
+                              G_PARAM_READWRITE);
+    obj_properties [PROP_PCR_CACHE] =
+        g_param_spec_object ("pcr-cache",
+                             "PcrCache",
+                             "Cache of PCR_Read responses",
+                             TYPE_PCR_CACHE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_RANDOM_POOL] =
+        g_param_spec_object ("random-pool",
+                             "RandomPool",
+                             "Pool of TPM random bytes for GetRandom",
+                             TYPE_RANDOM_POOL,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_COALESCE_CODES] =
+        g_param_spec_boxed ("coalesce-codes",
+                            "Coalesce codes",
+                            "Set of command codes eligible for coalescing",
+                            G_TYPE_HASH_TABLE,
+                            G_PARAM_READWRITE);
+    obj_properties [PROP_RETRY_POLICY] =
+        g_param_spec_object ("retry-policy",
+                             "RetryPolicy",
+                             "Policy for resubmitting commands the TPM asks to retry",
+                             TYPE_RETRY_POLICY,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_SELF_TEST] =
+        g_param_spec_object ("self-test",
+                             "SelfTest",
+                             "Algorithms to self test while idle",
+                             TYPE_SELF_TEST,
+                             G_PARAM_READWRITE);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
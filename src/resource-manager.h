@@ -13,7 +13,13 @@
 
 #include "access-broker.h"
 #include "connection-manager.h"
+#include "context-store.h"
 #include "message-queue.h"
+#include "object-cache.h"
+#include "pcr-cache.h"
+#include "random-pool.h"
+#include "retry-policy.h"
+#include "self-test.h"
 #include "session-list.h"
 #include "sink-interface.h"
 #include "thread.h"
@@ -24,12 +30,76 @@ typedef struct _ResourceManagerClass {
     ThreadClass      parent;
 } ResourceManagerClass;
 
+/*
+ * Daemon wide totals returned by resource_manager_get_stats. These are
+ * monotonic counters (except 'queue_depth'): a monitor takes the
+ * difference between two snapshots to get rates.
+ */
+typedef struct {
+    guint64           commands;
+    guint             queue_depth;
+    guint             queue_high_water;
+    guint64           tpm_busy_us;
+    guint64           context_loads;
+    guint64           context_saves;
+    guint64           retried;
+    guint64           retries;
+    guint64           retries_exhausted;
+} resource_manager_stats_t;
+
+/*
+ * A command waiting in the retry_queue. 'retries' is the number of times
+ * it will have been resubmitted once it's sent, 0 for a command that's only
+ * waiting behind an older one from the same connection. 'due' is when it
+ * may be sent and 'deadline' when its retry budget runs out.
+ */
+typedef struct {
+    Tpm2Command      *command;
+    gint64            due;
+    gint64            deadline;
+    gulong            delay;
+    guint             retries;
+} retry_entry_t;
+
 typedef struct _ResourceManager {
     Thread            parent_instance;
     AccessBroker     *access_broker;
     MessageQueue     *in_queue;
     Sink             *sink;
     SessionList      *session_list;
+    ContextStore     *context_store;
+    ObjectCache      *primary_cache;
+    ObjectCache      *load_cache;
+    gboolean          nv_public_cache_enabled;
+    GHashTable       *nv_public_cache;
+    PcrCache         *pcr_cache;
+    RandomPool       *random_pool;
+    GHashTable       *coalesce_codes;
+    guint64           coalesced;
+    guint64           prepared_while_busy;
+    RetryPolicy      *retry_policy;
+    retry_entry_t    *retrying;
+    GSource          *retry_source;
+    SelfTest         *self_test;
+    guint64           context_counter;
+    guint32           context_gap_max;
+    guint64           regaps;
+    guint64           context_gaps;
+    guint64           sessions_evicted;
+    /*
+     * Cancel requests come in on the IPC frontend's thread. These track
+     * the command the RM thread is working on and the commands waiting to
+     * be retried, and are protected by the cancel_mutex.
+     */
+    pthread_mutex_t   cancel_mutex;
+    GQueue            retry_queue;
+    Connection       *current;
+    gboolean          current_in_tpm;
+    gboolean          cancel_pending;
+    guint64           canceled;
+    guint64           purged;
+    /* commands processed, updated with atomic ops */
+    guint64           commands;
 } ResourceManager;
 
 #define TYPE_RESOURCE_MANAGER              (resource_manager_get_type ())
@@ -53,10 +123,24 @@ TSS2_RC               resource_manager_virt_to_phys      (ResourceManager *resmg
                                                           Tpm2Command     *command,
                                                           HandleMapEntry  *entry,
                                                           guint8           handle_number);
+gboolean              resource_manager_idle              (ResourceManager *resmgr);
 void                  resource_manager_enqueue           (Sink            *sink,
                                                           GObject         *obj);
 void                  resource_manager_remove_connection (ResourceManager *resource_manager,
                                                           Connection      *connection);
+TSS2_RC               resource_manager_cancel (ResourceManager *resmgr,
+                                               Connection      *connection);
+void                  resource_manager_get_stats (ResourceManager          *resmgr,
+                                                  resource_manager_stats_t *stats);
 TSS2_RC               get_cap_post_process (Tpm2Response *resp);
+gboolean              handle_rc (ResourceManager *resmgr,
+                                 TSS2_RC          rc,
+                                 Connection      *connection);
+gboolean              resource_manager_evict_session (ResourceManager *resmgr,
+                                                      Connection      *exclude);
+GBytes*               create_primary_cache_key (ResourceManager *resmgr,
+                                                Tpm2Command     *command);
+GBytes*               create_load_cache_key (ResourceManager *resmgr,
+                                             Tpm2Command     *command);
 G_END_DECLS
 #endif /* RESOURCE_MANAGER_H */
@@ -8,9 +8,11 @@
 #include <inttypes.h>
 #include <pthread.h>
 
+#include "admission-control.h"
 #include "connection.h"
 #include "sink-interface.h"
 #include "response-sink.h"
+#include "tabrmd-probes.h"
 #include "control-message.h"
 #include "tpm2-response.h"
 #include "util.h"
@@ -47,6 +49,12 @@ response_sink_enqueue (Sink            *self,
         g_error ("  passed NULL sink");
     if (obj == NULL)
         g_error ("  passed NULL object");
+    if (thread_is_inline (THREAD (sink))) {
+        /* run-to-completion: write on the caller's thread */
+        if (IS_TPM2_RESPONSE (obj))
+            response_sink_process_response (TPM2_RESPONSE (obj));
+        return;
+    }
     message_queue_enqueue (sink->in_queue, obj);
 }
 /**
@@ -185,10 +193,19 @@ response_sink_process_response (Tpm2Response *response)
     Connection  *connection = tpm2_response_get_connection (response);
     GIOStream   *iostream = connection_get_iostream (connection);
     GOutputStream *ostream = g_io_stream_get_output_stream (iostream);
+    connection_stats_t delta = { 0, };
 
     g_debug ("%s: writing 0x%x bytes", __func__, size);
     g_debug_bytes (buffer, size, 16, 4);
     written = write_all (ostream, buffer, size);
+    TABRMD_PROBE4 (response_write, connection->id,
+                   tpm2_response_get_code (response), size, written);
+    if (written > 0) {
+        delta.bytes_out = (guint64)written;
+        connection_stats_add (connection, &delta);
+    }
+    /* answered, even if the client is gone: let the next command in */
+    admission_control_release (connection, 1);
     g_object_unref (connection);
 
     return written;
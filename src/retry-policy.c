@@ -0,0 +1,259 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include "retry-policy.h"
+#include "util.h"
+
+G_DEFINE_TYPE (RetryPolicy, retry_policy, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_BUDGET,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+
+static void
+retry_policy_get_property (GObject     *object,
+                           guint        property_id,
+                           GValue      *value,
+                           GParamSpec  *pspec)
+{
+    RetryPolicy *self = RETRY_POLICY (object);
+
+    switch (property_id) {
+    case PROP_BUDGET:
+        g_value_set_uint (value, self->budget);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+retry_policy_set_property (GObject        *object,
+                           guint           property_id,
+                           GValue const   *value,
+                           GParamSpec     *pspec)
+{
+    RetryPolicy *self = RETRY_POLICY (object);
+
+    switch (property_id) {
+    case PROP_BUDGET:
+        self->budget = g_value_get_uint (value);
+        g_debug ("%s: budget: %u ms", __func__, self->budget);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+retry_policy_init (RetryPolicy *policy)
+{
+    pthread_mutex_init (&policy->mutex, NULL);
+    policy->budgets = g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+static void
+retry_policy_finalize (GObject *object)
+{
+    RetryPolicy *policy = RETRY_POLICY (object);
+
+    g_clear_pointer (&policy->budgets, g_hash_table_unref);
+    pthread_mutex_destroy (&policy->mutex);
+    G_OBJECT_CLASS (retry_policy_parent_class)->finalize (object);
+}
+static void
+retry_policy_class_init (RetryPolicyClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (retry_policy_parent_class == NULL)
+        retry_policy_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = retry_policy_finalize;
+    object_class->get_property = retry_policy_get_property;
+    object_class->set_property = retry_policy_set_property;
+
+    obj_properties [PROP_BUDGET] =
+        g_param_spec_uint ("budget",
+                           "budget",
+                           "Default milliseconds spent retrying a command",
+                           0,
+                           RETRY_POLICY_BUDGET_MAX_MS,
+                           0,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+RetryPolicy*
+retry_policy_new (guint budget)
+{
+    return RETRY_POLICY (g_object_new (TYPE_RETRY_POLICY,
+                                       "budget", budget,
+                                       NULL));
+}
+/*
+ * Parse a budget in milliseconds. Returns FALSE if 'str' isn't a number or
+ * is out of range.
+ */
+static gboolean
+retry_policy_parse_ms (const gchar *str,
+                       guint       *ms)
+{
+    guint64 value;
+    gchar *end;
+
+    value = g_ascii_strtoull (str, &end, 0);
+    if (end == str || *end != '\0' || value > RETRY_POLICY_BUDGET_MAX_MS) {
+        return FALSE;
+    }
+    *ms = (guint)value;
+    return TRUE;
+}
+/*
+ * Create a RetryPolicy from a comma separated list. A bare number is the
+ * default budget in milliseconds, a 'code:ms' pair sets the budget for a
+ * single command code, e.g. "250,0x131:2000". Returns NULL on error.
+ */
+RetryPolicy*
+retry_policy_parse (const gchar *str)
+{
+    RetryPolicy *policy = NULL;
+    gchar **tokens, **pair;
+    gchar *end, *bad = NULL;
+    guint64 code;
+    guint budget = 0, ms;
+    size_t i;
+
+    g_assert_nonnull (str);
+    tokens = g_strsplit (str, ",", -1);
+    /* the default budget is a construct property, find it first */
+    for (i = 0; tokens [i] != NULL && bad == NULL; ++i) {
+        if (strchr (tokens [i], ':') == NULL &&
+            !retry_policy_parse_ms (tokens [i], &budget))
+        {
+            bad = tokens [i];
+        }
+    }
+    if (bad == NULL) {
+        policy = retry_policy_new (budget);
+    }
+    for (i = 0; tokens [i] != NULL && bad == NULL; ++i) {
+        if (strchr (tokens [i], ':') == NULL) {
+            continue;
+        }
+        pair = g_strsplit (tokens [i], ":", 2);
+        code = g_ascii_strtoull (pair [0], &end, 0);
+        if (end != pair [0] && *end == '\0' && code <= UINT32_MAX &&
+            retry_policy_parse_ms (pair [1], &ms))
+        {
+            retry_policy_set_budget (policy, (TPM2_CC)code, ms);
+        } else {
+            bad = tokens [i];
+        }
+        g_strfreev (pair);
+    }
+    if (bad != NULL) {
+        g_critical ("invalid retry budget: \"%s\"", bad);
+        g_clear_object (&policy);
+    }
+    g_strfreev (tokens);
+    return policy;
+}
+/*
+ * Override the default budget for a single command code. A budget of 0
+ * disables retries for the command.
+ */
+void
+retry_policy_set_budget (RetryPolicy *policy,
+                         TPM2_CC      command_code,
+                         guint        budget)
+{
+    g_assert_nonnull (policy);
+    pthread_mutex_lock (&policy->mutex);
+    g_hash_table_insert (policy->budgets,
+                         GUINT_TO_POINTER (command_code),
+                         GUINT_TO_POINTER (budget));
+    pthread_mutex_unlock (&policy->mutex);
+}
+/* Milliseconds a command with the given code may spend being retried. */
+guint
+retry_policy_get_budget (RetryPolicy *policy,
+                         TPM2_CC      command_code)
+{
+    gpointer value;
+    guint budget;
+
+    g_assert_nonnull (policy);
+    pthread_mutex_lock (&policy->mutex);
+    if (g_hash_table_lookup_extended (policy->budgets,
+                                      GUINT_TO_POINTER (command_code),
+                                      NULL,
+                                      &value))
+    {
+        budget = GPOINTER_TO_UINT (value);
+    } else {
+        budget = policy->budget;
+    }
+    pthread_mutex_unlock (&policy->mutex);
+    return budget;
+}
+/*
+ * The TPM returns these when it didn't execute the command but would if
+ * the command were sent again unchanged.
+ */
+gboolean
+retry_policy_rc_is_retryable (TSS2_RC rc)
+{
+    switch (rc) {
+    case TPM2_RC_RETRY:
+    case TPM2_RC_YIELDED:
+    case TPM2_RC_TESTING:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+/* Exponential backoff: the delay after 'delay' microseconds. */
+gulong
+retry_policy_next_delay (gulong delay)
+{
+    if (delay < RETRY_POLICY_DELAY_MIN_US) {
+        return RETRY_POLICY_DELAY_MIN_US;
+    }
+    return MIN (delay * 2, RETRY_POLICY_DELAY_MAX_US);
+}
+/*
+ * Account for a command that was resubmitted 'retries' times. 'exhausted'
+ * is TRUE if the budget ran out before the TPM executed the command.
+ */
+void
+retry_policy_record (RetryPolicy *policy,
+                     guint        retries,
+                     gboolean     exhausted)
+{
+    g_assert_nonnull (policy);
+    pthread_mutex_lock (&policy->mutex);
+    if (retries > 0) {
+        ++policy->retried;
+        policy->retries += retries;
+    }
+    if (exhausted) {
+        ++policy->exhausted;
+    }
+    pthread_mutex_unlock (&policy->mutex);
+}
+void
+retry_policy_get_stats (RetryPolicy          *policy,
+                        retry_policy_stats_t *stats)
+{
+    g_assert_nonnull (policy);
+    g_assert_nonnull (stats);
+    pthread_mutex_lock (&policy->mutex);
+    stats->retried = policy->retried;
+    stats->retries = policy->retries;
+    stats->exhausted = policy->exhausted;
+    pthread_mutex_unlock (&policy->mutex);
+}
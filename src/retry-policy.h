@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef RETRY_POLICY_H
+#define RETRY_POLICY_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+#include <tss2/tss2_tpm2_types.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Backoff between resubmissions starts at the minimum delay and doubles up
+ * to the maximum. The budget is the total time a single command may spend
+ * being retried.
+ */
+#define RETRY_POLICY_DELAY_MIN_US  1000
+#define RETRY_POLICY_DELAY_MAX_US  100000
+#define RETRY_POLICY_BUDGET_MAX_MS 60000
+
+typedef struct {
+    guint64           retried;
+    guint64           retries;
+    guint64           exhausted;
+} retry_policy_stats_t;
+
+typedef struct _RetryPolicyClass {
+    GObjectClass      parent;
+} RetryPolicyClass;
+
+typedef struct _RetryPolicy {
+    GObject           parent_instance;
+    pthread_mutex_t   mutex;
+    guint             budget;
+    GHashTable       *budgets;
+    guint64           retried;
+    guint64           retries;
+    guint64           exhausted;
+} RetryPolicy;
+
+#define TYPE_RETRY_POLICY              (retry_policy_get_type   ())
+#define RETRY_POLICY(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_RETRY_POLICY, RetryPolicy))
+#define RETRY_POLICY_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_RETRY_POLICY, RetryPolicyClass))
+#define IS_RETRY_POLICY(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_RETRY_POLICY))
+#define IS_RETRY_POLICY_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_RETRY_POLICY))
+#define RETRY_POLICY_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_RETRY_POLICY, RetryPolicyClass))
+
+GType          retry_policy_get_type     (void);
+RetryPolicy*   retry_policy_new          (guint           budget);
+RetryPolicy*   retry_policy_parse        (const gchar    *str);
+void           retry_policy_set_budget   (RetryPolicy    *policy,
+                                          TPM2_CC         command_code,
+                                          guint           budget);
+guint          retry_policy_get_budget   (RetryPolicy    *policy,
+                                          TPM2_CC         command_code);
+gboolean       retry_policy_rc_is_retryable (TSS2_RC      rc);
+gulong         retry_policy_next_delay   (gulong          delay);
+void           retry_policy_record       (RetryPolicy    *policy,
+                                          guint           retries,
+                                          gboolean        exhausted);
+void           retry_policy_get_stats    (RetryPolicy    *policy,
+                                          retry_policy_stats_t *stats);
+
+G_END_DECLS
+#endif /* RETRY_POLICY_H */
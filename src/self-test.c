@@ -0,0 +1,344 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include "self-test.h"
+#include "util.h"
+
+G_DEFINE_TYPE (SelfTest, self_test, G_TYPE_OBJECT);
+
+/* algorithm names accepted by self_test_parse */
+static const struct {
+    const gchar *name;
+    TPM2_ALG_ID  alg;
+} self_test_alg_names [] = {
+    { "rsa",       TPM2_ALG_RSA },
+    { "sha1",      TPM2_ALG_SHA1 },
+    { "hmac",      TPM2_ALG_HMAC },
+    { "aes",       TPM2_ALG_AES },
+    { "keyedhash", TPM2_ALG_KEYEDHASH },
+    { "sha256",    TPM2_ALG_SHA256 },
+    { "sha384",    TPM2_ALG_SHA384 },
+    { "sha512",    TPM2_ALG_SHA512 },
+    { "rsassa",    TPM2_ALG_RSASSA },
+    { "rsapss",    TPM2_ALG_RSAPSS },
+    { "oaep",      TPM2_ALG_OAEP },
+    { "ecdsa",     TPM2_ALG_ECDSA },
+    { "ecdh",      TPM2_ALG_ECDH },
+    { "ecc",       TPM2_ALG_ECC },
+    { "cfb",       TPM2_ALG_CFB },
+};
+
+static void
+self_test_init (SelfTest *self_test)
+{
+    pthread_mutex_init (&self_test->mutex, NULL);
+    self_test->algs = g_array_new (FALSE, FALSE, sizeof (TPM2_ALG_ID));
+    self_test->pending = g_array_new (FALSE, FALSE, sizeof (TPM2_ALG_ID));
+    self_test->attempted = g_array_new (FALSE, FALSE, sizeof (TPM2_ALG_ID));
+    self_test->state = SELF_TEST_QUERY;
+    self_test->result = TPM2_RC_SUCCESS;
+    self_test->backoff_us = SELF_TEST_BACKOFF_MIN_US;
+}
+static void
+self_test_finalize (GObject *object)
+{
+    SelfTest *self_test = SELF_TEST (object);
+
+    g_debug ("%s: %" PRIu64 " rounds, %" PRIu64 " algorithms tested",
+             __func__, self_test->rounds, self_test->tests);
+    g_array_unref (self_test->algs);
+    g_array_unref (self_test->pending);
+    g_array_unref (self_test->attempted);
+    pthread_mutex_destroy (&self_test->mutex);
+    G_OBJECT_CLASS (self_test_parent_class)->finalize (object);
+}
+static void
+self_test_class_init (SelfTestClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (self_test_parent_class == NULL)
+        self_test_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = self_test_finalize;
+}
+/*
+ * Create a SelfTest for the 'count' algorithms in 'algs'. A count of 0
+ * means every algorithm the TPM reports as untested.
+ */
+SelfTest*
+self_test_new (const TPM2_ALG_ID *algs,
+               guint              count)
+{
+    SelfTest *self_test;
+
+    self_test = SELF_TEST (g_object_new (TYPE_SELF_TEST, NULL));
+    if (count > 0) {
+        g_array_append_vals (self_test->algs, algs, count);
+    }
+    return self_test;
+}
+static gboolean
+self_test_parse_alg (const gchar *str,
+                     TPM2_ALG_ID *alg)
+{
+    guint64 value;
+    gchar *end;
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS (self_test_alg_names); ++i) {
+        if (g_ascii_strcasecmp (str, self_test_alg_names [i].name) == 0) {
+            *alg = self_test_alg_names [i].alg;
+            return TRUE;
+        }
+    }
+    value = g_ascii_strtoull (str, &end, 0);
+    if (end == str || *end != '\0' || value > UINT16_MAX) {
+        return FALSE;
+    }
+    *alg = (TPM2_ALG_ID)value;
+    return TRUE;
+}
+/*
+ * Create a SelfTest from 'all' or a comma separated list of algorithm
+ * names or numeric algorithm IDs. Returns NULL on error.
+ */
+SelfTest*
+self_test_parse (const gchar *str)
+{
+    SelfTest *self_test;
+    GArray *algs;
+    gchar **tokens;
+    TPM2_ALG_ID alg;
+    size_t i;
+
+    g_assert_nonnull (str);
+    if (g_strcmp0 (str, "all") == 0) {
+        return self_test_new (NULL, 0);
+    }
+    algs = g_array_new (FALSE, FALSE, sizeof (TPM2_ALG_ID));
+    tokens = g_strsplit (str, ",", -1);
+    for (i = 0; tokens [i] != NULL; ++i) {
+        if (!self_test_parse_alg (tokens [i], &alg)) {
+            g_critical ("invalid algorithm in self test list: \"%s\"",
+                        tokens [i]);
+            break;
+        }
+        g_array_append_val (algs, alg);
+    }
+    if (tokens [i] == NULL && algs->len > 0) {
+        self_test = self_test_new ((TPM2_ALG_ID*)algs->data, algs->len);
+    } else {
+        self_test = NULL;
+    }
+    g_strfreev (tokens);
+    g_array_unref (algs);
+    return self_test;
+}
+static gboolean
+alg_array_contains (GArray      *array,
+                    TPM2_ALG_ID  alg)
+{
+    guint i;
+
+    for (i = 0; i < array->len; ++i) {
+        if (g_array_index (array, TPM2_ALG_ID, i) == alg) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+/*
+ * Start a new round. Called when the daemon starts and after the TPM is
+ * started again (e.g. on resume) since the TPM may test again.
+ */
+void
+self_test_reset (SelfTest *self_test)
+{
+    g_assert_nonnull (self_test);
+    pthread_mutex_lock (&self_test->mutex);
+    g_array_set_size (self_test->pending, 0);
+    g_array_set_size (self_test->attempted, 0);
+    self_test->state = SELF_TEST_QUERY;
+    self_test->requeries = 0;
+    self_test->retry_at = 0;
+    self_test->backoff_us = SELF_TEST_BACKOFF_MIN_US;
+    pthread_mutex_unlock (&self_test->mutex);
+}
+SelfTestState
+self_test_get_state (SelfTest *self_test)
+{
+    SelfTestState state;
+
+    g_assert_nonnull (self_test);
+    pthread_mutex_lock (&self_test->mutex);
+    state = self_test->state;
+    pthread_mutex_unlock (&self_test->mutex);
+    return state;
+}
+/*
+ * Update the pending list from the toDoList returned by the TPM. Only the
+ * configured algorithms that we haven't already asked the TPM to test in
+ * this round are kept: a TPM testing in the background may still report
+ * an algorithm it's working on.
+ */
+void
+self_test_set_to_do (SelfTest       *self_test,
+                     const TPML_ALG *to_do)
+{
+    TPM2_ALG_ID alg;
+    guint32 i;
+
+    g_assert_nonnull (self_test);
+    g_assert_nonnull (to_do);
+    pthread_mutex_lock (&self_test->mutex);
+    g_array_set_size (self_test->pending, 0);
+    self_test->untested = 0;
+    for (i = 0; i < to_do->count && i < TPM2_MAX_ALG_LIST_SIZE; ++i) {
+        alg = to_do->algorithms [i];
+        if (self_test->algs->len > 0 &&
+            !alg_array_contains (self_test->algs, alg))
+        {
+            continue;
+        }
+        ++self_test->untested;
+        if (!alg_array_contains (self_test->attempted, alg)) {
+            g_array_append_val (self_test->pending, alg);
+        }
+    }
+    if (self_test->pending->len > 0) {
+        self_test->backoff_us = SELF_TEST_BACKOFF_MIN_US;
+    }
+    self_test->state = self_test->pending->len > 0 ?
+        SELF_TEST_RUN : SELF_TEST_RESULT;
+    pthread_mutex_unlock (&self_test->mutex);
+}
+/*
+ * Get the next algorithm to test. Returns FALSE when there's none left, in
+ * which case the round moves on to reading the test result.
+ */
+gboolean
+self_test_next (SelfTest    *self_test,
+                TPM2_ALG_ID *alg)
+{
+    gboolean ret = FALSE;
+
+    g_assert_nonnull (self_test);
+    g_assert_nonnull (alg);
+    pthread_mutex_lock (&self_test->mutex);
+    if (self_test->pending->len > 0) {
+        *alg = g_array_index (self_test->pending, TPM2_ALG_ID, 0);
+        g_array_remove_index (self_test->pending, 0);
+        g_array_append_val (self_test->attempted, *alg);
+        ++self_test->tests;
+        ret = TRUE;
+    } else {
+        self_test->state = SELF_TEST_RESULT;
+    }
+    pthread_mutex_unlock (&self_test->mutex);
+    return ret;
+}
+/*
+ * The TPM answered TPM2_RC_TESTING: it's still running tests started
+ * earlier. 'alg' is the algorithm we just asked it to test, or NULL. It's
+ * put back at the head of the pending list so it's still tested this
+ * round. The TPM isn't asked again before the retry time, and the wait
+ * doubles each time the TPM is still busy.
+ */
+void
+self_test_retry (SelfTest          *self_test,
+                 const TPM2_ALG_ID *alg)
+{
+    guint i;
+
+    g_assert_nonnull (self_test);
+    pthread_mutex_lock (&self_test->mutex);
+    if (alg != NULL) {
+        g_array_prepend_val (self_test->pending, *alg);
+        for (i = 0; i < self_test->attempted->len; ++i) {
+            if (g_array_index (self_test->attempted, TPM2_ALG_ID, i) == *alg) {
+                g_array_remove_index (self_test->attempted, i);
+                --self_test->tests;
+                break;
+            }
+        }
+        self_test->state = SELF_TEST_RUN;
+    }
+    self_test->retry_at = g_get_monotonic_time () + self_test->backoff_us;
+    self_test->backoff_us = MIN (self_test->backoff_us * 2,
+                                 SELF_TEST_BACKOFF_MAX_US);
+    pthread_mutex_unlock (&self_test->mutex);
+}
+gint64
+self_test_get_retry_at (SelfTest *self_test)
+{
+    gint64 retry_at;
+
+    g_assert_nonnull (self_test);
+    pthread_mutex_lock (&self_test->mutex);
+    retry_at = self_test->retry_at;
+    pthread_mutex_unlock (&self_test->mutex);
+    return retry_at;
+}
+/*
+ * Handle the testResult from GetTestResult. Returns TRUE when the round is
+ * over, the result is then available from self_test_get_result.
+ * - TPM2_RC_TESTING: background tests are still running, ask again later.
+ * - TPM2_RC_NEEDS_TEST: something is untested. If none of the configured
+ *   algorithms were in the last toDoList that's the algorithms we weren't
+ *   asked to test and the round passed. Otherwise the TPM hadn't finished
+ *   ours yet: query the toDoList again later, up to SELF_TEST_REQUERY_MAX
+ *   times.
+ * Anything else ends the round with that result.
+ */
+gboolean
+self_test_check_result (SelfTest *self_test,
+                        TPM2_RC   test_result)
+{
+    g_assert_nonnull (self_test);
+    if (test_result == TPM2_RC_TESTING) {
+        self_test_retry (self_test, NULL);
+        return FALSE;
+    }
+    if (test_result == TPM2_RC_NEEDS_TEST) {
+        pthread_mutex_lock (&self_test->mutex);
+        if (self_test->untested == 0) {
+            test_result = TPM2_RC_SUCCESS;
+        } else if (self_test->requeries < SELF_TEST_REQUERY_MAX) {
+            ++self_test->requeries;
+            self_test->state = SELF_TEST_QUERY;
+            pthread_mutex_unlock (&self_test->mutex);
+            self_test_retry (self_test, NULL);
+            return FALSE;
+        }
+        pthread_mutex_unlock (&self_test->mutex);
+    }
+    self_test_set_result (self_test, test_result);
+    return TRUE;
+}
+/*
+ * Record the result of the round: the testResult from GetTestResult or the
+ * RC of the command that failed. Ends the round.
+ */
+void
+self_test_set_result (SelfTest *self_test,
+                      TPM2_RC   result)
+{
+    g_assert_nonnull (self_test);
+    pthread_mutex_lock (&self_test->mutex);
+    self_test->result = result;
+    self_test->state = SELF_TEST_DONE;
+    ++self_test->rounds;
+    pthread_mutex_unlock (&self_test->mutex);
+}
+TPM2_RC
+self_test_get_result (SelfTest *self_test)
+{
+    TPM2_RC result;
+
+    g_assert_nonnull (self_test);
+    pthread_mutex_lock (&self_test->mutex);
+    result = self_test->result;
+    pthread_mutex_unlock (&self_test->mutex);
+    return result;
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SELF_TEST_H
+#define SELF_TEST_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+#include <tss2/tss2_tpm2_types.h>
+
+G_BEGIN_DECLS
+
+/*
+ * While the TPM answers TPM2_RC_TESTING we wait before asking again,
+ * doubling the wait each time up to the maximum.
+ */
+#define SELF_TEST_BACKOFF_MIN_US 10000
+#define SELF_TEST_BACKOFF_MAX_US 1000000
+/*
+ * How many times a round queries the toDoList again when GetTestResult
+ * says configured algorithms still need testing before giving up.
+ */
+#define SELF_TEST_REQUERY_MAX 8
+
+/*
+ * The SelfTest object tracks the progress of a round of background self
+ * tests. It does not talk to the TPM itself: the ResourceManager asks it
+ * what to do next, sends the command and reports back.
+ * - QUERY: ask the TPM which algorithms still need testing
+ * - RUN: test the next algorithm
+ * - RESULT: read the overall result with GetTestResult
+ * - DONE: nothing to do until the next reset
+ */
+typedef enum {
+    SELF_TEST_QUERY,
+    SELF_TEST_RUN,
+    SELF_TEST_RESULT,
+    SELF_TEST_DONE,
+} SelfTestState;
+
+typedef struct _SelfTestClass {
+    GObjectClass      parent;
+} SelfTestClass;
+
+typedef struct _SelfTest {
+    GObject           parent_instance;
+    pthread_mutex_t   mutex;
+    GArray           *algs;
+    GArray           *pending;
+    GArray           *attempted;
+    SelfTestState     state;
+    TPM2_RC           result;
+    guint64           rounds;
+    guint64           tests;
+    /* configured algorithms in the last toDoList, tested or not */
+    guint             untested;
+    guint             requeries;
+    /* monotonic time before which the TPM shouldn't be asked again */
+    gint64            retry_at;
+    gint64            backoff_us;
+} SelfTest;
+
+#define TYPE_SELF_TEST              (self_test_get_type   ())
+#define SELF_TEST(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_SELF_TEST, SelfTest))
+#define SELF_TEST_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_SELF_TEST, SelfTestClass))
+#define IS_SELF_TEST(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_SELF_TEST))
+#define IS_SELF_TEST_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_SELF_TEST))
+#define SELF_TEST_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_SELF_TEST, SelfTestClass))
+
+GType          self_test_get_type        (void);
+SelfTest*      self_test_new             (const TPM2_ALG_ID *algs,
+                                          guint           count);
+SelfTest*      self_test_parse           (const gchar    *str);
+void           self_test_reset           (SelfTest       *self_test);
+SelfTestState  self_test_get_state       (SelfTest       *self_test);
+void           self_test_set_to_do       (SelfTest       *self_test,
+                                          const TPML_ALG *to_do);
+gboolean       self_test_next            (SelfTest       *self_test,
+                                          TPM2_ALG_ID    *alg);
+void           self_test_retry           (SelfTest       *self_test,
+                                          const TPM2_ALG_ID *alg);
+gint64         self_test_get_retry_at    (SelfTest       *self_test);
+gboolean       self_test_check_result    (SelfTest       *self_test,
+                                          TPM2_RC         test_result);
+void           self_test_set_result      (SelfTest       *self_test,
+                                          TPM2_RC         result);
+TPM2_RC        self_test_get_result      (SelfTest       *self_test);
+
+G_END_DECLS
+#endif /* SELF_TEST_H */
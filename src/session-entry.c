@@ -12,6 +12,7 @@
 #include "tpm2-header.h"
 #include "util.h"
 #include "session-entry.h"
+#include "tabrmd-probes.h"
 
 G_DEFINE_TYPE (SessionEntry, session_entry, G_TYPE_OBJECT);
 
@@ -40,7 +41,7 @@ session_entry_get_property (GObject        *object,
         g_value_set_pointer (value, self->connection);
         break;
     case PROP_CONTEXT:
-        g_value_set_pointer (value, &self->context);
+        g_value_set_pointer (value, session_entry_get_context (self));
         break;
     case PROP_HANDLE:
         g_value_set_uint (value, session_entry_get_handle (self));
@@ -91,8 +92,8 @@ session_entry_init (SessionEntry *entry)
     /* noop */
 }
 /*
- * Deallocate all associated resources. All are static so we just chain
- * up to the parent like a good GObject.
+ * Release references to other GObjects. The saved context is dropped from
+ * the ContextStore as well.
  */
 static void
 session_entry_dispose (GObject *object)
@@ -101,8 +102,21 @@ session_entry_dispose (GObject *object)
 
     g_debug ("%s", __func__);
     g_clear_object (&entry->connection);
+    if (entry->context_store != NULL && entry->context_id != 0) {
+        context_store_remove (entry->context_store, entry->context_id);
+        entry->context_id = 0;
+    }
+    g_clear_object (&entry->context_store);
     G_OBJECT_CLASS (session_entry_parent_class)->dispose (object);
 }
+static void
+session_entry_finalize (GObject *object)
+{
+    SessionEntry *entry = SESSION_ENTRY (object);
+
+    g_clear_pointer (&entry->context, g_free);
+    G_OBJECT_CLASS (session_entry_parent_class)->finalize (object);
+}
 /*
  * Class initialization function. Register function pointers and properties.
  */
@@ -114,6 +128,7 @@ session_entry_class_init (SessionEntryClass *klass)
     if (session_entry_parent_class == NULL)
         session_entry_parent_class = g_type_class_peek_parent (klass);
     object_class->dispose = session_entry_dispose;
+    object_class->finalize = session_entry_finalize;
     object_class->get_property = session_entry_get_property;
     object_class->set_property = session_entry_set_property;
 
@@ -160,7 +175,9 @@ session_entry_new (Connection *connection,
                                         NULL));
 }
 /*
- * Access the 'context' member.
+ * Access the 'context' member. If the context was stashed in the
+ * ContextStore it is read back first and the record is dropped from the
+ * store, the entry owns the context until it's stashed again.
  * NOTE: This directly exposes memory from an object instance. The caller
  * must be sure to hold a reference to this object to keep it from being
  * garbage collected while the caller is accessing the context structure.
@@ -169,7 +186,27 @@ session_entry_new (Connection *connection,
 size_buf_t*
 session_entry_get_context (SessionEntry *entry)
 {
-    return &entry->context;
+    if (entry->context != NULL) {
+        return entry->context;
+    }
+    entry->context = g_new0 (size_buf_t, 1);
+    if (entry->context_store == NULL || entry->context_id == 0) {
+        return entry->context;
+    }
+    entry->context->size = sizeof (entry->context->buf);
+    if (!context_store_lookup (entry->context_store,
+                               entry->context_id,
+                               entry->context->buf,
+                               &entry->context->size))
+    {
+        g_warning ("%s: failed to read context for session 0x%08" PRIx32
+                   " from ContextStore", __func__, entry->handle);
+        entry->context->size = 0;
+        return entry->context;
+    }
+    context_store_remove (entry->context_store, entry->context_id);
+    entry->context_id = 0;
+    return entry->context;
 }
 size_buf_t*
 session_entry_get_context_client (SessionEntry *entry)
@@ -224,6 +261,26 @@ session_entry_get_context_client_handle (SessionEntry *entry)
     g_assert_nonnull (entry);
     return get_handle (session_entry_get_context_client (entry));
 }
+/*
+ * Accessor for the sequence member of the most recently saved context. For
+ * sessions this is the TPM contextCounter at the time of the save.
+ */
+guint64
+session_entry_get_sequence (SessionEntry *entry)
+{
+    g_assert_nonnull (entry);
+    return entry->sequence;
+}
+/*
+ * Monotonic time (in microseconds) of the last time the session was loaded
+ * into the TPM.
+ */
+gint64
+session_entry_get_last_used (SessionEntry *entry)
+{
+    g_assert_nonnull (entry);
+    return entry->last_used;
+}
 /*
  * Simple accessor to the state of the SessionEntry.
  */
@@ -235,15 +292,21 @@ session_entry_get_state (SessionEntry *entry)
 /*
  * This function allows the caller to set the state of the SessionEntry. It
  * also ensures that if the SessionEntry is put into the 'SAVED_CLIENT_CLOSED'
- * state that the connection field is clear / NULL.
+ * state that the connection field is clear / NULL. Loading the session
+ * counts as a use for session_entry_get_last_used.
  */
 void
 session_entry_set_state (SessionEntry *entry,
                          SessionEntryStateEnum state)
 {
     assert (entry != NULL);
+    TABRMD_PROBE4 (session_state, entry->handle,
+                   entry->connection != NULL ? entry->connection->id : 0,
+                   entry->state, state);
     if (state == SESSION_ENTRY_SAVED_CLIENT_CLOSED) {
         g_clear_object (&entry->connection);
+    } else if (state == SESSION_ENTRY_LOADED) {
+        entry->last_used = g_get_monotonic_time ();
     }
     entry->state = state;
 }
@@ -252,17 +315,30 @@ session_entry_set_state (SessionEntry *entry,
  * in its marshalled form (ready to be sent to the TPM in the body of a
  * ContextLoad command). We also copy this same blob to the 'context_client'
  * blob (the TPMS_CONTEXT that we expose to clients) if it has not yet been
- * initialized.
+ * initialized. The sequence number from the TPMS_CONTEXT is cached since
+ * the blob itself may be moved to the ContextStore.
  */
 void
 session_entry_set_context (SessionEntry *entry,
                            uint8_t *buf,
                            size_t size)
 {
+    size_t offset = 0;
+
     assert (entry != NULL && buf != NULL && size <= SIZE_BUF_MAX);
+    /* TPMS_CONTEXT starts with the sequence, keep it while the blob is stashed */
+    if (Tss2_MU_UINT64_Unmarshal (buf, size, &offset, &entry->sequence)
+        != TSS2_RC_SUCCESS)
+    {
+        entry->sequence = 0;
+    }
 
-    memcpy (entry->context.buf, buf, size);
-    entry->context.size = size;
+    /* the old context is being replaced so there's no need to read it back */
+    if (entry->context == NULL) {
+        entry->context = g_new0 (size_buf_t, 1);
+    }
+    memcpy (entry->context->buf, buf, size);
+    entry->context->size = size;
     if (entry->context_client.size == 0) {
         memcpy (entry->context_client.buf, buf, size);
         entry->context_client.size = size;
@@ -386,3 +462,36 @@ session_entry_compare_on_context_client (SessionEntry *entry,
     size_buf = session_entry_get_context_client (entry);
     return memcmp (size_buf->buf, buf, size);
 }
+void
+session_entry_set_context_store (SessionEntry *entry,
+                                 ContextStore *store)
+{
+    g_object_ref (store);
+    g_clear_object (&entry->context_store);
+    entry->context_store = store;
+}
+/*
+ * Hand the RM's copy of the saved context off to the ContextStore. The
+ * 'context_client' blob stays with the entry since it's what we match
+ * against when clients load contexts. Without a ContextStore this is a
+ * no-op.
+ */
+void
+session_entry_stash_context (SessionEntry *entry)
+{
+    if (entry->context_store == NULL || entry->context == NULL) {
+        return;
+    }
+    if (entry->context_id == 0) {
+        entry->context_id = context_store_insert (entry->context_store,
+                                                  entry->context->buf,
+                                                  entry->context->size);
+    } else if (!context_store_update (entry->context_store,
+                                      entry->context_id,
+                                      entry->context->buf,
+                                      entry->context->size))
+    {
+        return;
+    }
+    g_clear_pointer (&entry->context, g_free);
+}
@@ -11,6 +11,7 @@
 #include <tss2/tss2_tpm2_types.h>
 
 #include "connection.h"
+#include "context-store.h"
 #include "session-entry-state-enum.h"
 
 G_BEGIN_DECLS
@@ -31,8 +32,12 @@ typedef struct _SessionEntry {
     Connection            *connection;
     SessionEntryStateEnum  state;
     TPM2_HANDLE            handle;
-    size_buf_t             context;
+    size_buf_t            *context;
     size_buf_t             context_client;
+    ContextStore          *context_store;
+    guint64                context_id;
+    guint64                sequence;
+    gint64                 last_used;
 } SessionEntry;
 
 #define TYPE_SESSION_ENTRY              (session_entry_get_type   ())
@@ -52,6 +57,8 @@ size_buf_t*      session_entry_get_context     (SessionEntry      *entry);
 void             session_entry_set_context     (SessionEntry      *entry,
                                                 uint8_t           *buf,
                                                 size_t             size);
+guint64          session_entry_get_sequence    (SessionEntry      *entry);
+gint64           session_entry_get_last_used   (SessionEntry      *entry);
 SessionEntryStateEnum session_entry_get_state  (SessionEntry      *entry);
 void             session_entry_set_connection  (SessionEntry      *entry,
                                                 Connection        *connection);
@@ -68,6 +75,9 @@ gint session_entry_compare_on_context_client (SessionEntry *entry,
                                               uint8_t *buf,
                                               size_t size);
 void session_entry_abandon (SessionEntry *entry);
+void session_entry_set_context_store (SessionEntry *entry,
+                                      ContextStore *store);
+void session_entry_stash_context (SessionEntry *entry);
 
 G_END_DECLS
 #endif /* SESSION_ENTRY_H */
@@ -67,19 +67,22 @@ session_list_set_property (GObject        *object,
 }
 /*
  * Initialize object.
- * GQueue for 'abandoned_queue' must be explicitly created.
- * GList for 'session_entry_list' does not.
+ * The 'session_entry_queue' holds the entries oldest first. The
+ * 'handle_to_link_table' maps the session handle to the entry's link in
+ * the queue so lookups and removals don't walk the queue.
  */
 static void
 session_list_init (SessionList     *list)
 {
     g_debug ("session_list_init");
     list->abandoned_queue = g_queue_new ();
-    list->session_entry_list = NULL;
+    list->session_entry_queue = g_queue_new ();
+    list->handle_to_link_table = g_hash_table_new (g_direct_hash,
+                                                   g_direct_equal);
 }
 /*
  * GObject dispose function: unref all SessionEntry objects in the internal
- * GSList and unref the list itself. NULL the pointer to the internal list
+ * GQueue and free the queue itself. NULL the pointer to the internal queue
  * as well.
  */
 static void
@@ -87,12 +90,16 @@ session_list_dispose (GObject *object)
 {
     SessionList *self = SESSION_LIST (object);
 
-    g_debug ("%s: SessionList with %" PRIu32 " entries", __func__,
-             g_list_length (self->session_entry_list));
-    g_queue_free (self->abandoned_queue);
-    self->abandoned_queue = NULL;
-    g_list_free_full (self->session_entry_list, g_object_unref);
-    self->session_entry_list = NULL;
+    if (self->session_entry_queue != NULL) {
+        g_debug ("%s: SessionList with %" PRIu32 " entries", __func__,
+                 g_queue_get_length (self->session_entry_queue));
+    }
+    g_clear_pointer (&self->abandoned_queue, g_queue_free);
+    g_clear_pointer (&self->handle_to_link_table, g_hash_table_unref);
+    if (self->session_entry_queue != NULL) {
+        g_queue_free_full (self->session_entry_queue, g_object_unref);
+        self->session_entry_queue = NULL;
+    }
     G_OBJECT_CLASS (session_list_parent_class)->dispose (object);
 }
 /*
@@ -101,11 +108,7 @@ session_list_dispose (GObject *object)
 static void
 session_list_finalize (GObject *object)
 {
-    SessionList *self = SESSION_LIST (object);
-
-    g_debug ("%s: SessionList with %" PRIu32 " entries", __func__,
-             g_list_length (self->session_entry_list));
-    g_list_free_full (self->session_entry_list, g_object_unref);
+    g_debug ("%s", __func__);
     G_OBJECT_CLASS (session_list_parent_class)->finalize (object);
 }
 /*
@@ -137,8 +140,8 @@ session_list_class_init (SessionListClass *klass)
                            "max entries per connection",
                            "maximum number of entries permitted for each connection",
                            0,
-                           MAX_ENTRIES_MAX,
-                           MAX_ENTRIES_DEFAULT,
+                           SESSION_LIST_MAX_ENTRIES_MAX,
+                           SESSION_LIST_MAX_ENTRIES_DEFAULT,
                            G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
@@ -176,27 +179,48 @@ session_list_insert (SessionList      *list,
         return FALSE;
     }
     g_object_ref (entry);
-    list->session_entry_list = g_list_append (list->session_entry_list,
-                                                 entry);
+    g_queue_push_tail (list->session_entry_queue, entry);
+    g_hash_table_insert (list->handle_to_link_table,
+                         GUINT_TO_POINTER (session_entry_get_handle (entry)),
+                         g_queue_peek_tail_link (list->session_entry_queue));
 
     return TRUE;
 }
+/*
+ * Unlink the provided link from the queue and the handle index. The
+ * reference held by the list is passed to the caller.
+ */
+static SessionEntry*
+session_list_unlink (SessionList *list,
+                     GList       *link)
+{
+    SessionEntry *entry = SESSION_ENTRY (link->data);
+
+    g_hash_table_remove (list->handle_to_link_table,
+                         GUINT_TO_POINTER (session_entry_get_handle (entry)));
+    g_queue_delete_link (list->session_entry_queue, link);
+
+    return entry;
+}
+static GList*
+session_list_lookup_link (SessionList *list,
+                          TPM2_HANDLE  handle)
+{
+    return g_hash_table_lookup (list->handle_to_link_table,
+                                GUINT_TO_POINTER (handle));
+}
 static gboolean
 session_list_remove_custom (SessionList  *list,
                             gconstpointer data,
                             GCompareFunc  func)
 {
     GList       *list_entry;
-    SessionEntry *entry_data;
 
-    list_entry = g_list_find_custom (list->session_entry_list, data, func);
+    list_entry = g_queue_find_custom (list->session_entry_queue, data, func);
     if (list_entry == NULL) {
         return FALSE;
     }
-    entry_data = SESSION_ENTRY (list_entry->data);
-    list->session_entry_list = g_list_remove_link (list->session_entry_list,
-                                                     list_entry);
-    g_object_unref (entry_data);
+    g_object_unref (session_list_unlink (list, list_entry));
 
     return TRUE;
 }
@@ -210,9 +234,14 @@ gboolean
 session_list_remove_handle (SessionList      *list,
                             TPM2_HANDLE        handle)
 {
-    return session_list_remove_custom (list,
-                                       &handle,
-                                       session_entry_compare_on_handle);
+    GList *link = session_list_lookup_link (list, handle);
+
+    if (link == NULL) {
+        return FALSE;
+    }
+    g_object_unref (session_list_unlink (list, link));
+
+    return TRUE;
 }
 /*
  * Returns TRUE on success, FALSE on failure.
@@ -226,18 +255,22 @@ session_list_remove_connection (SessionList      *list,
                                        session_entry_compare_on_connection);
 }
 /*
- * This function is a thin wrapper around the g_list_remove function. Pass it
- * a SessionEntry. It will find it in the list and remove the associated entry
- * and then unref it (to account for the SessionList no longer holding a
- * reference).
+ * Pass this function a SessionEntry. It will find it in the list through
+ * the handle index, remove the associated entry and then unref it (to
+ * account for the SessionList no longer holding a reference).
  */
 void
 session_list_remove (SessionList   *list,
                      SessionEntry  *entry)
 {
+    GList *link;
+
     g_debug ("%s", __func__);
-    list->session_entry_list = g_list_remove (list->session_entry_list, entry);
-    g_object_unref (entry);
+    link = session_list_lookup_link (list, session_entry_get_handle (entry));
+    if (link == NULL || link->data != entry) {
+        return;
+    }
+    g_object_unref (session_list_unlink (list, link));
 }
 /*
  * Get last entry in list and remove it from the list.
@@ -246,17 +279,13 @@ SessionEntry*
 session_list_remove_last (SessionList *list)
 {
     GList       *list_entry;
-    SessionEntry *entry_data;
 
-    list_entry = g_list_last (list->session_entry_list);
+    list_entry = g_queue_peek_tail_link (list->session_entry_queue);
     if (list_entry == NULL) {
         return NULL;
     }
-    entry_data = SESSION_ENTRY (list_entry->data);
-    list->session_entry_list = g_list_remove_link (list->session_entry_list,
-                                                     list_entry);
 
-    return entry_data;
+    return session_list_unlink (list, list_entry);
 }
 /*
  * This is a lookup function to find an entry in the SessionList given
@@ -270,9 +299,7 @@ session_list_lookup_handle (SessionList   *list,
 {
     GList *list_entry;
 
-    list_entry = g_list_find_custom (list->session_entry_list,
-                                      &handle,
-                                      session_entry_compare_on_handle);
+    list_entry = session_list_lookup_link (list, handle);
     if (list_entry != NULL) {
         g_object_ref (list_entry->data);
         return SESSION_ENTRY (list_entry->data);
@@ -312,9 +339,9 @@ session_list_lookup_context_client (SessionList *list,
         .buf = buf,
     };
 
-    list_entry = g_list_find_custom (list->session_entry_list,
-                                     &size_buf_ptr,
-                                     session_list_compare_context);
+    list_entry = g_queue_find_custom (list->session_entry_queue,
+                                      &size_buf_ptr,
+                                      session_list_compare_context);
     if (list_entry != NULL) {
         g_object_ref (list_entry->data);
         return SESSION_ENTRY (list_entry->data);
@@ -324,16 +351,12 @@ session_list_lookup_context_client (SessionList *list,
 }
 /*
  * Simple wrapper around the function that reports the number of entries in
- * the hash table.
+ * the queue.
  */
 guint
 session_list_size (SessionList *list)
 {
-    guint ret;
-
-    ret = g_list_length (list->session_entry_list);
-
-    return ret;
+    return g_queue_get_length (list->session_entry_queue);
 }
 /*
  * Structure used to hold data needed to count SessionEntry objects associated
@@ -403,7 +426,7 @@ session_list_foreach (SessionList *list,
                       GFunc        func,
                       gpointer     user_data)
 {
-    g_list_foreach (list->session_entry_list,
+    g_queue_foreach (list->session_entry_queue,
                      func,
                      user_data);
 }
@@ -444,7 +467,7 @@ session_list_abandon_handle (SessionList *list,
  *   connection with the object.
  * - If the SessionEntry has been saved BY THE CLIENT then it will *not* be
  *   in the 'abandoned_queue'. In this case we find the SessionEntry in the
- *   'session_entry_list' and change the connection.
+ *   'session_entry_queue' and change the connection.
  */
 gboolean
 session_list_claim (SessionList *list,
@@ -463,8 +486,8 @@ session_list_claim (SessionList *list,
         g_queue_remove (list->abandoned_queue, link->data);
         return TRUE;
     }
-    link = g_list_find (list->session_entry_list, entry);
-    if (link != NULL) {
+    link = session_list_lookup_link (list, session_entry_get_handle (entry));
+    if (link != NULL && link->data == entry) {
         g_assert (link->data == entry);
         g_debug ("%s: SessionEntry found in SessionList", __func__);
         session_entry_set_state (entry, SESSION_ENTRY_LOADED);
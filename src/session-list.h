@@ -20,7 +20,7 @@ G_BEGIN_DECLS
 #define SESSION_LIST_MAX_ABANDONED_DEFAULT SESSION_LIST_MAX_ABANDONED_MAX
 
 #define SESSION_LIST_MAX_ENTRIES_DEFAULT 4
-#define SESSION_LIST_MAX_ENTRIES_MAX     64
+#define SESSION_LIST_MAX_ENTRIES_MAX     1024
 
 typedef gboolean (*PruneFunc) (SessionEntry *entry, gpointer data);
 
@@ -33,7 +33,8 @@ typedef struct _SessionList {
     GQueue             *abandoned_queue;
     guint               max_abandoned;
     guint               max_per_connection;
-    GList              *session_entry_list;
+    GQueue             *session_entry_queue;
+    GHashTable         *handle_to_link_table;
 } SessionList;
 
 #define TYPE_SESSION_LIST              (session_list_get_type   ())
@@ -5,8 +5,13 @@
 #ifndef TABRMD_DEFAULTS_H
 #define TABRMD_DEFAULTS_H
 
+#define TABRMD_BUSY_WHEN_FULL_DEFAULT FALSE
 #define TABRMD_CONNECTIONS_MAX_DEFAULT 27
-#define TABRMD_CONNECTION_MAX 100
+#define TABRMD_CONNECTION_MAX 8192
+#define TABRMD_CONNECTION_IN_FLIGHT_MAX_DEFAULT 8
+#define TABRMD_COALESCE_COMMANDS_DEFAULT NULL
+#define TABRMD_CONTEXT_MEMORY_BUDGET_DEFAULT 0
+#define TABRMD_CONTEXT_STORE_PATH_DEFAULT "/run/tpm2-abrmd"
 #define TABRMD_DBUS_NAME_DEFAULT "com.intel.tss2.Tabrmd"
 #define TABRMD_DBUS_TYPE_DEFAULT G_BUS_TYPE_SYSTEM
 #define TABRMD_DBUS_PATH "/com/intel/tss2/Tabrmd/Tcti"
@@ -14,10 +19,27 @@
 #define TABRMD_DBUS_METHOD_CANCEL "Cancel"
 #define TABRMD_ERROR tabrmd_error_quark ()
 #define TABRMD_ENTROPY_SRC_DEFAULT "/dev/urandom"
+#define TABRMD_IN_FLIGHT_MAX_DEFAULT 1024
+#define TABRMD_IN_FLIGHT_MAX 65536
+#define TABRMD_LOAD_CACHE_SIZE_DEFAULT 0
+#define TABRMD_LOAD_CACHE_SIZE_MAX 64
+#define TABRMD_PCR_CACHE_MAX_AGE_DEFAULT 0
+#define TABRMD_PCR_CACHE_MAX_AGE_MAX 60000
+#define TABRMD_PRIMARY_CACHE_SIZE_DEFAULT 0
+#define TABRMD_PRIMARY_CACHE_SIZE_MAX 64
+#define TABRMD_RANDOM_POOL_SIZE_DEFAULT 0
+#define TABRMD_RANDOM_POOL_LOW_WATERMARK_DEFAULT 256
+#define TABRMD_RETRY_BUDGET_DEFAULT NULL
+#define TABRMD_RUN_TO_COMPLETION_DEFAULT FALSE
+#define TABRMD_SELF_TEST_DEFAULT NULL
 #define TABRMD_SESSIONS_MAX_DEFAULT 4
-#define TABRMD_SESSIONS_MAX 64
+#define TABRMD_SESSIONS_MAX 1024
+#define TABRMD_STATS_INTERVAL_DEFAULT 0
+#define TABRMD_STATS_INTERVAL_MAX 86400
 #define TABRMD_TCTI_CONF_DEFAULT "device:/dev/tpm0"
+#define TABRMD_THREAD_AFFINITY_DEFAULT NULL
+#define TABRMD_THREAD_SCHED_DEFAULT NULL
 #define TABRMD_TRANSIENT_MAX_DEFAULT 27
-#define TABRMD_TRANSIENT_MAX 100
+#define TABRMD_TRANSIENT_MAX 1024
 
 #endif
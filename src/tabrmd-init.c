@@ -1,7 +1,9 @@
+#include <errno.h>
 #include <glib-unix.h>
 #include <glib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sysexits.h>
 
 #include <tss2/tss2_tctildr.h>
@@ -9,11 +11,19 @@
 #include <tss2/tss2_tctildr.h>
 
 #include "access-broker.h"
+#include "admission-control.h"
 #include "command-source.h"
+#include "context-store.h"
 #include "logging.h"
 #include "ipc-frontend.h"
 #include "ipc-frontend-dbus.h"
+#include "lock-stats.h"
+#include "object-cache.h"
+#include "pcr-cache.h"
 #include "random.h"
+#include "random-pool.h"
+#include "retry-policy.h"
+#include "self-test.h"
 #include "resource-manager.h"
 #include "response-sink.h"
 #include "source-interface.h"
@@ -93,6 +103,11 @@ gmain_data_cleanup (gmain_data_t *data)
         ipc_frontend_disconnect (data->ipc_frontend);
         g_clear_object (&data->ipc_frontend);
     }
+    if (data->stats_source != 0) {
+        g_source_remove (data->stats_source);
+        data->stats_source = 0;
+    }
+    g_clear_object (&data->connection_manager);
     if (data->random != NULL) {
         g_clear_object (&data->random);
     }
@@ -100,6 +115,149 @@ gmain_data_cleanup (gmain_data_t *data)
         main_loop_quit (data->loop);
     }
 }
+typedef struct {
+    guint               connections;
+    connection_stats_t  stats;
+} pid_stats_t;
+/*
+ * The statistics of the active connections are added up by client PID and
+ * a line logged for each PID: the counts are totals since each connection
+ * was created.
+ */
+static void
+log_connection_stats (gmain_data_t *data)
+{
+    GHashTable *by_pid, *counts;
+    GHashTableIter iter;
+    GList *connections, *item;
+    Connection *connection;
+    connection_stats_t stats;
+    pid_stats_t *total;
+    gpointer key, value;
+
+    by_pid = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                    g_free);
+    connections = connection_manager_get_connections (data->connection_manager);
+    for (item = connections; item != NULL; item = item->next) {
+        connection = CONNECTION (item->data);
+        counts = connection_get_stats (connection, &stats);
+        g_hash_table_unref (counts);
+        total = g_hash_table_lookup (by_pid,
+                                     GUINT_TO_POINTER (connection->pid));
+        if (total == NULL) {
+            total = g_new0 (pid_stats_t, 1);
+            g_hash_table_insert (by_pid,
+                                 GUINT_TO_POINTER (connection->pid),
+                                 total);
+        }
+        ++total->connections;
+        total->stats.commands      += stats.commands;
+        total->stats.tpm_time_us   += stats.tpm_time_us;
+        total->stats.context_loads += stats.context_loads;
+        total->stats.context_saves += stats.context_saves;
+        total->stats.bytes_in      += stats.bytes_in;
+        total->stats.bytes_out     += stats.bytes_out;
+    }
+    g_list_free_full (connections, g_object_unref);
+
+    g_hash_table_iter_init (&iter, by_pid);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        total = (pid_stats_t*)value;
+        g_info ("pid %u: %u connections, %" PRIu64 " commands, TPM time %"
+                PRIu64 " us, %" PRIu64 " context loads, %" PRIu64 " context "
+                "saves, %" PRIu64 " bytes in, %" PRIu64 " bytes out",
+                GPOINTER_TO_UINT (key), total->connections,
+                total->stats.commands, total->stats.tpm_time_us,
+                total->stats.context_loads, total->stats.context_saves,
+                total->stats.bytes_in, total->stats.bytes_out);
+    }
+    g_hash_table_unref (by_pid);
+}
+/*
+ * One line for each instrumented lock, totals since the daemon started.
+ * There are none unless we were built with --enable-lock-stats.
+ */
+static void
+log_lock_stats (void)
+{
+    GList *locks, *item;
+    lock_stats_t *stats;
+
+    locks = lock_stats_get_all ();
+    for (item = locks; item != NULL; item = item->next) {
+        stats = (lock_stats_t*)item->data;
+        g_info ("lock %s: %" PRIu64 " acquisitions, %" PRIu64 " contended, "
+                "wait %" PRIu64 " ns, hold %" PRIu64 " ns",
+                stats->name, stats->acquired, stats->contended,
+                stats->wait_ns, stats->hold_ns);
+    }
+    g_list_free_full (locks, g_free);
+}
+/*
+ * Commands the TPM asked to have resubmitted, totals since the daemon
+ * started. All 0 unless a retry policy is set.
+ */
+static void
+log_retry_stats (gmain_data_t *data)
+{
+    resource_manager_stats_t stats;
+
+    if (data->resource_manager == NULL) {
+        return;
+    }
+    resource_manager_get_stats (data->resource_manager, &stats);
+    g_info ("retries: %" PRIu64 " commands retried with %" PRIu64
+            " resubmissions, %" PRIu64 " ran out of budget", stats.retried,
+            stats.retries, stats.retries_exhausted);
+}
+/*
+ * GSourceFunc run every 'stats_interval' seconds on the main loop.
+ */
+static gboolean
+log_stats (gpointer user_data)
+{
+    gmain_data_t *data = (gmain_data_t*)user_data;
+
+    log_connection_stats (data);
+    log_retry_stats (data);
+    log_lock_stats ();
+
+    return G_SOURCE_CONTINUE;
+}
+/*
+ * Each connection holds a file descriptor for the daemon end of its
+ * socket. Raise the soft RLIMIT_NOFILE so 'max_connections' connections
+ * fit with some headroom for the TCTI, D-Bus and logging. The soft limit
+ * can't go above the hard limit: if that's too low we warn and carry on,
+ * connections beyond it will fail to be created.
+ */
+#define NOFILE_HEADROOM 64
+static void
+raise_nofile_limit (guint max_connections)
+{
+    struct rlimit limit;
+    rlim_t needed = (rlim_t)max_connections + NOFILE_HEADROOM;
+
+    if (getrlimit (RLIMIT_NOFILE, &limit) != 0) {
+        g_warning ("%s: getrlimit failed: %s", __func__, strerror (errno));
+        return;
+    }
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= needed) {
+        return;
+    }
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+        g_warning ("%s: RLIMIT_NOFILE hard limit of %" PRIu64 " is too low "
+                   "for %u connections", __func__, (uint64_t)limit.rlim_max,
+                   max_connections);
+        needed = limit.rlim_max;
+    }
+    g_debug ("%s: raising RLIMIT_NOFILE from %" PRIu64 " to %" PRIu64,
+             __func__, (uint64_t)limit.rlim_cur, (uint64_t)needed);
+    limit.rlim_cur = needed;
+    if (setrlimit (RLIMIT_NOFILE, &limit) != 0) {
+        g_warning ("%s: setrlimit failed: %s", __func__, strerror (errno));
+    }
+}
 /*
  * This function initializes and configures all of the long-lived objects
  * in the tabrmd system. It is invoked on a thread separate from the main
@@ -110,7 +268,7 @@ gmain_data_cleanup (gmain_data_t *data)
  * - Locks the init_mutex.
  * - Registers a handler for UNIX signals for SIGINT and SIGTERM.
  * - Seeds the RNG state from an entropy source.
- * - Creates the ConnectionManager.
+ * - Raises RLIMIT_NOFILE and creates the ConnectionManager.
  * - Creates the TCTI instance used by the Tab.
  * - Creates an access broker and verify the current state of the TPM.
  * - Creates and wires up the objects that make up the TPM command
@@ -124,11 +282,22 @@ init_thread_func (gpointer user_data)
     gmain_data_t *data = (gmain_data_t*)user_data;
     gint ret;
     TSS2_RC rc;
+    AdmissionControl *admission = NULL;
     CommandAttrs *command_attrs;
     ConnectionManager *connection_manager = NULL;
+    ContextStore *context_store = NULL;
+    ObjectCache *load_cache = NULL;
+    ObjectCache *primary_cache = NULL;
+    PcrCache *pcr_cache = NULL;
+    RandomPool *random_pool = NULL;
+    RetryPolicy *retry_policy = NULL;
+    SelfTest *self_test = NULL;
+    GHashTable *coalesce_codes = NULL;
     SessionList *session_list;
     Tcti *tcti = NULL;
     TSS2_TCTI_CONTEXT *tcti_ctx = NULL;
+    thread_attrs_t thread_attrs [THREAD_STAGE_COUNT];
+    size_t i;
 
     g_info ("init_thread_func start");
     g_mutex_lock (&data->init_mutex);
@@ -150,7 +319,9 @@ init_thread_func (gpointer user_data)
         goto err_out;
     }
 
+    raise_nofile_limit (data->options.max_connections);
     connection_manager = connection_manager_new(data->options.max_connections);
+    data->connection_manager = g_object_ref (connection_manager);
     /* setup IpcFrontend */
     data->ipc_frontend =
         IPC_FRONTEND (ipc_frontend_dbus_new (data->options.bus,
@@ -196,14 +367,86 @@ init_thread_func (gpointer user_data)
         goto err_out;
     }
 
+    if (data->options.max_in_flight > 0 ||
+        data->options.max_connection_in_flight > 0)
+    {
+        admission = admission_control_new (data->options.max_in_flight,
+                                           data->options.max_connection_in_flight,
+                                           data->options.busy_when_full);
+    }
     data->command_source =
-        command_source_new (connection_manager, command_attrs);
+        command_source_new (connection_manager, command_attrs, admission);
     g_object_unref (connection_manager);
+    g_clear_object (&admission);
     session_list = session_list_new (data->options.max_sessions,
                                      SESSION_LIST_MAX_ABANDONED_DEFAULT);
     data->resource_manager = resource_manager_new (data->access_broker,
                                                    session_list);
     g_clear_object (&session_list);
+    g_object_set (data->ipc_frontend,
+                  "resource-manager", data->resource_manager,
+                  NULL);
+    if (data->options.context_memory_budget > 0) {
+        context_store = context_store_new (data->options.context_store_path,
+                                           data->options.context_memory_budget);
+        g_object_set (data->resource_manager,
+                      "context-store", context_store,
+                      NULL);
+        g_clear_object (&context_store);
+    }
+    if (data->options.primary_cache_size > 0) {
+        primary_cache = object_cache_new (data->options.primary_cache_size);
+        g_object_set (data->resource_manager,
+                      "primary-cache", primary_cache,
+                      NULL);
+        g_clear_object (&primary_cache);
+    }
+    if (data->options.load_cache_size > 0) {
+        load_cache = object_cache_new (data->options.load_cache_size);
+        g_object_set (data->resource_manager,
+                      "load-cache", load_cache,
+                      NULL);
+        g_clear_object (&load_cache);
+    }
+    g_object_set (data->resource_manager,
+                  "nv-public-cache", data->options.nv_public_cache,
+                  NULL);
+    if (data->options.pcr_cache_max_age > 0) {
+        pcr_cache = pcr_cache_new (data->options.pcr_cache_max_age);
+        g_object_set (data->resource_manager,
+                      "pcr-cache", pcr_cache,
+                      NULL);
+        g_clear_object (&pcr_cache);
+    }
+    if (data->options.coalesce_commands != NULL) {
+        coalesce_codes = coalesce_codes_parse (data->options.coalesce_commands);
+        g_object_set (data->resource_manager,
+                      "coalesce-codes", coalesce_codes,
+                      NULL);
+        g_clear_pointer (&coalesce_codes, g_hash_table_unref);
+    }
+    if (data->options.random_pool_size > 0) {
+        random_pool = random_pool_new (data->options.random_pool_size,
+                                       data->options.random_pool_low_watermark);
+        g_object_set (data->resource_manager,
+                      "random-pool", random_pool,
+                      NULL);
+        g_clear_object (&random_pool);
+    }
+    if (data->options.retry_budget != NULL) {
+        retry_policy = retry_policy_parse (data->options.retry_budget);
+        g_object_set (data->resource_manager,
+                      "retry-policy", retry_policy,
+                      NULL);
+        g_clear_object (&retry_policy);
+    }
+    if (data->options.self_test != NULL) {
+        self_test = self_test_parse (data->options.self_test);
+        g_object_set (data->resource_manager,
+                      "self-test", self_test,
+                      NULL);
+        g_clear_object (&self_test);
+    }
     data->response_sink = response_sink_new ();
     g_object_unref (command_attrs);
     g_object_unref (data->access_broker);
@@ -216,28 +459,60 @@ init_thread_func (gpointer user_data)
                      SINK   (data->resource_manager));
     source_add_sink (SOURCE (data->resource_manager),
                      SINK   (data->response_sink));
+    /*
+     * In run-to-completion mode the ResourceManager and ResponseSink don't
+     * get threads: each command is read, sent to the TPM and answered on
+     * the CommandSource thread. Otherwise each stage may be pinned to a
+     * CPU and / or given a scheduling policy.
+     */
+    if (data->options.run_to_completion) {
+        thread_set_inline (THREAD (data->resource_manager), TRUE);
+        thread_set_inline (THREAD (data->response_sink), TRUE);
+    }
+    for (i = 0; i < THREAD_STAGE_COUNT; ++i) {
+        thread_attrs [i] = (thread_attrs_t)THREAD_ATTRS_INIT;
+    }
+    if (!thread_attrs_parse (data->options.thread_affinity,
+                             data->options.thread_sched,
+                             thread_attrs)) {
+        g_critical ("failed to parse thread attributes");
+        ret = EX_USAGE;
+        goto err_out;
+    }
+    thread_set_attrs (THREAD (data->command_source),
+                      &thread_attrs [THREAD_STAGE_SOURCE]);
+    thread_set_attrs (THREAD (data->resource_manager),
+                      &thread_attrs [THREAD_STAGE_RESMGR]);
+    thread_set_attrs (THREAD (data->response_sink),
+                      &thread_attrs [THREAD_STAGE_SINK]);
     /*
      * Start the TPM command processing pipeline.
      */
     ret = thread_start (THREAD (data->command_source));
     if (ret != 0) {
-        g_critical ("failed to start connection_source");
+        g_critical ("failed to start connection_source: %s", strerror (ret));
         ret = EX_OSERR;
         goto err_out;
     }
     ret = thread_start (THREAD (data->resource_manager));
     if (ret != 0) {
-        g_critical ("failed to start ResourceManager: %s", strerror (errno));
+        g_critical ("failed to start ResourceManager: %s", strerror (ret));
         ret = EX_OSERR;
         goto err_out;
     }
     ret = thread_start (THREAD (data->response_sink));
     if (ret != 0) {
-        g_critical ("failed to start response_source");
+        g_critical ("failed to start response_source: %s", strerror (ret));
         ret = EX_OSERR;
         goto err_out;
     }
 
+    if (data->options.stats_interval > 0) {
+        data->stats_source = g_timeout_add_seconds (data->options.stats_interval,
+                                                    log_stats,
+                                                    data);
+    }
+
     g_mutex_unlock (&data->init_mutex);
     g_info ("init_thread_func done");
 
@@ -5,6 +5,7 @@
 
 #include "access-broker.h"
 #include "command-source.h"
+#include "connection-manager.h"
 #include "ipc-frontend.h"
 #include "random.h"
 #include "resource-manager.h"
@@ -24,6 +25,8 @@ typedef struct gmain_data {
     CommandSource          *command_source;
     Random                 *random;
     ResponseSink           *response_sink;
+    ConnectionManager      *connection_manager;
+    guint                   stats_source;
     GMutex                  init_mutex;
     IpcFrontend            *ipc_frontend;
     gboolean                ipc_disconnected;
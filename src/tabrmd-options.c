@@ -4,10 +4,14 @@
  */
 #include <glib.h>
 #include <tss2/tss2_tpm2_types.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "logging.h"
+#include "random-pool.h"
+#include "retry-policy.h"
+#include "self-test.h"
 #include "tabrmd-options.h"
 #include "util.h"
 
@@ -36,6 +40,196 @@ show_version (const gchar  *option_name,
     g_print ("tpm2-abrmd version %s\n", VERSION);
     exit (0);
 }
+/*
+ * Read-only commands that are coalesced by the 'default' allowlist.
+ */
+static const TPM2_CC coalesce_codes_default [] = {
+    TPM2_CC_GetCapability,
+    TPM2_CC_GetTestResult,
+    TPM2_CC_NV_Read,
+    TPM2_CC_NV_ReadPublic,
+    TPM2_CC_PCR_Read,
+    TPM2_CC_ReadClock,
+    TPM2_CC_ReadPublic,
+};
+/*
+ * Parse the allowlist of command codes eligible for coalescing. This is
+ * either the string 'default' or a comma separated list of numeric command
+ * codes (e.g. "0x17a,0x17e"). The returned GHashTable is a set of command
+ * codes stored with GUINT_TO_POINTER. Returns NULL if the string can't be
+ * parsed.
+ */
+GHashTable*
+coalesce_codes_parse (const gchar *str)
+{
+    GHashTable *codes;
+    gchar **tokens;
+    gchar *end;
+    guint64 code;
+    size_t i;
+
+    codes = g_hash_table_new (g_direct_hash, g_direct_equal);
+    if (g_strcmp0 (str, "default") == 0) {
+        for (i = 0; i < G_N_ELEMENTS (coalesce_codes_default); ++i) {
+            g_hash_table_add (codes,
+                              GUINT_TO_POINTER (coalesce_codes_default [i]));
+        }
+        return codes;
+    }
+    tokens = g_strsplit (str, ",", -1);
+    for (i = 0; tokens [i] != NULL; ++i) {
+        code = g_ascii_strtoull (tokens [i], &end, 0);
+        if (end == tokens [i] || *end != '\0' || code > UINT32_MAX) {
+            g_critical ("invalid command code in coalesce list: \"%s\"",
+                        tokens [i]);
+            g_clear_pointer (&codes, g_hash_table_unref);
+            break;
+        }
+        g_hash_table_add (codes, GUINT_TO_POINTER ((TPM2_CC)code));
+    }
+    g_strfreev (tokens);
+    return codes;
+}
+static const gchar *thread_stage_names [THREAD_STAGE_COUNT] = {
+    [THREAD_STAGE_SOURCE]  = "source",
+    [THREAD_STAGE_RESMGR]  = "resmgr",
+    [THREAD_STAGE_SINK]    = "sink",
+};
+static const struct {
+    const gchar *name;
+    gint         policy;
+} thread_sched_policies [] = {
+    { "other", SCHED_OTHER },
+    { "fifo",  SCHED_FIFO  },
+    { "rr",    SCHED_RR    },
+    { "batch", SCHED_BATCH },
+    { "idle",  SCHED_IDLE  },
+};
+/*
+ * Split a "stage:value" token, returning the stage or -1 if the stage
+ * name isn't one we know. '*value' points into 'token'.
+ */
+static gint
+thread_stage_split (gchar        *token,
+                    const gchar **value)
+{
+    gchar *colon = strchr (token, ':');
+    gint i;
+
+    if (colon == NULL) {
+        return -1;
+    }
+    *colon = '\0';
+    *value = colon + 1;
+    for (i = 0; i < THREAD_STAGE_COUNT; ++i) {
+        if (g_strcmp0 (token, thread_stage_names [i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+static gboolean
+thread_affinity_parse_one (gchar          *token,
+                           thread_attrs_t  attrs [THREAD_STAGE_COUNT])
+{
+    const gchar *value = NULL;
+    gchar *end;
+    guint64 cpu;
+    gint stage;
+
+    stage = thread_stage_split (token, &value);
+    if (stage < 0) {
+        return FALSE;
+    }
+    cpu = g_ascii_strtoull (value, &end, 10);
+    if (end == value || *end != '\0' || cpu >= CPU_SETSIZE) {
+        return FALSE;
+    }
+    attrs [stage].cpu = (gint)cpu;
+    return TRUE;
+}
+static gboolean
+thread_sched_parse_one (gchar          *token,
+                        thread_attrs_t  attrs [THREAD_STAGE_COUNT])
+{
+    const gchar *value = NULL;
+    gchar **fields, *end;
+    gint64 prio = 0;
+    gint stage, policy = -1;
+    size_t i;
+
+    stage = thread_stage_split (token, &value);
+    if (stage < 0) {
+        return FALSE;
+    }
+    fields = g_strsplit (value, ":", 2);
+    for (i = 0; i < G_N_ELEMENTS (thread_sched_policies); ++i) {
+        if (g_strcmp0 (fields [0], thread_sched_policies [i].name) == 0) {
+            policy = thread_sched_policies [i].policy;
+            break;
+        }
+    }
+    if (policy != -1 && fields [1] != NULL) {
+        prio = g_ascii_strtoll (fields [1], &end, 10);
+        if (end == fields [1] || *end != '\0') {
+            policy = -1;
+        }
+    }
+    g_strfreev (fields);
+    if (policy == -1 ||
+        prio < sched_get_priority_min (policy) ||
+        prio > sched_get_priority_max (policy))
+    {
+        return FALSE;
+    }
+    attrs [stage].policy = policy;
+    attrs [stage].priority = (gint)prio;
+    return TRUE;
+}
+/*
+ * Parse the per-stage thread attributes. 'affinity' is a comma separated
+ * list of "stage:cpu" and 'sched' one of "stage:policy[:priority]", either
+ * may be NULL. The stages are 'source', 'resmgr' and 'sink', policies
+ * are 'other', 'fifo', 'rr', 'batch' and 'idle'. 'attrs' must be
+ * initialized by the caller, stages that aren't mentioned are left alone.
+ */
+gboolean
+thread_attrs_parse (const gchar    *affinity,
+                    const gchar    *sched,
+                    thread_attrs_t  attrs [THREAD_STAGE_COUNT])
+{
+    gchar **tokens;
+    gboolean ret = TRUE;
+    size_t i;
+
+    if (affinity != NULL) {
+        tokens = g_strsplit (affinity, ",", -1);
+        for (i = 0; ret && tokens [i] != NULL; ++i) {
+            ret = thread_affinity_parse_one (tokens [i], attrs);
+            if (!ret) {
+                g_critical ("invalid thread affinity: \"%s\"", tokens [i]);
+            }
+        }
+        g_strfreev (tokens);
+    }
+    if (ret && sched != NULL) {
+        tokens = g_strsplit (sched, ",", -1);
+        for (i = 0; ret && tokens [i] != NULL; ++i) {
+            ret = thread_sched_parse_one (tokens [i], attrs);
+            if (!ret) {
+                g_critical ("invalid thread scheduling policy: \"%s\"",
+                            tokens [i]);
+            }
+        }
+        g_strfreev (tokens);
+    }
+    return ret;
+}
+static gboolean
+thread_attrs_is_set (const thread_attrs_t *attrs)
+{
+    return attrs->cpu >= 0 || attrs->policy >= 0;
+}
 /**
  * This function parses the parameter argument vector and populates the
  * parameter 'options' structure with data needed to configure the tabrmd.
@@ -93,6 +287,77 @@ parse_opts (gint argc,
             .description     = "TCTI configuration string. See tpm2-abrmd (8) for search rules.",
             .arg_description = "tcti-conf",
         },
+        { "context-memory-budget", 'b', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT64,
+          &options->context_memory_budget,
+          "Bytes of saved contexts kept in memory before the least recently "
+          "used are moved to the context store, 0 for no limit.", "bytes" },
+        { "context-store-path", 'c', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->context_store_path,
+          "Directory for the context store backing files.",
+          TABRMD_CONTEXT_STORE_PATH_DEFAULT },
+        { "primary-cache-size", 'p', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->primary_cache_size,
+          "Number of CreatePrimary results to cache, 0 to disable.", NULL },
+        { "load-cache-size", 'L', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->load_cache_size,
+          "Number of Load results under persistent parents to cache, 0 to "
+          "disable.", NULL },
+        { "nv-public-cache", 'N', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &options->nv_public_cache,
+          "Answer NV_ReadPublic from a cache invalidated by NV commands.",
+          NULL },
+        { "pcr-cache-max-age", 'P', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->pcr_cache_max_age,
+          "Answer PCR_Read from responses at most this many milliseconds "
+          "old, 0 to disable.", "ms" },
+        { "random-pool-size", 'R', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->random_pool_size,
+          "Bytes of TPM random data pooled to answer GetRandom, 0 to "
+          "disable.", "bytes" },
+        { "random-pool-low-watermark", 'W', G_OPTION_FLAG_NONE,
+          G_OPTION_ARG_INT, &options->random_pool_low_watermark,
+          "Refill the random pool once it holds fewer bytes.", "bytes" },
+        { "coalesce-commands", 'C', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->coalesce_commands,
+          "Execute identical queued read-only commands once: 'default' or a "
+          "comma separated list of command codes.", "codes" },
+        { "retry-budget", 'B', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->retry_budget,
+          "Resubmit commands the TPM answers with RETRY, YIELDED or TESTING "
+          "for up to this many milliseconds, with 'code:ms' overrides.",
+          "ms[,code:ms...]" },
+        { "self-test", 'T', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->self_test,
+          "Have the TPM self test these algorithms while idle: 'all' or a "
+          "comma separated list of algorithm names or IDs.", "algs" },
+        { "run-to-completion", 'i', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &options->run_to_completion,
+          "Read, process and answer each command on a single thread.",
+          NULL },
+        { "thread-affinity", 'a', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->thread_affinity,
+          "Pin pipeline threads to CPUs: comma separated list of "
+          "'stage:cpu'.", "stage:cpu[,...]" },
+        { "thread-sched", 'S', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->thread_sched,
+          "Scheduling policy for pipeline threads: comma separated list of "
+          "'stage:policy[:priority]'.", "stage:policy[:prio][,...]" },
+        { "max-in-flight", 'I', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_in_flight,
+          "Maximum number of commands read from all connections but not yet "
+          "answered, 0 for no limit.", NULL },
+        { "max-connection-in-flight", 'K', G_OPTION_FLAG_NONE,
+          G_OPTION_ARG_INT, &options->max_connection_in_flight,
+          "Maximum number of commands read from a single connection but "
+          "not yet answered, 0 for no limit.", NULL },
+        { "busy-when-full", 'Y', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &options->busy_when_full,
+          "Answer commands with a busy response code instead of waiting "
+          "when max-in-flight is reached.", NULL },
+        { "stats-interval", 'M', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->stats_interval,
+          "Log a summary of TPM use per client PID every N seconds, 0 to "
+          "disable.", "N" },
         { NULL, '\0', 0, 0, NULL, NULL, NULL },
     };
 
@@ -119,10 +384,10 @@ parse_opts (gint argc,
         return FALSE;
     }
     if (options->max_sessions < 1 ||
-        options->max_sessions > TABRMD_SESSIONS_MAX_DEFAULT)
+        options->max_sessions > TABRMD_SESSIONS_MAX)
     {
         g_critical ("max-sessions must be between 1 and %d",
-                    TABRMD_SESSIONS_MAX_DEFAULT);
+                    TABRMD_SESSIONS_MAX);
         return FALSE;
     }
     if (options->max_transients < 1 ||
@@ -132,6 +397,92 @@ parse_opts (gint argc,
                     TABRMD_TRANSIENT_MAX);
         return FALSE;
     }
+    if (options->context_memory_budget < 0) {
+        g_critical ("context-memory-budget must not be negative");
+        return FALSE;
+    }
+    if (options->primary_cache_size > TABRMD_PRIMARY_CACHE_SIZE_MAX) {
+        g_critical ("primary-cache-size must be between 0 and %d",
+                    TABRMD_PRIMARY_CACHE_SIZE_MAX);
+        return FALSE;
+    }
+    if (options->load_cache_size > TABRMD_LOAD_CACHE_SIZE_MAX) {
+        g_critical ("load-cache-size must be between 0 and %d",
+                    TABRMD_LOAD_CACHE_SIZE_MAX);
+        return FALSE;
+    }
+    if (options->pcr_cache_max_age > TABRMD_PCR_CACHE_MAX_AGE_MAX) {
+        g_critical ("pcr-cache-max-age must be between 0 and %d",
+                    TABRMD_PCR_CACHE_MAX_AGE_MAX);
+        return FALSE;
+    }
+    if (options->random_pool_size > RANDOM_POOL_SIZE_MAX) {
+        g_critical ("random-pool-size must be between 0 and %d",
+                    RANDOM_POOL_SIZE_MAX);
+        return FALSE;
+    }
+    if (options->max_in_flight > TABRMD_IN_FLIGHT_MAX) {
+        g_critical ("max-in-flight must be between 0 and %d",
+                    TABRMD_IN_FLIGHT_MAX);
+        return FALSE;
+    }
+    if (options->max_connection_in_flight > TABRMD_IN_FLIGHT_MAX) {
+        g_critical ("max-connection-in-flight must be between 0 and %d",
+                    TABRMD_IN_FLIGHT_MAX);
+        return FALSE;
+    }
+    if (options->busy_when_full && options->max_in_flight == 0) {
+        g_critical ("busy-when-full requires max-in-flight");
+        return FALSE;
+    }
+    if (options->stats_interval > TABRMD_STATS_INTERVAL_MAX) {
+        g_critical ("stats-interval must be between 0 and %d",
+                    TABRMD_STATS_INTERVAL_MAX);
+        return FALSE;
+    }
+    if (options->thread_affinity != NULL || options->thread_sched != NULL) {
+        thread_attrs_t attrs [THREAD_STAGE_COUNT];
+        size_t i;
+
+        for (i = 0; i < THREAD_STAGE_COUNT; ++i) {
+            attrs [i] = (thread_attrs_t)THREAD_ATTRS_INIT;
+        }
+        if (!thread_attrs_parse (options->thread_affinity,
+                                 options->thread_sched,
+                                 attrs)) {
+            return FALSE;
+        }
+        /* these stages don't get a thread of their own */
+        if (options->run_to_completion &&
+            (thread_attrs_is_set (&attrs [THREAD_STAGE_RESMGR]) ||
+             thread_attrs_is_set (&attrs [THREAD_STAGE_SINK])))
+        {
+            g_critical ("run-to-completion can't be combined with resmgr or "
+                        "sink thread attributes");
+            return FALSE;
+        }
+    }
+    if (options->coalesce_commands != NULL) {
+        GHashTable *codes = coalesce_codes_parse (options->coalesce_commands);
+        if (codes == NULL) {
+            return FALSE;
+        }
+        g_hash_table_unref (codes);
+    }
+    if (options->retry_budget != NULL) {
+        RetryPolicy *policy = retry_policy_parse (options->retry_budget);
+        if (policy == NULL) {
+            return FALSE;
+        }
+        g_object_unref (policy);
+    }
+    if (options->self_test != NULL) {
+        SelfTest *self_test = self_test_parse (options->self_test);
+        if (self_test == NULL) {
+            return FALSE;
+        }
+        g_object_unref (self_test);
+    }
     g_warning ("tcti_conf after: \"%s\"", options->tcti_conf);
     return TRUE;
 }
@@ -8,6 +8,7 @@
 #include <gio/gio.h>
 
 #include "tabrmd-defaults.h"
+#include "thread.h"
 
 #define TABRMD_OPTIONS_INIT_DEFAULT { \
     .bus = (GBusType)TABRMD_DBUS_TYPE_DEFAULT, \
@@ -19,8 +20,37 @@
     .prng_seed_file = TABRMD_ENTROPY_SRC_DEFAULT, \
     .allow_root = FALSE, \
     .tcti_conf = TABRMD_TCTI_CONF_DEFAULT, \
+    .context_memory_budget = TABRMD_CONTEXT_MEMORY_BUDGET_DEFAULT, \
+    .context_store_path = TABRMD_CONTEXT_STORE_PATH_DEFAULT, \
+    .primary_cache_size = TABRMD_PRIMARY_CACHE_SIZE_DEFAULT, \
+    .load_cache_size = TABRMD_LOAD_CACHE_SIZE_DEFAULT, \
+    .nv_public_cache = FALSE, \
+    .pcr_cache_max_age = TABRMD_PCR_CACHE_MAX_AGE_DEFAULT, \
+    .random_pool_size = TABRMD_RANDOM_POOL_SIZE_DEFAULT, \
+    .random_pool_low_watermark = TABRMD_RANDOM_POOL_LOW_WATERMARK_DEFAULT, \
+    .coalesce_commands = TABRMD_COALESCE_COMMANDS_DEFAULT, \
+    .retry_budget = TABRMD_RETRY_BUDGET_DEFAULT, \
+    .self_test = TABRMD_SELF_TEST_DEFAULT, \
+    .run_to_completion = TABRMD_RUN_TO_COMPLETION_DEFAULT, \
+    .thread_affinity = TABRMD_THREAD_AFFINITY_DEFAULT, \
+    .thread_sched = TABRMD_THREAD_SCHED_DEFAULT, \
+    .max_in_flight = TABRMD_IN_FLIGHT_MAX_DEFAULT, \
+    .max_connection_in_flight = TABRMD_CONNECTION_IN_FLIGHT_MAX_DEFAULT, \
+    .busy_when_full = TABRMD_BUSY_WHEN_FULL_DEFAULT, \
+    .stats_interval = TABRMD_STATS_INTERVAL_DEFAULT, \
 }
 
+/*
+ * The pipeline stages that get their own thread(s). The names used on the
+ * command line are in the same order.
+ */
+typedef enum {
+    THREAD_STAGE_SOURCE,
+    THREAD_STAGE_RESMGR,
+    THREAD_STAGE_SINK,
+    THREAD_STAGE_COUNT,
+} thread_stage_t;
+
 typedef struct tabrmd_options {
     GBusType        bus;
     gboolean        flush_all;
@@ -31,8 +61,32 @@ typedef struct tabrmd_options {
     const gchar    *prng_seed_file;
     gboolean        allow_root;
     gchar          *tcti_conf;
+    gint64          context_memory_budget;
+    gchar          *context_store_path;
+    guint           primary_cache_size;
+    guint           load_cache_size;
+    gboolean        nv_public_cache;
+    guint           pcr_cache_max_age;
+    guint           random_pool_size;
+    guint           random_pool_low_watermark;
+    gchar          *coalesce_commands;
+    gchar          *retry_budget;
+    gchar          *self_test;
+    gboolean        run_to_completion;
+    gchar          *thread_affinity;
+    gchar          *thread_sched;
+    guint           max_in_flight;
+    guint           max_connection_in_flight;
+    gboolean        busy_when_full;
+    guint           stats_interval;
 } tabrmd_options_t;
 
+GHashTable*
+coalesce_codes_parse (const gchar *str);
+gboolean
+thread_attrs_parse (const gchar    *affinity,
+                    const gchar    *sched,
+                    thread_attrs_t  attrs [THREAD_STAGE_COUNT]);
 gboolean
 parse_opts (gint argc,
             gchar *argv[],
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TABRMD_PROBES_H
+#define TABRMD_PROBES_H
+
+/*
+ * USDT probes for the 'tabrmd' provider. When built with --enable-usdt each
+ * probe is a nop and an ELF note (.note.stapsdt) that bpftrace, perf and
+ * systemtap use to find it: nothing happens until a tracer attaches. The
+ * arguments are still computed so they're kept to values the caller has on
+ * hand. Without USDT support the probes compile away, arguments and all.
+ *
+ * Probe arguments (connection ids are 0 for commands the daemon sends on
+ * its own behalf):
+ *   command_read   (connection id, command code, size, handle count,
+ *                   first handle)
+ *   queue_enqueue  (MessageQueue*, GObject*, queue length)
+ *   queue_dequeue  (MessageQueue*, GObject*)
+ *   tpm_transmit   (connection id, command code, size, first handle)
+ *   tpm_receive    (connection id, command code, size, response code)
+ *   context_load   (handle, response code)
+ *   context_save   (handle, response code)
+ *   context_flush  (handle, response code)
+ *   session_state  (handle, connection id, old state, new state)
+ *   response_write (connection id, response code, size, bytes written)
+ *
+ * See scripts/bpftrace for examples.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define TABRMD_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2 (tabrmd, name, a1, a2)
+#define TABRMD_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3 (tabrmd, name, a1, a2, a3)
+#define TABRMD_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4 (tabrmd, name, a1, a2, a3, a4)
+#define TABRMD_PROBE5(name, a1, a2, a3, a4, a5) \
+    DTRACE_PROBE5 (tabrmd, name, a1, a2, a3, a4, a5)
+
+#else /* ENABLE_USDT */
+
+/* never evaluated, only referenced so they don't show up as unused */
+#define TABRMD_PROBE2(name, a1, a2) \
+    do { if (0) { (void)(a1); (void)(a2); } } while (0)
+#define TABRMD_PROBE3(name, a1, a2, a3) \
+    do { if (0) { (void)(a1); (void)(a2); (void)(a3); } } while (0)
+#define TABRMD_PROBE4(name, a1, a2, a3, a4) \
+    do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } } \
+    while (0)
+#define TABRMD_PROBE5(name, a1, a2, a3, a4, a5) \
+    do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); \
+                  (void)(a5); } } while (0)
+
+#endif /* ENABLE_USDT */
+
+#endif /* TABRMD_PROBES_H */
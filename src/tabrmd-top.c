@@ -0,0 +1,513 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * tabrmd-top: a 'top' like view of a running tpm2-abrmd. Every interval
+ * it takes a snapshot of the daemon wide counters from the
+ * TctiTabrmd.Stats interface and of the per connection counters from
+ * GetConnectionStats, and shows the difference from the previous
+ * snapshot as rates.
+ */
+#include <gio/gio.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+#include "tabrmd-defaults.h"
+#include "tabrmd-generated.h"
+#include "util.h"
+
+/* work around older glib versions missing this symbol */
+#ifndef G_OPTION_FLAG_NONE
+#define G_OPTION_FLAG_NONE 0
+#endif
+
+#define TOP_INTERVAL_DEFAULT 1
+#define TOP_INTERVAL_MAX 3600
+#define TOP_CLIENTS_DEFAULT 10
+/* number of command codes shown in the command mix of each client */
+#define TOP_MIX_CODES 3
+
+typedef struct {
+    GBusType     bus;
+    gchar       *dbus_name;
+    gint         interval;
+    gint         iterations;
+    gint         clients;
+    gboolean     batch;
+} top_options_t;
+
+/* the daemon wide counters returned by GetSnapshot */
+typedef struct {
+    gint64       time_us;
+    guint32      connections;
+    guint64      commands;
+    guint32      queue_depth;
+    guint32      queue_high_water;
+    guint64      tpm_busy_us;
+    guint64      context_loads;
+    guint64      context_saves;
+} top_snapshot_t;
+
+/*
+ * The GetConnectionStats results added up by client PID, like the
+ * --stats-interval log. Connections aren't identified in the results so
+ * the PID is what we follow from one snapshot to the next. The deltas are
+ * filled in from the previous snapshot.
+ */
+typedef struct {
+    guint32      pid;
+    guint        connections;
+    guint64      commands;
+    guint64      tpm_time_us;
+    guint64      context_loads;
+    guint64      context_saves;
+    /* command code -> guint64* count */
+    GHashTable  *codes;
+    guint64      commands_delta;
+    guint64      tpm_time_delta;
+    guint64      context_loads_delta;
+    guint64      context_saves_delta;
+} top_client_t;
+
+typedef struct {
+    guint32      code;
+    guint64      count;
+} top_code_t;
+
+static gboolean
+show_version (const gchar  *option_name,
+              const gchar  *value,
+              gpointer      data,
+              GError      **error)
+{
+    UNUSED_PARAM(option_name);
+    UNUSED_PARAM(value);
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(error);
+
+    g_print ("tabrmd-top version %s\n", VERSION);
+    exit (0);
+}
+static gboolean
+parse_opts (gint           argc,
+            gchar         *argv[],
+            top_options_t *options)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    gboolean session_bus = FALSE;
+
+    GOptionEntry entries[] = {
+        { "dbus-name", 'n', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->dbus_name, "Name of the tpm2-abrmd instance on dbus.",
+          TABRMD_DBUS_NAME_DEFAULT },
+        { "session", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &session_bus,
+          "Connect to the session bus (system bus is default).", NULL },
+        { "interval", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->interval, "Seconds between updates.", "seconds" },
+        { "iterations", 'c', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->iterations,
+          "Exit after this many updates, 0 to run until interrupted.", NULL },
+        { "clients", 'N', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->clients, "Number of client PIDs to show.", NULL },
+        { "batch", 'b', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &options->batch,
+          "Print each update after the last instead of redrawing the "
+          "terminal.", NULL },
+        { "version", 'v', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          show_version, "Show version string", NULL },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+
+    ctx = g_option_context_new (" - live view of tpm2-abrmd throughput and clients");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
+        g_printerr ("Failed to parse options: %s\n", err->message);
+        g_error_free (err);
+        g_option_context_free (ctx);
+        return FALSE;
+    }
+    g_option_context_free (ctx);
+    options->bus = session_bus ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM;
+    if (options->dbus_name == NULL) {
+        options->dbus_name = g_strdup (TABRMD_DBUS_NAME_DEFAULT);
+    }
+    if (options->interval < 1 || options->interval > TOP_INTERVAL_MAX) {
+        g_printerr ("interval must be between 1 and %d\n", TOP_INTERVAL_MAX);
+        return FALSE;
+    }
+    if (options->iterations < 0) {
+        g_printerr ("iterations must not be negative\n");
+        return FALSE;
+    }
+    if (options->clients < 0) {
+        g_printerr ("clients must not be negative\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Missing keys are left at 0 so a newer tabrmd-top works against an
+ * older daemon that doesn't send all of them.
+ */
+static void
+snapshot_from_variant (GVariant       *dict,
+                       top_snapshot_t *snapshot)
+{
+    *snapshot = (top_snapshot_t){ 0, };
+    g_variant_lookup (dict, "time-us", "x", &snapshot->time_us);
+    g_variant_lookup (dict, "connections", "u", &snapshot->connections);
+    g_variant_lookup (dict, "commands", "t", &snapshot->commands);
+    g_variant_lookup (dict, "queue-depth", "u", &snapshot->queue_depth);
+    g_variant_lookup (dict, "queue-high-water", "u",
+                      &snapshot->queue_high_water);
+    g_variant_lookup (dict, "tpm-busy-us", "t", &snapshot->tpm_busy_us);
+    g_variant_lookup (dict, "context-loads", "t", &snapshot->context_loads);
+    g_variant_lookup (dict, "context-saves", "t", &snapshot->context_saves);
+}
+static void
+top_client_free (gpointer data)
+{
+    top_client_t *client = (top_client_t*)data;
+
+    g_hash_table_unref (client->codes);
+    g_free (client);
+}
+/*
+ * Add the counters of one connection from GetConnectionStats to the
+ * client with the same PID, creating it on first sight.
+ */
+static void
+clients_add_connection (GHashTable *clients,
+                        GVariant   *dict)
+{
+    top_client_t *client;
+    GVariant *codes;
+    GVariantIter iter;
+    guint32 pid = 0, code;
+    guint64 value, *count;
+
+    g_variant_lookup (dict, "pid", "u", &pid);
+    client = g_hash_table_lookup (clients, GUINT_TO_POINTER (pid));
+    if (client == NULL) {
+        client = g_new0 (top_client_t, 1);
+        client->pid = pid;
+        client->codes = g_hash_table_new_full (g_direct_hash,
+                                               g_direct_equal,
+                                               NULL,
+                                               g_free);
+        g_hash_table_insert (clients, GUINT_TO_POINTER (pid), client);
+    }
+    ++client->connections;
+    if (g_variant_lookup (dict, "commands", "t", &value))
+        client->commands += value;
+    if (g_variant_lookup (dict, "tpm-time-us", "t", &value))
+        client->tpm_time_us += value;
+    if (g_variant_lookup (dict, "context-loads", "t", &value))
+        client->context_loads += value;
+    if (g_variant_lookup (dict, "context-saves", "t", &value))
+        client->context_saves += value;
+
+    codes = g_variant_lookup_value (dict,
+                                    "command-codes",
+                                    G_VARIANT_TYPE ("a{ut}"));
+    if (codes == NULL) {
+        return;
+    }
+    g_variant_iter_init (&iter, codes);
+    while (g_variant_iter_next (&iter, "{ut}", &code, &value)) {
+        count = g_hash_table_lookup (client->codes, GUINT_TO_POINTER (code));
+        if (count == NULL) {
+            count = g_new0 (guint64, 1);
+            g_hash_table_insert (client->codes, GUINT_TO_POINTER (code), count);
+        }
+        *count += value;
+    }
+    g_variant_unref (codes);
+}
+static GHashTable*
+clients_from_variant (GVariant *array)
+{
+    GHashTable *clients;
+    GVariantIter iter;
+    GVariant *dict;
+
+    clients = g_hash_table_new_full (g_direct_hash,
+                                     g_direct_equal,
+                                     NULL,
+                                     top_client_free);
+    g_variant_iter_init (&iter, array);
+    while ((dict = g_variant_iter_next_value (&iter)) != NULL) {
+        clients_add_connection (clients, dict);
+        g_variant_unref (dict);
+    }
+    return clients;
+}
+/*
+ * A client's totals drop when one of its connections closes, the delta
+ * is 0 then rather than wrapping. A client we haven't seen before gets
+ * everything it has done as its delta.
+ */
+static guint64
+counter_delta (guint64 now,
+               guint64 prev)
+{
+    return now > prev ? now - prev : 0;
+}
+static void
+clients_set_deltas (GHashTable *clients,
+                    GHashTable *prev_clients)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    top_client_t *client, *prev, none = { 0, };
+
+    g_hash_table_iter_init (&iter, clients);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        client = (top_client_t*)value;
+        prev = g_hash_table_lookup (prev_clients, key);
+        if (prev == NULL) {
+            prev = &none;
+        }
+        client->commands_delta = counter_delta (client->commands,
+                                                prev->commands);
+        client->tpm_time_delta = counter_delta (client->tpm_time_us,
+                                                prev->tpm_time_us);
+        client->context_loads_delta = counter_delta (client->context_loads,
+                                                     prev->context_loads);
+        client->context_saves_delta = counter_delta (client->context_saves,
+                                                     prev->context_saves);
+    }
+}
+/* busiest first: by TPM time in the interval, then by commands */
+static gint
+client_compare (gconstpointer a,
+                gconstpointer b)
+{
+    const top_client_t *client_a = (const top_client_t*)a;
+    const top_client_t *client_b = (const top_client_t*)b;
+
+    if (client_a->tpm_time_delta != client_b->tpm_time_delta) {
+        return client_a->tpm_time_delta > client_b->tpm_time_delta ? -1 : 1;
+    }
+    if (client_a->commands_delta != client_b->commands_delta) {
+        return client_a->commands_delta > client_b->commands_delta ? -1 : 1;
+    }
+    return client_a->pid < client_b->pid ? -1 : client_a->pid > client_b->pid;
+}
+static gint
+code_compare (gconstpointer a,
+              gconstpointer b)
+{
+    const top_code_t *code_a = (const top_code_t*)a;
+    const top_code_t *code_b = (const top_code_t*)b;
+
+    if (code_a->count != code_b->count) {
+        return code_a->count > code_b->count ? -1 : 1;
+    }
+    return code_a->code < code_b->code ? -1 : code_a->code > code_b->code;
+}
+/*
+ * The most frequent command codes sent by the client's connections and
+ * their share of its commands, e.g. '0x176 60% 0x157 30% 0x165 10%'.
+ */
+static gchar*
+client_command_mix (top_client_t *client)
+{
+    GArray *codes;
+    GString *mix;
+    GHashTableIter iter;
+    gpointer key, value;
+    top_code_t entry;
+    guint i;
+
+    codes = g_array_sized_new (FALSE,
+                               FALSE,
+                               sizeof (top_code_t),
+                               g_hash_table_size (client->codes));
+    g_hash_table_iter_init (&iter, client->codes);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        entry.code = GPOINTER_TO_UINT (key);
+        entry.count = *(guint64*)value;
+        g_array_append_val (codes, entry);
+    }
+    g_array_sort (codes, code_compare);
+
+    mix = g_string_new (NULL);
+    for (i = 0; i < codes->len && i < TOP_MIX_CODES; ++i) {
+        entry = g_array_index (codes, top_code_t, i);
+        g_string_append_printf (mix, "%s0x%03" PRIx32 " %" PRIu64 "%%",
+                                i == 0 ? "" : " ", entry.code,
+                                client->commands == 0 ? 0 :
+                                entry.count * 100 / client->commands);
+    }
+    g_array_free (codes, TRUE);
+    return g_string_free (mix, FALSE);
+}
+static gdouble
+per_second (guint64 delta,
+            gint64  elapsed_us)
+{
+    return elapsed_us > 0 ?
+        (gdouble)delta * G_USEC_PER_SEC / (gdouble)elapsed_us : 0.0;
+}
+static void
+print_update (top_options_t  *options,
+              top_snapshot_t *now,
+              top_snapshot_t *prev,
+              GHashTable     *clients)
+{
+    GList *sorted, *item;
+    top_client_t *client;
+    gint64 elapsed = now->time_us - prev->time_us;
+    gchar *mix;
+    gint shown = 0;
+
+    if (!options->batch) {
+        /* home the cursor and clear the screen */
+        g_print ("\033[H\033[2J");
+    }
+    g_print ("tabrmd-top - %s, %" PRIu32 " connections\n",
+             options->dbus_name, now->connections);
+    g_print ("commands: %.1f/s  queue: %" PRIu32 " (max %" PRIu32 ")  "
+             "TPM busy: %.1f%%\n",
+             per_second (counter_delta (now->commands, prev->commands),
+                         elapsed),
+             now->queue_depth, now->queue_high_water,
+             per_second (counter_delta (now->tpm_busy_us, prev->tpm_busy_us),
+                         elapsed) * 100.0 / G_USEC_PER_SEC);
+    g_print ("context loads: %.1f/s  context saves: %.1f/s\n\n",
+             per_second (counter_delta (now->context_loads,
+                                        prev->context_loads), elapsed),
+             per_second (counter_delta (now->context_saves,
+                                        prev->context_saves), elapsed));
+    g_print ("%8s %5s %6s %8s %7s %7s %10s  %s\n", "PID", "CONNS", "TPM%",
+             "CMDS/s", "LOAD/s", "SAVE/s", "COMMANDS", "COMMAND MIX");
+
+    sorted = g_list_sort (g_hash_table_get_values (clients), client_compare);
+    for (item = sorted;
+         item != NULL && shown < options->clients;
+         item = item->next, ++shown)
+    {
+        client = (top_client_t*)item->data;
+        mix = client_command_mix (client);
+        g_print ("%8" PRIu32 " %5u %6.1f %8.1f %7.1f %7.1f %10" PRIu64
+                 "  %s\n",
+                 client->pid,
+                 client->connections,
+                 per_second (client->tpm_time_delta, elapsed) * 100.0 /
+                     G_USEC_PER_SEC,
+                 per_second (client->commands_delta, elapsed),
+                 per_second (client->context_loads_delta, elapsed),
+                 per_second (client->context_saves_delta, elapsed),
+                 client->commands,
+                 mix);
+        g_free (mix);
+    }
+    g_list_free (sorted);
+    if (options->batch) {
+        g_print ("\n");
+    }
+}
+/*
+ * Take one snapshot of the daemon and client counters. Returns NULL and
+ * sets 'error' if either call fails.
+ */
+static GHashTable*
+take_snapshot (TctiTabrmdStats *stats_proxy,
+               TctiTabrmd      *proxy,
+               top_snapshot_t  *snapshot,
+               GError         **error)
+{
+    GVariant *dict = NULL, *array = NULL;
+    GHashTable *clients;
+
+    if (!tcti_tabrmd_stats_call_get_snapshot_sync (stats_proxy,
+                                                   &dict,
+                                                   NULL,
+                                                   error)) {
+        return NULL;
+    }
+    snapshot_from_variant (dict, snapshot);
+    g_variant_unref (dict);
+    if (!tcti_tabrmd_call_get_connection_stats_sync (proxy,
+                                                     &array,
+                                                     NULL,
+                                                     error)) {
+        return NULL;
+    }
+    clients = clients_from_variant (array);
+    g_variant_unref (array);
+    return clients;
+}
+/*
+ * GetConnectionStats only returns the connections of our own UID unless
+ * we're root, the daemon wide figures are always complete.
+ */
+int
+main (int   argc,
+      char *argv[])
+{
+    top_options_t options = {
+        .interval = TOP_INTERVAL_DEFAULT,
+        .clients = TOP_CLIENTS_DEFAULT,
+    };
+    TctiTabrmdStats *stats_proxy = NULL;
+    TctiTabrmd *proxy = NULL;
+    top_snapshot_t now, prev;
+    GHashTable *clients = NULL, *prev_clients = NULL;
+    GError *error = NULL;
+    gint i, ret = EX_OK;
+
+    if (!parse_opts (argc, argv, &options)) {
+        return EX_USAGE;
+    }
+    stats_proxy = tcti_tabrmd_stats_proxy_new_for_bus_sync (options.bus,
+                                                            G_DBUS_PROXY_FLAGS_NONE,
+                                                            options.dbus_name,
+                                                            TABRMD_DBUS_PATH,
+                                                            NULL,
+                                                            &error);
+    if (stats_proxy != NULL) {
+        proxy = tcti_tabrmd_proxy_new_for_bus_sync (options.bus,
+                                                    G_DBUS_PROXY_FLAGS_NONE,
+                                                    options.dbus_name,
+                                                    TABRMD_DBUS_PATH,
+                                                    NULL,
+                                                    &error);
+    }
+    if (proxy == NULL) {
+        g_printerr ("failed to create dbus proxy for %s: %s\n",
+                    options.dbus_name, error->message);
+        ret = EX_UNAVAILABLE;
+        goto out;
+    }
+    prev_clients = take_snapshot (stats_proxy, proxy, &prev, &error);
+    for (i = 0;
+         prev_clients != NULL && (options.iterations == 0 || i < options.iterations);
+         ++i)
+    {
+        g_usleep ((gulong)options.interval * G_USEC_PER_SEC);
+        clients = take_snapshot (stats_proxy, proxy, &now, &error);
+        if (clients == NULL) {
+            break;
+        }
+        clients_set_deltas (clients, prev_clients);
+        print_update (&options, &now, &prev, clients);
+        g_hash_table_unref (prev_clients);
+        prev_clients = clients;
+        prev = now;
+    }
+    if (error != NULL) {
+        g_printerr ("failed to get statistics from %s: %s\n",
+                    options.dbus_name, error->message);
+        ret = EX_UNAVAILABLE;
+    }
+out:
+    g_clear_error (&error);
+    g_clear_pointer (&prev_clients, g_hash_table_unref);
+    g_clear_object (&proxy);
+    g_clear_object (&stats_proxy);
+    g_free (options.dbus_name);
+    return ret;
+}
@@ -24,6 +24,7 @@
 #define TSS2_RESMGR_RC_GENERAL_FAILURE (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TSS2_BASE_RC_GENERAL_FAILURE)
 #define TSS2_RESMGR_RC_OBJECT_MEMORY   (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TPM2_RC_OBJECT_MEMORY)
 #define TSS2_RESMGR_RC_SESSION_MEMORY  (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TPM2_RC_SESSION_MEMORY)
+#define TSS2_RESMGR_RC_BUSY            (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TSS2_BASE_RC_TRY_AGAIN)
 
 GQuark  tabrmd_error_quark (void);
 
@@ -140,3 +140,12 @@ tcti_receive (Tcti      *self,
                               response,
                               timeout);
 }
+/*
+ * Ask the TCTI to cancel the command in progress. This is meant to be
+ * called from a thread other than the one blocked in tcti_receive.
+ */
+TSS2_RC
+tcti_cancel (Tcti *self)
+{
+    return Tss2_Tcti_Cancel (self->tcti_context);
+}
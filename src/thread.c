@@ -4,16 +4,21 @@
  * All rights reserved.
  */
 
+#include <sched.h>
+#include <string.h>
+
 #include "util.h"
 #include "thread.h"
 
 G_DEFINE_ABSTRACT_TYPE (Thread, thread, G_TYPE_OBJECT);
 
 static void
-thread_init (Thread *iface)
+thread_init (Thread *self)
 {
-    UNUSED_PARAM(iface);
-/* noop, required by G_DEFINE_INTERFACE */
+    thread_attrs_t attrs = THREAD_ATTRS_INIT;
+
+    self->attrs = attrs;
+    self->inline_mode = FALSE;
 }
 static void
 thread_class_init (ThreadClass *klass)
@@ -21,17 +26,88 @@ thread_class_init (ThreadClass *klass)
     klass->thread_run = NULL;
 }
 
+/*
+ * Set the CPU affinity and scheduling policy used when the thread is
+ * started. Has no effect on a running thread.
+ */
+void
+thread_set_attrs (Thread               *self,
+                  const thread_attrs_t *attrs)
+{
+    g_assert_nonnull (attrs);
+    self->attrs = *attrs;
+}
+void
+thread_set_inline (Thread   *self,
+                   gboolean  inline_mode)
+{
+    if (self->thread_id != 0) {
+        g_warning ("thread running");
+        return;
+    }
+    self->inline_mode = inline_mode;
+}
+gboolean
+thread_is_inline (Thread *self)
+{
+    return self->inline_mode;
+}
 gint
 thread_start (Thread *self)
 {
+    pthread_attr_t attr;
+    struct sched_param param = { .sched_priority = self->attrs.priority };
+    cpu_set_t cpus;
+    gint ret;
+
+    if (self->inline_mode) {
+        return 0;
+    }
     if (self->thread_id != 0) {
         g_warning ("thread running");
         return -1;
     }
-    return pthread_create (&self->thread_id,
-                           NULL,
-                           THREAD_GET_CLASS (self)->thread_run,
-                           self);
+    pthread_attr_init (&attr);
+    if (self->attrs.policy >= 0) {
+        ret = pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+        if (ret != 0) {
+            g_warning ("%s: pthread_attr_setinheritsched failed: %s",
+                       __func__, strerror (ret));
+            goto out;
+        }
+        ret = pthread_attr_setschedpolicy (&attr, self->attrs.policy);
+        if (ret != 0) {
+            g_warning ("%s: pthread_attr_setschedpolicy %d failed: %s",
+                       __func__, self->attrs.policy, strerror (ret));
+            goto out;
+        }
+        ret = pthread_attr_setschedparam (&attr, &param);
+        if (ret != 0) {
+            g_warning ("%s: pthread_attr_setschedparam priority %d failed: %s",
+                       __func__, self->attrs.priority, strerror (ret));
+            goto out;
+        }
+    }
+    if (self->attrs.cpu >= 0) {
+        CPU_ZERO (&cpus);
+        CPU_SET (self->attrs.cpu, &cpus);
+        ret = pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+        if (ret != 0) {
+            g_warning ("%s: pthread_attr_setaffinity_np cpu %d failed: %s",
+                       __func__, self->attrs.cpu, strerror (ret));
+            goto out;
+        }
+    }
+    ret = pthread_create (&self->thread_id,
+                          &attr,
+                          THREAD_GET_CLASS (self)->thread_run,
+                          self);
+    if (ret != 0) {
+        self->thread_id = 0;
+    }
+out:
+    pthread_attr_destroy (&attr);
+    return ret;
 }
 
 void
@@ -39,6 +115,9 @@ thread_cancel (Thread *self)
 {
     ThreadClass *class = THREAD_GET_CLASS (self);
 
+    if (self->inline_mode) {
+        return;
+    }
     if (self->thread_id == 0) {
         g_warning ("thread not running");
         return;
@@ -51,6 +130,9 @@ thread_cancel (Thread *self)
 gint
 thread_join (Thread *self)
 {
+    if (self->inline_mode) {
+        return 0;
+    }
     if (self->thread_id == 0) {
         g_warning ("thread not running");
         return -1;
@@ -7,9 +7,22 @@
 #define THREAD_INTERFACE_H
 
 #include <glib-object.h>
+#include <pthread.h>
 
 G_BEGIN_DECLS
 
+/*
+ * Placement and scheduling for the pthread behind a Thread. A 'cpu' of -1
+ * leaves the affinity alone, a 'policy' of -1 inherits the scheduling
+ * policy and priority of the creating thread.
+ */
+typedef struct {
+    gint        cpu;
+    gint        policy;
+    gint        priority;
+} thread_attrs_t;
+#define THREAD_ATTRS_INIT { .cpu = -1, .policy = -1, .priority = 0, }
+
 typedef struct _Thread Thread;
 typedef struct _ThreadClass ThreadClass;
 
@@ -22,9 +35,16 @@ struct _ThreadClass {
     ThreadUnblockFunc thread_unblock;
 };
 
+/*
+ * An 'inline' Thread never starts a pthread: whoever passes it a message
+ * processes the message on their own thread (run to completion). Starting,
+ * canceling and joining it does nothing.
+ */
 struct _Thread {
-    GObject     parent;
-    pthread_t   thread_id;
+    GObject         parent;
+    pthread_t       thread_id;
+    thread_attrs_t  attrs;
+    gboolean        inline_mode;
 };
 
 #define TYPE_THREAD             (thread_get_type ())
@@ -38,6 +58,11 @@ GType           thread_get_type     (void);
 void            thread_cancel       (Thread            *self);
 gint            thread_join         (Thread            *self);
 gint            thread_start        (Thread            *self);
+void            thread_set_attrs    (Thread            *self,
+                                     const thread_attrs_t *attrs);
+void            thread_set_inline   (Thread            *self,
+                                     gboolean           inline_mode);
+gboolean        thread_is_inline    (Thread            *self);
 
 G_END_DECLS
 #endif /* THREAD_INTERFACE_H */
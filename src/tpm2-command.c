@@ -199,6 +199,7 @@ tpm2_command_finalize (GObject *obj)
 
     g_debug ("tpm2_command_finalize");
     g_clear_pointer (&cmd->buffer, g_free);
+    g_clear_pointer (&cmd->object_key, g_bytes_unref);
     G_OBJECT_CLASS (tpm2_command_parent_class)->finalize (obj);
 }
 static void
@@ -727,3 +728,73 @@ tpm2_command_foreach_auth (Tpm2Command *command,
 
     return TRUE;
 }
+/*
+ * Return the offset of the parameter area in the command buffer. This is
+ * immediately after the handle area for commands without authorizations
+ * and after the authorization area for those with. If the authorization
+ * area would overrun the buffer the size of the buffer is returned so that
+ * callers see an empty parameter area.
+ */
+size_t
+tpm2_command_get_params_offset (Tpm2Command *command)
+{
+    size_t offset;
+
+    if (command == NULL) {
+        g_warning ("%s passed NULL parameter", __func__);
+        return 0;
+    }
+    if (!tpm2_command_has_auths (command)) {
+        offset = AUTH_AREA_OFFSET (command);
+    } else if (AUTH_AREA_SIZE_END_OFFSET (command) > command->buffer_size) {
+        return command->buffer_size;
+    } else {
+        offset = AUTH_AREA_END_OFFSET (command);
+    }
+    return offset > command->buffer_size ? command->buffer_size : offset;
+}
+/*
+ * A stateless command references no handles and carries no sessions so the
+ * ResourceManager has nothing to virtualize for it. This is decided once by
+ * the CommandSource when the command is received.
+ */
+gboolean
+tpm2_command_is_stateless (Tpm2Command *command)
+{
+    return command->stateless;
+}
+void
+tpm2_command_set_stateless (Tpm2Command *command,
+                            gboolean     stateless)
+{
+    command->stateless = stateless;
+}
+/*
+ * The ResourceManager may prepare a command before it's processed, usually
+ * while the TPM is busy with the command before it. What it computes here
+ * must depend only on the command buffer as received from the client.
+ * 'object_key' is the ObjectCache key for the command or NULL if it isn't
+ * cacheable. The command takes its own reference.
+ */
+gboolean
+tpm2_command_is_prepared (Tpm2Command *command)
+{
+    return command->prepared;
+}
+void
+tpm2_command_set_prepared (Tpm2Command *command,
+                           GBytes      *object_key)
+{
+    g_clear_pointer (&command->object_key, g_bytes_unref);
+    if (object_key != NULL) {
+        command->object_key = g_bytes_ref (object_key);
+    }
+    command->prepared = TRUE;
+}
+/* Returns a new reference to the ObjectCache key or NULL. */
+GBytes*
+tpm2_command_get_object_key (Tpm2Command *command)
+{
+    return command->object_key != NULL ?
+        g_bytes_ref (command->object_key) : NULL;
+}
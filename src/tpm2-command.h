@@ -23,6 +23,9 @@ typedef struct _Tpm2Command {
     Connection     *connection;
     guint8         *buffer;
     size_t          buffer_size;
+    gboolean        stateless;
+    gboolean        prepared;
+    GBytes         *object_key;
 } Tpm2Command;
 
 #include "command-attrs.h"
@@ -76,6 +79,14 @@ UINT32                tpm2_command_get_auths_size  (Tpm2Command      *command);
 gboolean              tpm2_command_foreach_auth    (Tpm2Command      *command,
                                                     GFunc             func,
                                                     gpointer          user_data);
+size_t                tpm2_command_get_params_offset (Tpm2Command    *command);
+gboolean              tpm2_command_is_stateless    (Tpm2Command      *command);
+void                  tpm2_command_set_stateless   (Tpm2Command      *command,
+                                                    gboolean          stateless);
+gboolean              tpm2_command_is_prepared     (Tpm2Command      *command);
+GBytes*               tpm2_command_get_object_key  (Tpm2Command      *command);
+void                  tpm2_command_set_prepared    (Tpm2Command      *command,
+                                                    GBytes           *object_key);
 
 G_END_DECLS
 
@@ -256,6 +256,43 @@ out:
     }
     return response;
 }
+/*
+ * Create a new Tpm2Response object with a message body / buffer formatted
+ * for the response to the TPM2_GetRandom command. This command has no
+ * session and the body of the response is the TPM2B_DIGEST parameter.
+ */
+Tpm2Response*
+tpm2_response_new_get_random (Connection   *connection,
+                              TPM2B_DIGEST *random_bytes)
+{
+    Tpm2Response *response = NULL;
+    size_t offset = TPM_HEADER_SIZE;
+    size_t size = TPM_HEADER_SIZE + sizeof (UINT16) + random_bytes->size;
+    uint8_t *buf = g_malloc0 (size);
+    TSS2_RC rc;
+
+    rc = Tss2_MU_TPM2B_DIGEST_Marshal (random_bytes, buf, size, &offset);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: Failed to write TPM2B_DIGEST to response: 0x%"
+                   PRIx32, __func__, rc);
+        goto out;
+    }
+    rc = tpm2_header_init (buf, offset, TPM2_ST_NO_SESSIONS, offset, TSS2_RC_SUCCESS);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: Failed to initialize header: 0x%" PRIx32,
+                   __func__, rc);
+        goto out;
+    }
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  offset,
+                                  (TPMA_CC)TPM2_CC_GetRandom);
+out:
+    if (response == NULL) {
+        g_free (buf);
+    }
+    return response;
+}
 /*
  * Create a new Tpm2Response object with a message body / buffer formatted
  * for the response to the TPM2_ContextSave command. This command has no
@@ -46,6 +46,8 @@ Tpm2Response* tpm2_response_new_context_save (Connection *connection,
                                               SessionEntry *entry);
 Tpm2Response* tpm2_response_new_context_load (Connection *connection,
                                               SessionEntry *entry);
+Tpm2Response* tpm2_response_new_get_random (Connection   *connection,
+                                            TPM2B_DIGEST *random_bytes);
 TPMA_CC             tpm2_response_get_attributes (Tpm2Response   *response);
 guint8*             tpm2_response_get_buffer    (Tpm2Response    *response);
 TSS2_RC              tpm2_response_get_code      (Tpm2Response    *response);
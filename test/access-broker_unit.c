@@ -454,6 +454,91 @@ access_broker_send_command_success (void **state)
     assert_int_equal (connection, data->connection);
     g_object_unref (connection);
 }
+static void
+busy_func_count (gpointer user_data)
+{
+    guint *count = (guint*)user_data;
+
+    ++*count;
+}
+/*
+ * With a busy function registered the AccessBroker first polls for the
+ * response. When the TCTI says to try again the busy function is called
+ * once before blocking for the response.
+ */
+static void
+access_broker_send_command_busy_func (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+    uint8_t buf [1] = { 0 };
+    size_t size = sizeof (buf);
+    guint count = 0;
+
+    access_broker_set_busy_func (data->broker, busy_func_count, &count);
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, NULL);
+    will_return (tcti_mock_receive, 0);
+    will_return (tcti_mock_receive, TSS2_TCTI_RC_TRY_AGAIN);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, size);
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+    data->response = access_broker_send_command (data->broker, data->command, &rc);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_response_get_code (data->response), TSS2_RC_SUCCESS);
+    assert_int_equal (count, 1);
+}
+/*
+ * A cancel requested while the TPM is executing the command is passed to
+ * the TCTI by the thread polling for the response.
+ */
+static void
+access_broker_send_command_cancel (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+    uint8_t buf [1] = { 0 };
+    size_t size = sizeof (buf);
+
+    assert_int_equal (access_broker_cancel (data->broker), TSS2_RC_SUCCESS);
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, NULL);
+    will_return (tcti_mock_receive, 0);
+    will_return (tcti_mock_receive, TSS2_TCTI_RC_TRY_AGAIN);
+    will_return (tcti_mock_cancel, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, size);
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+    data->response = access_broker_send_command (data->broker, data->command, &rc);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_false (data->broker->cancel_requested);
+}
+/*
+ * A TCTI that rejects a non-blocking receive gets a blocking one instead.
+ * Nothing can pass a cancel on while it blocks so cancel is reported as
+ * not implemented from then on.
+ */
+static void
+access_broker_send_command_block_only (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+    uint8_t buf [1] = { 0 };
+    size_t size = sizeof (buf);
+
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, NULL);
+    will_return (tcti_mock_receive, 0);
+    will_return (tcti_mock_receive, TSS2_TCTI_RC_BAD_VALUE);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, size);
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+    data->response = access_broker_send_command (data->broker, data->command, &rc);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_true (data->broker->nonblock_unsupported);
+    assert_int_equal (access_broker_cancel (data->broker),
+                      TSS2_TCTI_RC_NOT_IMPLEMENTED);
+}
 
 static void
 access_broker_get_trans_object_count_caps_fail (void **state)
@@ -539,6 +624,29 @@ access_broker_context_save_test (void **state)
     assert_int_equal (rc, TPM2_RC_SUCCESS);
 }
 
+/*
+ * Context loads and saves are counted whether or not the TPM succeeds.
+ */
+static void
+access_broker_get_stats_test (void **state)
+{
+    TPMS_CONTEXT context = { 0, };
+    TPM2_HANDLE handle = 0;
+    test_data_t *data = (test_data_t*)*state;
+    access_broker_stats_t stats;
+
+    will_return (__wrap_Tss2_Sys_ContextLoad, TSS2_RC_SUCCESS);
+    access_broker_context_load (data->broker, &context, &handle);
+    will_return (__wrap_Tss2_Sys_ContextSave, TPM2_RC_SUCCESS);
+    access_broker_context_save (data->broker, handle, &context);
+    will_return (__wrap_Tss2_Sys_ContextSave, TPM2_RC_FAILURE);
+    access_broker_context_saveflush (data->broker, handle, &context);
+
+    access_broker_get_stats (data->broker, &stats);
+    assert_int_equal (stats.context_loads, 1);
+    assert_int_equal (stats.context_saves, 2);
+}
+
 static void
 access_broker_context_flush_fail (void **state)
 {
@@ -651,6 +759,15 @@ main (void)
         cmocka_unit_test_setup_teardown (access_broker_send_command_success,
                                          access_broker_setup_with_command,
                                          access_broker_teardown),
+        cmocka_unit_test_setup_teardown (access_broker_send_command_busy_func,
+                                         access_broker_setup_with_command,
+                                         access_broker_teardown),
+        cmocka_unit_test_setup_teardown (access_broker_send_command_cancel,
+                                         access_broker_setup_with_command,
+                                         access_broker_teardown),
+        cmocka_unit_test_setup_teardown (access_broker_send_command_block_only,
+                                         access_broker_setup_with_command,
+                                         access_broker_teardown),
         cmocka_unit_test_setup_teardown (access_broker_get_trans_object_count_caps_fail,
                                          access_broker_setup_with_command,
                                          access_broker_teardown),
@@ -667,6 +784,9 @@ main (void)
         cmocka_unit_test_setup_teardown (access_broker_context_save_test,
                                          access_broker_setup_with_init,
                                          access_broker_teardown),
+        cmocka_unit_test_setup_teardown (access_broker_get_stats_test,
+                                         access_broker_setup_with_init,
+                                         access_broker_teardown),
         cmocka_unit_test_setup_teardown (access_broker_context_flush_fail,
                                          access_broker_setup_with_init,
                                          access_broker_teardown),
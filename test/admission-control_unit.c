@@ -0,0 +1,241 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "admission-control.h"
+#include "util.h"
+
+#define TEST_MAX_IN_FLIGHT 3
+#define TEST_MAX_CONNECTION_IN_FLIGHT 2
+
+typedef struct {
+    AdmissionControl *admission;
+    Connection       *connections [3];
+    gint              client_fds [3];
+    guint             resumed;
+} test_data_t;
+
+static void
+on_resume (gpointer user_data)
+{
+    test_data_t *data = (test_data_t*)user_data;
+
+    ++data->resumed;
+}
+static int
+admission_control_setup_busy (void **state,
+                              gboolean busy_when_full)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    size_t i;
+
+    data->admission = admission_control_new (TEST_MAX_IN_FLIGHT,
+                                             TEST_MAX_CONNECTION_IN_FLIGHT,
+                                             busy_when_full);
+    admission_control_set_resume_func (data->admission, on_resume, data);
+    for (i = 0; i < G_N_ELEMENTS (data->connections); ++i) {
+        handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostream = create_connection_iostream (&data->client_fds [i]);
+        data->connections [i] = connection_new (iostream, i, handle_map);
+        g_object_unref (handle_map);
+        g_object_unref (iostream);
+        admission_control_attach (data->admission, data->connections [i]);
+    }
+    *state = data;
+    return 0;
+}
+static int
+admission_control_setup (void **state)
+{
+    return admission_control_setup_busy (state, FALSE);
+}
+static int
+admission_control_setup_busy_when_full (void **state)
+{
+    return admission_control_setup_busy (state, TRUE);
+}
+static int
+admission_control_teardown (void **state)
+{
+    test_data_t *data = *state;
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS (data->connections); ++i) {
+        g_clear_object (&data->connections [i]);
+        close (data->client_fds [i]);
+    }
+    g_clear_object (&data->admission);
+    free (data);
+    return 0;
+}
+/*
+ * Attached connections hold a reference to the AdmissionControl.
+ */
+static void
+admission_control_attach_test (void **state)
+{
+    test_data_t *data = *state;
+
+    assert_ptr_equal (data->connections [0]->admission, data->admission);
+    assert_int_equal (data->connections [0]->in_flight, 0);
+    assert_int_equal (admission_control_in_flight (data->admission), 0);
+}
+/*
+ * A connection is deferred once it has the maximum number of commands in
+ * flight. Releasing one of them resumes it.
+ */
+static void
+admission_control_connection_limit_test (void **state)
+{
+    test_data_t *data = *state;
+    Connection *connection = data->connections [0];
+    admission_control_stats_t stats;
+
+    assert_int_equal (admission_control_admit (data->admission, connection),
+                      ADMISSION_ADMIT);
+    assert_int_equal (admission_control_admit (data->admission, connection),
+                      ADMISSION_ADMIT);
+    assert_int_equal (admission_control_admit (data->admission, connection),
+                      ADMISSION_DEFER);
+    assert_int_equal (connection->in_flight, TEST_MAX_CONNECTION_IN_FLIGHT);
+    /* the other connection isn't held up */
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [1]),
+                      ADMISSION_ADMIT);
+    assert_int_equal (data->resumed, 0);
+
+    admission_control_release (connection, 1);
+    assert_int_equal (data->resumed, 1);
+    assert_int_equal (connection->in_flight, 1);
+    /* nobody's waiting now */
+    admission_control_release (data->connections [1], 1);
+    assert_int_equal (data->resumed, 1);
+
+    admission_control_get_stats (data->admission, &stats);
+    assert_int_equal (stats.admitted, 3);
+    assert_int_equal (stats.deferred, 1);
+    assert_int_equal (stats.rejected, 0);
+    assert_int_equal (stats.high_water, 3);
+    assert_int_equal (stats.connection_high_water,
+                      TEST_MAX_CONNECTION_IN_FLIGHT);
+}
+/*
+ * The global limit defers every connection.
+ */
+static void
+admission_control_global_limit_test (void **state)
+{
+    test_data_t *data = *state;
+
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [0]),
+                      ADMISSION_ADMIT);
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [0]),
+                      ADMISSION_ADMIT);
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [1]),
+                      ADMISSION_ADMIT);
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [1]),
+                      ADMISSION_DEFER);
+    assert_int_equal (admission_control_in_flight (data->admission),
+                      TEST_MAX_IN_FLIGHT);
+    admission_control_release (data->connections [0], 2);
+    assert_int_equal (data->resumed, 1);
+    assert_int_equal (admission_control_in_flight (data->admission), 1);
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [1]),
+                      ADMISSION_ADMIT);
+}
+/*
+ * With busy-when-full a connection with nothing in flight is rejected
+ * when the global limit is hit, one with commands in flight is deferred.
+ */
+static void
+admission_control_busy_when_full_test (void **state)
+{
+    test_data_t *data = *state;
+    admission_control_stats_t stats;
+
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [0]),
+                      ADMISSION_ADMIT);
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [0]),
+                      ADMISSION_ADMIT);
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [2]),
+                      ADMISSION_ADMIT);
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [1]),
+                      ADMISSION_REJECT);
+    assert_int_equal (data->connections [1]->in_flight, 0);
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [2]),
+                      ADMISSION_DEFER);
+    assert_int_equal (admission_control_in_flight (data->admission),
+                      TEST_MAX_IN_FLIGHT);
+
+    admission_control_get_stats (data->admission, &stats);
+    assert_int_equal (stats.rejected, 1);
+    assert_int_equal (stats.deferred, 1);
+}
+/*
+ * Releasing more than is in flight, or for a connection that isn't
+ * attached, doesn't underflow the counts.
+ */
+static void
+admission_control_release_test (void **state)
+{
+    test_data_t *data = *state;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Connection *connection;
+    gint client_fd;
+
+    assert_int_equal (admission_control_admit (data->admission,
+                                               data->connections [0]),
+                      ADMISSION_ADMIT);
+    admission_control_release (data->connections [0], 5);
+    assert_int_equal (data->connections [0]->in_flight, 0);
+    assert_int_equal (admission_control_in_flight (data->admission), 0);
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 10, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    admission_control_release (connection, 1);
+    assert_int_equal (connection->in_flight, 0);
+    g_object_unref (connection);
+    close (client_fd);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (admission_control_attach_test,
+                                         admission_control_setup,
+                                         admission_control_teardown),
+        cmocka_unit_test_setup_teardown (admission_control_connection_limit_test,
+                                         admission_control_setup,
+                                         admission_control_teardown),
+        cmocka_unit_test_setup_teardown (admission_control_global_limit_test,
+                                         admission_control_setup,
+                                         admission_control_teardown),
+        cmocka_unit_test_setup_teardown (admission_control_busy_when_full_test,
+                                         admission_control_setup_busy_when_full,
+                                         admission_control_teardown),
+        cmocka_unit_test_setup_teardown (admission_control_release_test,
+                                         admission_control_setup,
+                                         admission_control_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
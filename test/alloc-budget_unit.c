@@ -0,0 +1,429 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Allocation budgets for the command path. Each test builds the
+ * ResourceManager -> ResponseSink pipeline in run-to-completion mode, plays
+ * the part of the CommandSource (read the command from the connection and
+ * wrap it in a Tpm2Command) and counts the heap allocations and GObject
+ * instances it takes to get a command from the client socket to the TPM
+ * and the response back, once everything is warmed up.
+ *
+ * The TPM is a TCTI that answers every command immediately. Transient
+ * objects are loaded and saved through the SAPI, which is wrapped since it
+ * marshals into stack buffers and needs an initialized TPM.
+ *
+ * The test prints the per command figures with print_message. The object
+ * budgets are exact counts. The allocs and bytes budgets are round
+ * ceilings that haven't been checked against a measurement yet, so they
+ * only catch gross regressions. They should be replaced with the printed
+ * figures plus a 10% margin for allocator and GLib version differences,
+ * and lowered again whenever allocations are taken out of the command
+ * path.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_mu.h>
+#include <tss2/tss2_tcti.h>
+
+#include "alloc-count.h"
+#include "resource-manager.h"
+#include "response-sink.h"
+#include "session-entry.h"
+#include "session-list.h"
+#include "source-interface.h"
+#include "tcti.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define WARMUP_COMMANDS 16
+#define MEASURED_COMMANDS 64
+
+#define TEST_MAX_RESPONSE 4096
+#define TEST_CONTEXT_BLOB_SIZE 64
+#define TEST_PHANDLE 0x80000001
+#define TEST_SESSION_HANDLE 0x02000000
+/* TPM2_ReadClock: no handles, no parameters */
+#define READ_CLOCK_ATTRS TPM2_CC_ReadClock
+/* TPM2_VerifySignature: one handle, no authorizations */
+#define VERIFY_SIGNATURE_ATTRS \
+    (TPM2_CC_VerifySignature | (1 << TPMA_CC_CHANDLES_SHIFT))
+
+typedef struct {
+    const gchar *name;
+    guint64      allocs;
+    guint64      bytes;
+    guint64      objects;
+} alloc_budget_t;
+
+/*
+ * Objects: the Tpm2Command and Tpm2Response of the client command, plus a
+ * Tpm2Command and Tpm2Response each for the ContextLoad and ContextSave of
+ * the session. The allocs and bytes are the unmeasured ceilings described
+ * at the top of the file.
+ */
+static const alloc_budget_t stateless_budget = {
+    .name = "stateless",
+    .allocs = 160,
+    .bytes = 24 * 1024,
+    .objects = 2,
+};
+static const alloc_budget_t transient_budget = {
+    .name = "transient load",
+    .allocs = 256,
+    .bytes = 32 * 1024,
+    .objects = 2,
+};
+/* the session is loaded and saved for each command: 3 TPM commands */
+static const alloc_budget_t session_budget = {
+    .name = "session authorized",
+    .allocs = 512,
+    .bytes = 64 * 1024,
+    .objects = 6,
+};
+
+/*
+ * A TPM that answers everything with success. ContextLoad returns the
+ * handle from the context, ContextSave a context with a new sequence number.
+ */
+typedef struct {
+    TSS2_TCTI_CONTEXT_COMMON_V2 v2;
+    TPM2_CC     command_code;
+    TPM2_HANDLE handle;
+    guint64     sequence;
+} TCTI_BUDGET_CONTEXT;
+
+typedef struct {
+    TCTI_BUDGET_CONTEXT tcti_context;
+    AccessBroker       *broker;
+    SessionList        *session_list;
+    ResourceManager    *resmgr;
+    ResponseSink       *sink;
+    Connection         *connection;
+    GInputStream       *istream;
+    gint                client_fd;
+} test_data_t;
+
+static TSS2_RC
+tcti_budget_transmit (TSS2_TCTI_CONTEXT *context,
+                      size_t             size,
+                      uint8_t const     *command)
+{
+    TCTI_BUDGET_CONTEXT *tcti = (TCTI_BUDGET_CONTEXT*)context;
+    size_t offset = TPM_HEADER_SIZE;
+
+    tcti->command_code = get_command_code ((uint8_t*)command);
+    tcti->handle = 0;
+    switch (tcti->command_code) {
+    case TPM2_CC_ContextSave:
+        Tss2_MU_UINT32_Unmarshal (command, size, &offset, &tcti->handle);
+        break;
+    case TPM2_CC_ContextLoad:
+        /* TPMS_CONTEXT: sequence then savedHandle */
+        offset += sizeof (UINT64);
+        Tss2_MU_UINT32_Unmarshal (command, size, &offset, &tcti->handle);
+        break;
+    default:
+        break;
+    }
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+tcti_budget_receive (TSS2_TCTI_CONTEXT *context,
+                     size_t            *size,
+                     uint8_t           *response,
+                     int32_t            timeout)
+{
+    TCTI_BUDGET_CONTEXT *tcti = (TCTI_BUDGET_CONTEXT*)context;
+    TPMS_CONTEXT saved = {
+        .hierarchy = TPM2_RH_NULL,
+        .contextBlob = { .size = TEST_CONTEXT_BLOB_SIZE },
+    };
+    size_t offset = TPM_HEADER_SIZE;
+
+    UNUSED_PARAM (timeout);
+    switch (tcti->command_code) {
+    case TPM2_CC_ContextLoad:
+        Tss2_MU_UINT32_Marshal (tcti->handle, response, *size, &offset);
+        break;
+    case TPM2_CC_ContextSave:
+        saved.sequence = ++tcti->sequence;
+        saved.savedHandle = tcti->handle;
+        Tss2_MU_TPMS_CONTEXT_Marshal (&saved, response, *size, &offset);
+        break;
+    default:
+        break;
+    }
+    set_response_tag (response, TPM2_ST_NO_SESSIONS);
+    set_response_size (response, offset);
+    set_response_code (response, TSS2_RC_SUCCESS);
+    *size = offset;
+    return TSS2_RC_SUCCESS;
+}
+static void
+tcti_budget_init (TCTI_BUDGET_CONTEXT *tcti)
+{
+    memset (tcti, 0, sizeof (*tcti));
+    TSS2_TCTI_MAGIC (tcti) = 0x1;
+    TSS2_TCTI_VERSION (tcti) = 2;
+    TSS2_TCTI_TRANSMIT (tcti) = tcti_budget_transmit;
+    TSS2_TCTI_RECEIVE (tcti) = tcti_budget_receive;
+}
+TSS2_RC
+__wrap_access_broker_context_load (AccessBroker *broker,
+                                   TPMS_CONTEXT *context,
+                                   TPM2_HANDLE  *handle)
+{
+    UNUSED_PARAM (broker);
+    UNUSED_PARAM (context);
+
+    *handle = TEST_PHANDLE;
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_access_broker_context_saveflush (AccessBroker *broker,
+                                        TPM2_HANDLE   handle,
+                                        TPMS_CONTEXT *context)
+{
+    UNUSED_PARAM (broker);
+    UNUSED_PARAM (handle);
+    UNUSED_PARAM (context);
+
+    return TSS2_RC_SUCCESS;
+}
+static int
+alloc_budget_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    TPMS_TAGGED_PROPERTY *property;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Tcti *tcti;
+
+    tcti_budget_init (&data->tcti_context);
+    tcti = tcti_new ((TSS2_TCTI_CONTEXT*)&data->tcti_context);
+    data->broker = access_broker_new (tcti);
+    g_object_unref (tcti);
+    /* normally from the TPM by access_broker_init_tpm */
+    data->broker->properties_fixed.capability = TPM2_CAP_TPM_PROPERTIES;
+    data->broker->properties_fixed.data.tpmProperties.count = 1;
+    property = &data->broker->properties_fixed.data.tpmProperties.tpmProperty [0];
+    property->property = TPM2_PT_MAX_RESPONSE_SIZE;
+    property->value = TEST_MAX_RESPONSE;
+
+    data->session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT,
+                                           SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    data->resmgr = resource_manager_new (data->broker, data->session_list);
+    data->sink = response_sink_new ();
+    source_add_sink (SOURCE (data->resmgr), SINK (data->sink));
+    thread_set_inline (THREAD (data->resmgr), TRUE);
+    thread_set_inline (THREAD (data->sink), TRUE);
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&data->client_fd);
+    data->connection = connection_new (iostream, 1, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    data->istream =
+        g_io_stream_get_input_stream (connection_get_iostream (data->connection));
+
+    *state = data;
+    return 0;
+}
+static int
+alloc_budget_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_clear_object (&data->connection);
+    g_clear_object (&data->resmgr);
+    g_clear_object (&data->sink);
+    g_clear_object (&data->session_list);
+    g_clear_object (&data->broker);
+    close (data->client_fd);
+    free (data);
+    return 0;
+}
+/*
+ * One command from the client and its response. The CommandSource part
+ * is the same as command_source_on_input_ready with the attributes and
+ * stateless classification supplied by the caller.
+ */
+static void
+alloc_budget_command (test_data_t   *data,
+                      const uint8_t *buf,
+                      size_t         size,
+                      TPMA_CC        attributes,
+                      gboolean       stateless)
+{
+    Tpm2Command *command;
+    uint8_t *cmd_buf, response [TPM_HEADER_SIZE];
+    size_t cmd_size = 0;
+
+    assert_int_equal (write (data->client_fd, buf, size), size);
+    cmd_buf = read_tpm_buffer_alloc (data->istream, &cmd_size);
+    assert_non_null (cmd_buf);
+    command = tpm2_command_new (data->connection,
+                                cmd_buf,
+                                cmd_size,
+                                attributes);
+    tpm2_command_set_stateless (command, stateless);
+    sink_enqueue (SINK (data->resmgr), G_OBJECT (command));
+    g_object_unref (command);
+    /* run-to-completion: the response has already been written */
+    assert_int_equal (read (data->client_fd, response, sizeof (response)),
+                      sizeof (response));
+    assert_int_equal (get_response_code (response), TSS2_RC_SUCCESS);
+}
+/*
+ * Warm up, then run MEASURED_COMMANDS commands and check the allocations
+ * per command against the budget.
+ */
+static void
+alloc_budget_check (test_data_t          *data,
+                    const uint8_t        *buf,
+                    size_t                size,
+                    TPMA_CC               attributes,
+                    gboolean              stateless,
+                    const alloc_budget_t *budget)
+{
+    alloc_count_t count;
+    guint64 allocs, bytes, objects;
+    gint i;
+
+    if (!alloc_count_supported ()) {
+        skip ();
+    }
+    for (i = 0; i < WARMUP_COMMANDS; ++i) {
+        alloc_budget_command (data, buf, size, attributes, stateless);
+    }
+    alloc_count_start ();
+    for (i = 0; i < MEASURED_COMMANDS; ++i) {
+        alloc_budget_command (data, buf, size, attributes, stateless);
+    }
+    alloc_count_stop (&count);
+
+    allocs = (count.allocs + MEASURED_COMMANDS - 1) / MEASURED_COMMANDS;
+    bytes = (count.bytes + MEASURED_COMMANDS - 1) / MEASURED_COMMANDS;
+    objects = (count.objects + MEASURED_COMMANDS - 1) / MEASURED_COMMANDS;
+    print_message ("%s: %" PRIu64 " allocations (budget %" PRIu64 "), %"
+                   PRIu64 " bytes (budget %" PRIu64 "), %" PRIu64
+                   " objects (budget %" PRIu64 ") per command\n",
+                   budget->name, allocs, budget->allocs, bytes,
+                   budget->bytes, objects, budget->objects);
+    assert_true (allocs <= budget->allocs);
+    assert_true (bytes <= budget->bytes);
+    assert_true (objects <= budget->objects);
+}
+/*
+ * No handles and no sessions: the ResourceManager fast path.
+ */
+static void
+alloc_budget_stateless_test (void **state)
+{
+    test_data_t *data = *state;
+    uint8_t buf [TPM_HEADER_SIZE] = { 0, };
+
+    tpm2_header_init (buf, sizeof (buf), TPM2_ST_NO_SESSIONS, sizeof (buf),
+                      TPM2_CC_ReadClock);
+    alloc_budget_check (data, buf, sizeof (buf), READ_CLOCK_ATTRS, TRUE,
+                        &stateless_budget);
+}
+/*
+ * A command on a transient object: the object is loaded before the
+ * command and saved and flushed after it.
+ */
+static void
+alloc_budget_transient_test (void **state)
+{
+    test_data_t *data = *state;
+    uint8_t buf [TPM_HEADER_SIZE + sizeof (TPM2_HANDLE)] = { 0, };
+    HandleMap *map;
+    HandleMapEntry *entry;
+    TPM2_HANDLE vhandle;
+    size_t offset = TPM_HEADER_SIZE;
+
+    map = connection_get_trans_map (data->connection);
+    vhandle = handle_map_next_vhandle (map);
+    entry = handle_map_entry_new (0, vhandle);
+    handle_map_entry_get_context (entry)->savedHandle = TEST_PHANDLE;
+    handle_map_insert (map, vhandle, entry);
+    g_object_unref (entry);
+    g_object_unref (map);
+
+    tpm2_header_init (buf, sizeof (buf), TPM2_ST_NO_SESSIONS, sizeof (buf),
+                      TPM2_CC_VerifySignature);
+    Tss2_MU_UINT32_Marshal (vhandle, buf, sizeof (buf), &offset);
+    alloc_budget_check (data, buf, sizeof (buf), VERIFY_SIGNATURE_ATTRS,
+                        FALSE, &transient_budget);
+}
+/*
+ * A command authorized with a session the RM holds saved: the session is
+ * loaded before the command and saved again after it.
+ */
+static void
+alloc_budget_session_test (void **state)
+{
+    test_data_t *data = *state;
+    TPMS_CONTEXT context = {
+        .sequence = 1,
+        .savedHandle = TEST_SESSION_HANDLE,
+        .hierarchy = TPM2_RH_NULL,
+        .contextBlob = { .size = TEST_CONTEXT_BLOB_SIZE },
+    };
+    TPMS_AUTH_COMMAND auth = {
+        .sessionHandle = TEST_SESSION_HANDLE,
+        .sessionAttributes = TPMA_SESSION_CONTINUESESSION,
+    };
+    uint8_t buf [TPM_HEADER_SIZE + sizeof (UINT32) + sizeof (auth)] = { 0, };
+    uint8_t context_buf [sizeof (TPMS_CONTEXT)];
+    size_t offset = 0, auth_offset;
+    SessionEntry *entry;
+
+    Tss2_MU_TPMS_CONTEXT_Marshal (&context,
+                                  context_buf,
+                                  sizeof (context_buf),
+                                  &offset);
+    entry = session_entry_new (data->connection, TEST_SESSION_HANDLE);
+    session_entry_set_context (entry, context_buf, offset);
+    session_entry_set_state (entry, SESSION_ENTRY_SAVED_RM);
+    session_list_insert (data->session_list, entry);
+    g_object_unref (entry);
+
+    /* authorization area: size, then the one session */
+    offset = TPM_HEADER_SIZE + sizeof (UINT32);
+    Tss2_MU_TPMS_AUTH_COMMAND_Marshal (&auth, buf, sizeof (buf), &offset);
+    auth_offset = TPM_HEADER_SIZE;
+    Tss2_MU_UINT32_Marshal (offset - TPM_HEADER_SIZE - sizeof (UINT32),
+                            buf, sizeof (buf), &auth_offset);
+    tpm2_header_init (buf, sizeof (buf), TPM2_ST_SESSIONS, offset,
+                      TPM2_CC_ReadClock);
+    alloc_budget_check (data, buf, offset, READ_CLOCK_ATTRS, FALSE,
+                        &session_budget);
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (alloc_budget_stateless_test,
+                                         alloc_budget_setup,
+                                         alloc_budget_teardown),
+        cmocka_unit_test_setup_teardown (alloc_budget_transient_test,
+                                         alloc_budget_setup,
+                                         alloc_budget_teardown),
+        cmocka_unit_test_setup_teardown (alloc_budget_session_test,
+                                         alloc_budget_setup,
+                                         alloc_budget_teardown),
+    };
+
+    UNUSED_PARAM (argc);
+    alloc_count_init (argv);
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib-object.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc-count.h"
+
+static __thread gboolean counting = FALSE;
+static __thread alloc_count_t counts;
+
+static inline void
+count_alloc (size_t size)
+{
+    if (counting) {
+        ++counts.allocs;
+        counts.bytes += size;
+    }
+}
+
+#ifdef __GLIBC__
+/*
+ * Defining these in the executable interposes them for every library in
+ * the process. The memory still comes from (and goes back to) the glibc
+ * allocator so free, posix_memalign and friends are left alone.
+ */
+extern void* __libc_malloc  (size_t size);
+extern void* __libc_calloc  (size_t nmemb, size_t size);
+extern void* __libc_realloc (void *ptr, size_t size);
+
+void*
+malloc (size_t size)
+{
+    count_alloc (size);
+    return __libc_malloc (size);
+}
+void*
+calloc (size_t nmemb,
+        size_t size)
+{
+    count_alloc (nmemb * size);
+    return __libc_calloc (nmemb, size);
+}
+void*
+realloc (void  *ptr,
+         size_t size)
+{
+    count_alloc (size);
+    return __libc_realloc (ptr, size);
+}
+#endif /* __GLIBC__ */
+
+gpointer
+__wrap_g_object_new (GType        object_type,
+                     const gchar *first_property_name,
+                     ...)
+{
+    GObject *object;
+    va_list args;
+
+    if (counting) {
+        ++counts.objects;
+    }
+    va_start (args, first_property_name);
+    object = g_object_new_valist (object_type, first_property_name, args);
+    va_end (args);
+    return object;
+}
+/*
+ * Before GLib 2.76 g_slice has its own allocator that hands out memory
+ * without calling malloc once it's warmed up. It reads G_SLICE the first
+ * time it's used, which is before main, so set it and start over.
+ */
+void
+alloc_count_init (char *argv[])
+{
+    if (g_strcmp0 (g_getenv ("G_SLICE"), "always-malloc") == 0) {
+        return;
+    }
+    g_setenv ("G_SLICE", "always-malloc", TRUE);
+    execv ("/proc/self/exe", argv);
+    g_warning ("%s: failed to re-exec with G_SLICE=always-malloc, "
+               "slice allocations may not be counted", __func__);
+}
+gboolean
+alloc_count_supported (void)
+{
+#ifdef __GLIBC__
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+void
+alloc_count_start (void)
+{
+    memset (&counts, 0, sizeof (counts));
+    counting = TRUE;
+}
+void
+alloc_count_stop (alloc_count_t *count)
+{
+    counting = FALSE;
+    *count = counts;
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#include <glib.h>
+
+/*
+ * Count the heap allocations made by the calling thread between
+ * alloc_count_start and alloc_count_stop. Linking alloc-count.c into a test
+ * replaces malloc, calloc and realloc for the whole program, including
+ * GLib: g_malloc, g_new and (with G_SLICE=always-malloc) g_slice all end
+ * up there. 'bytes' is the total requested, a realloc counts as a new
+ * allocation of the new size. GObject instances are counted when the test
+ * is linked with -Wl,--wrap=g_object_new.
+ *
+ * The allocator is only replaced on glibc, where the real functions can be
+ * reached through __libc_malloc & co. Elsewhere alloc_count_supported
+ * returns FALSE and nothing is counted.
+ */
+typedef struct {
+    guint64 allocs;
+    guint64 bytes;
+    guint64 objects;
+} alloc_count_t;
+
+void         alloc_count_init      (char          *argv[]);
+gboolean     alloc_count_supported (void);
+void         alloc_count_start     (void);
+void         alloc_count_stop      (alloc_count_t *count);
+
+#endif /* ALLOC_COUNT_H */
@@ -0,0 +1,493 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Microbenchmarks for the parsing and framing functions on the command
+ * path, each at a few sizes. Every case is run long enough to get a
+ * stable time per operation and then again with the allocation counter
+ * from alloc-count.c on, so the result is both ns/op and allocations per
+ * operation. Results are written as JSON to stdout (or --output) to be
+ * compared across releases:
+ *
+ * { "version": "...", "alloc_counting": true,
+ *   "benchmarks": [ { "name": "...", "size": N, "iterations": N,
+ *                     "ns_per_op": X, "allocs_per_op": X,
+ *                     "bytes_per_op": X, "objects_per_op": X }, ... ] }
+ *
+ * 'size' is what the case is scaled by, it's described in the case.
+ */
+#include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "alloc-count.h"
+#include "command-attrs.h"
+#include "handle-map.h"
+#include "resource-manager.h"
+#include "session-entry.h"
+#include "session-list.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "tpm2-response.h"
+#include "util.h"
+
+#define MIN_TIME_MS_DEFAULT 200
+/* iterations with the allocation counter on, the counts are exact */
+#define ALLOC_ITERATIONS 1024
+#define CONTEXT_CLIENT_SIZE 64
+
+typedef void (*micro_func_t) (gpointer data);
+
+typedef struct {
+    guint64      min_time_ns;
+    const gchar *filter;
+    GString     *json;
+    guint        count;
+} micro_ctx_t;
+
+static guint64
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * G_GUINT64_CONSTANT (1000000000) +
+        (guint64)ts.tv_nsec;
+}
+/*
+ * Time 'func', doubling the iterations until a run takes at least
+ * min_time_ns, then count its allocations and add the result to the JSON.
+ */
+static void
+micro_measure (micro_ctx_t *ctx,
+               const gchar *name,
+               guint        size,
+               micro_func_t func,
+               gpointer     data)
+{
+    guint64 iterations = 1, alloc_iterations, i, start, elapsed;
+    alloc_count_t count = { 0, };
+
+    if (ctx->filter != NULL && strstr (name, ctx->filter) == NULL) {
+        return;
+    }
+    func (data);
+    for (;;) {
+        start = now_ns ();
+        for (i = 0; i < iterations; ++i) {
+            func (data);
+        }
+        elapsed = now_ns () - start;
+        if (elapsed >= ctx->min_time_ns || iterations >= G_MAXUINT32) {
+            break;
+        }
+        iterations *= 2;
+    }
+    alloc_iterations = MIN (iterations, ALLOC_ITERATIONS);
+    alloc_count_start ();
+    for (i = 0; i < alloc_iterations; ++i) {
+        func (data);
+    }
+    alloc_count_stop (&count);
+
+    g_string_append_printf (ctx->json,
+        "%s\n    { \"name\": \"%s\", \"size\": %u, \"iterations\": %"
+        PRIu64 ", \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, "
+        "\"bytes_per_op\": %.1f, \"objects_per_op\": %.2f }",
+        ctx->count > 0 ? "," : "", name, size, iterations,
+        (double)elapsed / (double)iterations,
+        (double)count.allocs / (double)alloc_iterations,
+        (double)count.bytes / (double)alloc_iterations,
+        (double)count.objects / (double)alloc_iterations);
+    ++ctx->count;
+}
+/*
+ * write_all and read_tpm_buffer: a TPM buffer of 'size' bytes written to
+ * one end of a socketpair and read from the other.
+ */
+typedef struct {
+    GOutputStream *ostream;
+    GInputStream  *istream;
+    uint8_t       *wbuf;
+    uint8_t       *rbuf;
+    size_t         size;
+} framing_data_t;
+static void
+framing_op (gpointer user_data)
+{
+    framing_data_t *data = user_data;
+    size_t index = 0;
+
+    write_all (data->ostream, data->wbuf, data->size);
+    read_tpm_buffer (data->istream, &index, data->rbuf, data->size);
+}
+static void
+bench_framing (micro_ctx_t *ctx)
+{
+    const size_t sizes [] = { TPM_HEADER_SIZE, 1024, 4096 };
+    framing_data_t data;
+    gint fd_a, fd_b;
+    size_t i;
+
+    if (create_socket_pair (&fd_a, &fd_b, SOCK_CLOEXEC) != 0) {
+        g_error ("failed to create socket pair");
+    }
+    data.ostream = g_unix_output_stream_new (fd_a, TRUE);
+    data.istream = g_unix_input_stream_new (fd_b, TRUE);
+    for (i = 0; i < G_N_ELEMENTS (sizes); ++i) {
+        data.size = sizes [i];
+        data.wbuf = g_malloc0 (data.size);
+        data.rbuf = g_malloc0 (data.size);
+        tpm2_header_init (data.wbuf, data.size, TPM2_ST_NO_SESSIONS,
+                          (UINT32)data.size, TPM2_CC_GetRandom);
+        micro_measure (ctx, "write_all+read_tpm_buffer", (guint)data.size,
+                       framing_op, &data);
+        g_free (data.wbuf);
+        g_free (data.rbuf);
+    }
+    g_object_unref (data.ostream);
+    g_object_unref (data.istream);
+}
+/*
+ * tpm2_command_new and a walk of the handle and auth areas, the way the
+ * ResourceManager does it for each command. 'size' is the number of
+ * password authorizations in a command with two handles.
+ */
+typedef struct {
+    uint8_t *buf;
+    size_t   size;
+    TPMA_CC  attrs;
+} command_data_t;
+static void
+command_auth_cb (gpointer auth_offset_ptr,
+                 gpointer user_data)
+{
+    Tpm2Command *command = user_data;
+    volatile TPM2_HANDLE handle;
+
+    handle = tpm2_command_get_auth_handle (command,
+                                           *(size_t*)auth_offset_ptr);
+    (void)handle;
+}
+static void
+command_op (gpointer user_data)
+{
+    command_data_t *data = user_data;
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES];
+    size_t count = TPM2_COMMAND_MAX_HANDLES;
+    Tpm2Command *command;
+    uint8_t *buf;
+
+    buf = g_malloc (data->size);
+    memcpy (buf, data->buf, data->size);
+    command = tpm2_command_new (NULL, buf, data->size, data->attrs);
+    tpm2_command_get_handles (command, handles, &count);
+    if (tpm2_command_has_auths (command)) {
+        tpm2_command_foreach_auth (command, command_auth_cb, command);
+    }
+    g_object_unref (command);
+}
+static void
+bench_command (micro_ctx_t *ctx)
+{
+    const guint auths [] = { 0, 1, 3 };
+    command_data_t data;
+    size_t offset, i;
+    guint j;
+
+    for (i = 0; i < G_N_ELEMENTS (auths); ++i) {
+        /* two handles, authSize, then handle, nonce, attrs, hmac each */
+        data.size = TPM_HEADER_SIZE + 2 * sizeof (TPM2_HANDLE) +
+            (auths [i] > 0 ? sizeof (UINT32) : 0) + auths [i] * 9 +
+            sizeof (UINT16);
+        data.buf = g_malloc0 (data.size);
+        data.attrs = TPM2_CC_PolicySecret | (2 << TPMA_CC_CHANDLES_SHIFT);
+        tpm2_header_init (data.buf, data.size,
+                          auths [i] > 0 ? TPM2_ST_SESSIONS :
+                          TPM2_ST_NO_SESSIONS,
+                          (UINT32)data.size, TPM2_CC_PolicySecret);
+        offset = TPM_HEADER_SIZE;
+        Tss2_MU_UINT32_Marshal (TPM2_RH_OWNER, data.buf, data.size, &offset);
+        Tss2_MU_UINT32_Marshal (TPM2_POLICY_SESSION_FIRST, data.buf,
+                                data.size, &offset);
+        if (auths [i] > 0) {
+            Tss2_MU_UINT32_Marshal (auths [i] * 9, data.buf, data.size,
+                                    &offset);
+        }
+        for (j = 0; j < auths [i]; ++j) {
+            Tss2_MU_UINT32_Marshal (TPM2_RS_PW, data.buf, data.size, &offset);
+            Tss2_MU_UINT16_Marshal (0, data.buf, data.size, &offset);
+            Tss2_MU_UINT8_Marshal (0, data.buf, data.size, &offset);
+            Tss2_MU_UINT16_Marshal (0, data.buf, data.size, &offset);
+        }
+        micro_measure (ctx, "tpm2_command_new+parse", auths [i], command_op,
+                       &data);
+        g_free (data.buf);
+    }
+}
+/*
+ * get_cap_post_process on a TPM2_CAP_TPM_PROPERTIES response, 'size' is
+ * the number of properties. The function is idempotent so the same
+ * response is processed each time.
+ */
+static void
+cap_op (gpointer user_data)
+{
+    get_cap_post_process (TPM2_RESPONSE (user_data));
+}
+static void
+bench_get_cap (micro_ctx_t *ctx)
+{
+    const guint counts [] = { 1, 16, TPM2_MAX_TPM_PROPERTIES };
+    TPMS_CAPABILITY_DATA cap_data = {
+        .capability = TPM2_CAP_TPM_PROPERTIES,
+    };
+    Tpm2Response *response;
+    uint8_t *buf;
+    size_t size, offset;
+    guint i, j;
+
+    for (i = 0; i < G_N_ELEMENTS (counts); ++i) {
+        cap_data.data.tpmProperties.count = counts [i];
+        for (j = 0; j < counts [i]; ++j) {
+            cap_data.data.tpmProperties.tpmProperty [j].property =
+                TPM2_PT_FIXED + j;
+            cap_data.data.tpmProperties.tpmProperty [j].value = j;
+        }
+        size = TPM_HEADER_SIZE + sizeof (TPMI_YES_NO) + sizeof (cap_data);
+        buf = g_malloc0 (size);
+        offset = TPM_HEADER_SIZE;
+        Tss2_MU_UINT8_Marshal (TPM2_NO, buf, size, &offset);
+        Tss2_MU_TPMS_CAPABILITY_DATA_Marshal (&cap_data, buf, size, &offset);
+        tpm2_header_init (buf, offset, TPM2_ST_NO_SESSIONS, (UINT32)offset,
+                          TSS2_RC_SUCCESS);
+        response = tpm2_response_new (NULL, buf, offset, 0);
+        micro_measure (ctx, "get_cap_post_process", counts [i], cap_op,
+                       response);
+        g_object_unref (response);
+    }
+}
+/*
+ * command_attrs_from_cc for the last of 'size' commands, the table is a
+ * list so this is the worst case.
+ */
+typedef struct {
+    CommandAttrs *attrs;
+    TPM2_CC       code;
+} attrs_data_t;
+static void
+attrs_op (gpointer user_data)
+{
+    attrs_data_t *data = user_data;
+    volatile TPMA_CC attrs;
+
+    attrs = command_attrs_from_cc (data->attrs, data->code);
+    (void)attrs;
+}
+static void
+bench_command_attrs (micro_ctx_t *ctx)
+{
+    const guint counts [] = { 16, 64, 128 };
+    attrs_data_t data;
+    guint i, j;
+
+    data.attrs = command_attrs_new ();
+    for (i = 0; i < G_N_ELEMENTS (counts); ++i) {
+        g_free (data.attrs->command_attrs);
+        data.attrs->command_attrs = g_new0 (TPMA_CC, counts [i]);
+        data.attrs->count = counts [i];
+        for (j = 0; j < counts [i]; ++j) {
+            data.attrs->command_attrs [j] = TPM2_CC_FIRST + j;
+        }
+        data.code = TPM2_CC_FIRST + counts [i] - 1;
+        micro_measure (ctx, "command_attrs_from_cc", counts [i], attrs_op,
+                       &data);
+    }
+    g_object_unref (data.attrs);
+}
+/*
+ * handle_map_vlookup of the handle in the middle of a map with 'size'
+ * entries.
+ */
+typedef struct {
+    HandleMap  *map;
+    TPM2_HANDLE vhandle;
+} vlookup_data_t;
+static void
+vlookup_op (gpointer user_data)
+{
+    vlookup_data_t *data = user_data;
+    HandleMapEntry *entry;
+
+    entry = handle_map_vlookup (data->map, data->vhandle);
+    g_clear_object (&entry);
+}
+static void
+bench_handle_map (micro_ctx_t *ctx)
+{
+    const guint counts [] = { 1, MAX_ENTRIES_DEFAULT, MAX_ENTRIES_MAX };
+    HandleMapEntry *entry;
+    vlookup_data_t data;
+    TPM2_HANDLE vhandle;
+    guint i, j;
+
+    for (i = 0; i < G_N_ELEMENTS (counts); ++i) {
+        data.map = handle_map_new (TPM2_HT_TRANSIENT, counts [i]);
+        for (j = 0; j < counts [i]; ++j) {
+            vhandle = handle_map_next_vhandle (data.map);
+            entry = handle_map_entry_new (TPM2_TRANSIENT_FIRST, vhandle);
+            handle_map_insert (data.map, vhandle, entry);
+            g_object_unref (entry);
+            if (j == counts [i] / 2) {
+                data.vhandle = vhandle;
+            }
+        }
+        micro_measure (ctx, "handle_map_vlookup", counts [i], vlookup_op,
+                       &data);
+        g_object_unref (data.map);
+    }
+}
+/*
+ * session_list_lookup_handle and session_list_lookup_context_client for
+ * the last session in a list of 'size' sessions.
+ */
+typedef struct {
+    SessionList *list;
+    TPM2_HANDLE  handle;
+    uint8_t      context [CONTEXT_CLIENT_SIZE];
+} session_data_t;
+static void
+session_handle_op (gpointer user_data)
+{
+    session_data_t *data = user_data;
+    SessionEntry *entry;
+
+    entry = session_list_lookup_handle (data->list, data->handle);
+    g_clear_object (&entry);
+}
+static void
+session_context_op (gpointer user_data)
+{
+    session_data_t *data = user_data;
+    SessionEntry *entry;
+
+    entry = session_list_lookup_context_client (data->list,
+                                                data->context,
+                                                sizeof (data->context));
+    g_clear_object (&entry);
+}
+static void
+bench_session_list (micro_ctx_t *ctx)
+{
+    const guint counts [] = { 1, 64, SESSION_LIST_MAX_ENTRIES_MAX };
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Connection *connection;
+    SessionEntry *entry;
+    size_buf_t *context;
+    session_data_t data;
+    gint client_fd;
+    guint i, j;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 1, handle_map);
+    g_object_unref (iostream);
+    g_object_unref (handle_map);
+    for (i = 0; i < G_N_ELEMENTS (counts); ++i) {
+        data.list = session_list_new (SESSION_LIST_MAX_ENTRIES_MAX,
+                                      SESSION_LIST_MAX_ABANDONED_DEFAULT);
+        for (j = 0; j < counts [i]; ++j) {
+            data.handle = TPM2_HMAC_SESSION_FIRST + j;
+            entry = session_entry_new (connection, data.handle);
+            /* a context the client saved, unique in its first bytes */
+            context = session_entry_get_context_client (entry);
+            memset (context->buf, 0xa5, CONTEXT_CLIENT_SIZE);
+            memcpy (context->buf, &j, sizeof (j));
+            context->size = CONTEXT_CLIENT_SIZE;
+            session_entry_set_state (entry, SESSION_ENTRY_SAVED_CLIENT);
+            session_list_insert (data.list, entry);
+            g_object_unref (entry);
+            memcpy (data.context, context->buf, sizeof (data.context));
+        }
+        micro_measure (ctx, "session_list_lookup_handle", counts [i],
+                       session_handle_op, &data);
+        micro_measure (ctx, "session_list_lookup_context_client", counts [i],
+                       session_context_op, &data);
+        g_object_unref (data.list);
+    }
+    g_object_unref (connection);
+    close (client_fd);
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    gint min_time_ms = MIN_TIME_MS_DEFAULT;
+    gchar *output = NULL, *filter = NULL;
+    GOptionEntry entries [] = {
+        { "min-time", 't', 0, G_OPTION_ARG_INT, &min_time_ms,
+          "Minimum time to run each case for", "MS" },
+        { "filter", 'f', 0, G_OPTION_ARG_STRING, &filter,
+          "Only run cases with names containing STRING", "STRING" },
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+          "Write the JSON results to FILE instead of stdout", "FILE" },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+    micro_ctx_t ctx = { .count = 0 };
+    GOptionContext *opt_ctx;
+    GError *error = NULL;
+    gint ret = 0;
+
+    alloc_count_init (argv);
+    opt_ctx = g_option_context_new (" - parsing and framing microbenchmarks");
+    g_option_context_add_main_entries (opt_ctx, entries, NULL);
+    if (!g_option_context_parse (opt_ctx, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_clear_error (&error);
+        g_option_context_free (opt_ctx);
+        return 1;
+    }
+    g_option_context_free (opt_ctx);
+    if (min_time_ms < 1) {
+        g_printerr ("min-time must be > 0\n");
+        return 1;
+    }
+    ctx.min_time_ns = (guint64)min_time_ms * G_GUINT64_CONSTANT (1000000);
+    ctx.filter = filter;
+    ctx.json = g_string_new (NULL);
+    g_string_append_printf (ctx.json,
+                            "{\n  \"version\": \"%s\",\n"
+                            "  \"alloc_counting\": %s,\n"
+                            "  \"benchmarks\": [", VERSION,
+                            alloc_count_supported () ? "true" : "false");
+
+    bench_framing (&ctx);
+    bench_command (&ctx);
+    bench_get_cap (&ctx);
+    bench_command_attrs (&ctx);
+    bench_handle_map (&ctx);
+    bench_session_list (&ctx);
+
+    g_string_append (ctx.json, "\n  ]\n}\n");
+    if (output != NULL) {
+        if (!g_file_set_contents (output, ctx.json->str, -1, &error)) {
+            g_printerr ("%s\n", error->message);
+            g_clear_error (&error);
+            ret = 1;
+        }
+    } else {
+        g_print ("%s", ctx.json->str);
+    }
+    g_string_free (ctx.json, TRUE);
+    g_free (output);
+    g_free (filter);
+    return ret;
+}
@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Measure the round trip time of a command through the ResourceManager and
+ * ResponseSink with each stage on its own thread, and with both inline on
+ * the caller's thread (run-to-completion). The AccessBroker is replaced by
+ * a wrapper that answers immediately so the TPM isn't part of the
+ * measurement: what's left is the cost of handing the command and response
+ * between threads. The calling thread stands in for the CommandSource.
+ */
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "resource-manager.h"
+#include "response-sink.h"
+#include "session-list.h"
+#include "source-interface.h"
+#include "tcti.h"
+#include "tcti-mock.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define ITERATIONS_DEFAULT 20000
+/* TPM2_ReadClock: no handles, no sessions, no parameters */
+#define READ_CLOCK_ATTRS 0x00000181
+
+static Tpm2Response *bench_response = NULL;
+
+Tpm2Response*
+__wrap_access_broker_send_command (AccessBroker *access_broker,
+                                   Tpm2Command  *command,
+                                   TSS2_RC      *rc)
+{
+    UNUSED_PARAM (access_broker);
+    UNUSED_PARAM (command);
+
+    *rc = TSS2_RC_SUCCESS;
+    return TPM2_RESPONSE (g_object_ref (bench_response));
+}
+static guint64
+wall_time_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * G_GUINT64_CONSTANT (1000000000) +
+        (guint64)ts.tv_nsec;
+}
+/*
+ * Wait for and read a single response header from the client end of the
+ * connection. The socket is non-blocking so we poll for it.
+ */
+static void
+read_response (gint fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, };
+    guint8 buf [TPM_HEADER_SIZE];
+    size_t got = 0;
+    ssize_t ret;
+
+    while (got < sizeof (buf)) {
+        ret = read (fd, buf + got, sizeof (buf) - got);
+        if (ret > 0) {
+            got += (size_t)ret;
+        } else if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+            poll (&pfd, 1, -1);
+        } else {
+            g_error ("failed to read response: %s", strerror (errno));
+        }
+    }
+}
+/*
+ * Send 'iterations' commands one at a time, waiting for each response,
+ * and return the mean round trip time in nanoseconds.
+ */
+static double
+bench_run (ResourceManager *resmgr,
+           Tpm2Command     *command,
+           gint             client_fd,
+           gint64           iterations)
+{
+    guint64 start;
+    gint64 i;
+
+    start = wall_time_ns ();
+    for (i = 0; i < iterations; ++i) {
+        sink_enqueue (SINK (resmgr), G_OBJECT (command));
+        read_response (client_fd);
+    }
+    return (double)(wall_time_ns () - start) / (double)iterations;
+}
+/*
+ * Build a ResourceManager -> ResponseSink pipeline, run the benchmark
+ * through it and tear it down again.
+ */
+static double
+bench_pipeline (AccessBroker *broker,
+                Tpm2Command  *command,
+                gint          client_fd,
+                gint64        iterations,
+                gboolean      run_to_completion)
+{
+    SessionList *session_list;
+    ResourceManager *resmgr;
+    ResponseSink *sink;
+    double ns;
+
+    session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT,
+                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    resmgr = resource_manager_new (broker, session_list);
+    g_object_unref (session_list);
+    sink = response_sink_new ();
+    source_add_sink (SOURCE (resmgr), SINK (sink));
+    thread_set_inline (THREAD (resmgr), run_to_completion);
+    thread_set_inline (THREAD (sink), run_to_completion);
+    if (thread_start (THREAD (sink)) != 0 ||
+        thread_start (THREAD (resmgr)) != 0)
+    {
+        g_error ("failed to start pipeline threads");
+    }
+
+    /* warm up allocator and caches before measuring */
+    bench_run (resmgr, command, client_fd, iterations / 10 + 1);
+    ns = bench_run (resmgr, command, client_fd, iterations);
+
+    thread_cancel (THREAD (resmgr));
+    thread_join (THREAD (resmgr));
+    thread_cancel (THREAD (sink));
+    thread_join (THREAD (sink));
+    g_object_unref (resmgr);
+    g_object_unref (sink);
+    return ns;
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    gint64 iterations = ITERATIONS_DEFAULT;
+    GOptionEntry entries [] = {
+        { "iterations", 'i', 0, G_OPTION_ARG_INT64, &iterations,
+          "Number of commands to send per run", "N" },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+    GOptionContext *ctx;
+    GError *error = NULL;
+    TSS2_TCTI_CONTEXT *tcti_context;
+    Tcti *tcti;
+    AccessBroker *broker;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Connection *connection;
+    Tpm2Command *command;
+    uint8_t *buf;
+    gint client_fd;
+    double threaded, rtc;
+
+    ctx = g_option_context_new (" - run-to-completion pipeline benchmark");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_clear_error (&error);
+        g_option_context_free (ctx);
+        return 1;
+    }
+    g_option_context_free (ctx);
+    if (iterations < 1) {
+        g_printerr ("iterations must be > 0\n");
+        return 1;
+    }
+
+    tcti_context = tcti_mock_init_full ();
+    tcti = tcti_new (tcti_context);
+    broker = access_broker_new (tcti);
+    g_object_unref (tcti);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 1, handle_map);
+    g_object_unref (iostream);
+    g_object_unref (handle_map);
+
+    /* command and response headers share the same layout */
+    buf = g_malloc0 (TPM_HEADER_SIZE);
+    set_response_tag (buf, TPM2_ST_NO_SESSIONS);
+    set_response_size (buf, TPM_HEADER_SIZE);
+    set_response_code (buf, TPM2_CC_ReadClock);
+    command = tpm2_command_new (connection,
+                                buf,
+                                TPM_HEADER_SIZE,
+                                READ_CLOCK_ATTRS);
+    bench_response = tpm2_response_new_rc (connection, TSS2_RC_SUCCESS);
+
+    threaded = bench_pipeline (broker, command, client_fd, iterations, FALSE);
+    rtc = bench_pipeline (broker, command, client_fd, iterations, TRUE);
+
+    g_print ("commands:          %" PRId64 "\n", iterations);
+    g_print ("threaded:          %.1f ns/command\n", threaded);
+    g_print ("run-to-completion: %.1f ns/command\n", rtc);
+    g_print ("saved:             %.1f ns/command (%.1f%%)\n", threaded - rtc,
+             threaded > 0 ? (threaded - rtc) * 100.0 / threaded : 0.0);
+
+    g_object_unref (bench_response);
+    g_object_unref (command);
+    g_object_unref (connection);
+    g_object_unref (broker);
+    close (client_fd);
+    return 0;
+}
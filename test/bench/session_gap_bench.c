@@ -0,0 +1,326 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Stress the session context gap: one hot session is loaded and saved for
+ * every client command while the other sessions sit saved, getting older.
+ * The AccessBroker is replaced by a model of the TPM contextCounter that
+ * returns TPM2_RC_CONTEXT_GAP from ContextSave when the save would put the
+ * oldest saved session out of reach. We count the TPM commands each client
+ * command costs with the reactive regap only, and with the idle regap run
+ * between client commands.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "resource-manager.h"
+#include "resource-manager-session.h"
+#include "session-entry.h"
+#include "session-list.h"
+#include "tabrmd.h"
+#include "tcti.h"
+#include "tcti-mock.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define COMMANDS_DEFAULT 100000
+#define GAP_MAX_DEFAULT 255
+#define SESSIONS_DEFAULT 3
+
+/* model of the TPM: contextCounter and the saved sessions */
+static guint32 gap_max = GAP_MAX_DEFAULT;
+static guint64 tpm_counter = 0;
+static guint64 tpm_commands = 0;
+static gint tpm_sessions = 0;
+static gboolean *tpm_saved = NULL;
+static guint64 *tpm_sequence = NULL;
+
+static gint
+session_index (TPM2_HANDLE handle)
+{
+    gint index = (gint)(handle - TPM2_HMAC_SESSION_FIRST);
+
+    g_assert (index >= 0 && index < tpm_sessions);
+    return index;
+}
+static Tpm2Response*
+bench_response_new (TSS2_RC  rc,
+                    uint8_t *body,
+                    size_t   body_size)
+{
+    uint8_t *buf;
+
+    buf = g_malloc0 (TPM_HEADER_SIZE + body_size);
+    set_response_tag (buf, TPM2_ST_NO_SESSIONS);
+    set_response_size (buf, TPM_HEADER_SIZE + body_size);
+    set_response_code (buf, rc);
+    if (body_size > 0) {
+        memcpy (&buf [TPM_HEADER_SIZE], body, body_size);
+    }
+    return tpm2_response_new (NULL, buf, TPM_HEADER_SIZE + body_size, 0);
+}
+static Tpm2Response*
+bench_context_save (TPM2_HANDLE handle)
+{
+    TPMS_CONTEXT context = {
+        .savedHandle = handle,
+        .hierarchy = TPM2_RH_NULL,
+        .contextBlob = { .size = 16 },
+    };
+    uint8_t body [sizeof (TPMS_CONTEXT)];
+    size_t offset = 0;
+    gint index = session_index (handle), i;
+
+    for (i = 0; i < tpm_sessions; ++i) {
+        if (i != index && tpm_saved [i] &&
+            tpm_counter + 1 - tpm_sequence [i] > gap_max)
+        {
+            return bench_response_new (TPM2_RC_CONTEXT_GAP, NULL, 0);
+        }
+    }
+    context.sequence = ++tpm_counter;
+    tpm_saved [index] = TRUE;
+    tpm_sequence [index] = context.sequence;
+    Tss2_MU_TPMS_CONTEXT_Marshal (&context, body, sizeof (body), &offset);
+    return bench_response_new (TSS2_RC_SUCCESS, body, offset);
+}
+static Tpm2Response*
+bench_context_load (uint8_t *buf,
+                    size_t   size)
+{
+    TPMS_CONTEXT context = { .sequence = 0 };
+    uint8_t body [sizeof (TPM2_HANDLE)];
+    size_t offset = TPM_HEADER_SIZE;
+
+    Tss2_MU_TPMS_CONTEXT_Unmarshal (buf, size, &offset, &context);
+    tpm_saved [session_index (context.savedHandle)] = FALSE;
+    offset = 0;
+    Tss2_MU_UINT32_Marshal (context.savedHandle, body, sizeof (body), &offset);
+    return bench_response_new (TSS2_RC_SUCCESS, body, offset);
+}
+Tpm2Response*
+__wrap_access_broker_send_command (AccessBroker *access_broker,
+                                   Tpm2Command  *command,
+                                   TSS2_RC      *rc)
+{
+    uint8_t *buf = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t offset = TPM_HEADER_SIZE;
+    TPM2_HANDLE handle = 0;
+
+    UNUSED_PARAM (access_broker);
+    ++tpm_commands;
+    *rc = TSS2_RC_SUCCESS;
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_ContextSave:
+        Tss2_MU_UINT32_Unmarshal (buf, size, &offset, &handle);
+        return bench_context_save (handle);
+    case TPM2_CC_ContextLoad:
+        return bench_context_load (buf, size);
+    case TPM2_CC_FlushContext:
+        Tss2_MU_UINT32_Unmarshal (buf, size, &offset, &handle);
+        tpm_saved [session_index (handle)] = FALSE;
+        return bench_response_new (TSS2_RC_SUCCESS, NULL, 0);
+    default:
+        return bench_response_new (TPM2_RC_COMMAND_CODE, NULL, 0);
+    }
+}
+TSS2_RC
+__wrap_access_broker_get_fixed_property (AccessBroker *broker,
+                                         TPM2_PT       property,
+                                         guint32      *value)
+{
+    UNUSED_PARAM (broker);
+
+    if (property != TPM2_PT_CONTEXT_GAP_MAX) {
+        return TSS2_RESMGR_RC_BAD_VALUE;
+    }
+    *value = gap_max;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * A client command using the hot session: load it, then save it again
+ * the way the RM's session save pass does, regapping if the TPM asks.
+ */
+static void
+bench_client_command (ResourceManager *resmgr,
+                      SessionEntry    *hot)
+{
+    Tpm2Response *response;
+    TSS2_RC rc;
+
+    response = load_session (resmgr, hot);
+    g_object_unref (response);
+    response = save_session (resmgr, hot);
+    rc = tpm2_response_get_code (response);
+    if (rc != TSS2_RC_SUCCESS && handle_rc (resmgr, rc, NULL)) {
+        g_object_unref (response);
+        response = save_session (resmgr, hot);
+    }
+    g_object_unref (response);
+}
+typedef struct {
+    guint64 client_tpm_commands;
+    guint64 client_tpm_max;
+    guint64 idle_tpm_commands;
+    guint64 context_gaps;
+    guint64 regaps;
+    guint sessions_left;
+} bench_result_t;
+static void
+bench_run (AccessBroker   *broker,
+           Connection     *connection,
+           gint64          commands,
+           gint            idle_steps,
+           bench_result_t *result)
+{
+    SessionList *session_list;
+    ResourceManager *resmgr;
+    SessionEntry *entry, *hot = NULL;
+    Tpm2Response *response;
+    guint64 before;
+    gint64 i;
+    gint j;
+
+    tpm_counter = 0;
+    memset (tpm_saved, 0, sizeof (gboolean) * (size_t)tpm_sessions);
+    memset (tpm_sequence, 0, sizeof (guint64) * (size_t)tpm_sessions);
+    session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_MAX,
+                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    resmgr = resource_manager_new (broker, session_list);
+    /* saved in order so the list is oldest first, like it would be */
+    for (j = 0; j < tpm_sessions; ++j) {
+        entry = session_entry_new (connection,
+                                   TPM2_HMAC_SESSION_FIRST + (TPM2_HANDLE)j);
+        session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+        session_list_insert (session_list, entry);
+        response = save_session (resmgr, entry);
+        g_object_unref (response);
+        if (j == tpm_sessions - 1) {
+            hot = entry;
+        } else {
+            g_object_unref (entry);
+        }
+    }
+
+    memset (result, 0, sizeof (*result));
+    for (i = 0; i < commands; ++i) {
+        before = tpm_commands;
+        bench_client_command (resmgr, hot);
+        result->client_tpm_commands += tpm_commands - before;
+        result->client_tpm_max = MAX (result->client_tpm_max,
+                                      tpm_commands - before);
+        before = tpm_commands;
+        for (j = 0; j < idle_steps; ++j) {
+            if (!resource_manager_idle (resmgr)) {
+                break;
+            }
+        }
+        result->idle_tpm_commands += tpm_commands - before;
+    }
+    result->context_gaps = resmgr->context_gaps;
+    result->regaps = resmgr->regaps;
+    result->sessions_left = session_list_size (session_list);
+
+    g_object_unref (hot);
+    g_object_unref (resmgr);
+    g_object_unref (session_list);
+}
+static void
+bench_print (const gchar    *name,
+             gint64          commands,
+             bench_result_t *result)
+{
+    g_print ("%s:\n", name);
+    g_print ("  TPM commands per client command: %.3f mean, %" PRIu64
+             " max\n", (double)result->client_tpm_commands /
+             (double)commands, result->client_tpm_max);
+    g_print ("  TPM commands while idle:         %" PRIu64 "\n",
+             result->idle_tpm_commands);
+    g_print ("  TPM2_RC_CONTEXT_GAP responses:   %" PRIu64 "\n",
+             result->context_gaps);
+    g_print ("  sessions regapped while idle:    %" PRIu64 "\n",
+             result->regaps);
+    g_print ("  sessions left:                   %u\n",
+             result->sessions_left);
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    gint64 commands = COMMANDS_DEFAULT;
+    gint sessions = SESSIONS_DEFAULT, idle_steps = 1, gap = GAP_MAX_DEFAULT;
+    GOptionEntry entries [] = {
+        { "commands", 'c', 0, G_OPTION_ARG_INT64, &commands,
+          "Number of client commands per run", "N" },
+        { "sessions", 's', 0, G_OPTION_ARG_INT, &sessions,
+          "Number of sessions, one of them hot", "N" },
+        { "gap-max", 'g', 0, G_OPTION_ARG_INT, &gap,
+          "TPM2_PT_CONTEXT_GAP_MAX of the modeled TPM", "N" },
+        { "idle-steps", 'i', 0, G_OPTION_ARG_INT, &idle_steps,
+          "Idle steps between client commands in the proactive run", "N" },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+    GOptionContext *ctx;
+    GError *error = NULL;
+    TSS2_TCTI_CONTEXT *tcti_context;
+    Tcti *tcti;
+    AccessBroker *broker;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Connection *connection;
+    bench_result_t result;
+    gint client_fd;
+
+    ctx = g_option_context_new (" - session context gap benchmark");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_clear_error (&error);
+        g_option_context_free (ctx);
+        return 1;
+    }
+    g_option_context_free (ctx);
+    if (commands < 1 || sessions < 2 ||
+        sessions > (gint)SESSION_LIST_MAX_ENTRIES_MAX ||
+        gap < sessions || idle_steps < 0)
+    {
+        g_printerr ("commands must be > 0, sessions between 2 and %u, "
+                    "gap-max >= sessions and idle-steps >= 0\n",
+                    SESSION_LIST_MAX_ENTRIES_MAX);
+        return 1;
+    }
+    gap_max = (guint32)gap;
+    tpm_sessions = sessions;
+    tpm_saved = g_new0 (gboolean, (gsize)sessions);
+    tpm_sequence = g_new0 (guint64, (gsize)sessions);
+
+    tcti_context = tcti_mock_init_full ();
+    tcti = tcti_new (tcti_context);
+    broker = access_broker_new (tcti);
+    g_object_unref (tcti);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 1, handle_map);
+    g_object_unref (iostream);
+    g_object_unref (handle_map);
+
+    g_print ("client commands: %" PRId64 "\n", commands);
+    g_print ("sessions:        %d\n", sessions);
+    g_print ("gap max:         %d\n", gap);
+    bench_run (broker, connection, commands, 0, &result);
+    bench_print ("reactive regap", commands, &result);
+    bench_run (broker, connection, commands, idle_steps, &result);
+    bench_print ("idle regap", commands, &result);
+
+    g_object_unref (connection);
+    g_object_unref (broker);
+    g_free (tpm_saved);
+    g_free (tpm_sequence);
+    close (client_fd);
+    return 0;
+}
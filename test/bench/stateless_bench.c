@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Measure the CPU time the ResourceManager spends on a command that has no
+ * handles and no sessions, with and without the stateless fast path. The
+ * AccessBroker and Sink are replaced by trivial wrappers so the TPM isn't
+ * part of the measurement: what's left is the RM bookkeeping.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "resource-manager.h"
+#include "session-entry.h"
+#include "session-list.h"
+#include "tcti.h"
+#include "tcti-mock.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define ITERATIONS_DEFAULT 100000
+/* TPM2_ReadClock: no handles, no sessions, no parameters */
+#define READ_CLOCK_ATTRS 0x00000181
+
+static Tpm2Response *bench_response = NULL;
+
+Tpm2Response*
+__wrap_access_broker_send_command (AccessBroker *access_broker,
+                                   Tpm2Command  *command,
+                                   TSS2_RC      *rc)
+{
+    UNUSED_PARAM (access_broker);
+    UNUSED_PARAM (command);
+
+    *rc = TSS2_RC_SUCCESS;
+    return TPM2_RESPONSE (g_object_ref (bench_response));
+}
+void
+__wrap_sink_enqueue (Sink    *self,
+                     GObject *obj)
+{
+    UNUSED_PARAM (self);
+    UNUSED_PARAM (obj);
+}
+static guint64
+cpu_time_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (guint64)ts.tv_sec * G_GUINT64_CONSTANT (1000000000) +
+        (guint64)ts.tv_nsec;
+}
+/*
+ * Run 'iterations' commands through the RM and return the mean CPU time
+ * per command in nanoseconds.
+ */
+static double
+bench_run (ResourceManager *resmgr,
+           Tpm2Command     *command,
+           gint64           iterations)
+{
+    guint64 start;
+    gint64 i;
+
+    start = cpu_time_ns ();
+    for (i = 0; i < iterations; ++i) {
+        resource_manager_process_tpm2_command (resmgr, command);
+    }
+    return (double)(cpu_time_ns () - start) / (double)iterations;
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    gint64 iterations = ITERATIONS_DEFAULT;
+    gint sessions = SESSION_LIST_MAX_ENTRIES_DEFAULT, i;
+    GOptionEntry entries [] = {
+        { "iterations", 'i', 0, G_OPTION_ARG_INT64, &iterations,
+          "Number of commands to process per run", "N" },
+        { "sessions", 's', 0, G_OPTION_ARG_INT, &sessions,
+          "Number of saved sessions held by the RM", "N" },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+    GOptionContext *ctx;
+    GError *error = NULL;
+    TSS2_TCTI_CONTEXT *tcti_context;
+    Tcti *tcti;
+    AccessBroker *broker;
+    SessionList *session_list;
+    SessionEntry *entry;
+    ResourceManager *resmgr;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Connection *connection;
+    Tpm2Command *command;
+    uint8_t *buf;
+    gint client_fd;
+    double slow, fast;
+
+    ctx = g_option_context_new (" - stateless command fast path benchmark");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_clear_error (&error);
+        g_option_context_free (ctx);
+        return 1;
+    }
+    g_option_context_free (ctx);
+    if (iterations < 1 || sessions < 0 ||
+        sessions > SESSION_LIST_MAX_ENTRIES_MAX)
+    {
+        g_printerr ("iterations must be > 0 and sessions <= %u\n",
+                    SESSION_LIST_MAX_ENTRIES_MAX);
+        return 1;
+    }
+
+    tcti_context = tcti_mock_init_full ();
+    tcti = tcti_new (tcti_context);
+    broker = access_broker_new (tcti);
+    g_object_unref (tcti);
+    session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_MAX,
+                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    resmgr = resource_manager_new (broker, session_list);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 1, handle_map);
+    g_object_unref (iostream);
+    g_object_unref (handle_map);
+    /* saved sessions are visited by the save pass on the slow path */
+    for (i = 0; i < sessions; ++i) {
+        entry = session_entry_new (connection, TPM2_HMAC_SESSION_FIRST + (TPM2_HANDLE)i);
+        session_list_insert (session_list, entry);
+        g_object_unref (entry);
+    }
+
+    /* command and response headers share the same layout */
+    buf = g_malloc0 (TPM_HEADER_SIZE);
+    set_response_tag (buf, TPM2_ST_NO_SESSIONS);
+    set_response_size (buf, TPM_HEADER_SIZE);
+    set_response_code (buf, TPM2_CC_ReadClock);
+    command = tpm2_command_new (connection,
+                                buf,
+                                TPM_HEADER_SIZE,
+                                READ_CLOCK_ATTRS);
+    bench_response = tpm2_response_new_rc (connection, TSS2_RC_SUCCESS);
+
+    /* warm up allocator and caches before measuring */
+    bench_run (resmgr, command, iterations / 10 + 1);
+    tpm2_command_set_stateless (command, FALSE);
+    slow = bench_run (resmgr, command, iterations);
+    tpm2_command_set_stateless (command, TRUE);
+    fast = bench_run (resmgr, command, iterations);
+
+    g_print ("commands:   %" PRId64 "\n", iterations);
+    g_print ("sessions:   %d\n", sessions);
+    g_print ("full path:  %.1f ns/command\n", slow);
+    g_print ("fast path:  %.1f ns/command\n", fast);
+    g_print ("saved:      %.1f ns/command (%.1f%%)\n", slow - fast,
+             slow > 0 ? (slow - fast) * 100.0 / slow : 0.0);
+
+    g_object_unref (bench_response);
+    g_object_unref (command);
+    g_object_unref (connection);
+    g_object_unref (resmgr);
+    g_object_unref (session_list);
+    g_object_unref (broker);
+    close (client_fd);
+    return 0;
+}
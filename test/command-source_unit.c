@@ -123,7 +123,8 @@ command_source_allocate_test (void **state)
 
     data->command_attrs = command_attrs_new ();
     data->source = command_source_new (data->manager,
-                                       data->command_attrs);
+                                       data->command_attrs,
+                                       NULL);
     assert_non_null (data->source);
 }
 
@@ -169,7 +170,8 @@ command_source_start_setup (void **state)
         g_error ("failed to allocate new connection_manager");
     data->command_attrs = command_attrs_new ();
     data->source = command_source_new (data->manager,
-                                       data->command_attrs);
+                                       data->command_attrs,
+                                       NULL);
     if (data->source == NULL)
         g_error ("failed to allocate new command_source");
 
@@ -209,7 +211,8 @@ command_source_connection_setup (void **state)
     data->manager = connection_manager_new (TABRMD_CONNECTIONS_MAX_DEFAULT);
     data->command_attrs = command_attrs_new ();
     data->source = command_source_new (data->manager,
-                                       data->command_attrs);
+                                       data->command_attrs,
+                                       NULL);
 
     *state = data;
     return 0;
@@ -271,6 +274,7 @@ command_source_on_io_ready_success_test (void **state)
     HandleMap   *handle_map;
     Connection *connection;
     Tpm2Command *command_out;
+    source_data_t source_data = { .self = data->source, };
     gint client_fd;
     guint8 data_in [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x17,
                           0x0,  0x0,  0x01, 0x7a, 0x0,  0x0,
@@ -293,7 +297,7 @@ command_source_on_io_ready_success_test (void **state)
 
     will_return (__wrap_sink_enqueue, &command_out);
 
-    command_source_on_input_ready (NULL, data->source);
+    command_source_on_input_ready (NULL, &source_data);
 
     assert_memory_equal (tpm2_command_get_buffer (command_out),
                          data_in,
@@ -340,6 +344,57 @@ command_source_on_io_ready_eof_test (void **state)
     assert_int_equal (hash_table_size, 0);
     g_object_unref (msg);
 }
+/*
+ * With an AdmissionControl a connection that's reached its limit isn't read
+ * from: the GSource is removed and the connection marked paused. Resuming
+ * creates a new GSource for it.
+ */
+static void
+command_source_on_io_ready_defer_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    AdmissionControl *admission;
+    source_data_t *source_data;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    gint client_fd;
+    gboolean ret;
+
+    admission = admission_control_new (0, 1, FALSE);
+    g_clear_object (&data->source);
+    data->source = command_source_new (data->manager,
+                                       data->command_attrs,
+                                       admission);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    will_return (__wrap_g_source_set_callback, &source_data);
+    command_source_on_new_connection (data->manager, connection, data->source);
+    assert_ptr_equal (connection->admission, admission);
+    assert_int_equal (admission_control_admit (admission, connection),
+                      ADMISSION_ADMIT);
+    /* on_input_ready drops the reference the lookup gives it */
+    will_return (__wrap_connection_manager_lookup_istream,
+                 g_object_ref (connection));
+    ret = command_source_on_input_ready (g_io_stream_get_input_stream (connection->iostream), source_data);
+    assert_int_equal (ret, G_SOURCE_REMOVE);
+    assert_true (source_data->paused);
+    assert_int_equal (g_hash_table_size (data->source->istream_to_source_data_map),
+                      1);
+
+    will_return (__wrap_g_source_set_callback, &source_data);
+    command_source_resume (data->source);
+    assert_false (source_data->paused);
+
+    g_clear_object (&data->source);
+    g_object_unref (connection);
+    g_object_unref (admission);
+    close (client_fd);
+}
 /* command_source_connection_test end */
 int
 main (void)
@@ -360,6 +415,9 @@ main (void)
         cmocka_unit_test_setup_teardown (command_source_on_io_ready_eof_test,
                                          command_source_connection_setup,
                                          command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_defer_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
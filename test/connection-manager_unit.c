@@ -131,8 +131,45 @@ connection_manager_remove_test (void **state)
     g_object_unref (iostream);
     ret_int = connection_manager_insert (manager, connection);
     assert_int_equal (ret_int, 0);
+    assert_int_equal (connection_manager_size (manager), 1);
     ret_bool = connection_manager_remove (manager, connection);
     assert_true (ret_bool);
+    assert_int_equal (connection_manager_size (manager), 0);
+}
+
+/*
+ * get_connections returns a reference to each of the managed Connections.
+ */
+static void
+connection_manager_get_connections_test (void **state)
+{
+    ConnectionManager *manager = CONNECTION_MANAGER (*state);
+    Connection *connections [2];
+    GIOStream *iostream;
+    HandleMap *handle_map;
+    GList *list;
+    gint client_fd;
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS (connections); ++i) {
+        handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostream = create_connection_iostream (&client_fd);
+        connections [i] = connection_new (iostream, i + 1, handle_map);
+        g_object_unref (handle_map);
+        g_object_unref (iostream);
+        assert_int_equal (connection_manager_insert (manager, connections [i]),
+                          0);
+    }
+    list = connection_manager_get_connections (manager);
+    assert_int_equal (g_list_length (list), G_N_ELEMENTS (connections));
+    for (i = 0; i < G_N_ELEMENTS (connections); ++i) {
+        assert_non_null (g_list_find (list, connections [i]));
+        connection_manager_remove (manager, connections [i]);
+        g_object_unref (connections [i]);
+    }
+    /* the list still holds a reference to each of them */
+    assert_true (IS_CONNECTION (list->data));
+    g_list_free_full (list, g_object_unref);
 }
 
 int
@@ -152,6 +189,9 @@ main(void)
         cmocka_unit_test_setup_teardown (connection_manager_remove_test,
                                          connection_manager_setup,
                                          connection_manager_teardown),
+        cmocka_unit_test_setup_teardown (connection_manager_get_connections_test,
+                                         connection_manager_setup,
+                                         connection_manager_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -163,6 +163,48 @@ connection_server_to_client_test (void **state)
     assert_int_equal (ret, strlen ("test"));
 }
 /* connection_server_to_client_test end */
+/*
+ * Stats added to a connection are summed, commands are counted by command
+ * code and the snapshot is a copy that later commands don't change.
+ */
+static void
+connection_stats_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+    Connection *connection = data->connection;
+    connection_stats_t delta = { 0, }, stats;
+    GHashTable *counts;
+    guint64 *count;
+
+    connection_set_client (connection, 1234, 1000);
+    assert_int_equal (connection->pid, 1234);
+    assert_int_equal (connection->uid, 1000);
+
+    delta.tpm_time_us = 100;
+    delta.context_loads = 2;
+    delta.bytes_in = 10;
+    connection_stats_add (connection, &delta);
+    connection_stats_add (connection, &delta);
+    connection_stats_add_command (connection, TPM2_CC_GetRandom);
+    connection_stats_add_command (connection, TPM2_CC_GetRandom);
+    connection_stats_add_command (connection, TPM2_CC_ReadClock);
+
+    counts = connection_get_stats (connection, &stats);
+    assert_int_equal (stats.commands, 3);
+    assert_int_equal (stats.tpm_time_us, 200);
+    assert_int_equal (stats.context_loads, 4);
+    assert_int_equal (stats.context_saves, 0);
+    assert_int_equal (stats.bytes_in, 20);
+    assert_int_equal (stats.bytes_out, 0);
+    assert_int_equal (g_hash_table_size (counts), 2);
+    count = g_hash_table_lookup (counts, GUINT_TO_POINTER (TPM2_CC_GetRandom));
+    assert_non_null (count);
+    assert_int_equal (*count, 2);
+
+    connection_stats_add_command (connection, TPM2_CC_GetRandom);
+    assert_int_equal (*count, 2);
+    g_hash_table_unref (counts);
+}
 
 int
 main(void)
@@ -181,6 +223,9 @@ main(void)
         cmocka_unit_test_setup_teardown (connection_server_to_client_test,
                                          connection_setup,
                                          connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_stats_test,
+                                         connection_setup,
+                                         connection_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
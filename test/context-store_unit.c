@@ -0,0 +1,222 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "context-store.h"
+#include "util.h"
+
+#define BLOB_SIZE 1024
+#define BLOB_COUNT 8
+
+typedef struct {
+    ContextStore *store;
+    gchar        *path;
+    guint64       ids [BLOB_COUNT];
+} test_data_t;
+/*
+ * Fill the buffer with a pattern unique to 'seed' so that we can tell
+ * blobs apart when they come back from the store.
+ */
+static void
+blob_fill (uint8_t *buf,
+           size_t   size,
+           guint    seed)
+{
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        buf [i] = (uint8_t)(seed + i);
+    }
+}
+static test_data_t*
+context_store_setup_common (guint64 budget)
+{
+    test_data_t *data;
+
+    data = calloc (1, sizeof (test_data_t));
+    data->path = g_dir_make_tmp ("context-store-XXXXXX", NULL);
+    assert_non_null (data->path);
+    data->store = context_store_new (data->path, budget);
+    return data;
+}
+/*
+ * Setup with a budget large enough for half of the blobs used in tests.
+ */
+static int
+context_store_setup (void **state)
+{
+    *state = context_store_setup_common (BLOB_SIZE * BLOB_COUNT / 2);
+    return 0;
+}
+static int
+context_store_setup_unlimited (void **state)
+{
+    *state = context_store_setup_common (0);
+    return 0;
+}
+static int
+context_store_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->store);
+    g_rmdir (data->path);
+    g_free (data->path);
+    free (data);
+    return 0;
+}
+/*
+ * Insert BLOB_COUNT blobs in to the store.
+ */
+static void
+insert_blobs (test_data_t *data)
+{
+    uint8_t buf [BLOB_SIZE];
+    guint i;
+
+    for (i = 0; i < BLOB_COUNT; ++i) {
+        blob_fill (buf, sizeof (buf), i);
+        data->ids [i] = context_store_insert (data->store, buf, sizeof (buf));
+        assert_int_not_equal (data->ids [i], 0);
+    }
+}
+static void
+context_store_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_CONTEXT_STORE (data->store));
+}
+/*
+ * With no budget everything stays in memory and no segments are created.
+ */
+static void
+context_store_unlimited_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    insert_blobs (data);
+    assert_int_equal (context_store_resident_bytes (data->store),
+                      BLOB_SIZE * BLOB_COUNT);
+    assert_int_equal (context_store_segment_count (data->store), 0);
+}
+/*
+ * Once the budget is exceeded the oldest blobs are spilled. Every blob must
+ * come back intact regardless of where it lives, and reading a spilled blob
+ * doesn't bring it back in to memory.
+ */
+static void
+context_store_spill_lookup_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t buf [BLOB_SIZE], expected [BLOB_SIZE];
+    size_t size;
+    guint64 resident;
+    guint i;
+
+    insert_blobs (data);
+    resident = context_store_resident_bytes (data->store);
+    assert_true (resident <= BLOB_SIZE * BLOB_COUNT / 2);
+    assert_int_equal (context_store_segment_count (data->store), 1);
+    for (i = 0; i < BLOB_COUNT; ++i) {
+        size = sizeof (buf);
+        blob_fill (expected, sizeof (expected), i);
+        assert_true (context_store_lookup (data->store,
+                                           data->ids [i],
+                                           buf,
+                                           &size));
+        assert_int_equal (size, BLOB_SIZE);
+        assert_memory_equal (buf, expected, BLOB_SIZE);
+    }
+    assert_int_equal (context_store_resident_bytes (data->store), resident);
+}
+/*
+ * Updating a spilled blob replaces its contents and makes it resident.
+ */
+static void
+context_store_update_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t buf [BLOB_SIZE], expected [BLOB_SIZE];
+    size_t size = sizeof (buf);
+
+    insert_blobs (data);
+    blob_fill (expected, sizeof (expected), 0xaa);
+    assert_true (context_store_update (data->store,
+                                       data->ids [0],
+                                       expected,
+                                       sizeof (expected)));
+    assert_true (context_store_lookup (data->store,
+                                       data->ids [0],
+                                       buf,
+                                       &size));
+    assert_memory_equal (buf, expected, BLOB_SIZE);
+}
+/*
+ * Removing every blob releases all of the memory and, once a segment has
+ * no live records left, the segment itself.
+ */
+static void
+context_store_remove_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t buf [BLOB_SIZE];
+    size_t size = sizeof (buf);
+    guint i;
+
+    insert_blobs (data);
+    for (i = 0; i < BLOB_COUNT; ++i) {
+        context_store_remove (data->store, data->ids [i]);
+    }
+    assert_int_equal (context_store_resident_bytes (data->store), 0);
+    assert_false (context_store_lookup (data->store,
+                                        data->ids [0],
+                                        buf,
+                                        &size));
+}
+/*
+ * A lookup with a buffer that's too small must fail without writing.
+ */
+static void
+context_store_lookup_small_buf_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t buf [BLOB_SIZE];
+    size_t size = BLOB_SIZE - 1;
+
+    insert_blobs (data);
+    assert_false (context_store_lookup (data->store,
+                                        data->ids [BLOB_COUNT - 1],
+                                        buf,
+                                        &size));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (context_store_type_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+        cmocka_unit_test_setup_teardown (context_store_unlimited_test,
+                                         context_store_setup_unlimited,
+                                         context_store_teardown),
+        cmocka_unit_test_setup_teardown (context_store_spill_lookup_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+        cmocka_unit_test_setup_teardown (context_store_update_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+        cmocka_unit_test_setup_teardown (context_store_remove_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+        cmocka_unit_test_setup_teardown (context_store_lookup_small_buf_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
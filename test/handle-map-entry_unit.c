@@ -85,6 +85,74 @@ handle_map_entry_get_vhandle_test (void **state)
     assert_int_equal (VHANDLE,
                       handle_map_entry_get_vhandle (data->handle_map_entry));
 }
+/*
+ * An entry starts out without a cached ReadPublic response. Once set the
+ * accessor returns a copy of the same bytes.
+ */
+static void
+handle_map_entry_public_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t buf [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    GBytes *bytes;
+
+    assert_null (handle_map_entry_get_public (data->handle_map_entry));
+    handle_map_entry_set_public (data->handle_map_entry, buf, sizeof (buf));
+    bytes = handle_map_entry_get_public (data->handle_map_entry);
+    assert_non_null (bytes);
+    assert_int_equal (g_bytes_get_size (bytes), sizeof (buf));
+    assert_memory_equal (g_bytes_get_data (bytes, NULL), buf, sizeof (buf));
+    g_bytes_unref (bytes);
+}
+/*
+ * A stashed context is handed back by 'get_context' and the entry owns it
+ * from then on: the record is dropped from the ContextStore rather than
+ * kept alongside the entry's copy.
+ */
+static void
+handle_map_entry_stash_context_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry = data->handle_map_entry;
+    ContextStore *store;
+    TPMS_CONTEXT context = { .savedHandle = PHANDLE, };
+    TPMS_CONTEXT *stashed;
+
+    store = context_store_new (NULL, 0);
+    handle_map_entry_set_context_store (entry, store);
+    handle_map_entry_set_context (entry, &context);
+    handle_map_entry_stash_context (entry);
+    assert_null (entry->context);
+    assert_true (context_store_resident_bytes (store) > 0);
+
+    stashed = handle_map_entry_get_context (entry);
+    assert_non_null (stashed);
+    assert_int_equal (stashed->savedHandle, PHANDLE);
+    assert_int_equal (context_store_resident_bytes (store), 0);
+    g_object_unref (store);
+}
+/*
+ * A context that can't be read back from the ContextStore isn't replaced
+ * by a zeroed one.
+ */
+static void
+handle_map_entry_stash_context_lost_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry = data->handle_map_entry;
+    ContextStore *store;
+    TPMS_CONTEXT context = { .savedHandle = PHANDLE, };
+
+    store = context_store_new (NULL, 0);
+    handle_map_entry_set_context_store (entry, store);
+    handle_map_entry_set_context (entry, &context);
+    handle_map_entry_stash_context (entry);
+    context_store_remove (store, entry->context_id);
+
+    assert_null (handle_map_entry_get_context (entry));
+    g_object_unref (store);
+}
 
 gint
 main (void)
@@ -99,6 +167,15 @@ main (void)
         cmocka_unit_test_setup_teardown (handle_map_entry_get_vhandle_test,
                                          handle_map_entry_setup,
                                          handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_public_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_stash_context_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_stash_context_lost_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
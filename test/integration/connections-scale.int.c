@@ -0,0 +1,204 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * This test opens a large number of connections to the tabrmd, each of
+ * which starts and flushes an auth session, and checks that the daemon
+ * doesn't get slower or more expensive per connection as the number of
+ * connections grows.
+ *
+ * At each checkpoint we measure the mean latency of a small command
+ * (GetRandom) sent over the first and the newest connection, and the
+ * resident set size of the daemon. The daemon PID is passed to us in the
+ * TABRMD_TEST_PID environment variable by int-test-setup.sh, which also
+ * starts the daemon with --max-connections=5000 for this test.
+ *
+ * Sessions are flushed after they're started: the TPM limits the number of
+ * active sessions (loaded or saved) to a few dozen so there's no way to
+ * hold one per connection.
+ */
+#include <inttypes.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <tss2/tss2_sys.h>
+
+#include "common.h"
+#include "test-options.h"
+#include "context-util.h"
+
+#define CONNECTION_COUNT 5000
+#define PROBE_ITERATIONS 50
+/* mean latency at the last checkpoint may be this many times the first */
+#define LATENCY_SLACK 4
+/* latencies under this many microseconds are all considered the same */
+#define LATENCY_FLOOR_US 1000
+/* later KiB per connection may be this many times the first, plus FLOOR */
+#define MEMORY_SLACK 2
+#define MEMORY_FLOOR_KB 4
+
+static const guint checkpoints [] = { 100, 1000, 2500, CONNECTION_COUNT };
+
+typedef struct {
+    guint   connections;
+    gint64  latency_us;
+    guint64 rss_kb;
+} checkpoint_t;
+
+/*
+ * Raise our own RLIMIT_NOFILE to the hard limit: we hold a socket for each
+ * connection.
+ */
+static void
+raise_nofile_limit (void)
+{
+    struct rlimit limit;
+
+    if (getrlimit (RLIMIT_NOFILE, &limit) != 0) {
+        g_error ("getrlimit failed");
+    }
+    if (limit.rlim_max != RLIM_INFINITY &&
+        limit.rlim_max < CONNECTION_COUNT + 64)
+    {
+        g_error ("RLIMIT_NOFILE hard limit of %" PRIu64 " is too low for %u "
+                 "connections", (uint64_t)limit.rlim_max, CONNECTION_COUNT);
+    }
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit (RLIMIT_NOFILE, &limit) != 0) {
+        g_error ("setrlimit failed");
+    }
+}
+/*
+ * Get the VmRSS of the daemon in KiB from /proc. Returns 0 if it's not
+ * available.
+ */
+static guint64
+get_daemon_rss_kb (void)
+{
+    const gchar *pid = g_getenv ("TABRMD_TEST_PID");
+    gchar *path, *contents = NULL, *line;
+    guint64 rss_kb = 0;
+
+    if (pid == NULL || pid [0] == '\0') {
+        return 0;
+    }
+    path = g_strdup_printf ("/proc/%s/status", pid);
+    if (g_file_get_contents (path, &contents, NULL, NULL)) {
+        line = g_strstr_len (contents, -1, "VmRSS:");
+        if (line != NULL) {
+            rss_kb = g_ascii_strtoull (line + strlen ("VmRSS:"), NULL, 10);
+        }
+    }
+    g_free (contents);
+    g_free (path);
+    return rss_kb;
+}
+/*
+ * Mean latency in microseconds of GetRandom over the provided connection.
+ */
+static gint64
+probe_latency (TSS2_SYS_CONTEXT *sapi_context)
+{
+    TPM2B_DIGEST random = { .size = 0, };
+    TSS2_RC rc;
+    gint64 start;
+    guint i;
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < PROBE_ITERATIONS; ++i) {
+        random.size = 0;
+        rc = Tss2_Sys_GetRandom (sapi_context, NULL, 16, &random, NULL);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_error ("Tss2_Sys_GetRandom failed: 0x%" PRIx32, rc);
+        }
+    }
+    return (g_get_monotonic_time () - start) / PROBE_ITERATIONS;
+}
+/*
+ * Start an auth session over the connection and flush it again.
+ */
+static void
+start_flush_session (TSS2_SYS_CONTEXT *sapi_context)
+{
+    TPMI_SH_AUTH_SESSION session_handle = 0;
+    TSS2_RC rc;
+
+    rc = start_auth_session (sapi_context, &session_handle);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_error ("start_auth_session failed: 0x%" PRIx32, rc);
+    }
+    rc = flush_context (sapi_context, session_handle);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_error ("flush_context failed: 0x%" PRIx32, rc);
+    }
+}
+int
+main ()
+{
+    TSS2_SYS_CONTEXT **sapi_contexts;
+    test_opts_t opts = TEST_OPTS_DEFAULT_INIT;
+    checkpoint_t results [G_N_ELEMENTS (checkpoints)] = { { 0 } };
+    guint64 rss_base, first_kb, last_kb;
+    gint64 first_us, last_us;
+    guint i, c = 0, prev;
+    gint ret = 0;
+
+    get_test_opts_from_env (&opts);
+    if (sanity_check_test_opts (&opts) != 0)
+        exit (1);
+    raise_nofile_limit ();
+
+    sapi_contexts = g_malloc0_n (CONNECTION_COUNT, sizeof (TSS2_SYS_CONTEXT*));
+    rss_base = get_daemon_rss_kb ();
+    for (i = 0; i < CONNECTION_COUNT; ++i) {
+        sapi_contexts [i] = sapi_init_from_opts (&opts);
+        if (sapi_contexts [i] == NULL) {
+            g_error ("Failed to create SAPI context number %u", i);
+        }
+        start_flush_session (sapi_contexts [i]);
+        if (i + 1 != checkpoints [c]) {
+            continue;
+        }
+        results [c].connections = i + 1;
+        results [c].latency_us = (probe_latency (sapi_contexts [0]) +
+                                  probe_latency (sapi_contexts [i])) / 2;
+        results [c].rss_kb = get_daemon_rss_kb ();
+        g_print ("%u connections: GetRandom %" PRId64 " us, daemon RSS "
+                 "%" PRIu64 " KiB\n", results [c].connections,
+                 results [c].latency_us, results [c].rss_kb);
+        ++c;
+    }
+
+    first_us = MAX (results [0].latency_us, LATENCY_FLOOR_US);
+    last_us = results [c - 1].latency_us;
+    if (last_us > first_us * LATENCY_SLACK) {
+        g_critical ("GetRandom latency grew from %" PRId64 " us to %" PRId64
+                    " us", results [0].latency_us, last_us);
+        ret = 1;
+    }
+    if (rss_base == 0) {
+        g_warning ("No daemon RSS available, skipping memory check");
+    } else {
+        /* KiB per connection over the first interval and the last */
+        first_kb = (results [0].rss_kb - MIN (rss_base, results [0].rss_kb)) /
+            results [0].connections;
+        prev = results [c - 2].connections;
+        last_kb = (results [c - 1].rss_kb -
+                   MIN (results [c - 2].rss_kb, results [c - 1].rss_kb)) /
+            (results [c - 1].connections - prev);
+        g_print ("daemon memory per connection: first %" PRIu64 " KiB, "
+                 "last %" PRIu64 " KiB\n", first_kb, last_kb);
+        if (last_kb > first_kb * MEMORY_SLACK + MEMORY_FLOOR_KB) {
+            g_critical ("Memory per connection grew from %" PRIu64 " KiB to "
+                        "%" PRIu64 " KiB", first_kb, last_kb);
+            ret = 1;
+        }
+    }
+
+    for (i = 0; i < CONNECTION_COUNT; ++i) {
+        sapi_teardown_full (sapi_contexts [i]);
+    }
+    g_free (sapi_contexts);
+    return ret;
+}
@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "lock-stats.h"
+
+static lock_stats_t test_lock_stats = LOCK_STATS_INIT ("test");
+
+typedef struct {
+    stat_mutex_t  mutex;
+    gboolean      acquired;
+} test_data_t;
+
+static int
+lock_stats_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    assert_int_equal (stat_mutex_init (&data->mutex, &test_lock_stats), 0);
+    *state = data;
+    return 0;
+}
+static int
+lock_stats_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    stat_mutex_destroy (&data->mutex);
+    free (data);
+    return 0;
+}
+static void*
+lock_thread (void *param)
+{
+    test_data_t *data = (test_data_t*)param;
+
+    stat_mutex_lock (&data->mutex);
+    data->acquired = TRUE;
+    stat_mutex_unlock (&data->mutex);
+
+    return NULL;
+}
+/*
+ * Find the copy of test_lock_stats in the list from lock_stats_get_all.
+ */
+static lock_stats_t*
+find_test_stats (GList *list)
+{
+    GList *item;
+
+    for (item = list; item != NULL; item = item->next) {
+        if (g_strcmp0 (((lock_stats_t*)item->data)->name, "test") == 0) {
+            return item->data;
+        }
+    }
+    return NULL;
+}
+static guint64
+hist_sum (guint64 hist [LOCK_STATS_BUCKETS])
+{
+    guint64 sum = 0;
+    size_t i;
+
+    for (i = 0; i < LOCK_STATS_BUCKETS; ++i) {
+        sum += hist [i];
+    }
+    return sum;
+}
+/*
+ * The lock excludes a second thread while it's held, whether or not
+ * statistics are being recorded.
+ */
+static void
+lock_stats_exclusion_test (void **state)
+{
+    test_data_t *data = *state;
+    pthread_t thread_id;
+
+    assert_int_equal (stat_mutex_lock (&data->mutex), 0);
+    assert_int_equal (pthread_create (&thread_id, NULL, lock_thread, data),
+                      0);
+    usleep (100000);
+    assert_false (data->acquired);
+    assert_int_equal (stat_mutex_unlock (&data->mutex), 0);
+    pthread_join (thread_id, NULL);
+    assert_true (data->acquired);
+}
+#ifdef ENABLE_LOCK_STATS
+/*
+ * Every acquisition is counted and has its hold time recorded. Only the
+ * contended one has a wait time.
+ */
+static void
+lock_stats_contended_test (void **state)
+{
+    test_data_t *data = *state;
+    pthread_t thread_id;
+    lock_stats_t *before, *after;
+    GList *list_before, *list_after;
+
+    list_before = lock_stats_get_all ();
+    before = find_test_stats (list_before);
+    assert_non_null (before);
+
+    stat_mutex_lock (&data->mutex);
+    stat_mutex_unlock (&data->mutex);
+    stat_mutex_lock (&data->mutex);
+    pthread_create (&thread_id, NULL, lock_thread, data);
+    usleep (100000);
+    stat_mutex_unlock (&data->mutex);
+    pthread_join (thread_id, NULL);
+
+    list_after = lock_stats_get_all ();
+    after = find_test_stats (list_after);
+    assert_non_null (after);
+    assert_int_equal (after->acquired - before->acquired, 3);
+    assert_int_equal (after->contended - before->contended, 1);
+    assert_int_equal (hist_sum (after->hold_hist) - hist_sum (before->hold_hist),
+                      3);
+    assert_int_equal (hist_sum (after->wait_hist) - hist_sum (before->wait_hist),
+                      1);
+    /* we held the lock for ~100ms while the thread waited */
+    assert_true (after->wait_ns - before->wait_ns >= 50000000);
+    assert_true (after->hold_ns - before->hold_ns >= 50000000);
+
+    g_list_free_full (list_before, g_free);
+    g_list_free_full (list_after, g_free);
+}
+#else
+/*
+ * Without lock statistics nothing is recorded.
+ */
+static void
+lock_stats_disabled_test (void **state)
+{
+    test_data_t *data = *state;
+
+    stat_mutex_lock (&data->mutex);
+    stat_mutex_unlock (&data->mutex);
+    assert_null (lock_stats_get_all ());
+}
+#endif
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (lock_stats_exclusion_test,
+                                         lock_stats_setup,
+                                         lock_stats_teardown),
+#ifdef ENABLE_LOCK_STATS
+        cmocka_unit_test_setup_teardown (lock_stats_contended_test,
+                                         lock_stats_setup,
+                                         lock_stats_teardown),
+#else
+        cmocka_unit_test_setup_teardown (lock_stats_disabled_test,
+                                         lock_stats_setup,
+                                         lock_stats_teardown),
+#endif
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -69,6 +69,175 @@ message_queue_enqueue_dequeue_test (void **state)
     g_object_unref (iostream);
 }
 
+/*
+ * try_dequeue must not block on an empty queue and must return queued
+ * objects like 'message_queue_dequeue'.
+ */
+static void
+message_queue_try_dequeue_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg_in;
+    GObject *obj_out;
+
+    assert_null (message_queue_try_dequeue (data->queue));
+    msg_in = control_message_new (CHECK_CANCEL);
+    message_queue_enqueue (data->queue, G_OBJECT (msg_in));
+    obj_out = message_queue_try_dequeue (data->queue);
+    assert_ptr_equal (obj_out, msg_in);
+    assert_null (message_queue_try_dequeue (data->queue));
+    g_object_unref (obj_out);
+    g_object_unref (msg_in);
+}
+/*
+ * timeout_dequeue must give up on an empty queue after the timeout and
+ * return queued objects like 'message_queue_dequeue'.
+ */
+static void
+message_queue_timeout_dequeue_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg_in;
+    GObject *obj_out;
+    gint64 start;
+
+    start = g_get_monotonic_time ();
+    assert_null (message_queue_timeout_dequeue (data->queue, 10000));
+    assert_true (g_get_monotonic_time () - start >= 10000);
+    msg_in = control_message_new (CHECK_CANCEL);
+    message_queue_enqueue (data->queue, G_OBJECT (msg_in));
+    obj_out = message_queue_timeout_dequeue (data->queue, 10000);
+    assert_ptr_equal (obj_out, msg_in);
+    assert_int_equal (message_queue_get_length (data->queue), 0);
+    g_object_unref (obj_out);
+    g_object_unref (msg_in);
+}
+
+static gboolean
+match_check_cancel (GObject  *obj,
+                    gpointer  user_data)
+{
+    UNUSED_PARAM (user_data);
+    return IS_CONTROL_MESSAGE (obj) &&
+        control_message_get_code (CONTROL_MESSAGE (obj)) == CHECK_CANCEL;
+}
+/*
+ * Remove the CHECK_CANCEL messages from a queue of three messages and make
+ * sure the remaining message is still there.
+ */
+static void
+message_queue_remove_matching_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *cancel0, *cancel1, *other;
+    GList *matched;
+    GObject *obj;
+
+    cancel0 = control_message_new (CHECK_CANCEL);
+    other = control_message_new (CONNECTION_REMOVED);
+    cancel1 = control_message_new (CHECK_CANCEL);
+    message_queue_enqueue (data->queue, G_OBJECT (cancel0));
+    message_queue_enqueue (data->queue, G_OBJECT (other));
+    message_queue_enqueue (data->queue, G_OBJECT (cancel1));
+    matched = message_queue_remove_matching (data->queue,
+                                             match_check_cancel,
+                                             NULL);
+    assert_int_equal (g_list_length (matched), 2);
+    assert_ptr_equal (g_list_nth_data (matched, 0), cancel0);
+    assert_ptr_equal (g_list_nth_data (matched, 1), cancel1);
+    obj = message_queue_try_dequeue (data->queue);
+    assert_ptr_equal (obj, other);
+    assert_null (message_queue_try_dequeue (data->queue));
+    g_list_free_full (matched, g_object_unref);
+    g_object_unref (obj);
+    g_object_unref (cancel0);
+    g_object_unref (cancel1);
+    g_object_unref (other);
+}
+/*
+ * Peeking returns the head of the queue in order without removing it.
+ */
+static void
+message_queue_peek_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg [3];
+    GList *peeked;
+    GObject *obj;
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS (msg); ++i) {
+        msg [i] = control_message_new (CHECK_CANCEL);
+        message_queue_enqueue (data->queue, G_OBJECT (msg [i]));
+    }
+    peeked = message_queue_peek (data->queue, 2);
+    assert_int_equal (g_list_length (peeked), 2);
+    assert_ptr_equal (g_list_nth_data (peeked, 0), msg [0]);
+    assert_ptr_equal (g_list_nth_data (peeked, 1), msg [1]);
+    g_list_free_full (peeked, g_object_unref);
+    for (i = 0; i < G_N_ELEMENTS (msg); ++i) {
+        obj = message_queue_try_dequeue (data->queue);
+        assert_ptr_equal (obj, msg [i]);
+        g_object_unref (obj);
+        g_object_unref (msg [i]);
+    }
+}
+/*
+ * The high water mark tracks the deepest the queue has been and doesn't
+ * drop when the queue drains.
+ */
+static void
+message_queue_high_water_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg = control_message_new (CHECK_CANCEL);
+    GObject *obj;
+    size_t i;
+
+    assert_int_equal (message_queue_get_high_water (data->queue), 0);
+    for (i = 0; i < 3; ++i) {
+        message_queue_enqueue (data->queue, G_OBJECT (msg));
+    }
+    assert_int_equal (message_queue_get_high_water (data->queue), 3);
+    for (i = 0; i < 3; ++i) {
+        obj = message_queue_try_dequeue (data->queue);
+        g_object_unref (obj);
+    }
+    message_queue_enqueue (data->queue, G_OBJECT (msg));
+    assert_int_equal (message_queue_get_high_water (data->queue), 3);
+    obj = message_queue_try_dequeue (data->queue);
+    g_object_unref (obj);
+    g_object_unref (msg);
+}
+/*
+ * The length follows enqueue, dequeue and remove_matching.
+ */
+static void
+message_queue_length_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg = control_message_new (CHECK_CANCEL);
+    GObject *obj;
+    GList *removed;
+    size_t i;
+
+    assert_int_equal (message_queue_get_length (data->queue), 0);
+    for (i = 0; i < 3; ++i) {
+        message_queue_enqueue (data->queue, G_OBJECT (msg));
+    }
+    assert_int_equal (message_queue_get_length (data->queue), 3);
+    obj = message_queue_dequeue (data->queue);
+    g_object_unref (obj);
+    assert_int_equal (message_queue_get_length (data->queue), 2);
+    removed = message_queue_remove_matching (data->queue,
+                                             match_check_cancel,
+                                             NULL);
+    assert_int_equal (g_list_length (removed), 2);
+    g_list_free_full (removed, g_object_unref);
+    assert_int_equal (message_queue_get_length (data->queue), 0);
+    g_object_unref (msg);
+}
+
 static void
 message_queue_dequeue_order_test (void **state)
 {
@@ -160,6 +329,24 @@ main(void)
         cmocka_unit_test_setup_teardown (message_queue_thread_unblock_test,
                                          message_queue_setup,
                                          message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_try_dequeue_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_timeout_dequeue_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_remove_matching_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_peek_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_high_water_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_length_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
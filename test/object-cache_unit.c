@@ -0,0 +1,242 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "object-cache.h"
+#include "util.h"
+
+#define MAX_ENTRIES 2
+#define RESPONSE_SIZE 16
+
+typedef struct {
+    ObjectCache  *cache;
+    uint8_t       response [RESPONSE_SIZE];
+    TPMS_CONTEXT  context;
+} test_data_t;
+
+static int
+object_cache_setup (void **state)
+{
+    test_data_t *data;
+    size_t i;
+
+    data = calloc (1, sizeof (test_data_t));
+    data->cache = object_cache_new (MAX_ENTRIES);
+    for (i = 0; i < RESPONSE_SIZE; ++i) {
+        data->response [i] = (uint8_t)i;
+    }
+    data->context.sequence = 0xdeadbeef;
+    data->context.savedHandle = 0x80000000;
+    data->context.hierarchy = TPM2_RH_OWNER;
+    *state = data;
+    return 0;
+}
+static int
+object_cache_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->cache);
+    free (data);
+    return 0;
+}
+static GBytes*
+key_new (guint32 value)
+{
+    return g_bytes_new (&value, sizeof (value));
+}
+static void
+cache_insert (test_data_t *data,
+              guint32      key_value,
+              TPM2_HANDLE  tag)
+{
+    GBytes *key = key_new (key_value);
+
+    object_cache_insert (data->cache,
+                         key,
+                         tag,
+                         data->response,
+                         sizeof (data->response),
+                         &data->context);
+    g_bytes_unref (key);
+}
+static gboolean
+cache_lookup (test_data_t  *data,
+              guint32       key_value,
+              GBytes      **response,
+              TPMS_CONTEXT *context)
+{
+    GBytes *key = key_new (key_value);
+    gboolean ret;
+
+    ret = object_cache_lookup (data->cache, key, response, context);
+    g_bytes_unref (key);
+    return ret;
+}
+static void
+object_cache_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_OBJECT_CACHE (data->cache));
+    assert_int_equal (object_cache_size (data->cache), 0);
+}
+/*
+ * A lookup after an insert returns copies of what was inserted.
+ */
+static void
+object_cache_insert_lookup_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GBytes *response = NULL;
+    TPMS_CONTEXT context = { 0 };
+    gsize size;
+    gconstpointer buf;
+
+    cache_insert (data, 1, TPM2_RH_OWNER);
+    assert_true (cache_lookup (data, 1, &response, &context));
+    buf = g_bytes_get_data (response, &size);
+    assert_int_equal (size, RESPONSE_SIZE);
+    assert_memory_equal (buf, data->response, RESPONSE_SIZE);
+    assert_memory_equal (&context, &data->context, sizeof (context));
+    assert_int_equal (data->cache->hits, 1);
+    g_bytes_unref (response);
+}
+static void
+object_cache_miss_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GBytes *response = NULL;
+    TPMS_CONTEXT context = { 0 };
+
+    cache_insert (data, 1, TPM2_RH_OWNER);
+    assert_false (cache_lookup (data, 2, &response, &context));
+    assert_null (response);
+    assert_int_equal (data->cache->misses, 1);
+}
+/*
+ * Once the cache is full the least recently used entry is evicted. Looking
+ * up the first entry makes the second the least recently used.
+ */
+static void
+object_cache_evict_lru_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GBytes *response = NULL;
+    TPMS_CONTEXT context = { 0 };
+
+    cache_insert (data, 1, TPM2_RH_OWNER);
+    cache_insert (data, 2, TPM2_RH_OWNER);
+    assert_true (cache_lookup (data, 1, &response, &context));
+    g_clear_pointer (&response, g_bytes_unref);
+    cache_insert (data, 3, TPM2_RH_OWNER);
+    assert_int_equal (object_cache_size (data->cache), MAX_ENTRIES);
+    assert_int_equal (data->cache->evictions, 1);
+    assert_false (cache_lookup (data, 2, &response, &context));
+    assert_true (cache_lookup (data, 1, &response, &context));
+    g_clear_pointer (&response, g_bytes_unref);
+    assert_true (cache_lookup (data, 3, &response, &context));
+    g_clear_pointer (&response, g_bytes_unref);
+}
+/*
+ * Inserting an existing key replaces the entry instead of adding another.
+ */
+static void
+object_cache_replace_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    cache_insert (data, 1, TPM2_RH_OWNER);
+    cache_insert (data, 1, TPM2_RH_OWNER);
+    assert_int_equal (object_cache_size (data->cache), 1);
+    assert_int_equal (data->cache->evictions, 0);
+}
+/*
+ * Invalidating a tag removes only the entries with that tag.
+ */
+static void
+object_cache_invalidate_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GBytes *response = NULL;
+    TPMS_CONTEXT context = { 0 };
+
+    cache_insert (data, 1, TPM2_RH_OWNER);
+    cache_insert (data, 2, TPM2_RH_ENDORSEMENT);
+    assert_int_equal (object_cache_invalidate (data->cache,
+                                               TPM2_RH_ENDORSEMENT), 1);
+    assert_false (cache_lookup (data, 2, &response, &context));
+    assert_true (cache_lookup (data, 1, &response, &context));
+    g_clear_pointer (&response, g_bytes_unref);
+    /* the freed LRU link must not be reused by the next insert */
+    cache_insert (data, 3, TPM2_RH_OWNER);
+    cache_insert (data, 4, TPM2_RH_OWNER);
+    assert_int_equal (object_cache_size (data->cache), MAX_ENTRIES);
+}
+static void
+object_cache_clear_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    cache_insert (data, 1, TPM2_RH_OWNER);
+    cache_insert (data, 2, TPM2_RH_ENDORSEMENT);
+    object_cache_clear (data->cache);
+    assert_int_equal (object_cache_size (data->cache), 0);
+    assert_int_equal (data->cache->invalidations, 2);
+}
+static void
+object_cache_get_stats_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    object_cache_stats_t stats = { 0 };
+    GBytes *response = NULL;
+    TPMS_CONTEXT context = { 0 };
+
+    cache_insert (data, 1, TPM2_RH_OWNER);
+    cache_insert (data, 2, 0x81000001);
+    assert_true (cache_lookup (data, 1, &response, &context));
+    g_clear_pointer (&response, g_bytes_unref);
+    assert_false (cache_lookup (data, 3, &response, &context));
+    object_cache_invalidate (data->cache, 0x81000001);
+    object_cache_get_stats (data->cache, &stats);
+    assert_int_equal (stats.size, 1);
+    assert_int_equal (stats.hits, 1);
+    assert_int_equal (stats.misses, 1);
+    assert_int_equal (stats.evictions, 0);
+    assert_int_equal (stats.invalidations, 1);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (object_cache_type_test,
+                                         object_cache_setup,
+                                         object_cache_teardown),
+        cmocka_unit_test_setup_teardown (object_cache_insert_lookup_test,
+                                         object_cache_setup,
+                                         object_cache_teardown),
+        cmocka_unit_test_setup_teardown (object_cache_miss_test,
+                                         object_cache_setup,
+                                         object_cache_teardown),
+        cmocka_unit_test_setup_teardown (object_cache_evict_lru_test,
+                                         object_cache_setup,
+                                         object_cache_teardown),
+        cmocka_unit_test_setup_teardown (object_cache_replace_test,
+                                         object_cache_setup,
+                                         object_cache_teardown),
+        cmocka_unit_test_setup_teardown (object_cache_invalidate_test,
+                                         object_cache_setup,
+                                         object_cache_teardown),
+        cmocka_unit_test_setup_teardown (object_cache_clear_test,
+                                         object_cache_setup,
+                                         object_cache_teardown),
+        cmocka_unit_test_setup_teardown (object_cache_get_stats_test,
+                                         object_cache_setup,
+                                         object_cache_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
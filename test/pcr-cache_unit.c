@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "pcr-cache.h"
+#include "util.h"
+
+#define MAX_AGE_MS 1000
+
+static uint8_t response [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static int
+pcr_cache_setup (void **state)
+{
+    *state = pcr_cache_new (MAX_AGE_MS);
+    return 0;
+}
+static int
+pcr_cache_setup_short (void **state)
+{
+    *state = pcr_cache_new (1);
+    return 0;
+}
+static int
+pcr_cache_teardown (void **state)
+{
+    PcrCache *cache = PCR_CACHE (*state);
+
+    g_clear_object (&cache);
+    return 0;
+}
+/*
+ * Create a key that looks like a TPML_PCR_SELECTION for a single bank. The
+ * content doesn't matter to the cache, only that it's distinct per 'pcr'.
+ */
+static GBytes*
+selection_new (guint8 pcr)
+{
+    uint8_t buf [] = { 0x00, 0x00, 0x00, 0x01, 0x00, 0x0b, 0x03,
+                       0x00, 0x00, 0x00 };
+
+    buf [7 + pcr / 8] = (uint8_t)(1 << (pcr % 8));
+    return g_bytes_new (buf, sizeof (buf));
+}
+static void
+pcr_cache_type_test (void **state)
+{
+    PcrCache *cache = PCR_CACHE (*state);
+
+    assert_true (IS_PCR_CACHE (cache));
+    assert_int_equal (pcr_cache_size (cache), 0);
+}
+static void
+pcr_cache_insert_lookup_test (void **state)
+{
+    PcrCache *cache = PCR_CACHE (*state);
+    GBytes *selection = selection_new (0), *other = selection_new (7);
+    GBytes *bytes;
+
+    pcr_cache_insert (cache, selection, response, sizeof (response));
+    bytes = pcr_cache_lookup (cache, selection);
+    assert_non_null (bytes);
+    assert_int_equal (g_bytes_get_size (bytes), sizeof (response));
+    assert_memory_equal (g_bytes_get_data (bytes, NULL),
+                         response,
+                         sizeof (response));
+    assert_null (pcr_cache_lookup (cache, other));
+    assert_int_equal (cache->hits, 1);
+    assert_int_equal (cache->misses, 1);
+    g_bytes_unref (bytes);
+    g_bytes_unref (selection);
+    g_bytes_unref (other);
+}
+static void
+pcr_cache_invalidate_test (void **state)
+{
+    PcrCache *cache = PCR_CACHE (*state);
+    GBytes *selection = selection_new (0);
+
+    pcr_cache_insert (cache, selection, response, sizeof (response));
+    pcr_cache_invalidate (cache);
+    assert_int_equal (pcr_cache_size (cache), 0);
+    assert_null (pcr_cache_lookup (cache, selection));
+    assert_int_equal (cache->invalidations, 1);
+    g_bytes_unref (selection);
+}
+/*
+ * Entries older than the max age are never returned.
+ */
+static void
+pcr_cache_expire_test (void **state)
+{
+    PcrCache *cache = PCR_CACHE (*state);
+    GBytes *selection = selection_new (0);
+
+    pcr_cache_insert (cache, selection, response, sizeof (response));
+    g_usleep (5 * G_TIME_SPAN_MILLISECOND);
+    assert_null (pcr_cache_lookup (cache, selection));
+    assert_int_equal (pcr_cache_size (cache), 0);
+    g_bytes_unref (selection);
+}
+/*
+ * Adding a new selection to a full cache drops everything else.
+ */
+static void
+pcr_cache_full_test (void **state)
+{
+    PcrCache *cache = PCR_CACHE (*state);
+    GBytes *selection;
+    guint8 i;
+
+    for (i = 0; i < PCR_CACHE_MAX_ENTRIES; ++i) {
+        selection = selection_new (i);
+        pcr_cache_insert (cache, selection, response, sizeof (response));
+        g_bytes_unref (selection);
+    }
+    assert_int_equal (pcr_cache_size (cache), PCR_CACHE_MAX_ENTRIES);
+    selection = selection_new (PCR_CACHE_MAX_ENTRIES);
+    pcr_cache_insert (cache, selection, response, sizeof (response));
+    g_bytes_unref (selection);
+    assert_int_equal (pcr_cache_size (cache), 1);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (pcr_cache_type_test,
+                                         pcr_cache_setup,
+                                         pcr_cache_teardown),
+        cmocka_unit_test_setup_teardown (pcr_cache_insert_lookup_test,
+                                         pcr_cache_setup,
+                                         pcr_cache_teardown),
+        cmocka_unit_test_setup_teardown (pcr_cache_invalidate_test,
+                                         pcr_cache_setup,
+                                         pcr_cache_teardown),
+        cmocka_unit_test_setup_teardown (pcr_cache_expire_test,
+                                         pcr_cache_setup_short,
+                                         pcr_cache_teardown),
+        cmocka_unit_test_setup_teardown (pcr_cache_full_test,
+                                         pcr_cache_setup,
+                                         pcr_cache_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "random-pool.h"
+#include "util.h"
+
+#define POOL_SIZE 64
+#define POOL_LOW_WATERMARK 16
+
+static int
+random_pool_setup (void **state)
+{
+    *state = random_pool_new (POOL_SIZE, POOL_LOW_WATERMARK);
+    return 0;
+}
+static int
+random_pool_teardown (void **state)
+{
+    RandomPool *pool = RANDOM_POOL (*state);
+
+    g_clear_object (&pool);
+    return 0;
+}
+/*
+ * Fill the pool to capacity with bytes counting up from 0.
+ */
+static void
+random_pool_fill (RandomPool *pool)
+{
+    uint8_t buf [POOL_SIZE];
+    size_t i;
+
+    for (i = 0; i < sizeof (buf); ++i) {
+        buf [i] = (uint8_t)i;
+    }
+    assert_int_equal (random_pool_add (pool, buf, sizeof (buf)), POOL_SIZE);
+}
+/*
+ * A new pool is empty and wants to be filled.
+ */
+static void
+random_pool_new_test (void **state)
+{
+    RandomPool *pool = RANDOM_POOL (*state);
+    uint8_t buf [1];
+
+    assert_true (IS_RANDOM_POOL (pool));
+    assert_int_equal (random_pool_level (pool), 0);
+    assert_int_equal (random_pool_refill_size (pool), POOL_SIZE);
+    assert_false (random_pool_take (pool, buf, sizeof (buf)));
+}
+/*
+ * Bytes taken from the pool are removed so they're never returned twice.
+ */
+static void
+random_pool_take_test (void **state)
+{
+    RandomPool *pool = RANDOM_POOL (*state);
+    uint8_t first [8], second [8];
+
+    random_pool_fill (pool);
+    assert_int_equal (random_pool_refill_size (pool), 0);
+    assert_true (random_pool_take (pool, first, sizeof (first)));
+    assert_true (random_pool_take (pool, second, sizeof (second)));
+    assert_memory_not_equal (first, second, sizeof (first));
+    assert_int_equal (random_pool_level (pool), POOL_SIZE - 16);
+}
+/*
+ * The pool isn't refilled until it drops below the low watermark, then it
+ * asks for enough to fill it completely.
+ */
+static void
+random_pool_watermark_test (void **state)
+{
+    RandomPool *pool = RANDOM_POOL (*state);
+    uint8_t buf [POOL_SIZE];
+
+    random_pool_fill (pool);
+    assert_true (random_pool_take (pool, buf, POOL_SIZE - POOL_LOW_WATERMARK));
+    assert_int_equal (random_pool_refill_size (pool), 0);
+    assert_true (random_pool_take (pool, buf, 1));
+    assert_int_equal (random_pool_refill_size (pool),
+                      POOL_SIZE - POOL_LOW_WATERMARK + 1);
+}
+/*
+ * A request larger than what's in the pool fails and leaves it untouched.
+ */
+static void
+random_pool_take_too_much_test (void **state)
+{
+    RandomPool *pool = RANDOM_POOL (*state);
+    uint8_t buf [POOL_SIZE + 1];
+
+    random_pool_fill (pool);
+    assert_false (random_pool_take (pool, buf, sizeof (buf)));
+    assert_int_equal (random_pool_level (pool), POOL_SIZE);
+}
+static void
+random_pool_stats_test (void **state)
+{
+    RandomPool *pool = RANDOM_POOL (*state);
+    random_pool_stats_t stats = { 0 };
+    uint8_t buf [4];
+
+    random_pool_fill (pool);
+    assert_true (random_pool_take (pool, buf, sizeof (buf)));
+    assert_true (random_pool_take (pool, buf, sizeof (buf)));
+    random_pool_get_stats (pool, &stats);
+    assert_int_equal (stats.served, 2);
+    assert_int_equal (stats.served_bytes, 8);
+    assert_int_equal (stats.refills, 1);
+    assert_int_equal (stats.refill_bytes, POOL_SIZE);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (random_pool_new_test,
+                                         random_pool_setup,
+                                         random_pool_teardown),
+        cmocka_unit_test_setup_teardown (random_pool_take_test,
+                                         random_pool_setup,
+                                         random_pool_teardown),
+        cmocka_unit_test_setup_teardown (random_pool_watermark_test,
+                                         random_pool_setup,
+                                         random_pool_teardown),
+        cmocka_unit_test_setup_teardown (random_pool_take_too_much_test,
+                                         random_pool_setup,
+                                         random_pool_teardown),
+        cmocka_unit_test_setup_teardown (random_pool_stats_test,
+                                         random_pool_setup,
+                                         random_pool_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -15,6 +15,7 @@
 
 #include <tss2/tss2_mu.h>
 
+#include "control-message.h"
 #include "resource-manager.h"
 #include "sink-interface.h"
 #include "source-interface.h"
@@ -108,6 +109,41 @@ __wrap_access_broker_context_load (AccessBroker *access_broker,
 
     return rc;
 }
+/*
+ * Wrap IncrementalSelfTest. The algorithm being tested (TPM2_ALG_NULL for
+ * the toDoList query) is checked against the value expected by the test.
+ * Pops the RC and a TPML_ALG* for the toDoList, NULL for an empty one.
+ */
+TSS2_RC
+__wrap_access_broker_incremental_self_test (AccessBroker *broker,
+                                            TPML_ALG     *to_test,
+                                            TPML_ALG     *to_do_list)
+{
+    TPM2_ALG_ID alg;
+    TSS2_RC rc;
+    TPML_ALG *to_do;
+    UNUSED_PARAM(broker);
+
+    alg = to_test->count > 0 ? to_test->algorithms [0] : TPM2_ALG_NULL;
+    check_expected (alg);
+    rc = mock_type (TSS2_RC);
+    to_do = mock_ptr_type (TPML_ALG*);
+    if (to_do != NULL) {
+        *to_do_list = *to_do;
+    } else {
+        to_do_list->count = 0;
+    }
+    return rc;
+}
+TSS2_RC
+__wrap_access_broker_get_test_result (AccessBroker *broker,
+                                      TPM2_RC      *test_result)
+{
+    UNUSED_PARAM(broker);
+
+    *test_result = mock_type (TPM2_RC);
+    return TSS2_RC_SUCCESS;
+}
 static int
 resource_manager_setup (void **state)
 {
@@ -234,6 +270,32 @@ resource_manager_sink_enqueue_test (void **state)
     assert_int_equal (data->command, command_out);
     assert_int_equal (1, 1);
 }
+/*
+ * A command waiting in the in_queue shows up in the queue depth of the
+ * stats snapshot but isn't counted as processed.
+ */
+static void
+resource_manager_get_stats_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    resource_manager_stats_t stats;
+    GObject *obj;
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (data->command));
+    resource_manager_get_stats (data->resource_manager, &stats);
+    assert_int_equal (stats.commands, 0);
+    assert_int_equal (stats.queue_depth, 1);
+    assert_int_equal (stats.queue_high_water, 1);
+    assert_int_equal (stats.tpm_busy_us, 0);
+
+    obj = message_queue_dequeue (data->resource_manager->in_queue);
+    g_object_unref (obj);
+    resource_manager_get_stats (data->resource_manager, &stats);
+    assert_int_equal (stats.queue_depth, 0);
+}
 /**
  * A test: exercise the resource_manager_process_tpm2_command function.
  * This function is normally invoked by the ResourceManager internal
@@ -273,6 +335,167 @@ resource_manager_process_tpm2_command_success_test (void **state)
     assert_int_equal (data->response, response);
     g_object_unref (response);
 }
+/*
+ * A stateless command is sent straight to the AccessBroker and the response
+ * goes straight to the sink. Any call to the context save / load wrappers
+ * would fail the test since none are expected.
+ */
+static void
+resource_manager_process_stateless_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    tpm2_command_set_stateless (data->command, TRUE);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+
+    will_return (__wrap_access_broker_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    g_object_unref (response);
+}
+/*
+ * Helpers for the coalescing tests: a header only command with no handles
+ * or sessions, and a connection with the client end of its socket closed.
+ */
+static Tpm2Command*
+coalesce_command_new (Connection *connection,
+                      TPM2_CC     code)
+{
+    Tpm2Command *command;
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    tpm2_header_init (buffer, TPM_HEADER_SIZE, TPM2_ST_NO_SESSIONS,
+                      TPM_HEADER_SIZE, code);
+    command = tpm2_command_new (connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    tpm2_command_set_stateless (command, TRUE);
+    return command;
+}
+static Connection*
+coalesce_connection_new (void)
+{
+    Connection *connection;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    gint client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 10, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    close (client_fd);
+    return connection;
+}
+static void
+coalesce_codes_set (ResourceManager *resmgr)
+{
+    GHashTable *codes = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    g_hash_table_add (codes, GUINT_TO_POINTER (TPM2_CC_PCR_Read));
+    g_hash_table_add (codes, GUINT_TO_POINTER (TPM2_CC_GetRandom));
+    g_object_set (resmgr, "coalesce-codes", codes, NULL);
+    g_hash_table_unref (codes);
+}
+/*
+ * Send our PCR_Read to the TPM and check which of the queued commands get
+ * a copy of the response.
+ */
+static void
+coalesce_process (test_data_t *data,
+                  guint        answered)
+{
+    data->command = coalesce_command_new (data->connection, TPM2_CC_PCR_Read);
+    will_return (__wrap_access_broker_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_send_command,
+                 tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS));
+    will_return_count (__wrap_sink_enqueue, data, answered + 1);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->resource_manager->coalesced, answered);
+}
+static void
+coalesce_assert_next (ResourceManager *resmgr,
+                      Tpm2Command     *expected)
+{
+    GObject *obj = message_queue_try_dequeue (resmgr->in_queue);
+
+    assert_ptr_equal (obj, expected);
+    g_object_unref (obj);
+}
+/*
+ * A PCR_Read queued behind a PCR_Extend from another connection must see
+ * the extended value: it's left in the queue rather than answered with
+ * the response to the PCR_Read executed before the extend.
+ */
+static void
+resource_manager_coalesce_stop_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    Connection *conn_b, *conn_c;
+    Tpm2Command *extend, *read;
+
+    coalesce_codes_set (resmgr);
+    conn_b = coalesce_connection_new ();
+    conn_c = coalesce_connection_new ();
+    extend = coalesce_command_new (conn_c, TPM2_CC_PCR_Extend);
+    read = coalesce_command_new (conn_b, TPM2_CC_PCR_Read);
+    resource_manager_enqueue (SINK (resmgr), G_OBJECT (extend));
+    resource_manager_enqueue (SINK (resmgr), G_OBJECT (read));
+
+    coalesce_process (data, 0);
+    coalesce_assert_next (resmgr, extend);
+    coalesce_assert_next (resmgr, read);
+    assert_null (message_queue_try_dequeue (resmgr->in_queue));
+
+    g_object_unref (extend);
+    g_object_unref (read);
+    g_object_unref (conn_b);
+    g_object_unref (conn_c);
+}
+/*
+ * A connection with a GetRandom queued ahead of its PCR_Read must get the
+ * responses in order, so only the PCR_Read from the other connection is
+ * answered early.
+ */
+static void
+resource_manager_coalesce_pipeline_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    Connection *conn_b, *conn_d;
+    Tpm2Command *random_b, *read_b, *read_d;
+
+    coalesce_codes_set (resmgr);
+    conn_b = coalesce_connection_new ();
+    conn_d = coalesce_connection_new ();
+    random_b = coalesce_command_new (conn_b, TPM2_CC_GetRandom);
+    read_b = coalesce_command_new (conn_b, TPM2_CC_PCR_Read);
+    read_d = coalesce_command_new (conn_d, TPM2_CC_PCR_Read);
+    resource_manager_enqueue (SINK (resmgr), G_OBJECT (random_b));
+    resource_manager_enqueue (SINK (resmgr), G_OBJECT (read_b));
+    resource_manager_enqueue (SINK (resmgr), G_OBJECT (read_d));
+
+    coalesce_process (data, 1);
+    coalesce_assert_next (resmgr, random_b);
+    coalesce_assert_next (resmgr, read_b);
+    assert_null (message_queue_try_dequeue (resmgr->in_queue));
+
+    g_object_unref (random_b);
+    g_object_unref (read_b);
+    g_object_unref (read_d);
+    g_object_unref (conn_b);
+    g_object_unref (conn_d);
+}
 static void
 resource_manager_flushsave_context_test (void **state)
 {
@@ -495,6 +718,413 @@ resource_manager_getcap_gap_max_test (void **state)
     /* verify property was modified by the RM */
     assert_int_equal (cap_data.data.tpmProperties.tpmProperty [0].value, UINT32_MAX);
 }
+/*
+ * On session memory pressure the RM saves the least recently used loaded
+ * session of another connection. The sessions of the connection that needs
+ * the slot are left loaded.
+ */
+static void
+resource_manager_evict_session_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    SessionList *session_list = data->resource_manager->session_list;
+    SessionEntry *own, *other_old, *other_new;
+    Connection *other;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Tpm2Response *response;
+    TPMS_CONTEXT context = {
+        .sequence = 1,
+        .savedHandle = TPM2_HMAC_SESSION_FIRST + 1,
+        .hierarchy = TPM2_RH_NULL,
+    };
+    guint8 *buffer;
+    size_t offset = TPM_HEADER_SIZE;
+    gint client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    other = connection_new (iostream, 11, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    own = session_entry_new (data->connection, TPM2_HMAC_SESSION_FIRST);
+    other_old = session_entry_new (other, TPM2_HMAC_SESSION_FIRST + 1);
+    other_new = session_entry_new (other, TPM2_HMAC_SESSION_FIRST + 2);
+    session_entry_set_state (own, SESSION_ENTRY_LOADED);
+    session_entry_set_state (other_old, SESSION_ENTRY_LOADED);
+    other_old->last_used = 1;
+    session_entry_set_state (other_new, SESSION_ENTRY_LOADED);
+    own->last_used = 0;
+    session_list_insert (session_list, own);
+    session_list_insert (session_list, other_old);
+    session_list_insert (session_list, other_new);
+
+    buffer = calloc (1, TPM_HEADER_SIZE + sizeof (TPMS_CONTEXT));
+    Tss2_MU_TPMS_CONTEXT_Marshal (&context,
+                                  buffer,
+                                  TPM_HEADER_SIZE + sizeof (TPMS_CONTEXT),
+                                  &offset);
+    set_response_tag (buffer, TPM2_ST_NO_SESSIONS);
+    set_response_size (buffer, offset);
+    set_response_code (buffer, TSS2_RC_SUCCESS);
+    response = tpm2_response_new (data->connection, buffer, offset, 0);
+    will_return (__wrap_access_broker_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_send_command, response);
+
+    assert_true (resource_manager_evict_session (data->resource_manager,
+                                                 data->connection));
+    assert_int_equal (session_entry_get_state (other_old),
+                      SESSION_ENTRY_SAVED_RM);
+    assert_int_equal (session_entry_get_state (other_new),
+                      SESSION_ENTRY_LOADED);
+    assert_int_equal (session_entry_get_state (own), SESSION_ENTRY_LOADED);
+    assert_int_equal (data->resource_manager->sessions_evicted, 1);
+
+    /* with other_new gone and other_old saved only our own session is left */
+    session_list_remove (session_list, other_new);
+    assert_false (resource_manager_evict_session (data->resource_manager,
+                                                  data->connection));
+
+    session_list_remove (session_list, own);
+    session_list_remove (session_list, other_old);
+    g_object_unref (own);
+    g_object_unref (other_old);
+    g_object_unref (other_new);
+    g_object_unref (other);
+    close (client_fd);
+}
+/*
+ * A command still in the in_queue when the connection cancels is removed
+ * from the queue and answered without going to the TPM.
+ */
+static void
+resource_manager_cancel_queued_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (data->command));
+
+    will_return (__wrap_sink_enqueue, data);
+    assert_int_equal (resource_manager_cancel (data->resource_manager,
+                                               data->connection),
+                      TSS2_RC_SUCCESS);
+    assert_non_null (data->response);
+    assert_int_equal (data->resource_manager->canceled, 1);
+    assert_null (message_queue_try_dequeue (data->resource_manager->in_queue));
+}
+/*
+ * A cancel that arrives after the RM thread has picked up the command but
+ * before it's sent to the TPM stops it from being sent.
+ */
+static void
+resource_manager_cancel_pending_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    tpm2_command_set_stateless (data->command, TRUE);
+    resmgr->current = data->connection;
+
+    assert_int_equal (resource_manager_cancel (resmgr, data->connection),
+                      TSS2_RC_SUCCESS);
+    assert_true (resmgr->cancel_pending);
+    /* no will_return for access_broker_send_command: it must not be called */
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (resmgr, data->command);
+    assert_false (resmgr->cancel_pending);
+    assert_int_equal (resmgr->canceled, 1);
+    resmgr->current = NULL;
+}
+/*
+ * A cancel for the command executing in the TPM is passed to the
+ * AccessBroker, other connections' commands are left alone. Leaving the
+ * TPM drops a cancel that came too late.
+ */
+static void
+resource_manager_cancel_in_tpm_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Connection *other;
+    Tpm2Response *response;
+    guint8 *buffer;
+    gint client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    other = connection_new (iostream, 11, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    resmgr->current = data->connection;
+    resmgr->current_in_tpm = TRUE;
+    assert_int_equal (resource_manager_cancel (resmgr, other),
+                      TSS2_RC_SUCCESS);
+    assert_false (data->access_broker->cancel_requested);
+    assert_int_equal (resource_manager_cancel (resmgr, data->connection),
+                      TSS2_RC_SUCCESS);
+    assert_true (data->access_broker->cancel_requested);
+    assert_false (resmgr->cancel_pending);
+
+    /* the command it was meant for is done, the next one mustn't get it */
+    resmgr->current_in_tpm = FALSE;
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    tpm2_command_set_stateless (data->command, TRUE);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_access_broker_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (resmgr, data->command);
+    assert_false (data->access_broker->cancel_requested);
+    assert_false (resmgr->current_in_tpm);
+    g_object_unref (response);
+
+    data->access_broker->cancel_unsupported = TRUE;
+    resmgr->current_in_tpm = TRUE;
+    assert_int_equal (resource_manager_cancel (resmgr, data->connection),
+                      TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    resmgr->current = NULL;
+    resmgr->current_in_tpm = FALSE;
+
+    g_object_unref (other);
+    close (client_fd);
+}
+/*
+ * Commands queued by a connection that's gone are dropped when the
+ * CONNECTION_REMOVED message is enqueued behind them.
+ */
+static void
+resource_manager_purge_removed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ControlMessage *msg;
+    GObject *obj;
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (data->command));
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (data->connection));
+    resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (msg));
+
+    obj = message_queue_try_dequeue (data->resource_manager->in_queue);
+    assert_ptr_equal (obj, msg);
+    assert_null (message_queue_try_dequeue (data->resource_manager->in_queue));
+    assert_int_equal (data->resource_manager->purged, 1);
+    g_object_unref (obj);
+    g_object_unref (msg);
+}
+/*
+ * A command the TPM answers with TPM2_RC_RETRY waits in the retry_queue
+ * while commands from other connections are processed, and is sent again
+ * from a timer when running inline.
+ */
+static void
+resource_manager_retry_deferred_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    resource_manager_stats_t stats;
+    RetryPolicy *retry_policy;
+    Connection *other;
+    Tpm2Command *command;
+    Tpm2Response *response;
+    guint8 *buffer;
+
+    retry_policy = retry_policy_new (1000);
+    g_object_set (resmgr, "retry-policy", retry_policy, NULL);
+    g_object_unref (retry_policy);
+    thread_set_inline (THREAD (resmgr), TRUE);
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    tpm2_command_set_stateless (data->command, TRUE);
+    will_return (__wrap_access_broker_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_send_command,
+                 tpm2_response_new_rc (data->connection, TPM2_RC_RETRY));
+    resource_manager_enqueue (SINK (resmgr), G_OBJECT (data->command));
+    assert_int_equal (g_queue_get_length (&resmgr->retry_queue), 1);
+    assert_non_null (resmgr->retry_source);
+
+    /* another connection isn't held up by the retry */
+    other = coalesce_connection_new ();
+    command = coalesce_command_new (other, TPM2_CC_GetRandom);
+    response = tpm2_response_new_rc (other, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_access_broker_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_enqueue (SINK (resmgr), G_OBJECT (command));
+    assert_ptr_equal (data->response, response);
+    assert_int_equal (g_queue_get_length (&resmgr->retry_queue), 1);
+    g_object_unref (response);
+    g_object_unref (command);
+    g_object_unref (other);
+
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_access_broker_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    while (resmgr->retry_source != NULL) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    assert_ptr_equal (data->response, response);
+    assert_int_equal (g_queue_get_length (&resmgr->retry_queue), 0);
+    g_object_unref (response);
+
+    resource_manager_get_stats (resmgr, &stats);
+    assert_int_equal (stats.retried, 1);
+    assert_int_equal (stats.retries, 1);
+    assert_int_equal (stats.retries_exhausted, 0);
+}
+/*
+ * Give the ResourceManager a SelfTest for the 'count' algorithms in 'algs'.
+ */
+static SelfTest*
+self_test_setup (test_data_t       *data,
+                 const TPM2_ALG_ID *algs,
+                 guint              count)
+{
+    SelfTest *self_test;
+
+    self_test = self_test_new (algs, count);
+    g_object_set (data->resource_manager, "self-test", self_test, NULL);
+    g_object_unref (self_test);
+    return self_test;
+}
+/*
+ * The TPM answers TPM2_RC_TESTING when asked to test an algorithm while
+ * it's still busy. The algorithm must be tested again once the back off
+ * is over, and the ResourceManager must not use the TPM before then.
+ */
+static void
+resource_manager_self_test_testing_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2_ALG_ID algs [] = { TPM2_ALG_SHA256, TPM2_ALG_AES };
+    TPML_ALG to_do = {
+        .count = 3,
+        .algorithms = { TPM2_ALG_SHA256, TPM2_ALG_AES, TPM2_ALG_RSA },
+    };
+    TPML_ALG to_do_aes = {
+        .count = 2,
+        .algorithms = { TPM2_ALG_AES, TPM2_ALG_RSA },
+    };
+    TPML_ALG to_do_rsa = {
+        .count = 1,
+        .algorithms = { TPM2_ALG_RSA },
+    };
+    SelfTest *self_test;
+
+    self_test = self_test_setup (data, algs, 2);
+    expect_value (__wrap_access_broker_incremental_self_test, alg,
+                  TPM2_ALG_NULL);
+    will_return (__wrap_access_broker_incremental_self_test, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_incremental_self_test, &to_do);
+    assert_true (resource_manager_idle (data->resource_manager));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_RUN);
+
+    expect_value (__wrap_access_broker_incremental_self_test, alg,
+                  TPM2_ALG_SHA256);
+    will_return (__wrap_access_broker_incremental_self_test, TPM2_RC_TESTING);
+    will_return (__wrap_access_broker_incremental_self_test, NULL);
+    assert_true (resource_manager_idle (data->resource_manager));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_RUN);
+    /* backing off: the TPM isn't used */
+    assert_true (self_test_get_retry_at (self_test) > g_get_monotonic_time ());
+    assert_false (resource_manager_idle (data->resource_manager));
+
+    self_test->retry_at = 0;
+    expect_value (__wrap_access_broker_incremental_self_test, alg,
+                  TPM2_ALG_SHA256);
+    will_return (__wrap_access_broker_incremental_self_test, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_incremental_self_test, &to_do_aes);
+    assert_true (resource_manager_idle (data->resource_manager));
+    expect_value (__wrap_access_broker_incremental_self_test, alg,
+                  TPM2_ALG_AES);
+    will_return (__wrap_access_broker_incremental_self_test, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_incremental_self_test, &to_do_rsa);
+    assert_true (resource_manager_idle (data->resource_manager));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_RESULT);
+    assert_int_equal (self_test->tests, 2);
+
+    /* tests still running in the background: not done yet */
+    will_return (__wrap_access_broker_get_test_result, TPM2_RC_TESTING);
+    assert_true (resource_manager_idle (data->resource_manager));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_RESULT);
+    assert_false (resource_manager_idle (data->resource_manager));
+
+    self_test->retry_at = 0;
+    will_return (__wrap_access_broker_get_test_result, TPM2_RC_SUCCESS);
+    assert_true (resource_manager_idle (data->resource_manager));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_DONE);
+    assert_int_equal (self_test_get_result (self_test), TPM2_RC_SUCCESS);
+    assert_false (resource_manager_idle (data->resource_manager));
+}
+/*
+ * GetTestResult answers TPM2_RC_NEEDS_TEST while any algorithm is
+ * untested, including those we weren't configured to test. That's a pass
+ * when none of ours are left in the toDoList. When some are, the toDoList
+ * is queried again.
+ */
+static void
+resource_manager_self_test_needs_test_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2_ALG_ID algs [] = { TPM2_ALG_SHA256 };
+    TPML_ALG to_do_ours = {
+        .count = 2,
+        .algorithms = { TPM2_ALG_SHA256, TPM2_ALG_RSA },
+    };
+    TPML_ALG to_do_other = {
+        .count = 1,
+        .algorithms = { TPM2_ALG_RSA },
+    };
+    SelfTest *self_test;
+
+    self_test = self_test_setup (data, algs, 1);
+    expect_value (__wrap_access_broker_incremental_self_test, alg,
+                  TPM2_ALG_NULL);
+    will_return (__wrap_access_broker_incremental_self_test, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_incremental_self_test, &to_do_ours);
+    assert_true (resource_manager_idle (data->resource_manager));
+    expect_value (__wrap_access_broker_incremental_self_test, alg,
+                  TPM2_ALG_SHA256);
+    will_return (__wrap_access_broker_incremental_self_test, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_incremental_self_test, &to_do_ours);
+    assert_true (resource_manager_idle (data->resource_manager));
+    /* SHA256 was started but is still in the toDoList */
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_RESULT);
+    will_return (__wrap_access_broker_get_test_result, TPM2_RC_NEEDS_TEST);
+    assert_true (resource_manager_idle (data->resource_manager));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_QUERY);
+    assert_false (resource_manager_idle (data->resource_manager));
+
+    /* only RSA, which we weren't asked to test, is left */
+    self_test->retry_at = 0;
+    expect_value (__wrap_access_broker_incremental_self_test, alg,
+                  TPM2_ALG_NULL);
+    will_return (__wrap_access_broker_incremental_self_test, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_incremental_self_test, &to_do_other);
+    assert_true (resource_manager_idle (data->resource_manager));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_RESULT);
+    will_return (__wrap_access_broker_get_test_result, TPM2_RC_NEEDS_TEST);
+    assert_true (resource_manager_idle (data->resource_manager));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_DONE);
+    assert_int_equal (self_test_get_result (self_test), TPM2_RC_SUCCESS);
+}
 int
 main (void)
 {
@@ -505,9 +1135,21 @@ main (void)
         cmocka_unit_test_setup_teardown (resource_manager_sink_enqueue_test,
                                          resource_manager_setup,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_get_stats_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
         cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_success_test,
                                          resource_manager_setup,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_stateless_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_coalesce_stop_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_coalesce_pipeline_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
         cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_test,
                                          resource_manager_setup,
                                          resource_manager_teardown),
@@ -523,6 +1165,30 @@ main (void)
         cmocka_unit_test_setup_teardown (resource_manager_getcap_gap_max_test,
                                          resource_manager_setup_getcap,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_session_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_cancel_queued_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_cancel_pending_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_cancel_in_tpm_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_purge_removed_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_retry_deferred_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_self_test_testing_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_self_test_needs_test_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
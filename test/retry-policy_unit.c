@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "retry-policy.h"
+#include "util.h"
+
+static void
+retry_policy_type_test (void **state)
+{
+    UNUSED_PARAM (state);
+    RetryPolicy *policy = retry_policy_new (100);
+
+    assert_true (IS_RETRY_POLICY (policy));
+    assert_int_equal (retry_policy_get_budget (policy, TPM2_CC_Sign), 100);
+    g_object_unref (policy);
+}
+/*
+ * Per command code budgets override the default, including a budget of 0.
+ */
+static void
+retry_policy_set_budget_test (void **state)
+{
+    UNUSED_PARAM (state);
+    RetryPolicy *policy = retry_policy_new (100);
+
+    retry_policy_set_budget (policy, TPM2_CC_CreatePrimary, 2000);
+    retry_policy_set_budget (policy, TPM2_CC_Sign, 0);
+    assert_int_equal (retry_policy_get_budget (policy, TPM2_CC_CreatePrimary),
+                      2000);
+    assert_int_equal (retry_policy_get_budget (policy, TPM2_CC_Sign), 0);
+    assert_int_equal (retry_policy_get_budget (policy, TPM2_CC_Load), 100);
+    g_object_unref (policy);
+}
+static void
+retry_policy_parse_test (void **state)
+{
+    UNUSED_PARAM (state);
+    RetryPolicy *policy = retry_policy_parse ("0x131:2000,250");
+
+    assert_non_null (policy);
+    assert_int_equal (retry_policy_get_budget (policy, TPM2_CC_CreatePrimary),
+                      2000);
+    assert_int_equal (retry_policy_get_budget (policy, TPM2_CC_Load), 250);
+    g_object_unref (policy);
+}
+static void
+retry_policy_parse_fail_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_null (retry_policy_parse ("bogus"));
+    assert_null (retry_policy_parse ("250,0x131"));
+    assert_null (retry_policy_parse ("250,0x131:bogus"));
+    assert_null (retry_policy_parse ("1000000"));
+}
+static void
+retry_policy_rc_is_retryable_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_true (retry_policy_rc_is_retryable (TPM2_RC_RETRY));
+    assert_true (retry_policy_rc_is_retryable (TPM2_RC_YIELDED));
+    assert_true (retry_policy_rc_is_retryable (TPM2_RC_TESTING));
+    assert_false (retry_policy_rc_is_retryable (TPM2_RC_SUCCESS));
+    assert_false (retry_policy_rc_is_retryable (TPM2_RC_CONTEXT_GAP));
+}
+/*
+ * The delay starts at the minimum, doubles and is capped at the maximum.
+ */
+static void
+retry_policy_next_delay_test (void **state)
+{
+    UNUSED_PARAM (state);
+    gulong delay;
+
+    delay = retry_policy_next_delay (0);
+    assert_int_equal (delay, RETRY_POLICY_DELAY_MIN_US);
+    delay = retry_policy_next_delay (delay);
+    assert_int_equal (delay, RETRY_POLICY_DELAY_MIN_US * 2);
+    assert_int_equal (retry_policy_next_delay (RETRY_POLICY_DELAY_MAX_US),
+                      RETRY_POLICY_DELAY_MAX_US);
+}
+static void
+retry_policy_stats_test (void **state)
+{
+    UNUSED_PARAM (state);
+    RetryPolicy *policy = retry_policy_new (100);
+    retry_policy_stats_t stats = { 0 };
+
+    retry_policy_record (policy, 0, FALSE);
+    retry_policy_record (policy, 3, FALSE);
+    retry_policy_record (policy, 2, TRUE);
+    retry_policy_get_stats (policy, &stats);
+    assert_int_equal (stats.retried, 2);
+    assert_int_equal (stats.retries, 5);
+    assert_int_equal (stats.exhausted, 1);
+    g_object_unref (policy);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (retry_policy_type_test),
+        cmocka_unit_test (retry_policy_set_budget_test),
+        cmocka_unit_test (retry_policy_parse_test),
+        cmocka_unit_test (retry_policy_parse_fail_test),
+        cmocka_unit_test (retry_policy_rc_is_retryable_test),
+        cmocka_unit_test (retry_policy_next_delay_test),
+        cmocka_unit_test (retry_policy_stats_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
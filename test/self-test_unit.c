@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "self-test.h"
+#include "util.h"
+
+static void
+self_test_type_test (void **state)
+{
+    UNUSED_PARAM (state);
+    SelfTest *self_test = self_test_new (NULL, 0);
+
+    assert_true (IS_SELF_TEST (self_test));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_QUERY);
+    g_object_unref (self_test);
+}
+static void
+self_test_parse_test (void **state)
+{
+    UNUSED_PARAM (state);
+    SelfTest *self_test = self_test_parse ("sha256,RSA,0x6");
+
+    assert_non_null (self_test);
+    assert_int_equal (self_test->algs->len, 3);
+    assert_int_equal (g_array_index (self_test->algs, TPM2_ALG_ID, 0),
+                      TPM2_ALG_SHA256);
+    assert_int_equal (g_array_index (self_test->algs, TPM2_ALG_ID, 1),
+                      TPM2_ALG_RSA);
+    assert_int_equal (g_array_index (self_test->algs, TPM2_ALG_ID, 2),
+                      TPM2_ALG_AES);
+    g_object_unref (self_test);
+
+    self_test = self_test_parse ("all");
+    assert_non_null (self_test);
+    assert_int_equal (self_test->algs->len, 0);
+    g_object_unref (self_test);
+}
+static void
+self_test_parse_fail_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_null (self_test_parse ("bogus"));
+    assert_null (self_test_parse ("sha256,"));
+    assert_null (self_test_parse ("0x10000"));
+}
+/*
+ * Only the configured algorithms from the toDoList are tested, each one
+ * once per round, and the round ends with reading the result.
+ */
+static void
+self_test_round_test (void **state)
+{
+    UNUSED_PARAM (state);
+    TPM2_ALG_ID algs [] = { TPM2_ALG_SHA256, TPM2_ALG_RSA };
+    SelfTest *self_test = self_test_new (algs, G_N_ELEMENTS (algs));
+    TPML_ALG to_do = {
+        .count = 3,
+        .algorithms = { TPM2_ALG_SHA1, TPM2_ALG_SHA256, TPM2_ALG_RSA },
+    };
+    TPM2_ALG_ID alg;
+
+    self_test_set_to_do (self_test, &to_do);
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_RUN);
+    assert_true (self_test_next (self_test, &alg));
+    assert_int_equal (alg, TPM2_ALG_SHA256);
+    /* the TPM is still testing SHA256 in the background */
+    self_test_set_to_do (self_test, &to_do);
+    assert_true (self_test_next (self_test, &alg));
+    assert_int_equal (alg, TPM2_ALG_RSA);
+    assert_false (self_test_next (self_test, &alg));
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_RESULT);
+    self_test_set_result (self_test, TPM2_RC_SUCCESS);
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_DONE);
+    assert_int_equal (self_test->tests, 2);
+    assert_int_equal (self_test->rounds, 1);
+
+    self_test_reset (self_test);
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_QUERY);
+    g_object_unref (self_test);
+}
+static void
+self_test_nothing_to_do_test (void **state)
+{
+    UNUSED_PARAM (state);
+    SelfTest *self_test = self_test_new (NULL, 0);
+    TPML_ALG to_do = { .count = 0, };
+
+    self_test_set_to_do (self_test, &to_do);
+    assert_int_equal (self_test_get_state (self_test), SELF_TEST_RESULT);
+    self_test_set_result (self_test, TPM2_RC_FAILURE);
+    assert_int_equal (self_test_get_result (self_test), TPM2_RC_FAILURE);
+    g_object_unref (self_test);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (self_test_type_test),
+        cmocka_unit_test (self_test_parse_test),
+        cmocka_unit_test (self_test_parse_fail_test),
+        cmocka_unit_test (self_test_round_test),
+        cmocka_unit_test (self_test_nothing_to_do_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
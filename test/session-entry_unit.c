@@ -108,6 +108,24 @@ session_entry_get_handle_test (void **state)
     assert_int_equal (handle, TEST_HANDLE);
 }
 
+/*
+ * The sequence is unmarshalled from the start of the TPMS_CONTEXT blob.
+ */
+static void
+session_entry_get_sequence_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t buf [] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, /* sequence */
+        0x02, 0x00, 0x00, 0x00, /* savedHandle */
+    };
+
+    assert_int_equal (session_entry_get_sequence (data->session_entry), 0);
+    session_entry_set_context (data->session_entry, buf, sizeof (buf));
+    assert_int_equal (session_entry_get_sequence (data->session_entry),
+                      0x102);
+}
+
 gint
 main (void)
 {
@@ -124,6 +142,9 @@ main (void)
         cmocka_unit_test_setup_teardown (session_entry_get_handle_test,
                                          session_entry_setup,
                                          session_entry_teardown),
+        cmocka_unit_test_setup_teardown (session_entry_get_sequence_test,
+                                         session_entry_setup,
+                                         session_entry_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -0,0 +1,25 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Replay the sample workloads through the ResourceManager simulation
+# under every RM policy. The gap is kept small so that sessions sitting
+# saved while other sessions are used have to be regapped. Run from the
+# build directory by 'make check'.
+#
+# Exit codes follow the automake test harness: 77 to skip, 99 for a hard
+# error.
+
+SIM=test/sim/rm-sim
+if [ ! -x "${SIM}" ]; then
+    echo "simulation binary not found: ${SIM}"
+    exit 99
+fi
+
+ret=0
+for workload in "${srcdir:-.}"/test/sim/workloads/*.txt; do
+    if ! "${SIM}" --workload="${workload}" --gap-max=8; then
+        echo "replay failed: ${workload}"
+        ret=1
+    fi
+done
+exit ${ret}
@@ -0,0 +1,708 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Discrete-event simulation of the ResourceManager. A workload (generated
+ * from a seed or read from a file) is replayed against the real
+ * ResourceManager, SessionList and HandleMap code with the TPM replaced by
+ * the model in sim-tpm.c. Everything runs on the calling thread and the
+ * time is virtual: commands from the clients arrive when the workload says
+ * and are served one at a time, each TPM command takes the time the model
+ * gives it. A workload of hours is replayed in milliseconds and every run
+ * of the same workload gives the same numbers.
+ *
+ * The workload is replayed once for each RM policy and the results are
+ * printed side by side: TPM round trips per client command, latency
+ * percentiles, TPM utilization, context gap handling and the peak number
+ * of sessions and transient objects the RM had to keep. The run fails if
+ * the TPM model saw the RM do something wrong, or if regapping sessions
+ * while idle caused more TPM2_RC_CONTEXT_GAP responses than not doing it.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "object-cache.h"
+#include "resource-manager.h"
+#include "session-list.h"
+#include "sim-tpm.h"
+#include "sim-workload.h"
+#include "sink-interface.h"
+#include "tcti.h"
+#include "tcti-mock.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "tpm2-response.h"
+#include "util.h"
+
+#define SIM_CLIENTS_DEFAULT 8
+#define SIM_EVENTS_DEFAULT 10000
+#define SIM_INTERARRIVAL_DEFAULT 10000
+#define SIM_KEYS_DEFAULT 4
+#define SIM_SEED_DEFAULT 1
+#define SIM_LOAD_CACHE_ENTRIES 16
+#define SIM_PARENT_HANDLE 0x81000001
+/* handle, empty nonce, session attributes, empty hmac */
+#define SIM_AUTH_SIZE (sizeof (TPM2_HANDLE) + sizeof (UINT16) + \
+                       sizeof (UINT8) + sizeof (UINT16))
+
+typedef struct {
+    const gchar *name;
+    gboolean     idle_regap;
+    guint        load_cache;
+} sim_policy_t;
+static const sim_policy_t sim_policies [] = {
+    { "reactive",   FALSE, 0 },
+    { "idle-regap", TRUE,  0 },
+    { "load-cache", TRUE,  SIM_LOAD_CACHE_ENTRIES },
+};
+
+typedef struct {
+    Connection  *connection;
+    gint         fd;
+    GArray      *sessions;
+    GArray      *objects;
+} sim_client_t;
+
+typedef struct {
+    guint64         commands;
+    guint64         failed;
+    guint64         skipped;
+    guint64         client_tpm;
+    guint64         client_tpm_max;
+    guint64         idle_tpm;
+    guint64         close_tpm;
+    GArray         *latencies;
+    gint64          end_us;
+    guint           sessions_max;
+    guint           objects_max;
+    guint64         context_gaps;
+    guint64         regaps;
+    guint64         evictions;
+    sim_tpm_stats_t tpm;
+    guint64         wall_us;
+} sim_result_t;
+
+typedef struct {
+    ResourceManager *resmgr;
+    SessionList     *session_list;
+    sim_client_t    *clients;
+    guint            client_count;
+    guint64          connection_id;
+} sim_run_t;
+
+/* the RM has no Sink, the last response it sent ends up here */
+static Tpm2Response *sim_response = NULL;
+
+void
+__wrap_sink_enqueue (Sink    *self,
+                     GObject *obj)
+{
+    UNUSED_PARAM (self);
+
+    if (IS_TPM2_RESPONSE (obj)) {
+        g_clear_object (&sim_response);
+        sim_response = TPM2_RESPONSE (g_object_ref (obj));
+    }
+}
+static guint64
+wall_time_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * G_GUINT64_CONSTANT (1000000) +
+        (guint64)ts.tv_nsec / 1000;
+}
+/*
+ * Build a client command. 'auth' is the handle of the single session in
+ * the authorization area or 0 for a command without one.
+ */
+static Tpm2Command*
+sim_command_new (Connection    *connection,
+                 TPM2_CC        code,
+                 TPMA_CC        attrs,
+                 TPM2_HANDLE   *handles,
+                 guint          handle_count,
+                 TPM2_HANDLE    auth,
+                 const uint8_t *params,
+                 size_t         params_size)
+{
+    size_t size, offset = TPM_HEADER_SIZE;
+    uint8_t *buf;
+    guint i;
+
+    size = TPM_HEADER_SIZE + handle_count * sizeof (TPM2_HANDLE) +
+        params_size;
+    if (auth != 0) {
+        size += sizeof (UINT32) + SIM_AUTH_SIZE;
+    }
+    buf = g_malloc0 (size);
+    tpm2_header_init (buf,
+                      size,
+                      auth != 0 ? TPM2_ST_SESSIONS : TPM2_ST_NO_SESSIONS,
+                      size,
+                      code);
+    for (i = 0; i < handle_count; ++i) {
+        Tss2_MU_UINT32_Marshal (handles [i], buf, size, &offset);
+    }
+    if (auth != 0) {
+        Tss2_MU_UINT32_Marshal (SIM_AUTH_SIZE, buf, size, &offset);
+        Tss2_MU_UINT32_Marshal (auth, buf, size, &offset);
+        Tss2_MU_UINT16_Marshal (0, buf, size, &offset);
+        Tss2_MU_UINT8_Marshal (TPMA_SESSION_CONTINUESESSION, buf, size,
+                               &offset);
+        Tss2_MU_UINT16_Marshal (0, buf, size, &offset);
+    }
+    if (params_size > 0) {
+        memcpy (&buf [offset], params, params_size);
+    }
+    return tpm2_command_new (connection,
+                             buf,
+                             size,
+                             code | attrs |
+                             (handle_count << TPMA_CC_CHANDLES_SHIFT));
+}
+static Tpm2Command*
+sim_start_auth_session_new (Connection *connection)
+{
+    TPM2_HANDLE handles [] = { TPM2_RH_NULL, TPM2_RH_NULL };
+    TPM2B_NONCE nonce = { .size = 16 };
+    uint8_t params [sizeof (TPM2B_NONCE) + 16];
+    size_t size = 0;
+
+    Tss2_MU_TPM2B_NONCE_Marshal (&nonce, params, sizeof (params), &size);
+    /* no salt, HMAC session, no symmetric algorithm, SHA256 */
+    Tss2_MU_UINT16_Marshal (0, params, sizeof (params), &size);
+    Tss2_MU_UINT8_Marshal (TPM2_SE_HMAC, params, sizeof (params), &size);
+    Tss2_MU_UINT16_Marshal (TPM2_ALG_NULL, params, sizeof (params), &size);
+    Tss2_MU_UINT16_Marshal (TPM2_ALG_SHA256, params, sizeof (params), &size);
+    return sim_command_new (connection, TPM2_CC_StartAuthSession,
+                            TPMA_CC_RHANDLE, handles, 2, 0, params, size);
+}
+/*
+ * Load the blob 'key' under a persistent parent with a password. The same
+ * key always gives the same command so the load cache can hit.
+ */
+static Tpm2Command*
+sim_load_new (Connection *connection,
+              guint       key)
+{
+    TPM2_HANDLE parent = SIM_PARENT_HANDLE;
+    TPM2B_PRIVATE in_private = { .size = sizeof (guint) };
+    TPM2B_PUBLIC in_public = {
+        .publicArea = {
+            .type = TPM2_ALG_KEYEDHASH,
+            .nameAlg = TPM2_ALG_SHA256,
+            .objectAttributes = TPMA_OBJECT_SIGN_ENCRYPT |
+                                TPMA_OBJECT_USERWITHAUTH,
+            .parameters.keyedHashDetail.scheme.scheme = TPM2_ALG_NULL,
+            .unique.keyedHash.size = sizeof (guint),
+        },
+    };
+    uint8_t params [sizeof (TPM2B_PRIVATE) + sizeof (TPM2B_PUBLIC)];
+    size_t size = 0;
+
+    memcpy (in_private.buffer, &key, sizeof (key));
+    memcpy (in_public.publicArea.unique.keyedHash.buffer, &key, sizeof (key));
+    Tss2_MU_TPM2B_PRIVATE_Marshal (&in_private, params, sizeof (params),
+                                   &size);
+    Tss2_MU_TPM2B_PUBLIC_Marshal (&in_public, params, sizeof (params), &size);
+    return sim_command_new (connection, TPM2_CC_Load, TPMA_CC_RHANDLE,
+                            &parent, 1, TPM2_RS_PW, params, size);
+}
+/* sign a digest with a loaded key, authorized with a password */
+static Tpm2Command*
+sim_sign_new (Connection  *connection,
+              TPM2_HANDLE  handle)
+{
+    TPM2B_DIGEST digest = { .size = 32 };
+    uint8_t params [sizeof (TPM2B_DIGEST) + 16];
+    size_t size = 0;
+
+    Tss2_MU_TPM2B_DIGEST_Marshal (&digest, params, sizeof (params), &size);
+    /* TPM2_ALG_NULL scheme and a NULL ticket */
+    Tss2_MU_UINT16_Marshal (TPM2_ALG_NULL, params, sizeof (params), &size);
+    Tss2_MU_UINT16_Marshal (TPM2_ST_HASHCHECK, params, sizeof (params), &size);
+    Tss2_MU_UINT32_Marshal (TPM2_RH_NULL, params, sizeof (params), &size);
+    Tss2_MU_UINT16_Marshal (0, params, sizeof (params), &size);
+    return sim_command_new (connection, TPM2_CC_Sign, 0, &handle, 1,
+                            TPM2_RS_PW, params, size);
+}
+/* GetRandom in a session, the way an audit or encrypt session is used */
+static Tpm2Command*
+sim_get_random_new (Connection  *connection,
+                    TPM2_HANDLE  session)
+{
+    uint8_t params [sizeof (UINT16)];
+    size_t size = 0;
+
+    Tss2_MU_UINT16_Marshal (16, params, sizeof (params), &size);
+    return sim_command_new (connection, TPM2_CC_GetRandom, 0, NULL, 0,
+                            session, params, size);
+}
+static Tpm2Command*
+sim_flush_context_new (Connection  *connection,
+                       TPM2_HANDLE  handle)
+{
+    uint8_t params [sizeof (TPM2_HANDLE)];
+    size_t size = 0;
+
+    Tss2_MU_UINT32_Marshal (handle, params, sizeof (params), &size);
+    return sim_command_new (connection, TPM2_CC_FlushContext, 0, NULL, 0, 0,
+                            params, size);
+}
+static sim_client_t*
+sim_client_get (sim_run_t *run,
+                guint      id)
+{
+    sim_client_t *client = &run->clients [id];
+    HandleMap *handle_map;
+    GIOStream *iostream;
+
+    if (client->connection == NULL) {
+        handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostream = create_connection_iostream (&client->fd);
+        client->connection = connection_new (iostream,
+                                             ++run->connection_id,
+                                             handle_map);
+        g_object_unref (iostream);
+        g_object_unref (handle_map);
+        client->sessions = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+        client->objects = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+    }
+    return client;
+}
+static void
+sim_client_close (sim_run_t    *run,
+                  sim_client_t *client)
+{
+    if (client->connection == NULL) {
+        return;
+    }
+    resource_manager_remove_connection (run->resmgr, client->connection);
+    g_clear_object (&client->connection);
+    g_array_free (client->sessions, TRUE);
+    g_array_free (client->objects, TRUE);
+    close (client->fd);
+}
+/*
+ * The Tpm2Command for an event, NULL if the event refers to a session or
+ * object the client doesn't have (e.g. because starting it failed).
+ */
+static Tpm2Command*
+sim_event_command (sim_client_t      *client,
+                   const sim_event_t *event)
+{
+    Tpm2Command *command;
+
+    switch (event->op) {
+    case SIM_OP_SESSION_START:
+        return sim_start_auth_session_new (client->connection);
+    case SIM_OP_LOAD:
+        return sim_load_new (client->connection, event->arg);
+    case SIM_OP_STATELESS:
+        command = sim_command_new (client->connection, TPM2_CC_ReadClock, 0,
+                                   NULL, 0, 0, NULL, 0);
+        tpm2_command_set_stateless (command, TRUE);
+        return command;
+    case SIM_OP_SESSION_USE:
+    case SIM_OP_SESSION_FLUSH:
+        if (event->arg >= client->sessions->len) {
+            return NULL;
+        }
+        if (event->op == SIM_OP_SESSION_USE) {
+            return sim_get_random_new (client->connection,
+                g_array_index (client->sessions, TPM2_HANDLE, event->arg));
+        }
+        return sim_flush_context_new (client->connection,
+            g_array_index (client->sessions, TPM2_HANDLE, event->arg));
+    case SIM_OP_USE:
+    case SIM_OP_FLUSH:
+        if (event->arg >= client->objects->len) {
+            return NULL;
+        }
+        if (event->op == SIM_OP_USE) {
+            return sim_sign_new (client->connection,
+                g_array_index (client->objects, TPM2_HANDLE, event->arg));
+        }
+        return sim_flush_context_new (client->connection,
+            g_array_index (client->objects, TPM2_HANDLE, event->arg));
+    default:
+        g_assert_not_reached ();
+    }
+    return NULL;
+}
+/* keep track of the sessions and objects the client has open */
+static void
+sim_event_response (sim_client_t      *client,
+                    const sim_event_t *event,
+                    Tpm2Response      *response)
+{
+    TPM2_HANDLE handle;
+
+    if (tpm2_response_get_code (response) != TSS2_RC_SUCCESS) {
+        return;
+    }
+    switch (event->op) {
+    case SIM_OP_SESSION_START:
+        handle = tpm2_response_get_handle (response);
+        g_array_append_val (client->sessions, handle);
+        break;
+    case SIM_OP_LOAD:
+        handle = tpm2_response_get_handle (response);
+        g_array_append_val (client->objects, handle);
+        break;
+    case SIM_OP_SESSION_FLUSH:
+        g_array_remove_index (client->sessions, event->arg);
+        break;
+    case SIM_OP_FLUSH:
+        g_array_remove_index (client->objects, event->arg);
+        break;
+    default:
+        break;
+    }
+}
+/*
+ * While the RM has nothing to do until the next arrival it does idle work
+ * if the policy lets it. A step that starts before the arrival delays it
+ * if it's still running when the command arrives.
+ */
+static void
+sim_idle (sim_run_t    *run,
+          sim_result_t *result,
+          gint64        until)
+{
+    sim_tpm_stats_t before, after;
+
+    sim_tpm_get_stats (&before);
+    while (sim_tpm_now () < until && resource_manager_idle (run->resmgr)) {
+        ;
+    }
+    sim_tpm_get_stats (&after);
+    result->idle_tpm += after.commands - before.commands;
+}
+static void
+sim_peaks (sim_run_t    *run,
+           sim_result_t *result)
+{
+    HandleMap *map;
+    guint i, objects = 0;
+
+    result->sessions_max = MAX (result->sessions_max,
+                                session_list_size (run->session_list));
+    for (i = 0; i < run->client_count; ++i) {
+        if (run->clients [i].connection != NULL) {
+            map = connection_get_trans_map (run->clients [i].connection);
+            objects += handle_map_size (map);
+            g_object_unref (map);
+        }
+    }
+    result->objects_max = MAX (result->objects_max, objects);
+}
+static void
+sim_event (sim_run_t         *run,
+           sim_result_t      *result,
+           const sim_event_t *event)
+{
+    sim_client_t *client;
+    Tpm2Command *command;
+    sim_tpm_stats_t before, after;
+    gint64 latency;
+
+    sim_tpm_advance (event->time_us);
+    sim_tpm_get_stats (&before);
+    if (event->op == SIM_OP_CLOSE) {
+        sim_client_close (run, &run->clients [event->client]);
+        sim_tpm_get_stats (&after);
+        result->close_tpm += after.commands - before.commands;
+        return;
+    }
+    client = sim_client_get (run, event->client);
+    command = sim_event_command (client, event);
+    if (command == NULL) {
+        ++result->skipped;
+        return;
+    }
+    resource_manager_process_tpm2_command (run->resmgr, command);
+    g_object_unref (command);
+    sim_tpm_get_stats (&after);
+
+    ++result->commands;
+    result->client_tpm += after.commands - before.commands;
+    result->client_tpm_max = MAX (result->client_tpm_max,
+                                  after.commands - before.commands);
+    latency = sim_tpm_now () - event->time_us;
+    g_array_append_val (result->latencies, latency);
+    if (sim_response == NULL) {
+        g_warning ("%s: no response for %s", __func__,
+                   sim_op_to_str (event->op));
+        ++result->failed;
+        return;
+    }
+    if (tpm2_response_get_code (sim_response) != TSS2_RC_SUCCESS) {
+        ++result->failed;
+    }
+    sim_event_response (client, event, sim_response);
+    g_clear_object (&sim_response);
+    sim_peaks (run, result);
+}
+static void
+sim_run (AccessBroker           *broker,
+         const sim_tpm_config_t *tpm_config,
+         const sim_policy_t     *policy,
+         GArray                 *events,
+         sim_result_t           *result)
+{
+    sim_run_t run = { .connection_id = 0 };
+    ObjectCache *cache;
+    const sim_event_t *event;
+    guint64 start;
+    guint i;
+
+    memset (result, 0, sizeof (*result));
+    result->latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64),
+                                           events->len);
+    sim_tpm_reset (tpm_config);
+    run.session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT,
+                                         SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    run.resmgr = resource_manager_new (broker, run.session_list);
+    if (policy->load_cache > 0) {
+        cache = object_cache_new (policy->load_cache);
+        g_object_set (run.resmgr, "load-cache", cache, NULL);
+        g_object_unref (cache);
+    }
+    run.client_count = sim_workload_clients (events);
+    run.clients = g_new0 (sim_client_t, run.client_count);
+
+    start = wall_time_us ();
+    for (i = 0; i < events->len; ++i) {
+        event = &g_array_index (events, sim_event_t, i);
+        if (policy->idle_regap) {
+            sim_idle (&run, result, event->time_us);
+        }
+        sim_event (&run, result, event);
+    }
+    for (i = 0; i < run.client_count; ++i) {
+        sim_client_close (&run, &run.clients [i]);
+    }
+    result->wall_us = wall_time_us () - start;
+    result->end_us = sim_tpm_now ();
+    result->context_gaps = run.resmgr->context_gaps;
+    result->regaps = run.resmgr->regaps;
+    result->evictions = run.resmgr->sessions_evicted;
+    sim_tpm_get_stats (&result->tpm);
+
+    g_free (run.clients);
+    g_object_unref (run.resmgr);
+    g_object_unref (run.session_list);
+}
+static gint
+compare_gint64 (gconstpointer a,
+                gconstpointer b)
+{
+    gint64 x = *(const gint64*)a, y = *(const gint64*)b;
+
+    return x < y ? -1 : x > y;
+}
+static gint64
+percentile (GArray *sorted,
+            guint   pct)
+{
+    guint index;
+
+    if (sorted->len == 0) {
+        return 0;
+    }
+    index = (sorted->len * pct + 99) / 100;
+    return g_array_index (sorted, gint64, index > 0 ? index - 1 : 0);
+}
+static void
+sim_print (const sim_policy_t *policy,
+           sim_result_t       *result)
+{
+    GArray *lat = result->latencies;
+
+    g_array_sort (lat, compare_gint64);
+    g_print ("%s:\n", policy->name);
+    g_print ("  client commands:                 %" PRIu64 " (%" PRIu64
+             " failed, %" PRIu64 " skipped)\n", result->commands,
+             result->failed, result->skipped);
+    g_print ("  TPM commands per client command: %.3f mean, %" PRIu64
+             " max\n", result->commands > 0 ?
+             (double)result->client_tpm / (double)result->commands : 0.0,
+             result->client_tpm_max);
+    g_print ("  TPM commands while idle:         %" PRIu64 "\n",
+             result->idle_tpm);
+    g_print ("  TPM commands on close:           %" PRIu64 "\n",
+             result->close_tpm);
+    g_print ("  latency us p50/p90/p99/max:      %" PRId64 "/%" PRId64 "/%"
+             PRId64 "/%" PRId64 "\n", percentile (lat, 50),
+             percentile (lat, 90), percentile (lat, 99),
+             percentile (lat, 100));
+    g_print ("  TPM utilization:                 %.1f%% of %" PRId64
+             " ms\n", result->end_us > 0 ? 100.0 *
+             (double)result->tpm.busy_us / (double)result->end_us : 0.0,
+             result->end_us / 1000);
+    g_print ("  context loads/saves/flushes:     %" PRIu64 "/%" PRIu64 "/%"
+             PRIu64 "\n", result->tpm.context_loads,
+             result->tpm.context_saves, result->tpm.flushes);
+    g_print ("  TPM2_RC_CONTEXT_GAP responses:   %" PRIu64 "\n",
+             result->context_gaps);
+    g_print ("  sessions regapped while idle:    %" PRIu64 "\n",
+             result->regaps);
+    g_print ("  sessions evicted:                %" PRIu64 "\n",
+             result->evictions);
+    g_print ("  peak SessionEntry objects:       %u\n", result->sessions_max);
+    g_print ("  peak HandleMapEntry objects:     %u\n", result->objects_max);
+    g_print ("  peak loaded sessions/objects:    %u/%u\n",
+             result->tpm.sessions_loaded_max,
+             result->tpm.objects_loaded_max);
+    g_print ("  TPM model errors:                %" PRIu64 "\n",
+             result->tpm.errors);
+    g_print ("  replayed in:                     %.1f ms\n",
+             (double)result->wall_us / 1000.0);
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    sim_synthetic_t synthetic = {
+        .clients = SIM_CLIENTS_DEFAULT,
+        .events = SIM_EVENTS_DEFAULT,
+        .mean_interarrival_us = SIM_INTERARRIVAL_DEFAULT,
+        .keys = SIM_KEYS_DEFAULT,
+        .seed = SIM_SEED_DEFAULT,
+    };
+    gint clients = SIM_CLIENTS_DEFAULT, events_count = SIM_EVENTS_DEFAULT;
+    gint keys = SIM_KEYS_DEFAULT, seed = SIM_SEED_DEFAULT;
+    gint64 interarrival = SIM_INTERARRIVAL_DEFAULT;
+    gint session_slots = SIM_TPM_SESSION_SLOTS_DEFAULT;
+    gint object_slots = SIM_TPM_OBJECT_SLOTS_DEFAULT;
+    gint gap = SIM_TPM_GAP_MAX_DEFAULT;
+    gchar *workload = NULL, *policy_name = NULL;
+    GOptionEntry entries [] = {
+        { "workload", 'w', 0, G_OPTION_ARG_FILENAME, &workload,
+          "Replay the workload in FILE", "FILE" },
+        { "clients", 'c', 0, G_OPTION_ARG_INT, &clients,
+          "Clients in the synthetic workload", "N" },
+        { "events", 'e', 0, G_OPTION_ARG_INT, &events_count,
+          "Operations in the synthetic workload", "N" },
+        { "interarrival", 'i', 0, G_OPTION_ARG_INT64, &interarrival,
+          "Mean time between operations in the synthetic workload", "US" },
+        { "keys", 'k', 0, G_OPTION_ARG_INT, &keys,
+          "Distinct keys loaded by the synthetic workload", "N" },
+        { "seed", 'S', 0, G_OPTION_ARG_INT, &seed,
+          "Seed for the synthetic workload", "N" },
+        { "session-slots", 's', 0, G_OPTION_ARG_INT, &session_slots,
+          "Sessions the modeled TPM can hold loaded", "N" },
+        { "object-slots", 'o', 0, G_OPTION_ARG_INT, &object_slots,
+          "Transient objects the modeled TPM can hold loaded", "N" },
+        { "gap-max", 'g', 0, G_OPTION_ARG_INT, &gap,
+          "TPM2_PT_CONTEXT_GAP_MAX of the modeled TPM", "N" },
+        { "policy", 'p', 0, G_OPTION_ARG_STRING, &policy_name,
+          "Only run the named RM policy", "NAME" },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+    sim_tpm_config_t tpm_config = {
+        .active_sessions = SIM_TPM_ACTIVE_SESSIONS_MAX,
+    };
+    sim_result_t results [G_N_ELEMENTS (sim_policies)];
+    gboolean ran [G_N_ELEMENTS (sim_policies)] = { FALSE, };
+    GOptionContext *ctx;
+    GError *error = NULL;
+    GArray *events;
+    TSS2_TCTI_CONTEXT *tcti_context;
+    Tcti *tcti;
+    AccessBroker *broker;
+    gint ret = 0;
+    size_t i;
+
+    ctx = g_option_context_new (" - ResourceManager simulation");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_clear_error (&error);
+        g_option_context_free (ctx);
+        return 1;
+    }
+    g_option_context_free (ctx);
+    if (clients < 1 || events_count < 1 || interarrival < 0 || keys < 1 ||
+        session_slots < 1 || object_slots < 1 || object_slots > 16 ||
+        gap < 1)
+    {
+        g_printerr ("clients, events, keys, session-slots and gap-max must "
+                    "be > 0, object-slots between 1 and 16 and "
+                    "interarrival >= 0\n");
+        return 1;
+    }
+    tpm_config.session_slots = (guint)session_slots;
+    tpm_config.object_slots = (guint)object_slots;
+    tpm_config.gap_max = (guint32)gap;
+
+    if (workload != NULL) {
+        events = sim_workload_load (workload, &error);
+        if (events == NULL) {
+            g_printerr ("%s\n", error->message);
+            g_clear_error (&error);
+            return 1;
+        }
+        g_print ("workload:        %s\n", workload);
+    } else {
+        synthetic.clients = (guint)clients;
+        synthetic.events = (guint)events_count;
+        synthetic.mean_interarrival_us = interarrival;
+        synthetic.keys = (guint)keys;
+        synthetic.seed = (guint32)seed;
+        events = sim_workload_synthetic (&synthetic);
+        g_print ("workload:        synthetic, seed %d, %d clients, %d keys\n",
+                 seed, clients, keys);
+    }
+    g_print ("operations:      %u\n", events->len);
+    g_print ("session slots:   %d\n", session_slots);
+    g_print ("object slots:    %d\n", object_slots);
+    g_print ("gap max:         %d\n", gap);
+
+    tcti_context = tcti_mock_init_full ();
+    tcti = tcti_new (tcti_context);
+    broker = access_broker_new (tcti);
+    g_object_unref (tcti);
+
+    for (i = 0; i < G_N_ELEMENTS (sim_policies); ++i) {
+        if (policy_name != NULL &&
+            g_strcmp0 (policy_name, sim_policies [i].name) != 0)
+        {
+            continue;
+        }
+        sim_run (broker, &tpm_config, &sim_policies [i], events, &results [i]);
+        sim_print (&sim_policies [i], &results [i]);
+        ran [i] = TRUE;
+        if (results [i].tpm.errors > 0) {
+            g_printerr ("%s: the TPM model reported %" PRIu64 " errors\n",
+                        sim_policies [i].name, results [i].tpm.errors);
+            ret = 1;
+        }
+    }
+    /* regapping while idle is only there to avoid TPM2_RC_CONTEXT_GAP */
+    if (ran [0] && ran [1] &&
+        results [1].context_gaps > results [0].context_gaps)
+    {
+        g_printerr ("%s: %" PRIu64 " TPM2_RC_CONTEXT_GAP responses, more than "
+                    "the %" PRIu64 " without it\n", sim_policies [1].name,
+                    results [1].context_gaps, results [0].context_gaps);
+        ret = 1;
+    }
+    for (i = 0; i < G_N_ELEMENTS (sim_policies); ++i) {
+        if (ran [i]) {
+            g_array_free (results [i].latencies, TRUE);
+        }
+    }
+    g_object_unref (broker);
+    g_array_free (events, TRUE);
+    g_free (workload);
+    g_free (policy_name);
+    return ret;
+}
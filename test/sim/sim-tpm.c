@@ -0,0 +1,554 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * The TPM model behind the ResourceManager simulation. Link with:
+ * -Wl,--wrap=access_broker_send_command,--wrap=access_broker_context_load,
+ * --wrap=access_broker_context_saveflush,--wrap=access_broker_context_flush,
+ * --wrap=access_broker_get_fixed_property,--wrap=g_get_monotonic_time,
+ * --wrap=g_usleep
+ *
+ * Sessions live in one of SIM_TPM_ACTIVE_SESSIONS_MAX handles and are
+ * either loaded (using one of the session slots) or saved. Saving a
+ * session advances the contextCounter and fails with TPM2_RC_CONTEXT_GAP
+ * if the save would leave another saved session more than gap_max behind.
+ * Transient objects use the object slots while loaded, their saved
+ * contexts are checked for shape only since the TPM doesn't track them.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "access-broker.h"
+#include "sim-tpm.h"
+#include "tabrmd.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "tpm2-response.h"
+#include "util.h"
+
+#define SIM_TPM_OBJECT_SLOTS_MAX 16
+#define SIM_TPM_OBJECT_BLOB_SIZE 16
+#define SIM_TPM_SESSION_BLOB_SIZE 16
+#define SIM_LATENCY_ERROR_US 50
+
+typedef enum {
+    SIM_SESSION_FREE,
+    SIM_SESSION_LOADED,
+    SIM_SESSION_SAVED,
+} sim_session_state_t;
+
+typedef struct {
+    sim_session_state_t state;
+    guint64             sequence;
+} sim_session_t;
+
+/*
+ * Per-command latency in microseconds, loosely from a discrete TPM. Only
+ * the ratios matter when comparing policies.
+ */
+typedef struct {
+    TPM2_CC code;
+    guint64 latency_us;
+} sim_latency_t;
+static const sim_latency_t sim_latencies [] = {
+    { TPM2_CC_ContextLoad,      150 },
+    { TPM2_CC_ContextSave,      200 },
+    { TPM2_CC_FlushContext,      30 },
+    { TPM2_CC_StartAuthSession, 2000 },
+    { TPM2_CC_Load,             8000 },
+    { TPM2_CC_Sign,            20000 },
+    { TPM2_CC_GetRandom,        300 },
+    { TPM2_CC_ReadClock,        100 },
+};
+#define SIM_LATENCY_DEFAULT_US 500
+
+static sim_tpm_config_t config = {
+    .session_slots = SIM_TPM_SESSION_SLOTS_DEFAULT,
+    .object_slots = SIM_TPM_OBJECT_SLOTS_DEFAULT,
+    .active_sessions = SIM_TPM_ACTIVE_SESSIONS_MAX,
+    .gap_max = SIM_TPM_GAP_MAX_DEFAULT,
+};
+static sim_session_t sessions [SIM_TPM_ACTIVE_SESSIONS_MAX];
+static gboolean objects [SIM_TPM_OBJECT_SLOTS_MAX];
+static guint sessions_loaded = 0;
+static guint objects_loaded = 0;
+static guint64 context_counter = 0;
+static guint64 object_sequence = 0;
+static gint64 now_us = 0;
+static sim_tpm_stats_t stats;
+
+void
+sim_tpm_reset (const sim_tpm_config_t *new_config)
+{
+    g_assert (new_config->session_slots > 0);
+    g_assert (new_config->object_slots > 0 &&
+              new_config->object_slots <= SIM_TPM_OBJECT_SLOTS_MAX);
+    g_assert (new_config->active_sessions > 0 &&
+              new_config->active_sessions <= SIM_TPM_ACTIVE_SESSIONS_MAX);
+    config = *new_config;
+    memset (sessions, 0, sizeof (sessions));
+    memset (objects, 0, sizeof (objects));
+    memset (&stats, 0, sizeof (stats));
+    sessions_loaded = 0;
+    objects_loaded = 0;
+    context_counter = 0;
+    object_sequence = 0;
+    now_us = 0;
+}
+void
+sim_tpm_get_stats (sim_tpm_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
+gint64
+sim_tpm_now (void)
+{
+    return now_us;
+}
+/* move the clock forward to 'now', it never goes back */
+void
+sim_tpm_advance (gint64 now)
+{
+    now_us = MAX (now_us, now);
+}
+guint64
+sim_tpm_command_latency (TPM2_CC code)
+{
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS (sim_latencies); ++i) {
+        if (sim_latencies [i].code == code) {
+            return sim_latencies [i].latency_us;
+        }
+    }
+    return SIM_LATENCY_DEFAULT_US;
+}
+static void
+sim_tpm_error (const gchar *msg,
+               TPM2_HANDLE  handle)
+{
+    g_warning ("sim-tpm: %s: 0x%08" PRIx32, msg, handle);
+    ++stats.errors;
+}
+/*
+ * Account one TPM command. Failed commands are cheap, the TPM finds out
+ * early that it can't execute them.
+ */
+static void
+sim_tpm_execute (TPM2_CC code,
+                 TSS2_RC rc)
+{
+    guint64 latency = rc == TSS2_RC_SUCCESS ?
+        sim_tpm_command_latency (code) : SIM_LATENCY_ERROR_US;
+
+    ++stats.commands;
+    stats.busy_us += latency;
+    now_us += (gint64)latency;
+    stats.sessions_loaded_max = MAX (stats.sessions_loaded_max,
+                                     sessions_loaded);
+    stats.objects_loaded_max = MAX (stats.objects_loaded_max,
+                                    objects_loaded);
+}
+static sim_session_t*
+sim_session_lookup (TPM2_HANDLE handle)
+{
+    switch (handle >> TPM2_HR_SHIFT) {
+    case TPM2_HT_HMAC_SESSION:
+    case TPM2_HT_POLICY_SESSION:
+        break;
+    default:
+        return NULL;
+    }
+    handle &= TPM2_HR_HANDLE_MASK;
+    if (handle >= config.active_sessions) {
+        return NULL;
+    }
+    return &sessions [handle];
+}
+static gint
+sim_object_index (TPM2_HANDLE handle)
+{
+    gint index = (gint)(handle - TPM2_TRANSIENT_FIRST);
+
+    if (handle >> TPM2_HR_SHIFT != TPM2_HT_TRANSIENT ||
+        index < 0 || index >= (gint)config.object_slots)
+    {
+        return -1;
+    }
+    return index;
+}
+static TSS2_RC
+sim_object_alloc (TPM2_HANDLE *handle)
+{
+    guint i;
+
+    for (i = 0; i < config.object_slots; ++i) {
+        if (!objects [i]) {
+            objects [i] = TRUE;
+            ++objects_loaded;
+            *handle = TPM2_TRANSIENT_FIRST + i;
+            return TSS2_RC_SUCCESS;
+        }
+    }
+    return TPM2_RC_OBJECT_MEMORY;
+}
+static TSS2_RC
+sim_flush (TPM2_HANDLE handle)
+{
+    sim_session_t *session;
+    gint index;
+
+    ++stats.flushes;
+    session = sim_session_lookup (handle);
+    if (session != NULL && session->state != SIM_SESSION_FREE) {
+        if (session->state == SIM_SESSION_LOADED) {
+            --sessions_loaded;
+        }
+        session->state = SIM_SESSION_FREE;
+        return TSS2_RC_SUCCESS;
+    }
+    index = sim_object_index (handle);
+    if (index >= 0 && objects [index]) {
+        objects [index] = FALSE;
+        --objects_loaded;
+        return TSS2_RC_SUCCESS;
+    }
+    sim_tpm_error ("flush of unknown handle", handle);
+    return TPM2_RC_HANDLE + TPM2_RC_P + TPM2_RC_1;
+}
+static Tpm2Response*
+sim_response_new (Tpm2Command *command,
+                  TSS2_RC      rc,
+                  uint8_t     *body,
+                  size_t       body_size)
+{
+    Connection *connection = tpm2_command_get_connection (command);
+    Tpm2Response *response;
+    uint8_t *buf;
+
+    if (rc != TSS2_RC_SUCCESS) {
+        body_size = 0;
+    }
+    buf = g_malloc0 (TPM_HEADER_SIZE + body_size);
+    set_response_tag (buf, TPM2_ST_NO_SESSIONS);
+    set_response_size (buf, TPM_HEADER_SIZE + body_size);
+    set_response_code (buf, rc);
+    if (body_size > 0) {
+        memcpy (&buf [TPM_HEADER_SIZE], body, body_size);
+    }
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  TPM_HEADER_SIZE + body_size,
+                                  rc == TSS2_RC_SUCCESS ?
+                                  tpm2_command_get_attributes (command) : 0);
+    g_clear_object (&connection);
+    return response;
+}
+static TSS2_RC
+sim_context_save_session (TPM2_HANDLE   handle,
+                          TPMS_CONTEXT *context)
+{
+    sim_session_t *session = sim_session_lookup (handle);
+    guint i;
+
+    ++stats.context_saves;
+    if (session == NULL || session->state != SIM_SESSION_LOADED) {
+        sim_tpm_error ("ContextSave of session that isn't loaded", handle);
+        return TPM2_RC_REFERENCE_H0;
+    }
+    for (i = 0; i < config.active_sessions; ++i) {
+        if (&sessions [i] != session &&
+            sessions [i].state == SIM_SESSION_SAVED &&
+            context_counter + 1 - sessions [i].sequence > config.gap_max)
+        {
+            return TPM2_RC_CONTEXT_GAP;
+        }
+    }
+    session->state = SIM_SESSION_SAVED;
+    session->sequence = ++context_counter;
+    --sessions_loaded;
+    memset (context, 0, sizeof (*context));
+    context->sequence = session->sequence;
+    context->savedHandle = handle;
+    context->hierarchy = TPM2_RH_NULL;
+    context->contextBlob.size = SIM_TPM_SESSION_BLOB_SIZE;
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+sim_context_load_session (TPMS_CONTEXT *context)
+{
+    sim_session_t *session = sim_session_lookup (context->savedHandle);
+
+    ++stats.context_loads;
+    if (session == NULL || session->state != SIM_SESSION_SAVED ||
+        session->sequence != context->sequence)
+    {
+        sim_tpm_error ("ContextLoad of stale session context",
+                       context->savedHandle);
+        return TPM2_RC_HANDLE + TPM2_RC_P + TPM2_RC_1;
+    }
+    if (sessions_loaded >= config.session_slots) {
+        return TPM2_RC_SESSION_MEMORY;
+    }
+    session->state = SIM_SESSION_LOADED;
+    ++sessions_loaded;
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+sim_start_auth_session (TPM2_HANDLE *handle)
+{
+    guint i;
+
+    for (i = 0; i < config.active_sessions; ++i) {
+        if (sessions [i].state == SIM_SESSION_FREE) {
+            break;
+        }
+    }
+    if (i == config.active_sessions) {
+        return TPM2_RC_SESSION_HANDLES;
+    }
+    if (sessions_loaded >= config.session_slots) {
+        return TPM2_RC_SESSION_MEMORY;
+    }
+    sessions [i].state = SIM_SESSION_LOADED;
+    ++sessions_loaded;
+    *handle = TPM2_HMAC_SESSION_FIRST + i;
+    return TSS2_RC_SUCCESS;
+}
+typedef struct {
+    Tpm2Command *command;
+    GSList      *flush;
+} sim_auth_data_t;
+/*
+ * Sessions in the authorization area must be loaded. Those without
+ * continueSession are flushed by the TPM once the command completes.
+ */
+static void
+sim_check_auth (gpointer auth_offset_ptr,
+                gpointer user_data)
+{
+    sim_auth_data_t *data = (sim_auth_data_t*)user_data;
+    size_t offset = *(size_t*)auth_offset_ptr;
+    TPM2_HANDLE handle;
+    sim_session_t *session;
+
+    handle = tpm2_command_get_auth_handle (data->command, offset);
+    if (handle == TPM2_RS_PW) {
+        return;
+    }
+    session = sim_session_lookup (handle);
+    if (session == NULL || session->state != SIM_SESSION_LOADED) {
+        sim_tpm_error ("command authorized by session that isn't loaded",
+                       handle);
+        return;
+    }
+    if (!(tpm2_command_get_auth_attrs (data->command, offset) &
+          TPMA_SESSION_CONTINUESESSION))
+    {
+        data->flush = g_slist_prepend (data->flush,
+                                       GUINT_TO_POINTER (handle));
+    }
+}
+/*
+ * Everything a client command references has to be in the TPM: transient
+ * objects and sessions in the handle area and sessions in the auth area.
+ */
+static void
+sim_check_client_command (Tpm2Command *command,
+                          GSList     **flush)
+{
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES] = { 0, };
+    size_t i, count = TPM2_COMMAND_MAX_HANDLES;
+    sim_session_t *session;
+    sim_auth_data_t data = { .command = command, .flush = NULL };
+    gint index;
+
+    tpm2_command_get_handles (command, handles, &count);
+    for (i = 0; i < count; ++i) {
+        switch (handles [i] >> TPM2_HR_SHIFT) {
+        case TPM2_HT_TRANSIENT:
+            index = sim_object_index (handles [i]);
+            if (index < 0 || !objects [index]) {
+                sim_tpm_error ("command references object that isn't loaded",
+                               handles [i]);
+            }
+            break;
+        case TPM2_HT_HMAC_SESSION:
+        case TPM2_HT_POLICY_SESSION:
+            session = sim_session_lookup (handles [i]);
+            if (session == NULL || session->state != SIM_SESSION_LOADED) {
+                sim_tpm_error ("command references session that isn't "
+                               "loaded", handles [i]);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    if (tpm2_command_has_auths (command)) {
+        tpm2_command_foreach_auth (command, sim_check_auth, &data);
+    }
+    *flush = data.flush;
+}
+Tpm2Response*
+__wrap_access_broker_send_command (AccessBroker *broker,
+                                   Tpm2Command  *command,
+                                   TSS2_RC      *rc)
+{
+    uint8_t *buf = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t offset = TPM_HEADER_SIZE;
+    TPM2_CC code = tpm2_command_get_code (command);
+    TPMS_CONTEXT context = { .sequence = 0 };
+    TPM2_HANDLE handle = 0;
+    uint8_t body [sizeof (TPMS_CONTEXT)];
+    size_t body_size = 0;
+    TSS2_RC resp_rc;
+    GSList *flush = NULL, *item;
+
+    UNUSED_PARAM (broker);
+    *rc = TSS2_RC_SUCCESS;
+    switch (code) {
+    case TPM2_CC_ContextSave:
+        Tss2_MU_UINT32_Unmarshal (buf, size, &offset, &handle);
+        resp_rc = sim_context_save_session (handle, &context);
+        if (resp_rc == TSS2_RC_SUCCESS) {
+            Tss2_MU_TPMS_CONTEXT_Marshal (&context, body, sizeof (body),
+                                          &body_size);
+        }
+        break;
+    case TPM2_CC_ContextLoad:
+        Tss2_MU_TPMS_CONTEXT_Unmarshal (buf, size, &offset, &context);
+        resp_rc = sim_context_load_session (&context);
+        if (resp_rc == TSS2_RC_SUCCESS) {
+            Tss2_MU_UINT32_Marshal (context.savedHandle, body, sizeof (body),
+                                    &body_size);
+        }
+        break;
+    case TPM2_CC_FlushContext:
+        Tss2_MU_UINT32_Unmarshal (buf, size, &offset, &handle);
+        resp_rc = sim_flush (handle);
+        break;
+    case TPM2_CC_StartAuthSession:
+        resp_rc = sim_start_auth_session (&handle);
+        if (resp_rc == TSS2_RC_SUCCESS) {
+            /* handle, then an empty nonceTPM */
+            Tss2_MU_UINT32_Marshal (handle, body, sizeof (body), &body_size);
+            Tss2_MU_UINT16_Marshal (0, body, sizeof (body), &body_size);
+        }
+        break;
+    default:
+        sim_check_client_command (command, &flush);
+        resp_rc = TSS2_RC_SUCCESS;
+        if (code == TPM2_CC_Load) {
+            resp_rc = sim_object_alloc (&handle);
+            if (resp_rc == TSS2_RC_SUCCESS) {
+                /* handle, then an empty name */
+                Tss2_MU_UINT32_Marshal (handle, body, sizeof (body),
+                                        &body_size);
+                Tss2_MU_UINT16_Marshal (0, body, sizeof (body), &body_size);
+            }
+        }
+        for (item = flush; item != NULL; item = item->next) {
+            sim_flush (GPOINTER_TO_UINT (item->data));
+        }
+        g_slist_free (flush);
+        break;
+    }
+    sim_tpm_execute (code, resp_rc);
+    return sim_response_new (command, resp_rc, body, body_size);
+}
+/*
+ * The RM loads and saves transient objects through the SAPI.
+ */
+TSS2_RC
+__wrap_access_broker_context_load (AccessBroker *broker,
+                                   TPMS_CONTEXT *context,
+                                   TPM2_HANDLE  *handle)
+{
+    TSS2_RC rc;
+
+    UNUSED_PARAM (broker);
+    ++stats.context_loads;
+    if (context->savedHandle >> TPM2_HR_SHIFT != TPM2_HT_TRANSIENT ||
+        context->contextBlob.size != SIM_TPM_OBJECT_BLOB_SIZE)
+    {
+        sim_tpm_error ("ContextLoad of malformed object context",
+                       context->savedHandle);
+        rc = TPM2_RC_INTEGRITY;
+    } else {
+        rc = sim_object_alloc (handle);
+    }
+    sim_tpm_execute (TPM2_CC_ContextLoad, rc);
+    return rc;
+}
+TSS2_RC
+__wrap_access_broker_context_saveflush (AccessBroker *broker,
+                                        TPM2_HANDLE   handle,
+                                        TPMS_CONTEXT *context)
+{
+    gint index = sim_object_index (handle);
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    UNUSED_PARAM (broker);
+    ++stats.context_saves;
+    if (index < 0 || !objects [index]) {
+        sim_tpm_error ("ContextSave of object that isn't loaded", handle);
+        rc = TPM2_RC_REFERENCE_H0;
+        sim_tpm_execute (TPM2_CC_ContextSave, rc);
+        return rc;
+    }
+    memset (context, 0, sizeof (*context));
+    context->sequence = ++object_sequence;
+    context->savedHandle = TPM2_TRANSIENT_FIRST;
+    context->hierarchy = TPM2_RH_OWNER;
+    context->contextBlob.size = SIM_TPM_OBJECT_BLOB_SIZE;
+    sim_tpm_execute (TPM2_CC_ContextSave, rc);
+    rc = sim_flush (handle);
+    sim_tpm_execute (TPM2_CC_FlushContext, rc);
+    return rc;
+}
+TSS2_RC
+__wrap_access_broker_context_flush (AccessBroker *broker,
+                                    TPM2_HANDLE   handle)
+{
+    TSS2_RC rc;
+
+    UNUSED_PARAM (broker);
+    rc = sim_flush (handle);
+    sim_tpm_execute (TPM2_CC_FlushContext, rc);
+    return rc;
+}
+TSS2_RC
+__wrap_access_broker_get_fixed_property (AccessBroker *broker,
+                                         TPM2_PT       property,
+                                         guint32      *value)
+{
+    UNUSED_PARAM (broker);
+
+    switch (property) {
+    case TPM2_PT_CONTEXT_GAP_MAX:
+        *value = config.gap_max;
+        return TSS2_RC_SUCCESS;
+    case TPM2_PT_HR_LOADED_MIN:
+        *value = config.session_slots;
+        return TSS2_RC_SUCCESS;
+    case TPM2_PT_ACTIVE_SESSIONS_MAX:
+        *value = config.active_sessions;
+        return TSS2_RC_SUCCESS;
+    default:
+        return TSS2_RESMGR_RC_BAD_VALUE;
+    }
+}
+gint64
+__wrap_g_get_monotonic_time (void)
+{
+    return now_us;
+}
+/* the RM only sleeps between retries, the TPM is idle meanwhile */
+void
+__wrap_g_usleep (gulong microseconds)
+{
+    now_us += (gint64)microseconds;
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SIM_TPM_H
+#define SIM_TPM_H
+
+#include <glib.h>
+#include <tss2/tss2_tpm2_types.h>
+
+/*
+ * A model of the parts of a TPM the ResourceManager has to manage: the
+ * session and transient object slots, the active session handles and the
+ * contextCounter with its gap limit. Programs linked with sim-tpm.c and
+ * the -Wl,--wrap flags for the AccessBroker functions listed in sim-tpm.c
+ * talk to this model instead of a TPM. Every TPM command advances a
+ * virtual clock by the modeled latency of the command, g_get_monotonic_time
+ * and g_usleep are wrapped to use the same clock.
+ *
+ * The model checks what the RM sends it: a client command referencing a
+ * transient object or session that isn't loaded, a save or flush of
+ * something that isn't there, or a stale context being loaded is counted
+ * as an error. A correct RM gets none.
+ */
+#define SIM_TPM_SESSION_SLOTS_DEFAULT 3
+#define SIM_TPM_OBJECT_SLOTS_DEFAULT  3
+#define SIM_TPM_ACTIVE_SESSIONS_MAX   64
+#define SIM_TPM_GAP_MAX_DEFAULT       255
+
+typedef struct {
+    guint    session_slots;
+    guint    object_slots;
+    guint    active_sessions;
+    guint32  gap_max;
+} sim_tpm_config_t;
+
+typedef struct {
+    guint64  commands;
+    guint64  context_loads;
+    guint64  context_saves;
+    guint64  flushes;
+    guint64  busy_us;
+    guint64  errors;
+    guint    sessions_loaded_max;
+    guint    objects_loaded_max;
+} sim_tpm_stats_t;
+
+void         sim_tpm_reset           (const sim_tpm_config_t *config);
+void         sim_tpm_get_stats       (sim_tpm_stats_t        *stats);
+gint64       sim_tpm_now             (void);
+void         sim_tpm_advance         (gint64                  now);
+guint64      sim_tpm_command_latency (TPM2_CC                 code);
+
+#endif /* SIM_TPM_H */
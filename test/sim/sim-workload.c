@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <gio/gio.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "sim-workload.h"
+
+/* per client limits for synthetic workloads, well inside the RM quotas */
+#define SIM_CLIENT_SESSIONS_MAX 2
+#define SIM_CLIENT_OBJECTS_MAX  2
+
+typedef struct {
+    sim_op_t     op;
+    const gchar *name;
+    gboolean     has_arg;
+} sim_op_info_t;
+static const sim_op_info_t sim_ops [] = {
+    { SIM_OP_SESSION_START, "session-start", FALSE },
+    { SIM_OP_SESSION_USE,   "session-use",   TRUE  },
+    { SIM_OP_SESSION_FLUSH, "session-flush", TRUE  },
+    { SIM_OP_LOAD,          "load",          TRUE  },
+    { SIM_OP_USE,           "use",           TRUE  },
+    { SIM_OP_FLUSH,         "flush",         TRUE  },
+    { SIM_OP_STATELESS,     "stateless",     FALSE },
+    { SIM_OP_CLOSE,         "close",         FALSE },
+};
+
+const gchar*
+sim_op_to_str (sim_op_t op)
+{
+    return sim_ops [op].name;
+}
+static const sim_op_info_t*
+sim_op_from_str (const gchar *name)
+{
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS (sim_ops); ++i) {
+        if (g_strcmp0 (sim_ops [i].name, name) == 0) {
+            return &sim_ops [i];
+        }
+    }
+    return NULL;
+}
+/*
+ * Read a workload file: one operation per line as
+ * '<time_us> <client> <op> [arg]', blank lines and lines starting with
+ * '#' are ignored. Times must not go backwards.
+ */
+GArray*
+sim_workload_load (const gchar *path,
+                   GError     **error)
+{
+    const sim_op_info_t *info;
+    GArray *events;
+    sim_event_t event;
+    gchar *contents = NULL, **lines, *line, op [32];
+    gint64 last = 0;
+    gint fields;
+    guint i;
+
+    if (!g_file_get_contents (path, &contents, NULL, error)) {
+        return NULL;
+    }
+    lines = g_strsplit (contents, "\n", -1);
+    g_free (contents);
+    events = g_array_new (FALSE, TRUE, sizeof (sim_event_t));
+    for (i = 0; lines [i] != NULL; ++i) {
+        line = g_strstrip (lines [i]);
+        if (line [0] == '\0' || line [0] == '#') {
+            continue;
+        }
+        memset (&event, 0, sizeof (event));
+        fields = sscanf (line, "%" SCNd64 " %u %31s %u", &event.time_us,
+                         &event.client, op, &event.arg);
+        info = fields >= 3 ? sim_op_from_str (op) : NULL;
+        if (info == NULL || (info->has_arg && fields != 4) ||
+            event.time_us < last)
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         "%s:%u: bad workload line: %s", path, i + 1, line);
+            g_array_free (events, TRUE);
+            g_strfreev (lines);
+            return NULL;
+        }
+        event.op = info->op;
+        last = event.time_us;
+        g_array_append_val (events, event);
+    }
+    g_strfreev (lines);
+    return events;
+}
+/*
+ * Pick the next operation for a client from what it has open. Clients
+ * start a session and load a key, then mostly use them, with some
+ * stateless commands, churn and the occasional disconnect.
+ */
+static void
+sim_synthetic_op (GRand       *rand,
+                  guint        keys,
+                  guint       *sessions,
+                  guint       *objects,
+                  sim_event_t *event)
+{
+    gint32 r = g_rand_int_range (rand, 0, 100);
+
+    event->arg = 0;
+    if (*sessions == 0) {
+        r = 85;
+    } else if (*objects == 0) {
+        r = 80;
+    }
+    if (r >= 80 && r < 85 && *objects >= SIM_CLIENT_OBJECTS_MAX) {
+        r = 35;
+    } else if (r >= 85 && r < 90 && *sessions >= SIM_CLIENT_SESSIONS_MAX) {
+        r = 0;
+    }
+    if (r < 35) {
+        event->op = SIM_OP_SESSION_USE;
+        event->arg = (guint)g_rand_int_range (rand, 0, (gint32)*sessions);
+    } else if (r < 55) {
+        event->op = SIM_OP_USE;
+        event->arg = (guint)g_rand_int_range (rand, 0, (gint32)*objects);
+    } else if (r < 80) {
+        event->op = SIM_OP_STATELESS;
+    } else if (r < 85) {
+        event->op = SIM_OP_LOAD;
+        event->arg = (guint)g_rand_int_range (rand, 0, (gint32)keys);
+        ++*objects;
+    } else if (r < 90) {
+        event->op = SIM_OP_SESSION_START;
+        ++*sessions;
+    } else if (r < 93) {
+        event->op = SIM_OP_FLUSH;
+        event->arg = (guint)g_rand_int_range (rand, 0, (gint32)*objects);
+        --*objects;
+    } else if (r < 96) {
+        event->op = SIM_OP_SESSION_FLUSH;
+        event->arg = (guint)g_rand_int_range (rand, 0, (gint32)*sessions);
+        --*sessions;
+    } else {
+        event->op = SIM_OP_CLOSE;
+        *sessions = 0;
+        *objects = 0;
+    }
+}
+/*
+ * Generate a workload from a seed so every run of the simulation sees the
+ * same one. Arrivals from all clients together are spaced uniformly
+ * between 0 and twice the mean, each arrival is from a random client.
+ */
+GArray*
+sim_workload_synthetic (const sim_synthetic_t *params)
+{
+    GArray *events;
+    GRand *rand;
+    guint *sessions, *objects, i;
+    sim_event_t event;
+    gint64 now = 0;
+
+    g_assert (params->clients > 0 && params->keys > 0);
+    rand = g_rand_new_with_seed (params->seed);
+    sessions = g_new0 (guint, params->clients);
+    objects = g_new0 (guint, params->clients);
+    events = g_array_sized_new (FALSE, TRUE, sizeof (sim_event_t),
+                                params->events);
+    for (i = 0; i < params->events; ++i) {
+        now += (gint64)g_rand_double_range (rand, 0.0,
+            2.0 * (gdouble)params->mean_interarrival_us);
+        event.time_us = now;
+        event.client = (guint)g_rand_int_range (rand, 0,
+                                                (gint32)params->clients);
+        sim_synthetic_op (rand,
+                          params->keys,
+                          &sessions [event.client],
+                          &objects [event.client],
+                          &event);
+        g_array_append_val (events, event);
+    }
+    g_free (sessions);
+    g_free (objects);
+    g_rand_free (rand);
+    return events;
+}
+/* the number of clients is one more than the largest client id */
+guint
+sim_workload_clients (GArray *events)
+{
+    guint i, clients = 0;
+
+    for (i = 0; i < events->len; ++i) {
+        clients = MAX (clients,
+                       g_array_index (events, sim_event_t, i).client + 1);
+    }
+    return clients;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SIM_WORKLOAD_H
+#define SIM_WORKLOAD_H
+
+#include <glib.h>
+
+/*
+ * A workload is a list of client operations ordered by arrival time. The
+ * argument of an operation is the blob to load for SIM_OP_LOAD and an index
+ * into the client's sessions or loaded objects (in the order they were
+ * created, counting only those still open) for the others that take one.
+ */
+typedef enum {
+    SIM_OP_SESSION_START,
+    SIM_OP_SESSION_USE,
+    SIM_OP_SESSION_FLUSH,
+    SIM_OP_LOAD,
+    SIM_OP_USE,
+    SIM_OP_FLUSH,
+    SIM_OP_STATELESS,
+    SIM_OP_CLOSE,
+} sim_op_t;
+
+typedef struct {
+    gint64      time_us;
+    guint       client;
+    sim_op_t    op;
+    guint       arg;
+} sim_event_t;
+
+typedef struct {
+    guint       clients;
+    guint       events;
+    gint64      mean_interarrival_us;
+    guint       keys;
+    guint32     seed;
+} sim_synthetic_t;
+
+const gchar* sim_op_to_str          (sim_op_t               op);
+GArray*      sim_workload_load      (const gchar           *path,
+                                     GError               **error);
+GArray*      sim_workload_synthetic (const sim_synthetic_t *params);
+guint        sim_workload_clients   (GArray                *events);
+
+#endif /* SIM_WORKLOAD_H */
@@ -5,8 +5,10 @@
  */
 #include <glib.h>
 #include <inttypes.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
+#include <tss2/tss2_tpm2_types.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
@@ -39,11 +41,14 @@ __wrap_g_option_context_add_main_entries (
         if (strcmp (long_name, entries [i].long_name) == 0) {
             if (strcmp (long_name, "max-connections") == 0 ||
                 strcmp (long_name, "max-sessions") == 0 ||
-                strcmp (long_name, "max-transients") == 0)
+                strcmp (long_name, "max-transients") == 0 ||
+                strcmp (long_name, "pcr-cache-max-age") == 0)
             {
                 *(guint*)entries [i].arg_data = mock_type (guint);
             }
-            if (strcmp (long_name, "tcti") == 0) {
+            if (strcmp (long_name, "tcti") == 0 ||
+                strcmp (long_name, "thread-sched") == 0)
+            {
                 *(char**)entries [i].arg_data = mock_type (char*);
             }
         }
@@ -160,6 +165,50 @@ tcti_conf_parse_opts_max_transient_fail (void **state)
     will_return (__wrap_set_logger, 0);
     assert_false (parse_opts (argc, argv, &options));
 }
+/*
+ * A negative max age wraps around to a huge guint and must be rejected.
+ */
+static void
+tcti_conf_parse_opts_pcr_cache_max_age_fail (void **state)
+{
+    UNUSED_PARAM (state);
+    tabrmd_options_t options = TABRMD_OPTIONS_INIT_DEFAULT;
+    GOptionContext *ctx = NULL;
+    int argc = 0;
+    char **argv = NULL;
+    GError error = { .message = "foo", };
+
+    will_return (__wrap_g_option_context_new, ctx);
+    will_return (__wrap_g_option_context_add_main_entries, "pcr-cache-max-age");
+    will_return (__wrap_g_option_context_add_main_entries, (guint)-1);
+    will_return (__wrap_g_option_context_parse, &error);
+    will_return (__wrap_g_option_context_parse, TRUE);
+    will_return (__wrap_set_logger, 0);
+    assert_false (parse_opts (argc, argv, &options));
+}
+/*
+ * With run-to-completion the ResourceManager and ResponseSink run on the
+ * CommandSource thread so attributes for them would be silently ignored.
+ */
+static void
+tcti_conf_parse_opts_run_to_completion_attrs_fail (void **state)
+{
+    UNUSED_PARAM (state);
+    tabrmd_options_t options = TABRMD_OPTIONS_INIT_DEFAULT;
+    GOptionContext *ctx = NULL;
+    int argc = 0;
+    char **argv = NULL;
+    GError error = { .message = "foo", };
+
+    options.run_to_completion = TRUE;
+    will_return (__wrap_g_option_context_new, ctx);
+    will_return (__wrap_g_option_context_add_main_entries, "thread-sched");
+    will_return (__wrap_g_option_context_add_main_entries, "resmgr:fifo:10");
+    will_return (__wrap_g_option_context_parse, &error);
+    will_return (__wrap_g_option_context_parse, TRUE);
+    will_return (__wrap_set_logger, 0);
+    assert_false (parse_opts (argc, argv, &options));
+}
 void
 __wrap_g_option_context_free (GOptionContext *context)
 {
@@ -186,6 +235,77 @@ tcti_conf_parse_opts_success (void **state)
     will_return (__wrap_set_logger, 0);
     assert_true (parse_opts (argc, argv, &options));
 }
+static void
+coalesce_codes_parse_default (void **state)
+{
+    UNUSED_PARAM (state);
+    GHashTable *codes = coalesce_codes_parse ("default");
+
+    assert_non_null (codes);
+    assert_true (g_hash_table_contains (codes,
+                                        GUINT_TO_POINTER (TPM2_CC_PCR_Read)));
+    g_hash_table_unref (codes);
+}
+static void
+coalesce_codes_parse_list (void **state)
+{
+    UNUSED_PARAM (state);
+    GHashTable *codes = coalesce_codes_parse ("0x17e,382");
+
+    assert_non_null (codes);
+    assert_int_equal (g_hash_table_size (codes), 1);
+    assert_true (g_hash_table_contains (codes,
+                                        GUINT_TO_POINTER (TPM2_CC_PCR_Read)));
+    g_hash_table_unref (codes);
+}
+static void
+coalesce_codes_parse_fail (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_null (coalesce_codes_parse ("0x17e,bogus"));
+}
+static void
+thread_attrs_init (thread_attrs_t attrs [THREAD_STAGE_COUNT])
+{
+    size_t i;
+
+    for (i = 0; i < THREAD_STAGE_COUNT; ++i) {
+        attrs [i] = (thread_attrs_t)THREAD_ATTRS_INIT;
+    }
+}
+static void
+thread_attrs_parse_success (void **state)
+{
+    UNUSED_PARAM (state);
+    thread_attrs_t attrs [THREAD_STAGE_COUNT];
+
+    thread_attrs_init (attrs);
+    assert_true (thread_attrs_parse ("resmgr:1,sink:3",
+                                     "resmgr:fifo:10,sink:batch",
+                                     attrs));
+    assert_int_equal (attrs [THREAD_STAGE_SOURCE].cpu, -1);
+    assert_int_equal (attrs [THREAD_STAGE_SOURCE].policy, -1);
+    assert_int_equal (attrs [THREAD_STAGE_RESMGR].cpu, 1);
+    assert_int_equal (attrs [THREAD_STAGE_RESMGR].policy, SCHED_FIFO);
+    assert_int_equal (attrs [THREAD_STAGE_RESMGR].priority, 10);
+    assert_int_equal (attrs [THREAD_STAGE_SINK].cpu, 3);
+    assert_int_equal (attrs [THREAD_STAGE_SINK].policy, SCHED_BATCH);
+    assert_int_equal (attrs [THREAD_STAGE_SINK].priority, 0);
+}
+static void
+thread_attrs_parse_fail (void **state)
+{
+    UNUSED_PARAM (state);
+    thread_attrs_t attrs [THREAD_STAGE_COUNT];
+
+    thread_attrs_init (attrs);
+    assert_false (thread_attrs_parse ("bogus:1", NULL, attrs));
+    assert_false (thread_attrs_parse ("resmgr:x", NULL, attrs));
+    assert_false (thread_attrs_parse (NULL, "sink:bogus", attrs));
+    /* only the real-time policies take a priority */
+    assert_false (thread_attrs_parse (NULL, "sink:other:5", attrs));
+}
 
 int
 main (void)
@@ -196,7 +316,14 @@ main (void)
         cmocka_unit_test (tcti_conf_parse_opts_max_connections_fail),
         cmocka_unit_test (tcti_conf_parse_opts_max_sessions_fail),
         cmocka_unit_test (tcti_conf_parse_opts_max_transient_fail),
+        cmocka_unit_test (tcti_conf_parse_opts_pcr_cache_max_age_fail),
+        cmocka_unit_test (tcti_conf_parse_opts_run_to_completion_attrs_fail),
         cmocka_unit_test (tcti_conf_parse_opts_success),
+        cmocka_unit_test (coalesce_codes_parse_default),
+        cmocka_unit_test (coalesce_codes_parse_list),
+        cmocka_unit_test (coalesce_codes_parse_fail),
+        cmocka_unit_test (thread_attrs_parse_success),
+        cmocka_unit_test (thread_attrs_parse_fail),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -103,6 +103,18 @@ tcti_mock_receive (TSS2_TCTI_CONTEXT *context,
 
     return rc;
 }
+/*
+ * This function is a mock of the TCTI cancel function. It returns the
+ * TSS2_RC passed to 'will_return'.
+ */
+TSS2_RC
+tcti_mock_cancel (TSS2_TCTI_CONTEXT *context)
+{
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    return mock_type (TSS2_RC);
+}
 TSS2_RC
 Tss2_Tcti_Mock_Init (TSS2_TCTI_CONTEXT *context,
                      size_t *size,
@@ -125,6 +137,7 @@ Tss2_Tcti_Mock_Init (TSS2_TCTI_CONTEXT *context,
     TSS2_TCTI_VERSION (tcti_mock) = 2;
     TSS2_TCTI_TRANSMIT (tcti_mock) = tcti_mock_transmit;
     TSS2_TCTI_RECEIVE (tcti_mock) = tcti_mock_receive;
+    TSS2_TCTI_CANCEL (tcti_mock) = tcti_mock_cancel;
     tcti_mock->state = SEND;
 
     return TSS2_RC_SUCCESS;
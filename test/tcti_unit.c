@@ -93,6 +93,16 @@ tcti_receive_test (void **state)
     assert_int_equal (rc, rc_expected);
 }
 
+static void
+tcti_cancel_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc_expected = TSS2_TCTI_RC_NOT_IMPLEMENTED;
+
+    will_return (tcti_mock_cancel, rc_expected);
+    assert_int_equal (tcti_cancel (data->tcti), rc_expected);
+}
+
 gint
 main (void)
 {
@@ -109,6 +119,9 @@ main (void)
         cmocka_unit_test_setup_teardown (tcti_receive_test,
                                          tcti_setup,
                                          tcti_teardown),
+        cmocka_unit_test_setup_teardown (tcti_cancel_test,
+                                         tcti_setup,
+                                         tcti_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -162,6 +162,48 @@ test_thread_lifecycle_test (void **state)
     assert_true (test_thread->canceled);
     assert_true (test_thread->cleaned_up);
 }
+/*
+ * An inline Thread never starts a pthread so the TestThread doesn't run
+ * and canceling / joining it does nothing.
+ */
+static void
+test_thread_inline_test (void **state)
+{
+    Thread *thread = THREAD (*state);
+    TestThread *test_thread = TEST_THREAD (*state);
+
+    thread_set_inline (thread, TRUE);
+    assert_true (thread_is_inline (thread));
+    assert_int_equal (thread_start (thread), 0);
+    assert_true (thread->thread_id == 0);
+    thread_cancel (thread);
+    assert_int_equal (thread_join (thread), 0);
+    assert_false (test_thread->running);
+    assert_false (test_thread->canceled);
+}
+/*
+ * A thread started with a CPU in its attributes is pinned to that CPU.
+ */
+static void
+test_thread_affinity_test (void **state)
+{
+    Thread *thread = THREAD (*state);
+    thread_attrs_t attrs = THREAD_ATTRS_INIT;
+    cpu_set_t cpus;
+    int ret;
+
+    attrs.cpu = 0;
+    thread_set_attrs (thread, &attrs);
+    ret = thread_start (thread);
+    assert_int_equal (ret, 0);
+    ret = pthread_getaffinity_np (thread->thread_id, sizeof (cpus), &cpus);
+    assert_int_equal (ret, 0);
+    assert_int_equal (CPU_COUNT (&cpus), 1);
+    assert_true (CPU_ISSET (0, &cpus));
+    thread_cancel (thread);
+    ret = thread_join (thread);
+    assert_int_equal (ret, 0);
+}
 int
 main (void)
 {
@@ -172,6 +214,12 @@ main (void)
         cmocka_unit_test_setup_teardown (test_thread_lifecycle_test,
                                          test_thread_setup,
                                          test_thread_teardown),
+        cmocka_unit_test_setup_teardown (test_thread_inline_test,
+                                         test_thread_setup,
+                                         test_thread_teardown),
+        cmocka_unit_test_setup_teardown (test_thread_affinity_test,
+                                         test_thread_setup,
+                                         test_thread_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
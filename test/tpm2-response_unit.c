@@ -6,6 +6,7 @@
 #include <glib.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <tss2/tss2_mu.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
@@ -305,6 +306,38 @@ tpm2_response_new_rc_connection_test (void **state)
 
     assert_int_equal (connection, tpm2_response_get_connection (data->response));
 }
+/*
+ * Check the buffer built by tpm2_response_new_get_random: a header with no
+ * sessions and a successful RC followed by the TPM2B_DIGEST.
+ */
+static void
+tpm2_response_new_get_random_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2B_DIGEST random_in = {
+        .size = 4,
+        .buffer = { 0xde, 0xad, 0xbe, 0xef },
+    };
+    TPM2B_DIGEST random_out = { 0 };
+    Tpm2Response *response;
+    size_t offset = TPM_HEADER_SIZE;
+    TSS2_RC rc;
+
+    response = tpm2_response_new_get_random (data->connection, &random_in);
+    assert_non_null (response);
+    assert_int_equal (tpm2_response_get_tag (response), TPM2_ST_NO_SESSIONS);
+    assert_int_equal (tpm2_response_get_size (response),
+                      TPM_HEADER_SIZE + sizeof (UINT16) + random_in.size);
+    assert_int_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    rc = Tss2_MU_TPM2B_DIGEST_Unmarshal (tpm2_response_get_buffer (response),
+                                         tpm2_response_get_size (response),
+                                         &offset,
+                                         &random_out);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (random_out.size, random_in.size);
+    assert_memory_equal (random_out.buffer, random_in.buffer, random_in.size);
+    g_object_unref (response);
+}
 /*
  * This test ensures that a tpm2_response_has_handle reports the
  * actual value in the TPMA_CC attributes field when the rHandle bit
@@ -442,6 +475,9 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_response_new_rc_connection_test,
                                          tpm2_response_new_rc_setup,
                                          tpm2_response_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_response_new_get_random_test,
+                                         tpm2_response_new_rc_setup,
+                                         tpm2_response_teardown),
         cmocka_unit_test_setup_teardown (tpm2_response_no_handle_test,
                                          tpm2_response_setup,
                                          tpm2_response_teardown),
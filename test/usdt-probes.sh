@@ -0,0 +1,44 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Check that every USDT probe in the 'tabrmd' provider made it into the
+# daemon binary: a probe the compiler or linker dropped is only noticed when
+# someone tries to attach to it. Run from the build directory by 'make
+# check' when configured with USDT support.
+#
+# Exit codes follow the automake test harness: 77 to skip, 99 for a hard
+# error.
+
+PROBES="command_read queue_enqueue queue_dequeue tpm_transmit tpm_receive
+context_load context_save context_flush session_state response_write"
+
+DAEMON=src/tpm2-abrmd
+# libtool may leave a wrapper script in place of the real binary
+if [ -x src/.libs/tpm2-abrmd ]; then
+    DAEMON=src/.libs/tpm2-abrmd
+fi
+if [ ! -x "${DAEMON}" ]; then
+    echo "daemon binary not found: ${DAEMON}"
+    exit 99
+fi
+if ! command -v readelf > /dev/null 2>&1; then
+    echo "readelf not found, skipping"
+    exit 77
+fi
+
+# one 'provider:name' line for each probe note
+NOTES=$(readelf -n "${DAEMON}" | awk '
+    /Provider:/ { provider = $2 }
+    /Name:/     { print provider ":" $2 }
+') || exit 99
+
+RET=0
+for PROBE in ${PROBES}; do
+    if echo "${NOTES}" | grep -qx "tabrmd:${PROBE}"; then
+        echo "found probe tabrmd:${PROBE}"
+    else
+        echo "missing probe tabrmd:${PROBE}"
+        RET=1
+    fi
+done
+exit ${RET}